@@ -8,6 +8,22 @@
 #include "raylib/raymesh.h"
 #include "raylib/rayply.h"
 #include "raylib/rayforeststructure.h"
+#include "treelib/treeforestfile.h"
+#include "treelib/treeforeststream.h"
+#include "treelib/treepruner.h"
+#include "treelib/treesegmentindex.h"
+#define STB_IMAGE_IMPLEMENTATION
+#include "treelib/imageread.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iterator>
+#include <limits>
+#include <random>
+#include <set>
+#include <sstream>
 #include <vector>
 #include <gtest/gtest.h>
 #include <cstdlib>
@@ -57,6 +73,20 @@ namespace raytest
     }
   }
 
+  /// Count the segments with a parent in @c forest, and those of them that are thinner than @c twig_radius
+  void countSegments(const ray::ForestStructure &forest, double twig_radius, size_t &num_segments, size_t &num_twigs)
+  {
+    num_segments = num_twigs = 0;
+    for (const auto &tree : forest.trees)
+    {
+      for (size_t i = 1; i < tree.segments().size(); i++)
+      {
+        num_segments++;
+        num_twigs += tree.segments()[i].radius < twig_radius ? 1 : 0;
+      }
+    }
+  }
+
   /// Colour a tree according to the branch lengths
   TEST(Basic, TreeColour)
   {
@@ -80,6 +110,61 @@ namespace raytest
     compareMoments(forest.getMoments(), {2, 0, 0, 0.214118, 0.0229267, 0.574374, 0, 0, 0});
   }
   
+  /// Create a forest, convert it to binary and back, and check it is unchanged
+  TEST(Basic, TreeConvert)
+  {
+    EXPECT_EQ(command("treecreate forest 2"), 0);
+    EXPECT_EQ(command("treeconvert forest.txt forest.treeb"), 0);
+    ray::ForestStructure binary_forest;
+    EXPECT_TRUE(tree::loadForest("forest.treeb", binary_forest));
+    compareMoments(binary_forest.getMoments(), {20, 34.3553, 1061.61, 1.51633, 0.128301, 2.60812, 0, 0, 0});
+
+    EXPECT_EQ(command("treeconvert forest.treeb forest_converted.txt"), 0);
+    ray::ForestStructure forest;
+    EXPECT_TRUE(forest.load("forest_converted.txt"));
+    compareMoments(forest.getMoments(), {20, 34.3553, 1061.61, 1.51633, 0.128301, 2.60812, 0, 0, 0});
+  }
+  
+  /// Check that binary forest files are not written with trees that their reader would reject or misread
+  TEST(Basic, TreeConvertInvalid)
+  {
+    ray::TreeStructure tree;
+    tree.attributeNames() = { "section_id" };
+    for (int i = 0; i < 3; i++)
+    {
+      ray::TreeStructure::Segment segment;
+      segment.tip = Eigen::Vector3d(0, 0, i);
+      segment.radius = 0.1;
+      segment.parent_id = i - 1;
+      segment.attributes = { 1.0 };
+      tree.segments().push_back(segment);
+    }
+    ray::ForestStructure forest;
+    forest.trees = { tree, tree };
+    EXPECT_TRUE(tree::saveBinaryForest("valid.treeb", forest));
+    ray::ForestStructure loaded;
+    EXPECT_TRUE(tree::loadForest("valid.treeb", loaded));
+    EXPECT_EQ(loaded.trees.size(), 2u);
+
+    // the second tree made invalid by a parent after its segment, different attribute names, or a missing value
+    std::vector<ray::TreeStructure> invalid(3, tree);
+    invalid[0].segments()[1].parent_id = 2;
+    invalid[1].attributeNames() = { "length" };
+    invalid[2].segments()[2].attributes.clear();
+    for (size_t i = 0; i < invalid.size(); i++)
+    {
+      const std::string file_name = "invalid" + std::to_string(i) + ".treeb";
+      forest.trees[1] = invalid[i];
+      EXPECT_FALSE(tree::saveBinaryForest(file_name, forest));
+      tree::ForestWriter writer;
+      ASSERT_TRUE(writer.open(file_name, forest.comments));
+      EXPECT_TRUE(writer.writeTree(tree));
+      EXPECT_FALSE(writer.writeTree(invalid[i]));
+      EXPECT_FALSE(writer.close());
+      EXPECT_FALSE(std::ifstream(file_name).is_open());
+    }
+  }
+  
   /// Create a tree and create a forest
   TEST(Basic, TreeCreate)
   {
@@ -104,6 +189,30 @@ namespace raytest
     compareMoments(forest.getMoments(), {20, 31.5473, 974.846, 1.52272, 0.129441, 2.66069, 0, 0, 0});
   }
   
+  /// The number following @c label in the text file @c file_name, or -1 if it isn't found
+  double readLabelledValue(const std::string &file_name, const std::string &label)
+  {
+    std::ifstream ifs(file_name);
+    const std::string text((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    const size_t pos = text.find(label);
+    return pos == std::string::npos ? -1.0 : std::atof(text.c_str() + pos + label.size());
+  }
+
+  /// A tree of a single vertical segment of @c radius from @c base up to @c height above it
+  ray::TreeStructure stemTree(const Eigen::Vector3d &base, double height, double radius)
+  {
+    ray::TreeStructure tree;
+    ray::TreeStructure::Segment root, stem;
+    root.tip = base;
+    root.radius = radius;
+    stem.tip = base + Eigen::Vector3d(0, 0, height);
+    stem.radius = radius;
+    stem.parent_id = 0;
+    tree.segments().push_back(root);
+    tree.segments().push_back(stem);
+    return tree;
+  }
+
   /// Difference between two forests
   TEST(Basic, TreeDiff)
   {
@@ -114,6 +223,84 @@ namespace raytest
     /// TODO: comparison not implemented, so just tests that it doesn't return a bad value
   }
 
+  /// The comma separated values of each row after the header of the csv file @c file_name
+  std::vector<std::vector<double>> readCsvRows(const std::string &file_name, std::string &header)
+  {
+    std::ifstream ifs(file_name);
+    std::vector<std::vector<double>> rows;
+    std::string line;
+    std::getline(ifs, header);
+    while (std::getline(ifs, line))
+    {
+      std::vector<double> row;
+      std::istringstream values(line);
+      std::string value;
+      while (std::getline(values, value, ','))
+      {
+        row.push_back(std::atof(value.c_str()));
+      }
+      rows.push_back(row);
+    }
+    return rows;
+  }
+
+  /// Check the pairs csv rows of two matched trees of equal volume: the ids, an unchanged growth scale, and an
+  /// overlap percent that agrees with the equal added and removed volumes
+  void checkPairRows(const std::vector<std::vector<double>> &rows, const std::vector<std::pair<int, int>> &pairs,
+                     double tree_volume)
+  {
+    ASSERT_EQ(rows.size(), pairs.size());
+    for (size_t i = 0; i < rows.size(); i++)
+    {
+      const std::vector<double> &row = rows[i];
+      ASSERT_EQ(row.size(), 6u);
+      EXPECT_EQ(row[0], pairs[i].first);
+      EXPECT_EQ(row[1], pairs[i].second);
+      EXPECT_EQ(row[2], 1.0);
+      EXPECT_EQ(row[4], row[5]);
+      const double overlap = tree_volume - row[4];
+      EXPECT_GT(row[3], 0.0);
+      EXPECT_NEAR(row[3], 100.0 * overlap / (2.0 * tree_volume - overlap), 1e-4 * row[3]);
+    }
+  }
+
+  /// Difference two forests whose trunks are matched differently by the default greedy matching, which matches
+  /// tree 0 to its nearest trunk and leaves tree 1 unmatched, and by --optimal_matching, which matches both trees. The pairs csv file lists just the matched pairs
+  TEST(Basic, TreeDiffMatching)
+  {
+    const double radius = 0.5, height = 4.0;
+    ray::ForestStructure forest1, forest2;
+    forest1.trees.push_back(stemTree(Eigen::Vector3d(0, 0, 0), height, radius));
+    forest1.trees.push_back(stemTree(Eigen::Vector3d(1.2, 0, 0), height, radius));
+    forest2.trees.push_back(stemTree(Eigen::Vector3d(0.6, 0, 0), height, radius));
+    forest2.trees.push_back(stemTree(Eigen::Vector3d(-0.7, 0, 0), height, radius));
+    ASSERT_TRUE(forest1.save("forest1.txt"));
+    ASSERT_TRUE(forest2.save("forest2.txt"));
+    const double tree_volume = forest1.trees[0].volume();
+    const std::string pairs_header = "tree_id1,tree_id2,growth_scale,overlap_percent,added_volume,removed_volume";
+
+    EXPECT_EQ(command("treediff forest1.txt forest2.txt --pairs_csv greedy_pairs.csv > greedy_diff.txt"), 0);
+    EXPECT_EQ(readLabelledValue("greedy_diff.txt", "#overlapping: "), 1.0);
+    EXPECT_EQ(readLabelledValue("greedy_diff.txt", "(ids 0, "), 0.0);
+    std::string header;
+    const std::vector<std::vector<double>> greedy_rows = readCsvRows("greedy_pairs.csv", header);
+    EXPECT_EQ(header, pairs_header);
+    checkPairRows(greedy_rows, { std::make_pair(0, 0) }, tree_volume);
+
+    EXPECT_EQ(command("treediff forest1.txt forest2.txt --optimal_matching --pairs_csv optimal_pairs.csv > optimal_diff.txt"), 0);
+    EXPECT_EQ(readLabelledValue("optimal_diff.txt", "#overlapping: "), 2.0);
+    EXPECT_EQ(readLabelledValue("optimal_diff.txt", "(ids 0, "), 1.0);
+    const std::vector<std::vector<double>> optimal_rows = readCsvRows("optimal_pairs.csv", header);
+    EXPECT_EQ(header, pairs_header);
+    checkPairRows(optimal_rows, { std::make_pair(0, 1), std::make_pair(1, 0) }, tree_volume);
+    if (optimal_rows.size() == 2 && greedy_rows.size() == 1)
+    {
+      // the closer trunks overlap more, and the pairs 0.6 m apart overlap equally
+      EXPECT_LT(optimal_rows[0][3], optimal_rows[1][3]);
+      EXPECT_NEAR(optimal_rows[1][3], greedy_rows[0][3], 1e-4 * greedy_rows[0][3]);
+    }
+  }
+
   /// create a raycloud forest, extract the trees, then set the foliage density of the raycloud at each branch 
   /// of the tree in forest_foliage.txt, and also save this as a shaded ray cloud in forest_densities.ply
   TEST(Basic, TreeFoliage)
@@ -131,6 +318,143 @@ namespace raytest
     compareMoments(cloud.getMoments(), {0.410108, 0.287581, 1.74041, 5.61377, 5.67701, 0.621977, 0.478583, 0.261382, 3.09509, 5.66319, 5.69592, 3.16601, 63.8625, 36.8713, 0.0947165, 0.0947165, 0.0947165, 1, 0.158243, 0.158243, 0.158243, 0});
   }
 
+  /// Remove the branches of @c tree that are no wider than @c diameter (in m) all the way to their tips, as
+  /// pruneDiameter did before the pruning criteria were combined into a single pass. Returns false if no branches remain
+  bool legacyPruneDiameter(const ray::TreeStructure &tree, double diameter, ray::TreeStructure &new_tree)
+  {
+    const auto &segments = tree.segments();
+    std::vector<std::vector<int>> children(segments.size());
+    for (size_t i = 1; i < segments.size(); i++)
+    {
+      children[segments[i].parent_id].push_back(static_cast<int>(i));
+    }
+    // the maximum diameter to the end of each branch, found by walking down from every leaf
+    std::vector<double> max_diameter(segments.size(), 0);
+    for (size_t i = 0; i < segments.size(); i++)
+    {
+      if (children[i].size() == 0)
+      {
+        int parent = segments[i].parent_id;
+        int child = static_cast<int>(i);
+        max_diameter[child] = 2.0 * segments[child].radius;
+        while (parent != -1)
+        {
+          const double parent_diameter = std::max(max_diameter[child], 2.0 * segments[parent].radius);
+          if (parent_diameter <= max_diameter[parent])
+          {
+            break;
+          }
+          max_diameter[parent] = parent_diameter;
+          child = parent;
+          parent = segments[parent].parent_id;
+        }
+      }
+    }
+    std::vector<int> new_index(segments.size());
+    new_index[0] = 0;
+    new_tree = tree;
+    new_tree.segments().clear();
+    new_tree.segments().push_back(segments[0]);
+    for (size_t i = 1; i < segments.size(); i++)
+    {
+      if (max_diameter[i] > diameter)
+      {
+        new_index[i] = static_cast<int>(new_tree.segments().size());
+        new_tree.segments().push_back(segments[i]);
+        new_tree.segments().back().parent_id = new_index[segments[i].parent_id];
+      }
+      else
+      {
+        new_index[i] = new_index[segments[i].parent_id];
+      }
+    }
+    return new_tree.segments().size() > 1;
+  }
+
+  /// Remove @c length (in m) from the end of every branch of @c tree, as pruneLength did before the pruning criteria
+  /// were combined into a single pass. Returns false if no branches remain
+  bool legacyPruneLength(const ray::TreeStructure &tree, double length, ray::TreeStructure &new_tree)
+  {
+    const auto &segments = tree.segments();
+    std::vector<std::vector<int>> children(segments.size());
+    for (size_t i = 1; i < segments.size(); i++)
+    {
+      children[segments[i].parent_id].push_back(static_cast<int>(i));
+    }
+    // the length from each segment to the end of its longest branch, found by walking down from every leaf
+    std::vector<double> min_length_from_leaf(segments.size(), 0);
+    for (size_t i = 0; i < segments.size(); i++)
+    {
+      if (children[i].size() == 0)
+      {
+        int parent = segments[i].parent_id;
+        int child = static_cast<int>(i);
+        while (parent != -1)
+        {
+          const double new_dist = min_length_from_leaf[child] + (segments[parent].tip - segments[child].tip).norm();
+          if (new_dist <= min_length_from_leaf[parent])
+          {
+            break;
+          }
+          min_length_from_leaf[parent] = new_dist;
+          child = parent;
+          parent = segments[parent].parent_id;
+        }
+      }
+    }
+    std::vector<int> new_index(segments.size());
+    new_index[0] = 0;
+    new_tree = tree;
+    new_tree.segments().clear();
+    new_tree.segments().push_back(segments[0]);
+    for (size_t i = 1; i < segments.size(); i++)
+    {
+      const int par = segments[i].parent_id;
+      if (min_length_from_leaf[i] > length)
+      {
+        new_index[i] = static_cast<int>(new_tree.segments().size());
+        new_tree.segments().push_back(segments[i]);
+        new_tree.segments().back().parent_id = new_index[par];
+      }
+      else if (min_length_from_leaf[par] > length)
+      {
+        // the length ends within this segment, so it is shortened
+        double blend = (min_length_from_leaf[par] - length) /
+                       std::max(std::numeric_limits<double>::min(), min_length_from_leaf[par] - min_length_from_leaf[i]);
+        blend = std::max(std::numeric_limits<double>::min(), std::min(blend, 1.0));
+        new_index[i] = static_cast<int>(new_tree.segments().size());
+        new_tree.segments().push_back(segments[i]);
+        new_tree.segments().back().tip = segments[par].tip + (segments[i].tip - segments[par].tip) * blend;
+        new_tree.segments().back().parent_id = new_index[par];
+      }
+      else
+      {
+        new_index[i] = new_index[par];
+      }
+    }
+    return new_tree.segments().size() > 1;
+  }
+
+  /// whether the segments of trees @c a and @c b are identical
+  bool sameSegments(const ray::TreeStructure &a, const ray::TreeStructure &b)
+  {
+    if (a.segments().size() != b.segments().size())
+    {
+      return false;
+    }
+    for (size_t i = 0; i < a.segments().size(); i++)
+    {
+      const auto &seg_a = a.segments()[i];
+      const auto &seg_b = b.segments()[i];
+      if (seg_a.tip != seg_b.tip || seg_a.radius != seg_b.radius || seg_a.parent_id != seg_b.parent_id ||
+          seg_a.attributes != seg_b.attributes)
+      {
+        return false;
+      }
+    }
+    return true;
+  }
+
   /// Create a forest, then grow it
   TEST(Basic, TreeGrow)
   {
@@ -144,6 +468,28 @@ namespace raytest
     ray::ForestStructure forest2;
     EXPECT_TRUE(forest2.load("forest_grown.txt"));
     compareMoments(forest2.getMoments(), {20, 46.4312, 681.105, 1.41261, 0.111921, 1.80229, 0, 0, 0});
+
+    // shrinking prunes the tips and any vanishingly thin branches in a single pass, which matches the separate length
+    // then diameter passes that it replaced
+    ray::ForestStructure source;
+    EXPECT_TRUE(source.load("forest.txt"));
+    for (const auto &source_tree : source.trees)
+    {
+      for (const double diameter : { 0.00001, 0.02 })
+      {
+        ray::TreeStructure shortened, expected, pruned = source_tree;
+        const bool kept = legacyPruneLength(source_tree, 0.6, shortened) &&
+                          legacyPruneDiameter(shortened, diameter, expected);
+        tree::PruneCriteria criteria;
+        criteria.tip_length = 0.6;
+        criteria.min_diameter = diameter;
+        EXPECT_EQ(tree::prune(pruned, criteria), kept);
+        if (kept)
+        {
+          EXPECT_TRUE(sameSegments(pruned, expected));
+        }
+      }
+    }
   }  
 
   /// Create a forest then get info on it
@@ -156,6 +502,139 @@ namespace raytest
     compareMoments(forest.getMoments(), {20.000, 22.294, 944.819, 1.534, 0.136, 2.909, 48618.000, 13.297, 0.956});
   }  
 
+  /// The objects of the top level array @c key in @c json. This only needs to parse the simple json that treemesh writes
+  std::vector<std::string> jsonObjects(const std::string &json, const std::string &key)
+  {
+    std::vector<std::string> objects;
+    size_t pos = json.find("\"" + key + "\":[{");
+    if (pos == std::string::npos)
+    {
+      return objects;
+    }
+    int depth = 0;
+    size_t start = 0;
+    for (pos = json.find('[', pos) + 1; pos < json.size() && (depth > 0 || json[pos] != ']'); pos++)
+    {
+      if (json[pos] == '{' && depth++ == 0)
+      {
+        start = pos;
+      }
+      else if (json[pos] == '}' && --depth == 0)
+      {
+        objects.push_back(json.substr(start, pos + 1 - start));
+      }
+    }
+    return objects;
+  }
+
+  /// The integer value of @c key in json @c object, or @c default_value if it isn't there
+  size_t jsonValue(const std::string &object, const std::string &key, size_t default_value = 0)
+  {
+    const size_t pos = object.find("\"" + key + "\":");
+    return pos == std::string::npos ? default_value : std::stoul(object.substr(pos + key.size() + 3));
+  }
+
+  /// Check that the glb file @c file_name is consistent: the header and chunk lengths add up, every buffer view is
+  /// non-empty and in the buffer, and every accessor is within its buffer view. It should have a node for each of the
+  /// @c num_trees trees, @c num_meshes of them with a mesh, and @c num_twigs instanced twigs
+  void checkGlb(const std::string &file_name, size_t num_trees, size_t num_meshes, size_t num_twigs)
+  {
+    std::ifstream ifs(file_name, std::ios::binary);
+    const std::string data((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    ASSERT_GE(data.size(), 28u);
+    uint32_t header[5];
+    memcpy(header, data.data(), sizeof(header));
+    EXPECT_EQ(header[0], 0x46546C67u);  // glTF
+    EXPECT_EQ(header[1], 2u);
+    EXPECT_EQ(header[2], data.size());
+    EXPECT_EQ(header[4], 0x4E4F534Au);  // JSON
+    EXPECT_EQ(header[3] % 4, 0u);
+    ASSERT_LE(20 + static_cast<size_t>(header[3]) + 8, data.size());
+    uint32_t binary_header[2];
+    memcpy(binary_header, data.data() + 20 + header[3], sizeof(binary_header));
+    EXPECT_EQ(binary_header[1], 0x004E4942u);  // BIN
+    EXPECT_EQ(20 + header[3] + 8 + static_cast<size_t>(binary_header[0]), data.size());
+    const size_t buffer_size = binary_header[0];
+    const std::string json = data.substr(20, header[3]);
+
+    const std::vector<std::string> buffers = jsonObjects(json, "buffers");
+    ASSERT_EQ(buffers.size(), 1u);
+    EXPECT_EQ(jsonValue(buffers[0], "byteLength"), buffer_size);
+    const std::vector<std::string> views = jsonObjects(json, "bufferViews");
+    for (const auto &view : views)
+    {
+      EXPECT_GT(jsonValue(view, "byteLength"), 0u);
+      EXPECT_LE(jsonValue(view, "byteOffset") + jsonValue(view, "byteLength"), buffer_size);
+    }
+    const std::vector<std::string> accessors = jsonObjects(json, "accessors");
+    for (const auto &accessor : accessors)
+    {
+      const size_t view_id = jsonValue(accessor, "bufferView", views.size());
+      ASSERT_LT(view_id, views.size());
+      const size_t component_type = jsonValue(accessor, "componentType");
+      const size_t component_size = component_type == 5121 ? 1 : (component_type == 5123 ? 2 : 4);
+      const size_t num_components = accessor.find("\"VEC3\"") != std::string::npos ?
+                                      3 :
+                                      (accessor.find("\"VEC4\"") != std::string::npos ? 4 : 1);
+      const size_t element_size = component_size * num_components;
+      const size_t stride = jsonValue(views[view_id], "byteStride", element_size);
+      const size_t offset = jsonValue(accessor, "byteOffset");
+      const size_t count = jsonValue(accessor, "count");
+      EXPECT_GT(count, 0u);
+      EXPECT_EQ((jsonValue(views[view_id], "byteOffset") + offset) % component_size, 0u);
+      EXPECT_LE(offset + (count - 1) * stride + element_size, jsonValue(views[view_id], "byteLength"));
+    }
+
+    const std::vector<std::string> meshes = jsonObjects(json, "meshes");
+    size_t num_tree_nodes = 0, num_tree_meshes = 0, num_instances = 0;
+    for (const auto &node : jsonObjects(json, "nodes"))
+    {
+      const bool has_mesh = node.find("\"mesh\":") != std::string::npos;
+      if (has_mesh)
+      {
+        EXPECT_LT(jsonValue(node, "mesh"), meshes.size());
+      }
+      if (node.find("\"name\":\"tree_") != std::string::npos)
+      {
+        num_tree_nodes++;
+        num_tree_meshes += has_mesh ? 1 : 0;
+      }
+      else if (node.find("EXT_mesh_gpu_instancing") != std::string::npos)
+      {
+        const size_t translations = jsonValue(node, "TRANSLATION", accessors.size());
+        ASSERT_LT(translations, accessors.size());
+        num_instances += jsonValue(accessors[translations], "count");
+      }
+    }
+    EXPECT_EQ(num_tree_nodes, num_trees);
+    EXPECT_EQ(num_tree_meshes, num_meshes);
+    EXPECT_EQ(num_instances, num_twigs);
+  }
+
+  /// Check that every triangle of @c mesh has three different vertices and that every vertex is used, so the mesh was
+  /// generated into exactly the space that was counted for it
+  void checkMeshFilled(const ray::Mesh &mesh)
+  {
+    std::vector<uint8_t> used(mesh.vertices().size(), 0);
+    size_t num_bad_triangles = 0;
+    for (const auto &triangle : mesh.indexList())
+    {
+      bool valid = triangle[0] != triangle[1] && triangle[1] != triangle[2] && triangle[2] != triangle[0];
+      for (int i = 0; i < 3; i++)
+      {
+        if (triangle[i] < 0 || triangle[i] >= static_cast<int>(used.size()))
+        {
+          valid = false;
+          continue;
+        }
+        used[triangle[i]] = 1;
+      }
+      num_bad_triangles += valid ? 0 : 1;
+    }
+    EXPECT_EQ(num_bad_triangles, 0u);
+    EXPECT_EQ(static_cast<size_t>(std::count(used.begin(), used.end(), 1)), used.size());
+  }
+
   /// Create a forest then mesh it
   TEST(Basic, TreeMesh)
   {
@@ -164,8 +643,103 @@ namespace raytest
     ray::Mesh mesh;
     EXPECT_TRUE(ray::readPlyMesh("forest_mesh.ply", mesh));
     compareMoments(mesh.getMoments(), {-0.215532, 1.0002, 5.18758, 6.22901, 6.14931, 2.09894});
+
+    // streaming the mesh a tree at a time gives the same mesh, in single precision
+    const Eigen::ArrayXd moments = mesh.getMoments();
+    EXPECT_EQ(command("treemesh forest.txt --stream"), 0);
+    ray::Mesh streamed_mesh;
+    EXPECT_TRUE(ray::readPlyMesh("forest_mesh.ply", streamed_mesh));
+    EXPECT_EQ(streamed_mesh.vertices().size(), mesh.vertices().size());
+    EXPECT_EQ(streamed_mesh.indexList().size(), mesh.indexList().size());
+    compareMoments(streamed_mesh.getMoments(), std::vector<double>(moments.data(), moments.data() + moments.size()),
+                   1e-4);
   }  
 
+  /// Create a forest then mesh it to a glb file, with and without instanced twigs, and check the file is consistent
+  TEST(Basic, TreeMeshGlb)
+  {
+    EXPECT_EQ(command("treecreate forest 13"), 0);
+    ray::ForestStructure forest;
+    EXPECT_TRUE(forest.load("forest.txt"));
+    const size_t num_trees = forest.trees.size();
+    size_t num_segments, num_twigs;
+    countSegments(forest, 0.02, num_segments, num_twigs);
+    EXPECT_EQ(command("treemesh forest.txt --glb"), 0);
+    checkGlb("forest_mesh.glb", num_trees, num_trees, 0);
+    EXPECT_EQ(command("treemesh forest.txt --glb --twigs 0.02"), 0);
+    checkGlb("forest_mesh.glb", num_trees, num_trees, num_twigs);
+    // when every segment is a twig the trees have no meshes, so the glb only has the twig buffer views
+    EXPECT_EQ(command("treemesh forest.txt --glb --twigs 100"), 0);
+    checkGlb("forest_mesh.glb", num_trees, 0, num_segments);
+  }
+
+  /// Create a forest then mesh it with levels of detail, checking that each mesh fills the space counted for it and
+  /// that each level has fewer triangles than the one before
+  TEST(Basic, TreeMeshLod)
+  {
+    EXPECT_EQ(command("treecreate forest 13"), 0);
+    EXPECT_EQ(command("treemesh forest.txt --lod 0.01"), 0);
+    ray::Mesh mesh;
+    EXPECT_TRUE(ray::readPlyMesh("forest_mesh.ply", mesh));
+    checkMeshFilled(mesh);
+    // streaming writes the counted sizes to the file before meshing the trees, so they must match the mesh
+    EXPECT_EQ(command("treemesh forest.txt --lod 0.01 --stream"), 0);
+    ray::Mesh streamed_mesh;
+    EXPECT_TRUE(ray::readPlyMesh("forest_mesh.ply", streamed_mesh));
+    EXPECT_EQ(streamed_mesh.vertices().size(), mesh.vertices().size());
+    EXPECT_EQ(streamed_mesh.indexList().size(), mesh.indexList().size());
+    checkMeshFilled(streamed_mesh);
+
+    EXPECT_EQ(command("treemesh forest.txt --lod 0.01 --lod_levels 3"), 0);
+    size_t num_triangles = 0;
+    for (int level = 0; level < 3; level++)
+    {
+      ray::Mesh level_mesh;
+      EXPECT_TRUE(ray::readPlyMesh("forest_mesh_lod" + std::to_string(level) + ".ply", level_mesh));
+      checkMeshFilled(level_mesh);
+      if (level == 0)  // the first level has the lod distance itself
+      {
+        EXPECT_EQ(level_mesh.indexList().size(), mesh.indexList().size());
+      }
+      else
+      {
+        EXPECT_LT(level_mesh.indexList().size(), num_triangles);
+      }
+      num_triangles = level_mesh.indexList().size();
+    }
+  }
+
+  /// Create a forest then mesh it with its thinnest branches as twig instances, which are left out of the mesh and
+  /// listed in the _twigs.txt file
+  TEST(Basic, TreeMeshTwigs)
+  {
+    EXPECT_EQ(command("treecreate forest 13"), 0);
+    ray::ForestStructure forest;
+    EXPECT_TRUE(forest.load("forest.txt"));
+    size_t num_segments, num_twigs;
+    countSegments(forest, 0.02, num_segments, num_twigs);
+    EXPECT_EQ(command("treemesh forest.txt --twigs 0.02"), 0);
+    ray::Mesh mesh;
+    EXPECT_TRUE(ray::readPlyMesh("forest_mesh.ply", mesh));
+    checkMeshFilled(mesh);
+    std::ifstream ifs("forest_twigs.txt");
+    std::string line;
+    size_t num_instances = 0;
+    while (std::getline(ifs, line))
+    {
+      num_instances += !line.empty() && line[0] != '#' ? 1 : 0;
+    }
+    EXPECT_EQ(num_instances, num_twigs);
+
+    // each remaining segment is one capsule of 14 vertices and 24 triangles
+    EXPECT_EQ(command("treemesh forest.txt --capsules --twigs 0.02"), 0);
+    ray::Mesh capsules_mesh;
+    EXPECT_TRUE(ray::readPlyMesh("forest_mesh.ply", capsules_mesh));
+    EXPECT_EQ(capsules_mesh.vertices().size(), 14 * (num_segments - num_twigs));
+    EXPECT_EQ(capsules_mesh.indexList().size(), 24 * (num_segments - num_twigs));
+    checkMeshFilled(capsules_mesh);
+  }
+
   /// Create a raycloud forest, then extract the ground and the trees, then colour the extracted tree file and
   /// apply it back onto the segmented ray cloud
   TEST(Basic, TreePaint)
@@ -189,8 +763,842 @@ namespace raytest
     ray::ForestStructure forest;
     EXPECT_TRUE(forest.load("forest_pruned.txt"));
     compareMoments(forest.getMoments(), {20, 11.4855, 819.359, 1.53167, 0.130798, 2.6197, 0, 0, 0});
+
+    // pruning by a single criterion gives the same trees as the diameter and length pruning that it replaced
+    ray::ForestStructure source;
+    EXPECT_TRUE(source.load("forest.txt"));
+    for (const auto &source_tree : source.trees)
+    {
+      for (const double diameter : { 0.01, 0.02, 0.04 })
+      {
+        ray::TreeStructure expected, pruned = source_tree;
+        const bool kept = legacyPruneDiameter(source_tree, diameter, expected);
+        EXPECT_EQ(tree::pruneDiameter(pruned, 100.0 * diameter), kept);
+        if (kept)
+        {
+          EXPECT_TRUE(sameSegments(pruned, expected));
+        }
+      }
+      for (const double length : { 0.2, 0.5, 1.0 })
+      {
+        ray::TreeStructure expected, pruned = source_tree;
+        const bool kept = legacyPruneLength(source_tree, length, expected);
+        tree::PruneCriteria criteria;
+        criteria.tip_length = length;
+        EXPECT_EQ(tree::prune(pruned, criteria), kept);
+        if (kept)
+        {
+          EXPECT_TRUE(sameSegments(pruned, expected));
+        }
+      }
+    }
+
+    // the tip length is removed before the diameters are found, so a wide tip within the tip length does not keep
+    // the thin branch below it, matching separate length then diameter passes
+    ray::TreeStructure thin_branch;
+    for (int i = 0; i < 4; i++)
+    {
+      ray::TreeStructure::Segment segment;
+      segment.tip = Eigen::Vector3d(0, 0, i < 3 ? i : 2.1);
+      segment.radius = i == 2 ? 0.005 : 0.05;
+      segment.parent_id = i - 1;
+      thin_branch.segments().push_back(segment);
+    }
+    ray::TreeStructure shortened_branch, expected_branch, pruned_branch = thin_branch;
+    EXPECT_TRUE(legacyPruneLength(thin_branch, 0.5, shortened_branch));
+    EXPECT_EQ(shortened_branch.segments().size(), 3u);
+    EXPECT_TRUE(legacyPruneDiameter(shortened_branch, 0.02, expected_branch));
+    EXPECT_EQ(expected_branch.segments().size(), 2u);
+    tree::PruneCriteria branch_criteria;
+    branch_criteria.tip_length = 0.5;
+    branch_criteria.min_diameter = 0.02;
+    EXPECT_TRUE(tree::prune(pruned_branch, branch_criteria));
+    EXPECT_TRUE(sameSegments(pruned_branch, expected_branch));
+
+    // prune by every criterion at once, and compare with removing the tip length then searching each segment's whole
+    // subtree in the shortened tree
+    EXPECT_EQ(command("treeinfo forest.txt"), 0);
+    EXPECT_EQ(command("treeprune forest_info.txt --diameter 1 --length 0.2 --order 2 --min_height 0.5 --max_height 10 "
+                      "--attribute length --threshold 1"), 0);
+    ray::ForestStructure info, info_pruned;
+    EXPECT_TRUE(info.load("forest_info.txt"));
+    EXPECT_TRUE(info_pruned.load("forest_info_pruned.txt"));
+    size_t num_pruned_trees = 0;
+    for (const auto &info_tree : info.trees)
+    {
+      ray::TreeStructure shortened;
+      if (!legacyPruneLength(info_tree, 0.2, shortened))  // the whole tree is pruned
+      {
+        continue;
+      }
+      const auto &segments = shortened.segments();
+      const auto &names = shortened.attributeNames();
+      const size_t length_id = std::find(names.begin(), names.end(), "length") - names.begin();
+      ASSERT_LT(length_id, names.size());
+      std::vector<std::vector<int>> children(segments.size());
+      for (size_t i = 1; i < segments.size(); i++)
+      {
+        children[segments[i].parent_id].push_back(static_cast<int>(i));
+      }
+      std::function<double(int)> max_diameter = [&](int id) {
+        double value = 2.0 * segments[id].radius;
+        for (const int child : children[id])
+        {
+          value = std::max(value, max_diameter(child));
+        }
+        return value;
+      };
+      std::function<double(int)> max_height = [&](int id) {
+        double value = segments[id].tip[2];
+        for (const int child : children[id])
+        {
+          value = std::max(value, max_height(child));
+        }
+        return value;
+      };
+      std::function<double(int)> max_length = [&](int id) {
+        double value = segments[id].attributes[length_id];
+        for (const int child : children[id])
+        {
+          value = std::max(value, max_length(child));
+        }
+        return value;
+      };
+      std::function<int(int)> order = [&](int id) {
+        std::vector<int> orders;
+        for (const int child : children[id])
+        {
+          orders.push_back(order(child));
+        }
+        if (orders.empty())
+        {
+          return 1;
+        }
+        std::sort(orders.rbegin(), orders.rend());
+        return orders.size() > 1 && orders[0] == orders[1] ? orders[0] + 1 : orders[0];
+      };
+
+      // a segment is kept if it and all of its parents pass each criterion
+      const double base_height = segments[0].tip[2];
+      std::vector<int> new_index(segments.size(), -1);
+      std::vector<int> kept = { 0 };
+      new_index[0] = 0;
+      for (size_t i = 1; i < segments.size(); i++)
+      {
+        const int par = segments[i].parent_id;
+        if (new_index[par] != -1 && max_diameter(i) > 0.01 && order(i) >= 2 && max_height(i) - base_height >= 0.5 &&
+            segments[par].tip[2] - base_height <= 10.0 && max_length(i) >= 1.0)
+        {
+          new_index[i] = static_cast<int>(kept.size());
+          kept.push_back(static_cast<int>(i));
+        }
+      }
+      if (kept.size() == 1)  // the whole tree is pruned
+      {
+        continue;
+      }
+      ASSERT_LT(num_pruned_trees, info_pruned.trees.size());
+      const auto &pruned_segments = info_pruned.trees[num_pruned_trees++].segments();
+      ASSERT_EQ(pruned_segments.size(), kept.size());
+      for (size_t j = 1; j < kept.size(); j++)
+      {
+        const auto &segment = segments[kept[j]];
+        const auto &pruned_segment = pruned_segments[j];
+        EXPECT_EQ(pruned_segment.parent_id, new_index[segment.parent_id]);
+        EXPECT_NEAR(pruned_segment.radius, segment.radius, 1e-4);
+        EXPECT_NEAR((pruned_segment.tip - segment.tip).norm(), 0.0, 1e-3);
+      }
+    }
+    EXPECT_EQ(num_pruned_trees, info_pruned.trees.size());
   }  
 
+  /// Read the image @c file_name as RGBA pixels in rows from the top of the image down
+  bool readImage(const std::string &file_name, int &width, int &height, std::vector<uint32_t> &pixels)
+  {
+    int num_channels = 0;
+    stbi_set_flip_vertically_on_load(0);
+    uint8_t *data = stbi_load(file_name.c_str(), &width, &height, &num_channels, 4);
+    if (!data)
+    {
+      return false;
+    }
+    pixels.resize(static_cast<size_t>(width) * height);
+    memcpy(pixels.data(), data, pixels.size() * sizeof(uint32_t));
+    stbi_image_free(data);
+    return true;
+  }
+
+  /// The depth along the ray from @c start to @c end of its first intersection with the capsule from @c v1 to @c v2,
+  /// or 0 if it misses, as treerender originally traced each pixel
+  double capsuleRayDepth(const Eigen::Vector3d &v1, const Eigen::Vector3d &v2, double radius,
+                         const Eigen::Vector3d &start, const Eigen::Vector3d &end)
+  {
+    Eigen::Vector3d ray = end - start;
+    Eigen::Vector3d dir = v2 - v1;
+    double length = dir.norm();
+    if (length > 0.0)
+    {
+      dir /= length;
+    }
+
+    // cylinder part:
+    double cylinder_intersection1 = 1e10;
+    Eigen::Vector3d up = dir.cross(ray);
+    double mag = up.norm();
+    if (mag > 0.0)  // two rays are not inline
+    {
+      up /= mag;
+      double gap = std::abs((start - v1).dot(up));
+      if (gap > radius)
+      {
+        return 0.0;
+      }
+
+      Eigen::Vector3d lateral_dir = ray - dir * ray.dot(dir);
+      double lateral_length = lateral_dir.norm();
+      double d_mid = (v1 - start).dot(lateral_dir) / ray.dot(lateral_dir);
+      double shift = std::sqrt(radius * radius - gap * gap) / lateral_length;
+      double d_min = d_mid - shift;
+      double d1 = (start + ray * d_min - v1).dot(dir) / length;
+      if (d1 > 0.0 && d1 < 1.0)
+      {
+        cylinder_intersection1 = d_min;
+      }
+    }
+
+    // the spheres part:
+    double ray_length = ray.norm();
+    double sphere_intersection1[2] = { 1e10, 1e10 };
+    Eigen::Vector3d ends[2] = { v1, v2 };
+    for (int e = 0; e < 2; e++)
+    {
+      double mid_d = (ends[e] - start).dot(ray) / (ray_length * ray_length);
+      Eigen::Vector3d shortest_dir = (ends[e] - start) - ray * mid_d;
+      double shortest_sqr = shortest_dir.squaredNorm();
+      if (shortest_sqr < radius * radius)
+      {
+        double shift = std::sqrt(radius * radius - shortest_sqr) / ray_length;
+        sphere_intersection1[e] = mid_d - shift;
+      }
+    }
+
+    // combining together
+    double closest_d = std::min({ cylinder_intersection1, sphere_intersection1[0], sphere_intersection1[1] });
+    if (closest_d == 1e10)
+    {
+      return 0.0;
+    }
+    return closest_d * ray_length;
+  }
+
+  /// Render the height style, or the colour style from attribute @c red_id when it is not -1, of a @c width x
+  /// @c height image over the bounds, as treerender originally did: each capsule in forest order traces the pixels
+  /// within its bounds, and the nearest capsule so far, or the later one at equal depths, colours the pixel. Returns
+  /// the RGBA pixels starting from the top row, as they are read from the image file
+  std::vector<uint32_t> referenceDepthRender(const ray::ForestStructure &forest, const Eigen::Vector3d &min_bound,
+                                             const Eigen::Vector3d &max_bound, double pixel_width, int width,
+                                             int height, int red_id, double colour_scale)
+  {
+    std::vector<double> depths(static_cast<size_t>(width) * height, 1e10);
+    std::vector<uint32_t> pixels(depths.size(), 0);
+    for (const auto &tree : forest.trees)
+    {
+      for (size_t i = 1; i < tree.segments().size(); i++)
+      {
+        const auto &segment = tree.segments()[i];
+        const Eigen::Vector3d v1 = tree.segments()[segment.parent_id].tip, v2 = segment.tip;
+        const double radius = segment.radius + pixel_width / 2.0;
+        const Eigen::Vector3d min_caps = v1.cwiseMin(v2) - Eigen::Vector3d(radius, radius, 0);
+        const Eigen::Vector3d max_caps = v1.cwiseMax(v2) + Eigen::Vector3d(radius, radius, 0);
+        const Eigen::Vector2i mins =
+          ((min_caps - min_bound) / pixel_width).head<2>().cast<int>().cwiseMax(Eigen::Vector2i(0, 0));
+        const Eigen::Vector2i maxs = (((max_caps - min_bound) / pixel_width).head<2>().cast<int>() +
+                                      Eigen::Vector2i(1, 1)).cwiseMin(Eigen::Vector2i(width, height));
+        for (int x = mins[0]; x < maxs[0]; x++)
+        {
+          for (int y = mins[1]; y < maxs[1]; y++)
+          {
+            Eigen::Vector3d top = Eigen::Vector3d((double)x + 0.5, (double)y + 0.5, 0.0) * pixel_width + min_bound;
+            top[2] = max_bound[2] + pixel_width;
+            Eigen::Vector3d bottom = top;
+            bottom[2] = min_bound[2] - pixel_width;
+            const double depth = capsuleRayDepth(v1, v2, radius, top, bottom);
+            const size_t ind = static_cast<size_t>(x) + static_cast<size_t>(width) * (height - 1 - y);
+            if (depth > 0.0 && depth <= depths[ind])
+            {
+              depths[ind] = depth;
+              Eigen::Vector3d colour;
+              if (red_id == -1)
+              {
+                const double shade =
+                  std::max(0.0, std::min(1.0 - depth / (max_bound[2] - min_bound[2]), 1.0)) * 255.0;
+                colour = Eigen::Vector3d(shade, shade, shade);
+              }
+              else
+              {
+                colour = Eigen::Vector3d(segment.attributes[red_id], segment.attributes[red_id + 1],
+                                         segment.attributes[red_id + 2]) *
+                         colour_scale;
+              }
+              const uint8_t rgba[4] = { static_cast<uint8_t>(colour[0]), static_cast<uint8_t>(colour[1]),
+                                        static_cast<uint8_t>(colour[2]), 255 };
+              memcpy(&pixels[ind], rgba, 4);
+            }
+          }
+        }
+      }
+    }
+    return pixels;
+  }
+
+  /// Count the pixels of the image file @c image_file that differ from @c pixels, which are @c width x @c height
+  size_t countDifferentPixels(const std::string &image_file, int width, int height,
+                              const std::vector<uint32_t> &pixels)
+  {
+    int image_width = 0, image_height = 0;
+    std::vector<uint32_t> image;
+    EXPECT_TRUE(readImage(image_file, image_width, image_height, image));
+    EXPECT_EQ(image_width, width);
+    EXPECT_EQ(image_height, height);
+    if (image.size() != pixels.size())
+    {
+      return pixels.size();
+    }
+    size_t num_different = 0;
+    for (size_t i = 0; i < pixels.size(); i++)
+    {
+      num_different += image[i] != pixels[i] ? 1 : 0;
+    }
+    return num_different;
+  }
+
+  /// Render a crop of a forest that is wider than a render window, so that capsules straddle the windows and the
+  /// capsule bins within them, and lie partly outside the image, checking it against tracing every capsule's pixels
+  TEST(Basic, TreeRenderBins)
+  {
+    EXPECT_EQ(command("treecreate forest 3"), 0);
+    EXPECT_EQ(command("treeinfo forest.txt"), 0);
+    EXPECT_EQ(command("treecolour forest_info.txt length --gradient_rgb"), 0);
+    ray::ForestStructure forest;
+    ASSERT_TRUE(tree::loadForest("forest_info_coloured.txt", forest));
+    ASSERT_FALSE(forest.trees.empty());
+    const auto &names = forest.trees[0].attributeNames();
+    const int red_id = static_cast<int>(std::find(names.begin(), names.end(), "red") - names.begin());
+    ASSERT_LT(red_id + 2, static_cast<int>(names.size()));
+    Eigen::Vector3d min_bound(1e10, 1e10, 1e10), max_bound(-1e10, -1e10, -1e10);
+    double max_colour = 0.0;
+    for (const auto &tree : forest.trees)
+    {
+      for (size_t i = 0; i < tree.segments().size(); i++)
+      {
+        min_bound = min_bound.cwiseMin(tree.segments()[i].tip);
+        max_bound = max_bound.cwiseMax(tree.segments()[i].tip);
+        for (int c = 0; c < 3 && i > 0; c++)
+        {
+          max_colour = std::max(max_colour, tree.segments()[i].attributes[red_id + c]);
+        }
+      }
+    }
+
+    // crop the middle of the forest to a 1280 pixel square, which is rendered in several windows
+    const Eigen::Vector2d centre = ((min_bound + max_bound) / 2.0).head<2>();
+    const double radius = 0.3 * (max_bound - min_bound).head<2>().minCoeff();
+    const double pixel_width = radius / 640.0;
+    std::stringstream options;
+    options << std::setprecision(17) << " --pixel_width " << pixel_width << " --crop " << centre[0] << ","
+            << centre[1] << "," << radius << "," << radius;
+    const int size = static_cast<int>(std::round(2.0 * radius / pixel_width));
+    EXPECT_GT(size, 1024);
+    min_bound.head<2>() = centre - Eigen::Vector2d(radius, radius);
+    max_bound.head<2>() = centre + Eigen::Vector2d(radius, radius);
+
+    EXPECT_EQ(command("treerender forest_info_coloured.txt height --output crop_depths.png" + options.str()), 0);
+    EXPECT_EQ(countDifferentPixels("crop_depths.png", size, size,
+                                   referenceDepthRender(forest, min_bound, max_bound, pixel_width, size, size, -1, 0.0)),
+              0u);
+    EXPECT_EQ(command("treerender forest_info_coloured.txt --output crop_colours.png" + options.str()), 0);
+    EXPECT_EQ(countDifferentPixels("crop_colours.png", size, size,
+                                   referenceDepthRender(forest, min_bound, max_bound, pixel_width, size, size, red_id,
+                                                        255.0 / max_colour)),
+              0u);
+  }
+
+  /// Read the Radiance HDR image @c file_name as RGB values in rows from the top of the image down
+  bool readFloatImage(const std::string &file_name, int &width, int &height, std::vector<float> &values)
+  {
+    int num_channels = 0;
+    stbi_set_flip_vertically_on_load(0);
+    float *data = stbi_loadf(file_name.c_str(), &width, &height, &num_channels, 3);
+    if (!data)
+    {
+      return false;
+    }
+    values.assign(data, data + static_cast<size_t>(width) * height * 3);
+    stbi_image_free(data);
+    return true;
+  }
+
+  /// Render the surface_area and plant_density styles of a forest into a window around it, checking that the
+  /// surface areas sum to the bark area of all the segments, and that each tree adds one stem at the pixel of its base
+  TEST(Basic, TreeRenderCoverage)
+  {
+    EXPECT_EQ(command("treecreate forest 4"), 0);
+    ray::ForestStructure forest;
+    ASSERT_TRUE(tree::loadForest("forest.txt", forest));
+    Eigen::Vector3d min_bound(1e10, 1e10, 1e10), max_bound(-1e10, -1e10, -1e10);
+    double bark_area = 0.0;
+    for (const auto &tree : forest.trees)
+    {
+      for (size_t i = 0; i < tree.segments().size(); i++)
+      {
+        const auto &segment = tree.segments()[i];
+        min_bound = min_bound.cwiseMin(segment.tip);
+        max_bound = max_bound.cwiseMax(segment.tip);
+        if (i > 0)
+        {
+          const double length = (segment.tip - tree.segments()[segment.parent_id].tip).norm();
+          bark_area += 2.0 * ray::kPi * segment.radius * length;
+        }
+      }
+    }
+    ASSERT_GT(bark_area, 0.0);
+
+    // a window with a margin around the forest, so that all of the bark is over the image
+    const double pixel_width = 0.1;
+    const Eigen::Vector2d centre = ((min_bound + max_bound) / 2.0).head<2>().array().round();
+    const double radius = std::ceil((max_bound - min_bound).head<2>().maxCoeff() / 2.0) + 3.0;
+    std::stringstream options;
+    options << " --pixel_width 0.1 --crop " << centre[0] << "," << centre[1] << "," << radius << "," << radius;
+    const int size = static_cast<int>(std::round(2.0 * radius / pixel_width));
+    min_bound.head<2>() = centre - Eigen::Vector2d(radius, radius);
+
+    // the printed total is the sum of the pixels, while the image stores each pixel to about 3 significant figures
+    EXPECT_EQ(command("treerender forest.txt surface_area --output area.hdr" + options.str() + " > area.txt"), 0);
+    EXPECT_NEAR(readLabelledValue("area.txt", "total surface area: "), bark_area, 1e-5 * bark_area);
+    int width = 0, height = 0;
+    std::vector<float> values;
+    ASSERT_TRUE(readFloatImage("area.hdr", width, height, values));
+    EXPECT_EQ(width, size);
+    EXPECT_EQ(height, size);
+    double area_sum = 0.0;
+    for (size_t i = 0; i < values.size(); i += 3)
+    {
+      area_sum += values[i];
+    }
+    EXPECT_NEAR(area_sum, bark_area, 0.01 * bark_area);
+
+    // the stems per hectare in red, from which the number of stems at each pixel is recovered
+    std::vector<int> expected_stems(static_cast<size_t>(size) * size, 0);
+    for (const auto &tree : forest.trees)
+    {
+      const Eigen::Vector3d &base = tree.segments()[0].tip;
+      const int x = static_cast<int>(std::floor((base[0] - min_bound[0]) / pixel_width));
+      const int y = static_cast<int>(std::floor((base[1] - min_bound[1]) / pixel_width));
+      expected_stems[static_cast<size_t>(x) + static_cast<size_t>(size) * (size - 1 - y)]++;
+    }
+    EXPECT_EQ(command("treerender forest.txt plant_density --output density.hdr" + options.str()), 0);
+    ASSERT_TRUE(readFloatImage("density.hdr", width, height, values));
+    ASSERT_EQ(values.size(), 3 * expected_stems.size());
+    const double per_hectare = 10000.0 / (pixel_width * pixel_width);
+    size_t num_stems = 0, num_different = 0;
+    for (size_t i = 0; i < expected_stems.size(); i++)
+    {
+      const int stems = static_cast<int>(std::round(values[3 * i] / per_hectare));
+      num_stems += stems;
+      num_different += stems != expected_stems[i] ? 1 : 0;
+    }
+    EXPECT_EQ(num_stems, forest.trees.size());
+    EXPECT_EQ(num_different, 0u);
+  }
+
+  /// Render the height and colour styles, checking that they are the same to the pixel as tracing a ray through every
+  /// pixel of every capsule, as treerender originally did
+  TEST(Basic, TreeRenderDepths)
+  {
+    EXPECT_EQ(command("treecreate forest 3"), 0);
+    EXPECT_EQ(command("treeinfo forest.txt"), 0);
+    EXPECT_EQ(command("treecolour forest_info.txt length --gradient_rgb"), 0);
+    ray::ForestStructure forest;
+    ASSERT_TRUE(tree::loadForest("forest_info_coloured.txt", forest));
+    ASSERT_FALSE(forest.trees.empty());
+    const auto &names = forest.trees[0].attributeNames();
+    const int red_id = static_cast<int>(std::find(names.begin(), names.end(), "red") - names.begin());
+    ASSERT_LT(red_id + 2, static_cast<int>(names.size()));
+    // a copy of the first tree with red and blue swapped is at equal depths to it, where the later capsule is drawn
+    forest.trees.push_back(forest.trees[0]);
+    for (auto &segment : forest.trees.back().segments())
+    {
+      std::swap(segment.attributes[red_id], segment.attributes[red_id + 2]);
+    }
+    ASSERT_TRUE(tree::saveForest("forest_coloured.txt", forest));
+    ASSERT_TRUE(tree::loadForest("forest_coloured.txt", forest));
+    Eigen::Vector3d min_bound(1e10, 1e10, 1e10), max_bound(-1e10, -1e10, -1e10);
+    for (const auto &tree : forest.trees)
+    {
+      for (const auto &segment : tree.segments())
+      {
+        min_bound = min_bound.cwiseMin(segment.tip);
+        max_bound = max_bound.cwiseMax(segment.tip);
+      }
+    }
+    double max_colour = 0.0;
+    for (const auto &tree : forest.trees)
+    {
+      for (size_t i = 1; i < tree.segments().size(); i++)
+      {
+        for (int c = 0; c < 3; c++)
+        {
+          max_colour = std::max(max_colour, tree.segments()[i].attributes[red_id + c]);
+        }
+      }
+    }
+
+    const double pixel_width = 0.02;
+    const Eigen::Vector3d extent = max_bound - min_bound;
+    const int width = static_cast<int>(std::round(extent[0] / pixel_width));
+    const int height = static_cast<int>(std::round(extent[1] / pixel_width));
+    EXPECT_EQ(command("treerender forest_coloured.txt height --pixel_width 0.02 --output depths.png"), 0);
+    EXPECT_EQ(countDifferentPixels("depths.png", width, height,
+                                   referenceDepthRender(forest, min_bound, max_bound, pixel_width, width, height, -1, 0.0)),
+              0u);
+    EXPECT_EQ(command("treerender forest_coloured.txt --pixel_width 0.02 --output colours.png"), 0);
+    EXPECT_EQ(countDifferentPixels("colours.png", width, height,
+                                   referenceDepthRender(forest, min_bound, max_bound, pixel_width, width, height,
+                                                        red_id, 255.0 / max_colour)),
+              0u);
+  }
+
+  /// Render a forest in each style as a single image and as tiles, and check that the tiles put back together are
+  /// the same as the single image
+  TEST(Basic, TreeRenderTiles)
+  {
+    EXPECT_EQ(command("treecreate forest 13"), 0);
+    const int tile_size = 100;
+    for (const std::string style : { "height", "volume", "surface_area", "plant_density" })
+    {
+      EXPECT_EQ(command("treerender forest.txt " + style + " --pixel_width 0.1 --output render.png"), 0);
+      EXPECT_EQ(command("treerender forest.txt " + style + " --pixel_width 0.1 --tiles 100 --output render_tile.png"), 0);
+      int width = 0, height = 0;
+      std::vector<uint32_t> image;
+      ASSERT_TRUE(readImage("render.png", width, height, image));
+      // the tiles are numbered from the top left, with the partial tiles along the right and top edges, as the
+      // tiles are laid out from the lower left corner of the image
+      const int num_x = (width + tile_size - 1) / tile_size, num_y = (height + tile_size - 1) / tile_size;
+      EXPECT_GT(num_x * num_y, 4);
+      size_t num_different = 0;
+      for (int row = 0; row < num_y; row++)
+      {
+        for (int column = 0; column < num_x; column++)
+        {
+          const int x0 = column * tile_size, y0 = (num_y - 1 - row) * tile_size;
+          const int top = height - std::min(y0 + tile_size, height);
+          int tile_width = 0, tile_height = 0;
+          std::vector<uint32_t> tile;
+          ASSERT_TRUE(readImage("render_tile_" + std::to_string(column) + "_" + std::to_string(row) + ".png",
+                                tile_width, tile_height, tile));
+          ASSERT_EQ(tile_width, std::min(x0 + tile_size, width) - x0);
+          ASSERT_EQ(tile_height, std::min(y0 + tile_size, height) - y0);
+          for (int y = 0; y < tile_height; y++)
+          {
+            for (int x = 0; x < tile_width; x++)
+            {
+              num_different += tile[x + tile_width * y] != image[x0 + x + width * (top + y)] ? 1 : 0;
+            }
+          }
+        }
+      }
+      EXPECT_EQ(num_different, 0u) << style;
+    }
+    // tiles that can't be written, here into a missing directory, are an error
+    EXPECT_NE(command("treerender forest.txt height --pixel_width 0.1 --tiles 100 --output missing/render.png"), 0);
+    EXPECT_NE(command("treerender forest.txt volume --pixel_width 0.1 --tiles 100 --output missing/render.png"), 0);
+  }
+
+  /// The finest level tiles (x, y) of a pyramid, counting y from the top row of tiles
+  typedef std::set<std::pair<int, int>> TileSet;
+
+  /// Replace every tile of the pyramid @c stub of @c num_levels levels, which has @c num_x by @c num_y finest tiles,
+  /// with a marker, so that the tiles rewritten by the next build can be found
+  void markTiles(const std::string &stub, int num_levels, int num_x, int num_y)
+  {
+    for (int z = 0; z < num_levels; z++)
+    {
+      const int scale = 1 << (num_levels - 1 - z);
+      for (int y = 0; y < (num_y + scale - 1) / scale; y++)
+      {
+        for (int x = 0; x < (num_x + scale - 1) / scale; x++)
+        {
+          std::ofstream ofs(stub + "_" + std::to_string(z) + "_" + std::to_string(x) + "_" + std::to_string(y) + ".png");
+          ofs << "unchanged";
+        }
+      }
+    }
+  }
+
+  /// Check that the tiles of the pyramid rewritten since markTiles are exactly the finest tiles @c changed and the
+  /// tiles above them
+  void checkRewritten(const std::string &stub, int num_levels, int num_x, int num_y, const TileSet &changed)
+  {
+    for (int z = 0; z < num_levels; z++)
+    {
+      const int scale = 1 << (num_levels - 1 - z);
+      for (int y = 0; y < (num_y + scale - 1) / scale; y++)
+      {
+        for (int x = 0; x < (num_x + scale - 1) / scale; x++)
+        {
+          bool expected = false;
+          for (const auto &tile : changed)
+          {
+            expected = expected || (tile.first / scale == x && tile.second / scale == y);
+          }
+          const std::string tile_name =
+            stub + "_" + std::to_string(z) + "_" + std::to_string(x) + "_" + std::to_string(y) + ".png";
+          std::ifstream ifs(tile_name, std::ios::binary);
+          const std::string data((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+          EXPECT_EQ(data != "unchanged", expected) << tile_name;
+        }
+      }
+    }
+  }
+
+  /// Check that every tile above the finest level of the pyramid @c stub is reduced from the four tiles below it, by
+  /// the opacity weighted mean or the maximum of each 2x2 block of pixels. Missing tiles are transparent
+  void checkReduction(const std::string &stub, int num_levels, int num_x, int num_y, bool max_reduction)
+  {
+    const int size = 256, half = size / 2;
+    for (int z = 0; z < num_levels - 1; z++)
+    {
+      const int scale = 1 << (num_levels - 1 - z), child_scale = scale / 2;
+      for (int y = 0; y < (num_y + scale - 1) / scale; y++)
+      {
+        for (int x = 0; x < (num_x + scale - 1) / scale; x++)
+        {
+          int width = 0, height = 0;
+          std::vector<uint32_t> tile, children[4];
+          ASSERT_TRUE(readImage(stub + "_" + std::to_string(z) + "_" + std::to_string(x) + "_" + std::to_string(y) +
+                                  ".png", width, height, tile));
+          ASSERT_EQ(width, size);
+          ASSERT_EQ(height, size);
+          for (int i = 0; i < 4; i++)
+          {
+            const int child_x = 2 * x + i % 2, child_y = 2 * y + i / 2;
+            children[i].assign(size * size, 0);
+            if (child_x < (num_x + child_scale - 1) / child_scale && child_y < (num_y + child_scale - 1) / child_scale)
+            {
+              ASSERT_TRUE(readImage(stub + "_" + std::to_string(z + 1) + "_" + std::to_string(child_x) + "_" +
+                                      std::to_string(child_y) + ".png", width, height, children[i]));
+            }
+          }
+          size_t num_different = 0;
+          for (int py = 0; py < size; py++)
+          {
+            for (int px = 0; px < size; px++)
+            {
+              const std::vector<uint32_t> &child = children[px / half + 2 * (py / half)];
+              const int cx = 2 * (px % half), cy = 2 * (py % half);
+              const uint32_t block[4] = { child[cx + size * cy], child[cx + 1 + size * cy],
+                                          child[cx + size * (cy + 1)], child[cx + 1 + size * (cy + 1)] };
+              uint8_t expected[4] = { 0, 0, 0, 0 };
+              double sums[3] = { 0.0, 0.0, 0.0 }, alpha = 0.0;
+              for (const uint32_t pixel : block)
+              {
+                const uint8_t *channels = reinterpret_cast<const uint8_t *>(&pixel);
+                for (int c = 0; c < 4; c++)
+                {
+                  expected[c] = std::max(expected[c], channels[c]);
+                }
+                for (int c = 0; c < 3; c++)
+                {
+                  sums[c] += static_cast<double>(channels[c]) * static_cast<double>(channels[3]);
+                }
+                alpha += static_cast<double>(channels[3]);
+              }
+              if (!max_reduction)
+              {
+                for (int c = 0; c < 3; c++)
+                {
+                  expected[c] = alpha > 0.0 ? static_cast<uint8_t>(std::round(sums[c] / alpha)) : 0;
+                }
+                expected[3] = static_cast<uint8_t>(std::round(alpha / 4.0));
+              }
+              num_different += memcmp(expected, &tile[px + size * py], 4) != 0 ? 1 : 0;
+            }
+          }
+          EXPECT_EQ(num_different, 0u);
+        }
+      }
+    }
+  }
+
+  /// Render a forest as a tile pyramid, check that the coarser levels are reduced from the finer ones, then change one
+  /// tree and render it again, checking that only the tiles that the tree overlaps are written again
+  TEST(Basic, TreeRenderPyramid)
+  {
+    EXPECT_EQ(command("treecreate forest 13"), 0);
+    // save the forest as it is read, so that resaving it below only changes the tree that is altered
+    ray::ForestStructure forest;
+    ASSERT_TRUE(forest.load("forest.txt"));
+    ASSERT_TRUE(forest.save("forest.txt"));
+    ASSERT_TRUE(forest.load("forest.txt"));
+    Eigen::Vector3d min_bound(1e10, 1e10, 1e10), max_bound(-1e10, -1e10, -1e10);
+    for (const auto &tree : forest.trees)
+    {
+      for (const auto &segment : tree.segments())
+      {
+        min_bound = min_bound.cwiseMin(segment.tip);
+        max_bound = max_bound.cwiseMax(segment.tip);
+      }
+    }
+    // a 1024 pixel square image, so 4x4 finest tiles in 3 levels
+    const double pixel_width = 0.05, radius = 25.6;
+    const int num_levels = 3, num_tiles = 4, image_size = 1024, tile_size = 256;
+    const Eigen::Vector2d centre = ((min_bound + max_bound) / 2.0).head<2>().array().round();
+    min_bound.head<2>() = centre - Eigen::Vector2d(radius, radius);
+    std::stringstream crop;
+    crop << centre[0] << "," << centre[1] << "," << radius << "," << radius;
+    const std::string render = "treerender forest.txt height --pixel_width 0.05 --pyramid 3 --crop " + crop.str();
+
+    EXPECT_EQ(command(render + " --output pyramid.png"), 0);
+    checkReduction("pyramid", num_levels, num_tiles, num_tiles, false);
+    EXPECT_EQ(command(render + " --max_reduction --output pyramid_max.png"), 0);
+    checkReduction("pyramid_max", num_levels, num_tiles, num_tiles, true);
+
+    // rebuilding an unchanged forest writes nothing
+    markTiles("pyramid", num_levels, num_tiles, num_tiles);
+    EXPECT_EQ(command(render + " --output pyramid.png"), 0);
+    checkRewritten("pyramid", num_levels, num_tiles, num_tiles, TileSet());
+
+    // thicken the tree that overlaps the fewest tiles. A tile is overlapped by the pixel range of any of the tree's
+    // capsules, at the thicker radius and widened by half a pixel as in the height style
+    const double scale = 1.5;
+    size_t changed_tree = 0;
+    TileSet changed;
+    for (size_t t = 0; t < forest.trees.size(); t++)
+    {
+      TileSet tiles;
+      const auto &segments = forest.trees[t].segments();
+      for (size_t i = 1; i < segments.size(); i++)
+      {
+        const double capsule_radius = scale * segments[i].radius + pixel_width / 2.0;
+        const Eigen::Vector3d &tip = segments[i].tip, &parent_tip = segments[segments[i].parent_id].tip;
+        const Eigen::Vector3d extent(capsule_radius, capsule_radius, 0.0);
+        const Eigen::Vector2i mins =
+          ((tip.cwiseMin(parent_tip) - extent - min_bound) / pixel_width).head<2>().cast<int>().cwiseMax(0);
+        const Eigen::Vector2i maxs =
+          (((tip.cwiseMax(parent_tip) + extent - min_bound) / pixel_width).head<2>().cast<int>() +
+           Eigen::Vector2i(1, 1))
+            .cwiseMin(image_size);
+        if (mins[0] >= maxs[0] || mins[1] >= maxs[1])
+        {
+          continue;
+        }
+        // the tile rows count down from the top of the image
+        for (int y = (image_size - maxs[1]) / tile_size; y <= (image_size - 1 - mins[1]) / tile_size; y++)
+        {
+          for (int x = mins[0] / tile_size; x <= (maxs[0] - 1) / tile_size; x++)
+          {
+            tiles.insert(std::make_pair(x, y));
+          }
+        }
+      }
+      if (!tiles.empty() && (changed.empty() || tiles.size() < changed.size()))
+      {
+        changed_tree = t;
+        changed = tiles;
+      }
+    }
+    ASSERT_FALSE(changed.empty());
+    EXPECT_LT(changed.size(), static_cast<size_t>(num_tiles * num_tiles));
+    for (auto &segment : forest.trees[changed_tree].segments())
+    {
+      segment.radius *= scale;
+    }
+    ASSERT_TRUE(forest.save("forest.txt"));
+    markTiles("pyramid", num_levels, num_tiles, num_tiles);
+    EXPECT_EQ(command(render + " --output pyramid.png"), 0);
+    checkRewritten("pyramid", num_levels, num_tiles, num_tiles, changed);
+
+    // a finest tile that cannot be written fails the build, and is left out of the manifest so that it alone (with
+    // the tiles above it) is written by the next build
+    EXPECT_EQ(global_command("mkdir pyramid_failed_2_1_2.png"), 0);
+    EXPECT_NE(command(render + " --output pyramid_failed.png"), 0);
+    EXPECT_EQ(global_command("rmdir pyramid_failed_2_1_2.png"), 0);
+    markTiles("pyramid_failed", num_levels, num_tiles, num_tiles);
+    EXPECT_EQ(command(render + " --output pyramid_failed.png"), 0);
+    checkRewritten("pyramid_failed", num_levels, num_tiles, num_tiles, TileSet{ std::make_pair(1, 2) });
+  }
+
+  /// Render the volume of isolated and overlapping vertical segments standing on the ground, checking the total
+  /// against the volume of the solid they make, which is counted once where they overlap. The volume is of the
+  /// cylinders and their upper end caps, as the lower caps are below the ground
+  TEST(Basic, TreeRenderVolume)
+  {
+    const double radius = 0.2, height = 4.0, offset = 0.25;
+    const std::string render = "volume --pixel_width 0.05 --crop 0,0,1,1 --output volume.png > ";
+    ray::ForestStructure forest;
+    forest.trees.push_back(stemTree(Eigen::Vector3d(0, 0, 0), height, radius));
+    ASSERT_TRUE(forest.save("cylinder.txt"));
+    EXPECT_EQ(command("treerender cylinder.txt " + render + "cylinder_volume.txt"), 0);
+    const double sphere_volume = 4.0 / 3.0 * ray::kPi * radius * radius * radius;
+    const double cylinder_volume = ray::kPi * radius * radius * height + sphere_volume / 2.0;
+    EXPECT_NEAR(readLabelledValue("cylinder_volume.txt", "total volume: "), cylinder_volume, 0.005 * cylinder_volume);
+
+    // the same segment twice is the same volume
+    forest.trees.push_back(forest.trees[0]);
+    ASSERT_TRUE(forest.save("cylinder_twice.txt"));
+    EXPECT_EQ(command("treerender cylinder_twice.txt " + render + "cylinder_twice_volume.txt"), 0);
+    EXPECT_EQ(readLabelledValue("cylinder_twice_volume.txt", "total volume: "),
+              readLabelledValue("cylinder_volume.txt", "total volume: "));
+
+    // two segments partly overlapping, whose cross section is two overlapping circles and whose caps are half of
+    // two overlapping spheres
+    forest.trees[1] = stemTree(Eigen::Vector3d(offset, 0, 0), height, radius);
+    ASSERT_TRUE(forest.save("cylinders.txt"));
+    EXPECT_EQ(command("treerender cylinders.txt " + render + "cylinders_volume.txt"), 0);
+    const double lens_area = 2.0 * radius * radius * std::acos(offset / (2.0 * radius)) -
+                             offset / 2.0 * std::sqrt(4.0 * radius * radius - offset * offset);
+    const double lens_volume =
+      ray::kPi * (4.0 * radius + offset) * (2.0 * radius - offset) * (2.0 * radius - offset) / 12.0;
+    const double cylinders_volume =
+      (2.0 * ray::kPi * radius * radius - lens_area) * height + (2.0 * sphere_volume - lens_volume) / 2.0;
+    EXPECT_NEAR(readLabelledValue("cylinders_volume.txt", "total volume: "), cylinders_volume,
+                0.005 * cylinders_volume);
+  }
+
+  /// Issues the specified tool command with OpenMP using @c num_threads threads
+  int threadedCommand(int num_threads, const std::string &system_command)
+  {
+    #ifdef _WIN32
+    return system(("set OMP_NUM_THREADS=" + std::to_string(num_threads) + " && " + system_command).c_str());
+    #else
+    return system(("OMP_NUM_THREADS=" + std::to_string(num_threads) + " ./" + system_command).c_str());
+    #endif // _WIN32
+  }
+
+  /// Render the volume of a forest with one thread and with several, which split the rows between them, checking
+  /// that the images and totals are identical
+  TEST(Basic, TreeRenderVolumeThreads)
+  {
+    EXPECT_EQ(command("treecreate forest 4"), 0);
+    const std::string render = "treerender forest.txt volume --pixel_width 0.05 --output ";
+    EXPECT_EQ(threadedCommand(1, render + "volume_serial.hdr > volume_serial.txt"), 0);
+    EXPECT_EQ(threadedCommand(4, render + "volume_parallel.hdr > volume_parallel.txt"), 0);
+    std::string images[2];
+    const std::string files[2] = { "volume_serial", "volume_parallel" };
+    for (int i = 0; i < 2; i++)
+    {
+      std::ifstream image(files[i] + ".hdr", std::ios::binary);
+      images[i].assign(std::istreambuf_iterator<char>(image), std::istreambuf_iterator<char>());
+    }
+    EXPECT_FALSE(images[0].empty());
+    EXPECT_TRUE(images[0] == images[1]);
+    EXPECT_GT(readLabelledValue("volume_serial.txt", "total volume: "), 0.0);
+    EXPECT_EQ(readLabelledValue("volume_serial.txt", "total volume: "),
+              readLabelledValue("volume_parallel.txt", "total volume: "));
+    EXPECT_EQ(readLabelledValue("volume_serial.txt", "pixel volume % error: "),
+              readLabelledValue("volume_parallel.txt", "pixel volume % error: "));
+  }
+
   /// Create a forest then rotate it
   TEST(Basic, TreeRotate)
   {
@@ -201,6 +1609,221 @@ namespace raytest
     compareMoments(forest.getMoments(), {20, 37.4163, 1013.61, 1.51963, 0.12723, 2.5333, 0, 0, 0});
   }
 
+  /// the distance from @c point to the line segment from @c v1 to @c v2
+  double segmentDistance(const Eigen::Vector3d &point, const Eigen::Vector3d &v1, const Eigen::Vector3d &v2)
+  {
+    const Eigen::Vector3d axis = v2 - v1;
+    const double length_sqr = axis.squaredNorm();
+    const double t = length_sqr > 0.0 ? std::max(0.0, std::min((point - v1).dot(axis) / length_sqr, 1.0)) : 0.0;
+    return (v1 + axis * t - point).norm();
+  }
+
+  /// Brute force distance along the ray from @c start in unit direction @c dir, up to @c length, that it first enters
+  /// @c capsule, or -1 if it misses. The distance to the capsule's axis is convex along the ray, so this searches
+  /// for its minimum then bisects back to the entry, independently of the index's intersection code
+  double capsuleEntry(const Eigen::Vector3d &start, const Eigen::Vector3d &dir, double length,
+                      const tree::Cylinder &capsule)
+  {
+    auto outside = [&](double t) { return segmentDistance(start + dir * t, capsule.v1, capsule.v2) - capsule.radius; };
+    if (outside(0.0) <= 0.0)
+    {
+      return 0.0;
+    }
+    double lo = 0.0, hi = length;
+    for (int i = 0; i < 100; i++)
+    {
+      const double a = lo + (hi - lo) / 3.0, b = hi - (hi - lo) / 3.0;
+      if (outside(a) < outside(b))
+      {
+        hi = b;
+      }
+      else
+      {
+        lo = a;
+      }
+    }
+    hi = 0.5 * (lo + hi);
+    if (outside(hi) > 0.0)
+    {
+      return -1.0;
+    }
+    lo = 0.0;
+    for (int i = 0; i < 100; i++)
+    {
+      const double mid = 0.5 * (lo + hi);
+      if (outside(mid) <= 0.0)
+      {
+        hi = mid;
+      }
+      else
+      {
+        lo = mid;
+      }
+    }
+    return hi;
+  }
+
+  /// Create a forest and index its segments, then check each type of query against a brute force search of every
+  /// segment, before and after saving and loading the index
+  TEST(Basic, TreeSegmentIndex)
+  {
+    EXPECT_EQ(command("treecreate forest 12"), 0);
+    ray::ForestStructure forest;
+    ASSERT_TRUE(forest.load("forest.txt"));
+    std::vector<tree::SegmentRef> refs;
+    std::vector<tree::Cylinder> capsules;
+    tree::BoundingBox bounds;
+    for (size_t t = 0; t < forest.trees.size(); t++)
+    {
+      const auto &segments = forest.trees[t].segments();
+      for (size_t i = 0; i < segments.size(); i++)
+      {
+        if (segments[i].parent_id != -1)
+        {
+          refs.push_back({ static_cast<int>(t), static_cast<int>(i) });
+          capsules.push_back(tree::Cylinder(segments[i].tip, segments[segments[i].parent_id].tip, segments[i].radius));
+          bounds.include(tree::cylinderBounds(capsules.back()));
+        }
+      }
+    }
+    ASSERT_FALSE(refs.empty());
+    tree::SegmentIndex index(forest);
+    EXPECT_TRUE(index.refs() == refs);
+
+    const Eigen::Vector3d extent = bounds.max_bound - bounds.min_bound;
+    auto check_queries = [&](const tree::SegmentIndex &idx) {
+      std::mt19937 random(12);
+      std::uniform_real_distribution<double> unit(0.0, 1.0);
+      std::uniform_int_distribution<size_t> pick(0, capsules.size() - 1);
+      for (int q = 0; q < 50; q++)
+      {
+        const Eigen::Vector3d point =
+          bounds.min_bound + Eigen::Vector3d(unit(random), unit(random), unit(random)).cwiseProduct(extent);
+        const double radius = 0.1 * extent.maxCoeff() * unit(random);
+
+        std::vector<tree::SegmentRef> found, expected;
+        const tree::BoundingBox box(point - Eigen::Vector3d::Constant(radius), point + Eigen::Vector3d::Constant(radius));
+        idx.findInBox(box, found);
+        for (size_t i = 0; i < capsules.size(); i++)
+        {
+          if (tree::cylinderBounds(capsules[i]).overlaps(box))
+          {
+            expected.push_back(refs[i]);
+          }
+        }
+        EXPECT_TRUE(found == expected);
+
+        idx.findInRadius(point, radius, found);
+        expected.clear();
+        for (size_t i = 0; i < capsules.size(); i++)
+        {
+          if (segmentDistance(point, capsules[i].v1, capsules[i].v2) <= radius + capsules[i].radius)
+          {
+            expected.push_back(refs[i]);
+          }
+        }
+        EXPECT_TRUE(found == expected);
+
+        // the nearest segment to a random point, then to a segment tip, where the segment and its children are all at
+        // distance 0 so the first of them is returned
+        const Eigen::Vector3d tip = capsules[pick(random)].v1;
+        for (const auto &query : { point, tip })
+        {
+          tree::SegmentRef ref;
+          double distance = 0.0, nearest = std::numeric_limits<double>::infinity();
+          size_t nearest_id = 0;
+          for (size_t i = 0; i < capsules.size(); i++)
+          {
+            const double dist =
+              std::max(0.0, segmentDistance(query, capsules[i].v1, capsules[i].v2) - capsules[i].radius);
+            if (dist < nearest)
+            {
+              nearest = dist;
+              nearest_id = i;
+            }
+          }
+          EXPECT_TRUE(idx.nearest(query, ref, distance));
+          EXPECT_DOUBLE_EQ(distance, nearest);
+          EXPECT_TRUE(ref == refs[nearest_id]);
+          if (nearest > 0.0)
+          {
+            EXPECT_FALSE(idx.nearest(query, ref, distance, 0.5 * nearest));
+          }
+        }
+
+        // a ray from the random point towards a segment, which is checked against the first entry of any capsule
+        const Eigen::Vector3d end = capsules[pick(random)].v1;
+        const double length = (end - point).norm();
+        const Eigen::Vector3d dir = (end - point) / length;
+        const tree::BoundingBox ray_box(point.cwiseMin(end), point.cwiseMax(end));
+        double first = -1.0;
+        std::vector<double> entries(capsules.size(), -1.0);
+        for (size_t i = 0; i < capsules.size(); i++)
+        {
+          if (tree::cylinderBounds(capsules[i]).overlaps(ray_box))
+          {
+            entries[i] = capsuleEntry(point, dir, length, capsules[i]);
+            if (entries[i] >= 0.0 && (first < 0.0 || entries[i] < first))
+            {
+              first = entries[i];
+            }
+          }
+        }
+        tree::SegmentRef ref;
+        double distance = 0.0;
+        ASSERT_EQ(idx.raycast(point, end, ref, distance), first >= 0.0);
+        if (first >= 0.0)
+        {
+          EXPECT_NEAR(distance, first, 1e-6);
+          const size_t hit_id = std::lower_bound(refs.begin(), refs.end(), ref) - refs.begin();
+          ASSERT_LT(hit_id, refs.size());
+          EXPECT_NEAR(entries[hit_id], first, 1e-6);
+        }
+
+        // a ray starting at a segment tip is inside several capsules, so hits the first of them at distance 0
+        size_t inside_id = 0;
+        while (segmentDistance(tip, capsules[inside_id].v1, capsules[inside_id].v2) > capsules[inside_id].radius)
+        {
+          inside_id++;
+        }
+        EXPECT_TRUE(idx.raycast(tip, end, ref, distance));
+        EXPECT_EQ(distance, 0.0);
+        EXPECT_TRUE(ref == refs[inside_id]);
+      }
+    };
+    check_queries(index);
+
+    // save and reload the index, which should give the same results and be valid only for the unchanged forest
+    const std::string index_file = tree::segmentIndexFileName("forest.txt");
+    EXPECT_EQ(index_file, "forest_index.bin");
+    EXPECT_TRUE(index.save(index_file));
+    tree::SegmentIndex loaded;
+    EXPECT_TRUE(loaded.load(index_file));
+    EXPECT_TRUE(loaded.matches(forest));
+    EXPECT_TRUE(loaded.refs() == refs);
+    check_queries(loaded);
+
+    ray::ForestStructure modified = forest;
+    modified.trees[0].segments().back().radius *= 2.0;
+    EXPECT_FALSE(index.matches(modified));
+    EXPECT_FALSE(loaded.matches(modified));
+    ray::ForestStructure fewer = forest;
+    fewer.trees.pop_back();
+    EXPECT_FALSE(loaded.matches(fewer));
+
+    // loadOrBuild reuses the saved index while it matches, otherwise rebuilds it and saves over the old one
+    tree::SegmentIndex reused;
+    reused.loadOrBuild("forest.txt", forest);
+    EXPECT_TRUE(reused.matches(forest));
+    tree::SegmentIndex rebuilt;
+    rebuilt.loadOrBuild("forest.txt", modified);
+    EXPECT_TRUE(rebuilt.matches(modified));
+    tree::SegmentIndex reloaded;
+    EXPECT_TRUE(reloaded.load(index_file));
+    EXPECT_TRUE(reloaded.matches(modified));
+    EXPECT_FALSE(reloaded.matches(forest));
+  }
+
   /// Create a forest then smooth it
   TEST(Basic, TreeSmooth)
   {
@@ -234,4 +1857,54 @@ namespace raytest
     compareMoments(forest.getMoments(), {20, 755.012, 20106.4, 1.52222, 0.129316, 2.65571, 0, 0, 0});
   }
 
+  /// Translate a binary forest by streaming it through treetranslate, and check it matches translating it in memory
+  TEST(Basic, TreeTranslateBinary)
+  {
+    EXPECT_EQ(command("treecreate forest 11"), 0);
+    EXPECT_EQ(command("treeinfo forest.txt"), 0);
+    EXPECT_EQ(command("treeconvert forest_info.txt forest_info.treeb"), 0);
+    ray::ForestStructure expected;
+    ASSERT_TRUE(tree::loadForest("forest_info.treeb", expected));
+    const Eigen::Vector3d translation(10, 20, 30.1);
+    for (auto &tree : expected.trees)
+    {
+      for (auto &segment : tree.segments())
+      {
+        segment.tip += translation;
+      }
+    }
+    EXPECT_TRUE(tree::saveForest("forest_expected.treeb", expected));
+    EXPECT_EQ(command("treetranslate forest_info.treeb 10,20,30.1"), 0);
+
+    ray::ForestStructure forest;
+    ASSERT_TRUE(tree::loadForest("forest_info.treeb", forest));
+    EXPECT_EQ(forest.comments, expected.comments);
+    ASSERT_EQ(forest.trees.size(), expected.trees.size());
+    for (size_t t = 0; t < forest.trees.size(); t++)
+    {
+      const auto &tree = forest.trees[t];
+      const auto &expected_tree = expected.trees[t];
+      EXPECT_EQ(tree.treeAttributeNames(), expected_tree.treeAttributeNames());
+      EXPECT_EQ(tree.treeAttributes(), expected_tree.treeAttributes());
+      EXPECT_EQ(tree.attributeNames(), expected_tree.attributeNames());
+      ASSERT_EQ(tree.segments().size(), expected_tree.segments().size());
+      for (size_t i = 0; i < tree.segments().size(); i++)
+      {
+        const auto &segment = tree.segments()[i];
+        const auto &expected_segment = expected_tree.segments()[i];
+        EXPECT_EQ(segment.tip, expected_segment.tip);
+        EXPECT_EQ(segment.radius, expected_segment.radius);
+        EXPECT_EQ(segment.parent_id, expected_segment.parent_id);
+        EXPECT_EQ(segment.attributes, expected_segment.attributes);
+      }
+    }
+
+    // the streamed file should also be byte-for-byte what saveForest writes
+    std::ifstream streamed("forest_info.treeb", std::ios::binary), saved("forest_expected.treeb", std::ios::binary);
+    const std::string streamed_bytes((std::istreambuf_iterator<char>(streamed)), std::istreambuf_iterator<char>());
+    const std::string saved_bytes((std::istreambuf_iterator<char>(saved)), std::istreambuf_iterator<char>());
+    EXPECT_EQ(streamed_bytes.size(), saved_bytes.size());
+    EXPECT_TRUE(streamed_bytes == saved_bytes);
+  }
+
 } // raytest
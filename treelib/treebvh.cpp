@@ -0,0 +1,279 @@
+// Copyright (c) 2022
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#include "treebvh.h"
+#include <algorithm>
+#include <istream>
+#include <limits>
+#include <ostream>
+
+namespace tree
+{
+namespace
+{
+const int kMaxLeafSize = 4;
+
+template <class T>
+void writeValue(std::ostream &out, const T &value)
+{
+  out.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+template <class T>
+bool readValue(std::istream &in, T &value)
+{
+  return static_cast<bool>(in.read(reinterpret_cast<char *>(&value), sizeof(T)));
+}
+
+void writeBox(std::ostream &out, const BoundingBox &box)
+{
+  out.write(reinterpret_cast<const char *>(box.min_bound.data()), 3 * sizeof(double));
+  out.write(reinterpret_cast<const char *>(box.max_bound.data()), 3 * sizeof(double));
+}
+
+bool readBox(std::istream &in, BoundingBox &box)
+{
+  in.read(reinterpret_cast<char *>(box.min_bound.data()), 3 * sizeof(double));
+  return static_cast<bool>(in.read(reinterpret_cast<char *>(box.max_bound.data()), 3 * sizeof(double)));
+}
+
+/// the number of bytes from the current position to the end of @c in, so that sizes read from a file can be checked
+/// before allocating for them
+uint64_t remainingBytes(std::istream &in)
+{
+  const std::streampos pos = in.tellg();
+  if (pos < 0 || !in.seekg(0, std::ios::end))
+  {
+    return 0;
+  }
+  const std::streampos end = in.tellg();
+  in.seekg(pos);
+  return end >= pos ? static_cast<uint64_t>(end - pos) : 0;
+}
+}  // namespace
+
+BoundingBox::BoundingBox()
+  : min_bound(Eigen::Vector3d::Constant(std::numeric_limits<double>::max()))
+  , max_bound(Eigen::Vector3d::Constant(std::numeric_limits<double>::lowest()))
+{}
+
+void BoundingBox::include(const BoundingBox &box)
+{
+  min_bound = min_bound.cwiseMin(box.min_bound);
+  max_bound = max_bound.cwiseMax(box.max_bound);
+}
+
+double BoundingBox::rayEntry(const Eigen::Vector3d &start, const Eigen::Vector3d &inv_dir) const
+{
+  // the slab test, intersecting the ray's ranges within each pair of axis aligned planes
+  double entry = 0.0;
+  double exit = std::numeric_limits<double>::infinity();
+  for (int i = 0; i < 3; i++)
+  {
+    double t1 = (min_bound[i] - start[i]) * inv_dir[i];
+    double t2 = (max_bound[i] - start[i]) * inv_dir[i];
+    if (t1 != t1 || t2 != t2)  // parallel to the slab and on its boundary gives 0 * infinity
+    {
+      if (start[i] < min_bound[i] || start[i] > max_bound[i])
+      {
+        return std::numeric_limits<double>::infinity();
+      }
+      continue;
+    }
+    entry = std::max(entry, std::min(t1, t2));
+    exit = std::min(exit, std::max(t1, t2));
+  }
+  return entry <= exit ? entry : std::numeric_limits<double>::infinity();
+}
+
+BoundingBox cylinderBounds(const Cylinder &cylinder, double radius_scale)
+{
+  const Eigen::Vector3d radius = Eigen::Vector3d::Constant(cylinder.radius * radius_scale);
+  return BoundingBox(cylinder.v1.cwiseMin(cylinder.v2) - radius, cylinder.v1.cwiseMax(cylinder.v2) + radius);
+}
+
+void CylinderBVH::build(const std::vector<Cylinder> &cylinders, double radius_scale)
+{
+  const int num = static_cast<int>(cylinders.size());
+  boxes_.resize(num);
+  ids_.resize(num);
+  for (int i = 0; i < num; i++)
+  {
+    boxes_[i] = cylinderBounds(cylinders[i], radius_scale);
+    ids_[i] = i;
+  }
+  nodes_.clear();
+  if (num == 0)
+  {
+    return;
+  }
+  nodes_.reserve(2 * (num / kMaxLeafSize + 1));
+
+  // top-down build, splitting each node at the median of its cylinder centres along the widest axis
+  struct Task
+  {
+    int node, first, count;
+  };
+  std::vector<Task> tasks;
+  nodes_.push_back(Node());
+  tasks.push_back({ 0, 0, num });
+  while (!tasks.empty())
+  {
+    const Task task = tasks.back();
+    tasks.pop_back();
+    BoundingBox box, centres;
+    for (int i = task.first; i < task.first + task.count; i++)
+    {
+      box.include(boxes_[ids_[i]]);
+      const Eigen::Vector3d centre = boxes_[ids_[i]].centre();
+      centres.include(BoundingBox(centre, centre));
+    }
+    nodes_[task.node].box = box;
+    if (task.count <= kMaxLeafSize)
+    {
+      nodes_[task.node].first = task.first;
+      nodes_[task.node].count = task.count;
+      continue;
+    }
+    int axis;
+    (centres.max_bound - centres.min_bound).maxCoeff(&axis);
+    const int half = task.count / 2;
+    std::nth_element(ids_.begin() + task.first, ids_.begin() + task.first + half,
+                     ids_.begin() + task.first + task.count, [&](int a, int b) {
+                       return boxes_[a].min_bound[axis] + boxes_[a].max_bound[axis] <
+                              boxes_[b].min_bound[axis] + boxes_[b].max_bound[axis];
+                     });
+    const int child = static_cast<int>(nodes_.size());
+    nodes_[task.node].first = child;
+    nodes_[task.node].count = 0;
+    nodes_.push_back(Node());
+    nodes_.push_back(Node());
+    tasks.push_back({ child, task.first, half });
+    tasks.push_back({ child + 1, task.first + half, task.count - half });
+  }
+}
+
+void CylinderBVH::findOverlappingPairs(const CylinderBVH &other, std::vector<std::pair<int, int>> &pairs) const
+{
+  pairs.clear();
+  if (nodes_.empty() || other.nodes_.empty())
+  {
+    return;
+  }
+  std::vector<std::pair<int, int>> stack;
+  stack.push_back(std::make_pair(0, 0));
+  while (!stack.empty())
+  {
+    const int a = stack.back().first;
+    const int b = stack.back().second;
+    stack.pop_back();
+    const Node &node_a = nodes_[a];
+    const Node &node_b = other.nodes_[b];
+    if (!node_a.box.overlaps(node_b.box))
+    {
+      continue;
+    }
+    if (node_a.count > 0 && node_b.count > 0)  // two leaves, so test their cylinders directly
+    {
+      for (int i = node_a.first; i < node_a.first + node_a.count; i++)
+      {
+        const BoundingBox &box = boxes_[ids_[i]];
+        for (int j = node_b.first; j < node_b.first + node_b.count; j++)
+        {
+          if (box.overlaps(other.boxes_[other.ids_[j]]))
+          {
+            pairs.push_back(std::make_pair(ids_[i], other.ids_[j]));
+          }
+        }
+      }
+    }
+    // otherwise descend into the larger of the two nodes, or the only one that isn't a leaf
+    else if (node_b.count > 0 || (node_a.count == 0 && node_a.box.volume() >= node_b.box.volume()))
+    {
+      stack.push_back(std::make_pair(node_a.first, b));
+      stack.push_back(std::make_pair(node_a.first + 1, b));
+    }
+    else
+    {
+      stack.push_back(std::make_pair(a, node_b.first));
+      stack.push_back(std::make_pair(a, node_b.first + 1));
+    }
+  }
+  std::sort(pairs.begin(), pairs.end());
+}
+
+void CylinderBVH::write(std::ostream &out) const
+{
+  writeValue(out, static_cast<uint64_t>(boxes_.size()));
+  writeValue(out, static_cast<uint64_t>(nodes_.size()));
+  for (const auto &box : boxes_)
+  {
+    writeBox(out, box);
+  }
+  out.write(reinterpret_cast<const char *>(ids_.data()), static_cast<std::streamsize>(ids_.size() * sizeof(int)));
+  for (const auto &node : nodes_)
+  {
+    writeBox(out, node.box);
+    writeValue(out, static_cast<int32_t>(node.first));
+    writeValue(out, static_cast<int32_t>(node.count));
+  }
+}
+
+bool CylinderBVH::read(std::istream &in)
+{
+  uint64_t num_boxes = 0, num_nodes = 0;
+  if (!readValue(in, num_boxes) || !readValue(in, num_nodes) || num_boxes > std::numeric_limits<int>::max() ||
+      num_nodes > 2 * num_boxes || (num_boxes > 0) != (num_nodes > 0))
+  {
+    return false;
+  }
+  // each box is 6 doubles and an id, each node is a box and two indices
+  const uint64_t box_bytes = 6 * sizeof(double) + sizeof(int);
+  const uint64_t node_bytes = 6 * sizeof(double) + 2 * sizeof(int32_t);
+  if (num_boxes * box_bytes + num_nodes * node_bytes > remainingBytes(in))
+  {
+    return false;
+  }
+  boxes_.resize(num_boxes);
+  for (auto &box : boxes_)
+  {
+    if (!readBox(in, box))
+    {
+      return false;
+    }
+  }
+  ids_.resize(num_boxes);
+  in.read(reinterpret_cast<char *>(ids_.data()), static_cast<std::streamsize>(ids_.size() * sizeof(int)));
+  nodes_.resize(num_nodes);
+  for (uint64_t n = 0; n < num_nodes; n++)
+  {
+    Node &node = nodes_[n];
+    int32_t first = 0, count = 0;
+    if (!readBox(in, node.box) || !readValue(in, first) || !readValue(in, count))
+    {
+      return false;
+    }
+    node.first = first;
+    node.count = count;
+    // check the indices, so that queries on the hierarchy can't go out of bounds. Children always follow their
+    // parent node, so the traversals also always terminate
+    const bool valid = count > 0 ? first >= 0 && static_cast<uint64_t>(first) + count <= num_boxes :
+                                   count == 0 && static_cast<uint64_t>(first) > n &&
+                                     static_cast<uint64_t>(first) + 1 < num_nodes;
+    if (!valid)
+    {
+      return false;
+    }
+  }
+  for (const int id : ids_)
+  {
+    if (id < 0 || static_cast<uint64_t>(id) >= num_boxes)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+}  // namespace tree
@@ -0,0 +1,169 @@
+// Copyright (c) 2022
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#ifndef TREELIB_TREEBVH_H
+#define TREELIB_TREEBVH_H
+
+#include <Eigen/Dense>
+#include <iosfwd>
+#include <limits>
+#include <utility>
+#include <vector>
+#include "treelib/treelibconfig.h"
+#include "treelib/treeutils.h"
+
+namespace tree
+{
+/// Axis aligned bounding box
+struct TREELIB_EXPORT BoundingBox
+{
+  BoundingBox();
+  BoundingBox(const Eigen::Vector3d &min_bound, const Eigen::Vector3d &max_bound)
+    : min_bound(min_bound)
+    , max_bound(max_bound)
+  {}
+  /// expand to include @c box
+  void include(const BoundingBox &box);
+  bool overlaps(const BoundingBox &box) const
+  {
+    return (min_bound.array() <= box.max_bound.array()).all() && (box.min_bound.array() <= max_bound.array()).all();
+  }
+  Eigen::Vector3d centre() const { return 0.5 * (min_bound + max_bound); }
+  double volume() const { return (max_bound - min_bound).prod(); }
+  /// the distance from @c point to the box, 0 if it is inside
+  double distance(const Eigen::Vector3d &point) const
+  {
+    return (min_bound - point).cwiseMax(point - max_bound).cwiseMax(0.0).norm();
+  }
+  /// the distance along the ray from @c start in direction @c dir (with inverse @c inv_dir) that it enters the box,
+  /// 0 if it starts inside, or infinity if it misses the box
+  double rayEntry(const Eigen::Vector3d &start, const Eigen::Vector3d &inv_dir) const;
+
+  Eigen::Vector3d min_bound, max_bound;
+};
+
+/// the bounding box of the capsule around @c cylinder, with its radius multiplied by @c radius_scale. This bounds
+/// any point within the cylinder's radius of its axis, so is a conservative bound for intersection tests
+BoundingBox TREELIB_EXPORT cylinderBounds(const Cylinder &cylinder, double radius_scale = 1.0);
+
+/// A bounding volume hierarchy over a list of cylinders, such as the segments of a tree.
+/// It is used to find the pairs of cylinders that may intersect, without testing every pair.
+class TREELIB_EXPORT CylinderBVH
+{
+public:
+  CylinderBVH() = default;
+  /// build the hierarchy over @c cylinders, with each radius multiplied by @c radius_scale. Use the largest scale
+  /// that will be queried, as the bounds are then conservative for any smaller scale
+  explicit CylinderBVH(const std::vector<Cylinder> &cylinders, double radius_scale = 1.0)
+  {
+    build(cylinders, radius_scale);
+  }
+  void build(const std::vector<Cylinder> &cylinders, double radius_scale = 1.0);
+
+  /// Find the pairs (i, j) of cylinder i in this hierarchy and cylinder j in @c other whose bounds overlap, using a
+  /// dual-tree traversal. The pairs are returned in increasing order of i then j, so that results accumulated over
+  /// them do not depend on the structure of the hierarchy
+  void findOverlappingPairs(const CylinderBVH &other, std::vector<std::pair<int, int>> &pairs) const;
+
+  /// Call @c visit(id) for each cylinder whose bounds overlap @c box, in no particular order
+  template <class Visit>
+  void findOverlapping(const BoundingBox &box, Visit visit) const
+  {
+    std::vector<int> stack;
+    if (!nodes_.empty())
+    {
+      stack.push_back(0);
+    }
+    while (!stack.empty())
+    {
+      const Node &node = nodes_[stack.back()];
+      stack.pop_back();
+      if (!node.box.overlaps(box))
+      {
+        continue;
+      }
+      if (node.count == 0)
+      {
+        stack.push_back(node.first);
+        stack.push_back(node.first + 1);
+        continue;
+      }
+      for (int i = node.first; i < node.first + node.count; i++)
+      {
+        if (boxes_[ids_[i]].overlaps(box))
+        {
+          visit(ids_[i]);
+        }
+      }
+    }
+  }
+
+  /// Find the cylinders closest by some distance measure, visiting the nearer nodes first so that farther ones can be
+  /// skipped. @c box_distance(box) must be a lower bound on the distance to anything within @c box, and
+  /// @c visit(id) returns the distance to cylinder @c id. Nodes farther than the closest distance so far, or than
+  /// @c max_distance, are not visited. Cylinders at equal distances may all be visited, for the caller to choose
+  template <class BoxDistance, class Visit>
+  void findClosest(BoxDistance box_distance, Visit visit,
+                   double max_distance = std::numeric_limits<double>::infinity()) const
+  {
+    std::vector<std::pair<int, double>> stack;  // node and the lower bound on its distance
+    if (!nodes_.empty())
+    {
+      stack.push_back(std::make_pair(0, box_distance(nodes_[0].box)));
+    }
+    while (!stack.empty())
+    {
+      const int id = stack.back().first;
+      const double bound = stack.back().second;
+      stack.pop_back();
+      if (bound > max_distance)
+      {
+        continue;
+      }
+      const Node &node = nodes_[id];
+      if (node.count == 0)
+      {
+        // push the farther child first, so the nearer one is searched first
+        const double bound1 = box_distance(nodes_[node.first].box);
+        const double bound2 = box_distance(nodes_[node.first + 1].box);
+        const int near = bound1 <= bound2 ? node.first : node.first + 1;
+        stack.push_back(std::make_pair(near == node.first ? node.first + 1 : node.first, std::max(bound1, bound2)));
+        stack.push_back(std::make_pair(near, std::min(bound1, bound2)));
+        continue;
+      }
+      for (int i = node.first; i < node.first + node.count; i++)
+      {
+        if (box_distance(boxes_[ids_[i]]) <= max_distance)
+        {
+          max_distance = std::min(max_distance, visit(ids_[i]));
+        }
+      }
+    }
+  }
+
+  /// write the hierarchy in binary to @c out, to be read back with read()
+  void write(std::ostream &out) const;
+  /// read a hierarchy written by write(), returning false if the stream ends early or is invalid
+  bool read(std::istream &in);
+
+  /// the number of cylinders
+  size_t size() const { return boxes_.size(); }
+  /// the bounds of cylinder @c id
+  const BoundingBox &bounds(int id) const { return boxes_[id]; }
+
+private:
+  struct Node
+  {
+    BoundingBox box;
+    int first;  // for leaves the first index into ids_, otherwise the index of the first of the two child nodes
+    int count;  // the number of cylinders in a leaf, 0 for internal nodes
+  };
+  std::vector<Node> nodes_;
+  std::vector<int> ids_;  // cylinder ids, arranged so that each leaf's cylinders are contiguous
+  std::vector<BoundingBox> boxes_;
+};
+}  // namespace tree
+
+#endif  // TREELIB_TREEBVH_H
@@ -0,0 +1,470 @@
+// Copyright (c) 2022
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#include "treeforestfile.h"
+#include <raylib/rayutils.h>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace tree
+{
+namespace
+{
+const char kMagic[8] = { 'T', 'R', 'E', 'E', 'B', 'I', 'N', 0 };
+const uint32_t kVersion = 1;
+static_assert(sizeof(BinaryForestHeader) == 104, "binary forest header must have no padding");
+
+bool isLittleEndian()
+{
+  const uint16_t one = 1;
+  return *reinterpret_cast<const uint8_t *>(&one) == 1;
+}
+
+uint64_t align8(uint64_t pos)
+{
+  return (pos + 7) & ~static_cast<uint64_t>(7);
+}
+
+// whether an array of @c count elements of @c element_size bytes at @c start lies within @c size bytes. The count is
+// bounded before multiplying, so that corrupt counts can't overflow to a small size
+bool arrayFits(uint64_t start, uint64_t count, uint64_t element_size, uint64_t size)
+{
+  return (start % 8) == 0 && start <= size && (element_size == 0 || count <= (size - start) / element_size);
+}
+
+// read the next string from the string table, returning false if it runs past the end of the data
+bool readString(const char *data, size_t size, size_t &pos, std::string &str)
+{
+  uint32_t length;
+  if (pos + sizeof(length) > size)
+  {
+    return false;
+  }
+  std::memcpy(&length, data + pos, sizeof(length));
+  pos += sizeof(length);
+  if (pos + length > size)
+  {
+    return false;
+  }
+  str.assign(data + pos, length);
+  pos += length;
+  return true;
+}
+
+void writeString(std::ostream &ofs, const std::string &str)
+{
+  const uint32_t length = static_cast<uint32_t>(str.size());
+  ofs.write(reinterpret_cast<const char *>(&length), sizeof(length));
+  ofs.write(str.data(), length);
+}
+
+void writePadding(std::ostream &ofs, uint64_t &pos)
+{
+  const char zeros[8] = { 0 };
+  const uint64_t aligned = align8(pos);
+  ofs.write(zeros, static_cast<std::streamsize>(aligned - pos));
+  pos = aligned;
+}
+}  // namespace
+
+BinaryForestMapping::~BinaryForestMapping()
+{
+  close();
+}
+
+bool BinaryForestMapping::open(const std::string &filename)
+{
+  close();
+  if (!isLittleEndian())
+  {
+    std::cerr << "Error: binary forest files are only supported on little-endian platforms" << std::endl;
+    return false;
+  }
+#if defined(_WIN32)
+  std::ifstream ifs(filename, std::ios::binary | std::ios::ate);
+  if (!ifs.is_open())
+  {
+    std::cerr << "Error: cannot open " << filename << std::endl;
+    return false;
+  }
+  buffer_.resize(static_cast<size_t>(ifs.tellg()));
+  ifs.seekg(0);
+  ifs.read(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+  data_ = buffer_.data();
+  size_ = buffer_.size();
+#else
+  const int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0)
+  {
+    std::cerr << "Error: cannot open " << filename << std::endl;
+    return false;
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0)
+  {
+    ::close(fd);
+    std::cerr << "Error: cannot read " << filename << std::endl;
+    return false;
+  }
+  size_ = static_cast<size_t>(file_stat.st_size);
+  void *mapped = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);  // the mapping remains valid after the file is closed
+  if (mapped == MAP_FAILED)
+  {
+    size_ = 0;
+    std::cerr << "Error: cannot memory map " << filename << std::endl;
+    return false;
+  }
+  data_ = static_cast<const char *>(mapped);
+#endif
+
+  // validate the header, tree offsets and parent ids, so that the arrays can then be used without any further checks
+  const BinaryForestHeader *header = reinterpret_cast<const BinaryForestHeader *>(data_);
+  bool valid = size_ >= sizeof(BinaryForestHeader) && std::memcmp(header->magic, kMagic, sizeof(kMagic)) == 0 &&
+               header->version == kVersion && header->file_size == size_;
+  if (valid)
+  {
+    const uint64_t num_trees = header->num_trees;
+    const uint64_t num_segments = header->num_segments;
+    // bounding the tree count first also stops num_trees + 1 from overflowing
+    valid = num_trees < size_ &&
+            arrayFits(header->tree_offsets_start, num_trees + 1, sizeof(uint64_t), size_) &&
+            arrayFits(header->tree_attributes_start, num_trees, header->num_tree_attributes * sizeof(double), size_) &&
+            arrayFits(header->tips_start, num_segments, 3 * sizeof(double), size_) &&
+            arrayFits(header->radii_start, num_segments, sizeof(double), size_) &&
+            arrayFits(header->parent_ids_start, num_segments, sizeof(int32_t), size_) &&
+            arrayFits(header->attributes_start, num_segments, header->num_attributes * sizeof(double), size_);
+  }
+  if (valid)
+  {
+    size_t pos = sizeof(BinaryForestHeader);
+    const uint64_t num_strings =
+      header->num_comments + header->num_tree_attributes + static_cast<uint64_t>(header->num_attributes);
+    valid = num_strings == header->num_strings;
+    for (uint64_t i = 0; i < num_strings && valid; i++)
+    {
+      std::string str;
+      valid = readString(data_, size_, pos, str);
+      if (i < header->num_comments)
+      {
+        comments_.push_back(str);
+      }
+      else if (i < header->num_comments + header->num_tree_attributes)
+      {
+        tree_attribute_names_.push_back(str);
+      }
+      else
+      {
+        attribute_names_.push_back(str);
+      }
+    }
+  }
+  if (!valid)
+  {
+    std::cerr << "Error: " << filename << " is not a valid binary forest file" << std::endl;
+    close();
+    return false;
+  }
+  header_ = header;
+  const uint64_t *offsets = treeOffsets();
+  bool valid_offsets = offsets[0] == 0 && offsets[numTrees()] == header_->num_segments;
+  for (size_t t = 0; t < numTrees() && valid_offsets; t++)
+  {
+    valid_offsets = offsets[t] <= offsets[t + 1];
+  }
+  if (!valid_offsets)
+  {
+    std::cerr << "Error: bad tree offsets in binary forest file " << filename << std::endl;
+    close();
+    return false;
+  }
+  // each parent must precede its segment within the tree, so that the trees can be indexed and traversed safely
+  const int32_t *parent_ids = parentIds();
+  for (size_t t = 0; t < numTrees(); t++)
+  {
+    for (uint64_t i = offsets[t]; i < offsets[t + 1]; i++)
+    {
+      const int32_t parent_id = parent_ids[i];
+      if (parent_id != -1 && (parent_id < 0 || static_cast<uint64_t>(parent_id) >= i - offsets[t]))
+      {
+        std::cerr << "Error: bad parent id in binary forest file " << filename << std::endl;
+        close();
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void BinaryForestMapping::close()
+{
+#if !defined(_WIN32)
+  if (data_ != nullptr)
+  {
+    munmap(const_cast<char *>(data_), size_);
+  }
+#endif
+  buffer_.clear();
+  buffer_.shrink_to_fit();
+  data_ = nullptr;
+  size_ = 0;
+  header_ = nullptr;
+  comments_.clear();
+  tree_attribute_names_.clear();
+  attribute_names_.clear();
+}
+
+void BinaryForestMapping::extractTree(size_t tree_id, ray::TreeStructure &tree) const
+{
+  const size_t num_tree_attributes = tree_attribute_names_.size();
+  const size_t num_attributes = attribute_names_.size();
+  const size_t first = static_cast<size_t>(treeOffsets()[tree_id]);
+  const size_t last = static_cast<size_t>(treeOffsets()[tree_id + 1]);
+  const double *tree_atts = treeAttributes() + tree_id * num_tree_attributes;
+  tree.treeAttributeNames() = tree_attribute_names_;
+  tree.treeAttributes().assign(tree_atts, tree_atts + num_tree_attributes);
+  tree.attributeNames() = attribute_names_;
+
+  const double *tip = tips() + 3 * first;
+  const double *radius = radii() + first;
+  const int32_t *parent_id = parentIds() + first;
+  const double *atts = attributes() + first * num_attributes;
+  auto &segments = tree.segments();
+  segments.resize(last - first);
+  for (auto &segment : segments)
+  {
+    segment.tip = Eigen::Vector3d(tip[0], tip[1], tip[2]);
+    segment.radius = *radius++;
+    segment.parent_id = *parent_id++;
+    segment.attributes.assign(atts, atts + num_attributes);
+    tip += 3;
+    atts += num_attributes;
+  }
+}
+
+void BinaryForestMapping::extractForest(ray::ForestStructure &forest) const
+{
+  forest.comments = comments_;
+  forest.trees.resize(numTrees());
+  for (size_t t = 0; t < numTrees(); t++)
+  {
+    extractTree(t, forest.trees[t]);
+  }
+}
+
+bool isBinaryForestFile(const std::string &filename)
+{
+  return ray::getFileNameExtension(filename) == kBinaryForestExtension;
+}
+
+std::string forestFileExtension(const std::string &filename)
+{
+  return isBinaryForestFile(filename) ? "." + kBinaryForestExtension : ".txt";
+}
+
+bool loadForest(const std::string &filename, ray::ForestStructure &forest)
+{
+  if (!isBinaryForestFile(filename))
+  {
+    return forest.load(filename);
+  }
+  BinaryForestMapping mapping;
+  if (!mapping.open(filename))
+  {
+    return false;
+  }
+  mapping.extractForest(forest);
+  return true;
+}
+
+bool saveForest(const std::string &filename, ray::ForestStructure &forest)
+{
+  if (!isBinaryForestFile(filename))
+  {
+    return forest.save(filename);
+  }
+  return saveBinaryForest(filename, forest);
+}
+
+bool checkBinaryTree(const std::string &filename, size_t tree_id, const ray::TreeStructure &tree,
+                     const std::vector<std::string> &tree_attribute_names,
+                     const std::vector<std::string> &attribute_names)
+{
+  if (tree.treeAttributeNames() != tree_attribute_names || tree.attributeNames() != attribute_names)
+  {
+    std::cerr << "Error: tree " << tree_id << " has different attributes to the first tree, so cannot be written to "
+              << filename << std::endl;
+    return false;
+  }
+  if (tree.treeAttributes().size() != tree_attribute_names.size())
+  {
+    std::cerr << "Error: tree " << tree_id << " has " << tree.treeAttributes().size() << " tree attributes, not "
+              << tree_attribute_names.size() << ", so cannot be written to " << filename << std::endl;
+    return false;
+  }
+  const auto &segments = tree.segments();
+  for (size_t i = 0; i < segments.size(); i++)
+  {
+    if (segments[i].attributes.size() != attribute_names.size())
+    {
+      std::cerr << "Error: segment " << i << " of tree " << tree_id << " has " << segments[i].attributes.size()
+                << " attributes, not " << attribute_names.size() << ", so cannot be written to " << filename
+                << std::endl;
+      return false;
+    }
+    const int parent_id = segments[i].parent_id;
+    if (parent_id != -1 && (parent_id < 0 || static_cast<size_t>(parent_id) >= i))
+    {
+      std::cerr << "Error: segment " << i << " of tree " << tree_id << " has parent id " << parent_id
+                << ", which does not precede it, so cannot be written to " << filename << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+bool saveBinaryForest(const std::string &filename, const ray::ForestStructure &forest)
+{
+  if (!isLittleEndian())
+  {
+    std::cerr << "Error: binary forest files are only supported on little-endian platforms" << std::endl;
+    return false;
+  }
+  const std::vector<std::string> no_names;
+  const auto &tree_attribute_names = forest.trees.empty() ? no_names : forest.trees[0].treeAttributeNames();
+  const auto &attribute_names = forest.trees.empty() ? no_names : forest.trees[0].attributeNames();
+  const uint64_t num_trees = forest.trees.size();
+  uint64_t num_segments = 0;
+  for (size_t t = 0; t < forest.trees.size(); t++)
+  {
+    if (!checkBinaryTree(filename, t, forest.trees[t], tree_attribute_names, attribute_names))
+    {
+      return false;
+    }
+    num_segments += forest.trees[t].segments().size();
+  }
+  std::ofstream ofs(filename, std::ios::binary | std::ios::out);
+  if (!ofs.is_open())
+  {
+    std::cerr << "Error: cannot open " << filename << " for writing" << std::endl;
+    return false;
+  }
+
+  const BinaryForestHeader header =
+    binaryForestHeader(forest.comments, tree_attribute_names, attribute_names, num_trees, num_segments);
+  writeBinaryForestHeader(ofs, header, forest.comments, tree_attribute_names, attribute_names);
+
+  // then each array in turn
+  auto write_values = [&ofs](const std::vector<double> &values) {
+    ofs.write(reinterpret_cast<const char *>(values.data()),
+              static_cast<std::streamsize>(values.size() * sizeof(double)));
+  };
+  uint64_t offset = 0;
+  for (const auto &tree : forest.trees)
+  {
+    ofs.write(reinterpret_cast<const char *>(&offset), sizeof(offset));
+    offset += tree.segments().size();
+  }
+  ofs.write(reinterpret_cast<const char *>(&offset), sizeof(offset));
+  for (const auto &tree : forest.trees)
+  {
+    write_values(tree.treeAttributes());
+  }
+  for (const auto &tree : forest.trees)
+  {
+    for (const auto &segment : tree.segments())
+    {
+      ofs.write(reinterpret_cast<const char *>(segment.tip.data()), 3 * sizeof(double));
+    }
+  }
+  for (const auto &tree : forest.trees)
+  {
+    for (const auto &segment : tree.segments())
+    {
+      ofs.write(reinterpret_cast<const char *>(&segment.radius), sizeof(double));
+    }
+  }
+  for (const auto &tree : forest.trees)
+  {
+    for (const auto &segment : tree.segments())
+    {
+      const int32_t parent_id = static_cast<int32_t>(segment.parent_id);
+      ofs.write(reinterpret_cast<const char *>(&parent_id), sizeof(parent_id));
+    }
+  }
+  uint64_t pos = header.parent_ids_start + num_segments * sizeof(int32_t);
+  writePadding(ofs, pos);
+  for (const auto &tree : forest.trees)
+  {
+    for (const auto &segment : tree.segments())
+    {
+      write_values(segment.attributes);
+    }
+  }
+  if (!ofs.good())
+  {
+    std::cerr << "Error: failed writing " << filename << std::endl;
+    return false;
+  }
+  return true;
+}
+BinaryForestHeader binaryForestHeader(const std::vector<std::string> &comments,
+                                      const std::vector<std::string> &tree_attribute_names,
+                                      const std::vector<std::string> &attribute_names, uint64_t num_trees,
+                                      uint64_t num_segments)
+{
+  BinaryForestHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.num_tree_attributes = static_cast<uint32_t>(tree_attribute_names.size());
+  header.num_attributes = static_cast<uint32_t>(attribute_names.size());
+  header.num_comments = comments.size();
+  header.num_strings = static_cast<uint32_t>(comments.size() + tree_attribute_names.size() + attribute_names.size());
+  header.num_trees = num_trees;
+  header.num_segments = num_segments;
+  uint64_t pos = sizeof(header);
+  for (const auto &strings : { &comments, &tree_attribute_names, &attribute_names })
+  {
+    for (const auto &str : *strings)
+    {
+      pos += sizeof(uint32_t) + str.size();
+    }
+  }
+  header.tree_offsets_start = align8(pos);
+  header.tree_attributes_start = header.tree_offsets_start + (num_trees + 1) * sizeof(uint64_t);
+  header.tips_start = header.tree_attributes_start + num_trees * header.num_tree_attributes * sizeof(double);
+  header.radii_start = header.tips_start + num_segments * 3 * sizeof(double);
+  header.parent_ids_start = header.radii_start + num_segments * sizeof(double);
+  header.attributes_start = align8(header.parent_ids_start + num_segments * sizeof(int32_t));
+  header.file_size = header.attributes_start + num_segments * header.num_attributes * sizeof(double);
+  return header;
+}
+
+void writeBinaryForestHeader(std::ostream &out, const BinaryForestHeader &header,
+                             const std::vector<std::string> &comments,
+                             const std::vector<std::string> &tree_attribute_names,
+                             const std::vector<std::string> &attribute_names)
+{
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  uint64_t pos = sizeof(header);
+  for (const auto &strings : { &comments, &tree_attribute_names, &attribute_names })
+  {
+    for (const auto &str : *strings)
+    {
+      writeString(out, str);
+      pos += sizeof(uint32_t) + str.size();
+    }
+  }
+  writePadding(out, pos);
+}
+}  // namespace tree
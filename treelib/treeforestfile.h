@@ -0,0 +1,135 @@
+// Copyright (c) 2022
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#ifndef TREELIB_TREEFORESTFILE_H
+#define TREELIB_TREEFORESTFILE_H
+
+#include <raylib/rayforeststructure.h>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "treelib/treelibconfig.h"
+
+/// This file provides a compact binary forest file format (.treeb) alongside the text tree file format.
+/// The binary file consists of a fixed size header, a string table (comments, tree attribute names and segment
+/// attribute names), then contiguous 8-byte aligned arrays:
+///   tree_offsets    uint64 [num_trees + 1]   index of the first segment of each tree
+///   tree_attributes double [num_trees * num_tree_attributes]
+///   tips            double [num_segments * 3]
+///   radii           double [num_segments]
+///   parent_ids      int32  [num_segments]    ids are relative to the tree's first segment, -1 for roots
+///   attributes      double [num_segments * num_attributes]
+/// All values are stored in little-endian byte order, so the arrays can be memory mapped and used without parsing.
+namespace tree
+{
+/// the file extension used for binary forest files
+const std::string kBinaryForestExtension = "treeb";
+
+/// The fixed size header at the start of every binary forest file
+struct TREELIB_EXPORT BinaryForestHeader
+{
+  char magic[8];  // "TREEBIN" followed by a zero
+  uint32_t version;
+  uint32_t num_tree_attributes;
+  uint32_t num_attributes;
+  uint32_t num_strings;  // total number of strings in the string table
+  uint64_t num_comments;
+  uint64_t num_trees;
+  uint64_t num_segments;
+  // byte offsets from the start of the file for each array
+  uint64_t tree_offsets_start;
+  uint64_t tree_attributes_start;
+  uint64_t tips_start;
+  uint64_t radii_start;
+  uint64_t parent_ids_start;
+  uint64_t attributes_start;
+  uint64_t file_size;
+};
+
+/// A read-only memory mapping of a binary forest file. The per-segment arrays are accessed in place,
+/// without parsing or copying, so tools that only need the geometry can use them directly.
+class TREELIB_EXPORT BinaryForestMapping
+{
+public:
+  BinaryForestMapping() = default;
+  ~BinaryForestMapping();
+  BinaryForestMapping(const BinaryForestMapping &) = delete;
+  BinaryForestMapping &operator=(const BinaryForestMapping &) = delete;
+
+  /// map the file @c filename, returning false if it cannot be opened or is not a valid binary forest file
+  bool open(const std::string &filename);
+  void close();
+  bool isOpen() const { return header_ != nullptr; }
+
+  size_t numTrees() const { return static_cast<size_t>(header_->num_trees); }
+  size_t numSegments() const { return static_cast<size_t>(header_->num_segments); }
+  const std::vector<std::string> &comments() const { return comments_; }
+  const std::vector<std::string> &treeAttributeNames() const { return tree_attribute_names_; }
+  const std::vector<std::string> &attributeNames() const { return attribute_names_; }
+
+  const uint64_t *treeOffsets() const { return array<uint64_t>(header_->tree_offsets_start); }
+  const double *treeAttributes() const { return array<double>(header_->tree_attributes_start); }
+  const double *tips() const { return array<double>(header_->tips_start); }
+  const double *radii() const { return array<double>(header_->radii_start); }
+  const int32_t *parentIds() const { return array<int32_t>(header_->parent_ids_start); }
+  const double *attributes() const { return array<double>(header_->attributes_start); }
+
+  /// fill in tree @c tree_id from the mapped arrays, including its attribute names
+  void extractTree(size_t tree_id, ray::TreeStructure &tree) const;
+  /// fill in the whole forest structure from the mapped arrays
+  void extractForest(ray::ForestStructure &forest) const;
+
+private:
+  template <class T>
+  const T *array(uint64_t start) const
+  {
+    return reinterpret_cast<const T *>(data_ + start);
+  }
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+  const BinaryForestHeader *header_ = nullptr;
+  std::vector<char> buffer_;  // used on platforms without memory mapping
+  std::vector<std::string> comments_, tree_attribute_names_, attribute_names_;
+};
+
+/// whether @c filename has the binary forest file extension
+bool TREELIB_EXPORT isBinaryForestFile(const std::string &filename);
+
+/// the extension (including the '.') to use for files derived from @c filename, so that tools output the same
+/// format that they read
+std::string TREELIB_EXPORT forestFileExtension(const std::string &filename);
+
+/// load a forest from a text or binary tree file, chosen by the extension of @c filename
+bool TREELIB_EXPORT loadForest(const std::string &filename, ray::ForestStructure &forest);
+
+/// save a forest to a text or binary tree file, chosen by the extension of @c filename
+bool TREELIB_EXPORT saveForest(const std::string &filename, ray::ForestStructure &forest);
+
+/// save a forest in the binary forest file format. Every tree must have the attribute names of the first tree and a
+/// value for each, and each segment's parent must precede it in its tree, otherwise nothing is written.
+bool TREELIB_EXPORT saveBinaryForest(const std::string &filename, const ray::ForestStructure &forest);
+
+/// whether tree @c tree_id can be written to the binary forest file @c filename, whose attribute names are
+/// @c tree_attribute_names and @c attribute_names. The tree must have these attributes exactly, and each parent id
+/// must be -1 or an earlier segment of the tree, as required when the file is read. Otherwise an error is reported
+bool TREELIB_EXPORT checkBinaryTree(const std::string &filename, size_t tree_id, const ray::TreeStructure &tree,
+                                    const std::vector<std::string> &tree_attribute_names,
+                                    const std::vector<std::string> &attribute_names);
+
+/// lay out a binary forest file with the given strings and array sizes, returning its header
+BinaryForestHeader TREELIB_EXPORT binaryForestHeader(const std::vector<std::string> &comments,
+                                                     const std::vector<std::string> &tree_attribute_names,
+                                                     const std::vector<std::string> &attribute_names,
+                                                     uint64_t num_trees, uint64_t num_segments);
+
+/// write the header and string table of a binary forest file, padded up to the start of the tree offsets array
+void TREELIB_EXPORT writeBinaryForestHeader(std::ostream &out, const BinaryForestHeader &header,
+                                            const std::vector<std::string> &comments,
+                                            const std::vector<std::string> &tree_attribute_names,
+                                            const std::vector<std::string> &attribute_names);
+}  // namespace tree
+
+#endif  // TREELIB_TREEFORESTFILE_H
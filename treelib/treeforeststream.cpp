@@ -0,0 +1,433 @@
+// Copyright (c) 2022
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#include "treeforeststream.h"
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+namespace tree
+{
+namespace
+{
+// the temporary file suffixes for the output file and the spooled per-segment arrays of binary files
+const std::string kTempSuffix = ".partial";
+const char *const kSpoolSuffixes[4] = { ".tips", ".radii", ".parents", ".attributes" };
+
+// remove spaces, tabs and carriage returns from either end of a string
+std::string trim(const std::string &str)
+{
+  const size_t first = str.find_first_not_of(" \t\r");
+  if (first == std::string::npos)
+  {
+    return "";
+  }
+  const size_t last = str.find_last_not_of(" \t\r");
+  return str.substr(first, last + 1 - first);
+}
+
+bool isCommentLine(const std::string &line)
+{
+  return trim(line).empty() || line[0] == '#';
+}
+
+// writes @c values in binary
+void writeValues(std::ostream &out, const std::vector<double> &values)
+{
+  out.write(reinterpret_cast<const char *>(values.data()), static_cast<std::streamsize>(values.size() * sizeof(double)));
+}
+
+// move the finished temporary file over the destination file
+bool replaceFile(const std::string &temp_name, const std::string &filename)
+{
+  std::remove(filename.c_str());  // needed on platforms where rename does not overwrite
+  if (std::rename(temp_name.c_str(), filename.c_str()) != 0)
+  {
+    std::cerr << "Error: cannot write " << filename << ", the output remains in " << temp_name << std::endl;
+    return false;
+  }
+  return true;
+}
+}  // namespace
+
+bool ForestReader::open(const std::string &filename)
+{
+  close();
+  filename_ = filename;
+  binary_ = isBinaryForestFile(filename);
+  if (binary_)
+  {
+    if (!mapping_.open(filename))
+    {
+      failed_ = true;
+      return false;
+    }
+    comments_ = mapping_.comments();
+    tree_attribute_names_ = mapping_.treeAttributeNames();
+    attribute_names_ = mapping_.attributeNames();
+    return true;
+  }
+
+  ifs_.open(filename, std::ios::in);
+  if (!ifs_.is_open())
+  {
+    std::cerr << "Error: cannot open " << filename << std::endl;
+    failed_ = true;
+    return false;
+  }
+  // the initial comments, then the format line
+  while (std::getline(ifs_, line_) && isCommentLine(line_))
+  {
+    comments_.push_back(line_);
+  }
+  std::vector<std::string> names;
+  std::stringstream ss(line_);
+  std::string name;
+  while (std::getline(ss, name, ','))
+  {
+    names.push_back(trim(name));
+  }
+  // any per-tree attributes precede the mandatory x,y,z,radius fields
+  size_t x_id = 0;
+  while (x_id < names.size() && names[x_id] != "x")
+  {
+    x_id++;
+  }
+  if (x_id + 4 > names.size() || names[x_id + 1] != "y" || names[x_id + 2] != "z" || names[x_id + 3] != "radius")
+  {
+    std::cerr << "Error: " << filename << " does not have a valid tree file format line" << std::endl;
+    close();
+    failed_ = true;
+    return false;
+  }
+  tree_attribute_names_.assign(names.begin(), names.begin() + x_id);
+  has_parent_ids_ = x_id + 4 < names.size() && names[x_id + 4] == "parent_id";
+  attribute_names_.assign(names.begin() + x_id + (has_parent_ids_ ? 5 : 4), names.end());
+  return true;
+}
+
+void ForestReader::close()
+{
+  mapping_.close();
+  if (ifs_.is_open())
+  {
+    ifs_.close();
+  }
+  ifs_.clear();
+  next_tree_ = 0;
+  failed_ = false;
+  has_parent_ids_ = true;
+  comments_.clear();
+  tree_attribute_names_.clear();
+  attribute_names_.clear();
+}
+
+bool ForestReader::readTree(ray::TreeStructure &tree)
+{
+  if (failed_)
+  {
+    return false;
+  }
+  if (!binary_)
+  {
+    return readTextTree(tree);
+  }
+  if (!mapping_.isOpen() || next_tree_ >= mapping_.numTrees())
+  {
+    return false;
+  }
+  mapping_.extractTree(next_tree_++, tree);
+  return true;
+}
+
+bool ForestReader::readTextTree(ray::TreeStructure &tree)
+{
+  if (!ifs_.is_open())
+  {
+    return false;
+  }
+  do
+  {
+    if (!std::getline(ifs_, line_))
+    {
+      return false;
+    }
+  } while (isCommentLine(line_));
+
+  // the values are separated by commas, and the segments by a space
+  values_.clear();
+  const char *str = line_.c_str();
+  while (*str != '\0')
+  {
+    if (*str == ',' || *str == ' ' || *str == '\t' || *str == '\r')
+    {
+      str++;
+      continue;
+    }
+    char *end;
+    values_.push_back(std::strtod(str, &end));
+    if (end == str)
+    {
+      std::cerr << "Error: cannot parse value in " << filename_ << ": " << str << std::endl;
+      failed_ = true;
+      return false;
+    }
+    str = end;
+  }
+
+  const size_t num_tree_attributes = tree_attribute_names_.size();
+  const size_t num_attributes = attribute_names_.size();
+  const size_t segment_size = (has_parent_ids_ ? 5 : 4) + num_attributes;
+  if (values_.size() < num_tree_attributes + segment_size ||
+      (values_.size() - num_tree_attributes) % segment_size != 0)
+  {
+    std::cerr << "Error: a tree in " << filename_ << " does not match the file format line" << std::endl;
+    failed_ = true;
+    return false;
+  }
+  tree.treeAttributeNames() = tree_attribute_names_;
+  tree.treeAttributes().assign(values_.begin(), values_.begin() + num_tree_attributes);
+  tree.attributeNames() = attribute_names_;
+  auto &segments = tree.segments();
+  segments.resize((values_.size() - num_tree_attributes) / segment_size);
+  const double *value = values_.data() + num_tree_attributes;
+  for (auto &segment : segments)
+  {
+    segment.tip = Eigen::Vector3d(value[0], value[1], value[2]);
+    segment.radius = value[3];
+    value += 4;
+    segment.parent_id = has_parent_ids_ ? static_cast<int>(*value++) : -1;
+    segment.attributes.assign(value, value + num_attributes);
+    value += num_attributes;
+  }
+  return true;
+}
+
+ForestWriter::~ForestWriter()
+{
+  if (isOpen())
+  {
+    close();
+  }
+}
+
+bool ForestWriter::open(const std::string &filename, const std::vector<std::string> &comments)
+{
+  if (isOpen())
+  {
+    close();
+  }
+  binary_ = isBinaryForestFile(filename);
+  const uint16_t one = 1;
+  if (binary_ && *reinterpret_cast<const uint8_t *>(&one) != 1)
+  {
+    std::cerr << "Error: binary forest files are only supported on little-endian platforms" << std::endl;
+    return false;
+  }
+  temp_name_ = filename + kTempSuffix;
+  const std::ios::openmode mode = binary_ ? (std::ios::binary | std::ios::out) : std::ios::out;
+  ofs_.open(temp_name_, mode);
+  bool ok = ofs_.is_open();
+  if (binary_)
+  {
+    for (int i = 0; i < 4; i++)
+    {
+      spools_[i].open(temp_name_ + kSpoolSuffixes[i], mode);
+      ok = ok && spools_[i].is_open();
+    }
+  }
+  filename_ = filename;
+  if (!ok)
+  {
+    std::cerr << "Error: cannot open " << filename << " for writing" << std::endl;
+    discard();
+    return false;
+  }
+  comments_ = comments;
+  failed_ = false;
+  started_ = false;
+  num_trees_ = 0;
+  tree_offsets_.assign(1, 0);
+  tree_attributes_.clear();
+  if (!binary_)
+  {
+    ofs_ << std::setprecision(10);
+    for (const auto &comment : comments_)
+    {
+      ofs_ << (comment.empty() || comment[0] == '#' ? "" : "# ") << comment << std::endl;
+    }
+  }
+  return true;
+}
+
+void ForestWriter::writeTextHeader()
+{
+  for (const auto &name : tree_attribute_names_)
+  {
+    ofs_ << name << ",";
+  }
+  ofs_ << (tree_attribute_names_.empty() ? "" : " ") << "x,y,z,radius,parent_id";
+  for (const auto &name : attribute_names_)
+  {
+    ofs_ << "," << name;
+  }
+  ofs_ << std::endl;
+}
+
+bool ForestWriter::writeTree(const ray::TreeStructure &tree)
+{
+  if (!isOpen() || failed_)
+  {
+    return false;
+  }
+  if (!started_)
+  {
+    tree_attribute_names_ = tree.treeAttributeNames();
+    attribute_names_ = tree.attributeNames();
+    if (!binary_)
+    {
+      writeTextHeader();
+    }
+    started_ = true;
+  }
+  const size_t num_tree_attributes = tree_attribute_names_.size();
+  const size_t num_attributes = attribute_names_.size();
+  num_trees_++;
+
+  if (binary_)
+  {
+    // the binary reader requires exactly the file's attributes, and parents that precede their segments
+    if (!checkBinaryTree(filename_, num_trees_ - 1, tree, tree_attribute_names_, attribute_names_))
+    {
+      failed_ = true;
+      return false;
+    }
+    tree_offsets_.push_back(tree_offsets_.back() + tree.segments().size());
+    tree_attributes_.insert(tree_attributes_.end(), tree.treeAttributes().begin(), tree.treeAttributes().end());
+    for (const auto &segment : tree.segments())
+    {
+      const int32_t parent_id = static_cast<int32_t>(segment.parent_id);
+      spools_[0].write(reinterpret_cast<const char *>(segment.tip.data()), 3 * sizeof(double));
+      spools_[1].write(reinterpret_cast<const char *>(&segment.radius), sizeof(double));
+      spools_[2].write(reinterpret_cast<const char *>(&parent_id), sizeof(parent_id));
+      writeValues(spools_[3], segment.attributes);
+    }
+    failed_ = !spools_[0].good() || !spools_[1].good() || !spools_[2].good() || !spools_[3].good();
+    return !failed_;
+  }
+
+  // text output, with the per-tree attributes first, then comma separated values for each segment, with the segments
+  // separated by a space. Missing attributes are written as zeros
+  for (size_t i = 0; i < num_tree_attributes; i++)
+  {
+    ofs_ << (i < tree.treeAttributes().size() ? tree.treeAttributes()[i] : 0.0) << ",";
+  }
+  for (size_t s = 0; s < tree.segments().size(); s++)
+  {
+    const auto &segment = tree.segments()[s];
+    ofs_ << (s > 0 || num_tree_attributes > 0 ? " " : "") << segment.tip[0] << "," << segment.tip[1] << ","
+         << segment.tip[2] << "," << segment.radius << "," << segment.parent_id;
+    for (size_t i = 0; i < num_attributes; i++)
+    {
+      ofs_ << "," << (i < segment.attributes.size() ? segment.attributes[i] : 0.0);
+    }
+    if (s + 1 < tree.segments().size())
+    {
+      ofs_ << ",";
+    }
+  }
+  ofs_ << "\n";
+  failed_ = !ofs_.good();
+  return !failed_;
+}
+
+bool ForestWriter::finishBinary()
+{
+  const uint64_t num_segments = tree_offsets_.back();
+  const BinaryForestHeader header =
+    binaryForestHeader(comments_, tree_attribute_names_, attribute_names_, num_trees_, num_segments);
+  writeBinaryForestHeader(ofs_, header, comments_, tree_attribute_names_, attribute_names_);
+  ofs_.write(reinterpret_cast<const char *>(tree_offsets_.data()),
+             static_cast<std::streamsize>(tree_offsets_.size() * sizeof(uint64_t)));
+  ofs_.write(reinterpret_cast<const char *>(tree_attributes_.data()),
+             static_cast<std::streamsize>(tree_attributes_.size() * sizeof(double)));
+
+  // append the spooled arrays in turn, padding before the attributes array to keep it aligned
+  std::vector<char> buffer(1 << 20);
+  bool ok = true;
+  for (int i = 0; i < 4; i++)
+  {
+    spools_[i].close();
+    ok = ok && !spools_[i].fail();
+    if (i == 3)
+    {
+      const uint64_t parent_ids_end = header.parent_ids_start + num_segments * sizeof(int32_t);
+      const char zeros[8] = { 0 };
+      ofs_.write(zeros, static_cast<std::streamsize>(header.attributes_start - parent_ids_end));
+    }
+    std::ifstream spool(temp_name_ + kSpoolSuffixes[i], std::ios::binary | std::ios::in);
+    while (spool.read(buffer.data(), static_cast<std::streamsize>(buffer.size())) || spool.gcount() > 0)
+    {
+      ofs_.write(buffer.data(), spool.gcount());
+    }
+  }
+  return ok;
+}
+
+bool ForestWriter::close()
+{
+  if (!isOpen())
+  {
+    return false;
+  }
+  if (!started_ && !binary_)
+  {
+    writeTextHeader();
+  }
+  bool ok = !failed_;
+  if (binary_)
+  {
+    ok = finishBinary() && ok;
+  }
+  ofs_.close();
+  ok = ok && !ofs_.fail();
+  if (ok)
+  {
+    ok = replaceFile(temp_name_, filename_);
+  }
+  else
+  {
+    std::cerr << "Error: failed writing " << filename_ << std::endl;
+    std::remove(temp_name_.c_str());
+  }
+  for (int i = 0; i < 4 && binary_; i++)
+  {
+    spools_[i].clear();
+    std::remove((temp_name_ + kSpoolSuffixes[i]).c_str());
+  }
+  filename_.clear();
+  ofs_.clear();
+  return ok;
+}
+
+void ForestWriter::discard()
+{
+  ofs_.close();
+  ofs_.clear();
+  std::remove(temp_name_.c_str());
+  for (int i = 0; i < 4; i++)
+  {
+    if (spools_[i].is_open())
+    {
+      spools_[i].close();
+    }
+    spools_[i].clear();
+    std::remove((temp_name_ + kSpoolSuffixes[i]).c_str());
+  }
+  filename_.clear();
+}
+}  // namespace tree
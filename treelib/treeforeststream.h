@@ -0,0 +1,92 @@
+// Copyright (c) 2022
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#ifndef TREELIB_TREEFORESTSTREAM_H
+#define TREELIB_TREEFORESTSTREAM_H
+
+#include <raylib/raytreestructure.h>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "treelib/treeforestfile.h"
+#include "treelib/treelibconfig.h"
+
+/// Streaming access to text (.txt) and binary (.treeb) forest files, one tree at a time.
+/// Tools that process each tree independently can use these in place of loading and saving a whole
+/// ray::ForestStructure, so that peak memory is bounded by the largest tree rather than the whole forest.
+namespace tree
+{
+/// Reads the trees of a forest file in order, one at a time
+class TREELIB_EXPORT ForestReader
+{
+public:
+  /// open @c filename, reading its comments and attribute names. The format is chosen by the file extension
+  bool open(const std::string &filename);
+  void close();
+
+  /// read the next tree into @c tree, reusing its storage. Returns false once there are no more trees,
+  /// or if the file could not be parsed, in which case failed() is true
+  bool readTree(ray::TreeStructure &tree);
+  bool failed() const { return failed_; }
+
+  const std::vector<std::string> &comments() const { return comments_; }
+  const std::vector<std::string> &treeAttributeNames() const { return tree_attribute_names_; }
+  const std::vector<std::string> &attributeNames() const { return attribute_names_; }
+
+private:
+  bool readTextTree(ray::TreeStructure &tree);
+
+  std::string filename_;
+  bool binary_ = false;
+  bool failed_ = false;
+  BinaryForestMapping mapping_;
+  size_t next_tree_ = 0;
+  std::ifstream ifs_;
+  std::string line_;
+  std::vector<double> values_;  // the parsed values of one line of a text file
+  bool has_parent_ids_ = true;
+  std::vector<std::string> comments_, tree_attribute_names_, attribute_names_;
+};
+
+/// Writes trees to a forest file as they are processed. The attribute names of the first tree written are used for
+/// the whole file. Binary files require every tree to have exactly those attributes and each segment's parent to
+/// precede it, so writing a tree that does not fails. The output is written to a temporary file and only moved to @c filename when closed, so the
+/// writer may safely replace the file that is being read.
+class TREELIB_EXPORT ForestWriter
+{
+public:
+  ~ForestWriter();
+
+  /// start writing to @c filename, with the format chosen by the file extension
+  bool open(const std::string &filename, const std::vector<std::string> &comments);
+  /// append @c tree to the file
+  bool writeTree(const ray::TreeStructure &tree);
+  /// finish writing the file and move it into place
+  bool close();
+  /// stop writing and remove any partially written file
+  void discard();
+  bool isOpen() const { return !filename_.empty(); }
+
+  size_t numTrees() const { return num_trees_; }
+
+private:
+  void writeTextHeader();
+  bool finishBinary();
+
+  std::string filename_, temp_name_;
+  bool binary_ = false;
+  bool failed_ = false;
+  bool started_ = false;  // whether the attribute names have been set by the first tree
+  size_t num_trees_ = 0;
+  std::vector<std::string> comments_, tree_attribute_names_, attribute_names_;
+  std::ofstream ofs_;
+  // binary output: the per-tree arrays are kept in memory, the per-segment arrays are spooled to temporary files
+  std::vector<uint64_t> tree_offsets_;
+  std::vector<double> tree_attributes_;
+  std::ofstream spools_[4];
+};
+}  // namespace tree
+
+#endif  // TREELIB_TREEFORESTSTREAM_H
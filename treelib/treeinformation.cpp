@@ -118,10 +118,10 @@ void calculatePowerLaw(std::vector<double> &xs, double &c, double &d, double &r2
 /// NOTE: this relies on segment 0's radius being accurate. If we allow linear interpolation of radii then this should
 /// always be tree rather than it being zero or undefined, or total radius or something
 /// @param tree the tree to analyse trunk bend on
-/// @param children the precalculated list of children for each segment
+/// @param topology the precalculated connectivity of the tree
 /// @param bend_id the id of the per-tree parameter representing the trunk bend (to fill in)
 /// @param length_id the id of the parameter representing length (to fill in)
-void setTrunkBend(ray::TreeStructure &tree, const std::vector<std::vector<int>> &children, int bend_id, int length_id, int branch_gradient_id)
+void setTrunkBend(ray::TreeStructure &tree, const TreeTopology &topology, int bend_id, int length_id, int branch_gradient_id)
 {
   // get the trunk
   std::vector<int> ids = { 0 };
@@ -132,7 +132,7 @@ void setTrunkBend(ray::TreeStructure &tree, const std::vector<std::vector<int>>
     double max_score = -1;
     int largest_child = -1;
     int id = ids[i];
-    for (const auto &child : children[id])
+    for (const auto &child : topology.children(id))
     {
       // we pick the route which has the longer and wider branch
       double score = tree.segments()[child].radius * tree.segments()[child].attributes[length_id];
@@ -147,13 +147,13 @@ void setTrunkBend(ray::TreeStructure &tree, const std::vector<std::vector<int>>
       ids.push_back(largest_child);
 
       // here we estimate the secondary branch gradient
-      for (const auto &child : children[id])
+      for (const auto &child : topology.children(id))
       {
         if (child == largest_child)
         {
           continue;
         }
-        for (const auto &grandchild : children[child])
+        for (const auto &grandchild : topology.children(child))
         {
           Eigen::Vector3d dif = tree.segments()[grandchild].tip - tree.segments()[child].tip;
           double w = tree.segments()[grandchild].radius;
@@ -241,9 +241,9 @@ void setTrunkBend(ray::TreeStructure &tree, const std::vector<std::vector<int>>
 
 /// @brief set the diameter at breast height
 /// @param tree the tree to analyse
-/// @param children precalculated list of children per segment
+/// @param topology precalculated connectivity of the tree
 /// @param DBH_id the id of the parameter to fill in
-void setDBH(ray::TreeStructure &tree, const std::vector<std::vector<int>> &children, int DBH_id)
+void setDBH(ray::TreeStructure &tree, const TreeTopology &topology, int DBH_id)
 {
   // what do we do if the tree has multiple stems?
   // I'm just going to use the average DBH
@@ -252,27 +252,27 @@ void setDBH(ray::TreeStructure &tree, const std::vector<std::vector<int>> &child
   double num_valid_stems = 0.0;
   bool branched = false;
   double base_height = tree.segments()[0].tip[2];
-  for (auto &root : children[0])
+  for (auto &root : topology.children(0))
   {
     // 1. find first branch id:
     int segment = root;
     while (tree.segments()[segment].tip[2] < base_height + breast_height)
     {
-      size_t num_kids = children[segment].size();
+      size_t num_kids = topology.children(segment).size();
       if (num_kids == 0)
       {
         break;
       }
       else if (num_kids == 1)
       {
-        segment = children[segment][0];
+        segment = topology.children(segment)[0];
         branched = false;
       }
       else // pick largest child
       {
         double max_child_rad = 0.0;
         int max_child_id = 0;
-        for (auto &child_id: children[segment])
+        for (auto &child_id: topology.children(segment))
         {
           double rad = tree.segments()[child_id].radius;
           if (rad >= max_child_rad)
@@ -314,19 +314,19 @@ void setDBH(ray::TreeStructure &tree, const std::vector<std::vector<int>> &child
 
 /// @brief analyse the tree and set the degree to which it is monocotal (palm-like in structure)
 /// @param tree the tree to analyse
-/// @param children precalculated list of children per segment
+/// @param topology precalculated connectivity of the tree
 /// @param monocotal_id the id of the parameter to fill in representing the monocotal value
-void setMonocotal(ray::TreeStructure &tree, const std::vector<std::vector<int>> &children, int monocotal_id)
+void setMonocotal(ray::TreeStructure &tree, const TreeTopology &topology, int monocotal_id)
 {
   // One per child of root, this is because many palms can grow from a single point at the bottom.
   double max_monocotal = 0.0;
-  for (auto &root : children[0])
+  for (auto &root : topology.children(0))
   {
     // 1. find first branch id:
     int segment = root;
-    while (children[segment].size() == 1)
+    while (topology.children(segment).size() == 1)
     {
-      segment = children[segment][0];
+      segment = topology.children(segment)[0];
     }
     // 2. get distance to root:
     const Eigen::Vector3d branch_point = tree.segments()[segment].tip;
@@ -347,8 +347,9 @@ void setMonocotal(ray::TreeStructure &tree, const std::vector<std::vector<int>>
     for (size_t i = 0; i < list.size(); i++)
     {
       max_height = std::max(max_height, tree.segments()[list[i]].tip[2]);
-      num_branches += children[list[i]].size() > 1 ? static_cast<int>(children[list[i]].size()) : 0;
-      list.insert(list.end(), children[list[i]].begin(), children[list[i]].end());
+      const auto kids = topology.children(list[i]);
+      num_branches += kids.size() > 1 ? static_cast<int>(kids.size()) : 0;
+      list.insert(list.end(), kids.begin(), kids.end());
     }
     const double dist_to_top = max_height - tree.segments()[top_segment].tip[2];
 
@@ -367,44 +368,34 @@ void setMonocotal(ray::TreeStructure &tree, const std::vector<std::vector<int>>
   tree.treeAttributes()[monocotal_id] = max_monocotal;
 }
 
-void getBranchLengths(ray::TreeStructure &tree, const std::vector<std::vector<int>> &children, std::vector<double> &lengths, double prune_length)
+void getBranchLengths(ray::TreeStructure &tree, const TreeTopology &topology, std::vector<double> &lengths, double prune_length)
 {
-  lengths.resize(tree.segments().size(), 0);
-  for (size_t i = 1; i < tree.segments().size(); i++)
+  const auto &segments = tree.segments();
+  // firstly the longest path from the base of each segment to a leaf, found in a single bottom-up pass.
+  // Leaves start at the prune length, representing the length lost in reconstruction
+  lengths.assign(segments.size(), 0);
+  for (const auto &leaf : topology.leaves())
   {
-    // for each leaf, iterate to trunk updating the maximum length...
-    if (children[i].empty())  // so it is a leaf
+    if (leaf > 0)
     {
-      int I = static_cast<int>(i);
-      int j = tree.segments()[I].parent_id;
-      lengths[I] = prune_length;
-      int child = I;
-      while (j != -1)
-      {
-        const double dist =
-          lengths[child] + (tree.segments()[I].tip - tree.segments()[j].tip).norm();
-        double &length = lengths[I];
-        if (dist > length)
-        {
-          length = dist;
-        }
-        else
-        {
-          break;
-        }
-        child = I;
-        I = j;
-        j = tree.segments()[I].parent_id;
-      }
+      lengths[leaf] = prune_length;
     }
   }
-  for (auto &child : children[0])
+  topology.reduceSubtrees([&](int id, int child) {
+    lengths[id] = std::max(lengths[id], lengths[child] + (segments[child].tip - segments[id].tip).norm());
+  });
+  // then add on each segment's own length, so the length runs from its parent's tip
+  for (size_t i = 0; i < segments.size(); i++)
   {
-    lengths[0] = std::max(lengths[0], lengths[child]);
-  }  
+    const int parent = segments[i].parent_id;
+    if (parent != -1)
+    {
+      lengths[i] += (segments[i].tip - segments[parent].tip).norm();
+    }
+  }
 }
 
-void getBifurcationProperties(ray::TreeStructure &tree, const std::vector<std::vector<int>> &children, std::vector<double> &angles, std::vector<double> &dominances, std::vector<double> &num_children, 
+void getBifurcationProperties(ray::TreeStructure &tree, const TreeTopology &topology, std::vector<double> &angles, std::vector<double> &dominances, std::vector<double> &num_children, 
   double &tree_dominance, double &tree_angle, double &total_weight)
 {
   angles.resize(tree.segments().size(), 0);
@@ -413,25 +404,25 @@ void getBifurcationProperties(ray::TreeStructure &tree, const std::vector<std::v
   tree_dominance = 0.0;
   tree_angle = 0.0;
   total_weight = 1e-10;
-  num_children[0] = static_cast<double>(children[0].size());
+  num_children[0] = static_cast<double>(topology.children(0).size());
   for (size_t i = 1; i < tree.segments().size(); i++)
   {
-    num_children[i] = static_cast<double>(children[i].size());
+    num_children[i] = static_cast<double>(topology.children(i).size());
     // if its a branch point then record how dominant the branching is
-    if (children[i].size() > 1)
+    if (topology.children(i).size() > 1)
     {
       double max_rad = -1.0;
       double second_max = -1.0;
       Eigen::Vector3d dir1(0, 0, 0), dir2(0, 0, 0);
-      for (auto &child : children[i])
+      for (auto &child : topology.children(i))
       {
         double rad = tree.segments()[child].radius;
         Eigen::Vector3d dir = tree.segments()[child].tip - tree.segments()[i].tip;
         // we go up a segment if we can, as the radius and angle will have settled better here
-        if (children[child].size() == 1)
+        if (topology.children(child).size() == 1)
         {
-          rad = tree.segments()[children[child][0]].radius;
-          dir = tree.segments()[children[child][0]].tip - tree.segments()[child].tip;
+          rad = tree.segments()[topology.children(child)[0]].radius;
+          dir = tree.segments()[topology.children(child)[0]].tip - tree.segments()[child].tip;
         }
         if (rad > max_rad)
         {
@@ -4,75 +4,198 @@
 //
 // Author: Thomas Lowe
 #include "treepruner.h"
+#include "treetopology.h"
 #include <raylib/rayutils.h>
+#include <algorithm>
 
 namespace tree
 {
-/// remove all branches which are less than the specified diameter
-void pruneDiameter(ray::ForestStructure &forest, double diameter_value, ray::ForestStructure &new_forest)
+namespace
 {
-  new_forest = forest;
+/// move segment @c id to the earlier or equal index @c new_id, and give it the parent @c new_parent_id.
+/// Segments are visited from root to tips, so the moved segment never overwrites one that is still to be visited
+void moveSegment(std::vector<ray::TreeStructure::Segment> &segments, size_t id, int new_id, int new_parent_id)
+{
+  if (static_cast<size_t>(new_id) != id)
+  {
+    segments[new_id] = std::move(segments[id]);
+  }
+  segments[new_id].parent_id = new_parent_id;
+}
 
-  for (int t = 0; t < static_cast<int>(forest.trees.size()); t++)
+/// apply @c prune to each tree of @c forest, then remove the trees that have no branches left, keeping the order
+/// of the remaining trees
+template <class PruneFunction>
+void pruneForest(ray::ForestStructure &forest, bool parallel, PruneFunction prune)
+{
+  (void)parallel;  // unused without OpenMP
+  const int num_trees = static_cast<int>(forest.trees.size());
+  std::vector<uint8_t> remaining(num_trees);
+  #pragma omp parallel for schedule(dynamic) if (parallel)
+  for (int t = 0; t < num_trees; t++)
   {
-    auto &tree = forest.trees[t];
-    // temporarily get the children list, it helps
-    std::vector<std::vector<int>> children(tree.segments().size());
-    for (size_t i = 1; i < tree.segments().size(); i++)
-    {
-      children[tree.segments()[i].parent_id].push_back(static_cast<int>(i));
-    }
-    // firstly, get the maximum diameter for each section to its end.
-    // this data is monotonically decreasing, so easier to work with
-    std::vector<double> max_diameter(tree.segments().size(), 0);
-    for (size_t i = 0; i < tree.segments().size(); i++)
+    remaining[t] = prune(forest.trees[t]);
+  }
+  int num_remaining = 0;
+  for (int t = 0; t < num_trees; t++)
+  {
+    if (remaining[t])
     {
-      if (children[i].size() == 0)  // a leaf, so ...
+      if (num_remaining != t)
       {
-        int parent = tree.segments()[i].parent_id;
-        int child = static_cast<int>(i);
-        max_diameter[child] = 2.0 * tree.segments()[child].radius;
-
-        while (parent != -1)  // from the leaf, iterate through its parents
-        {
-          double diameter_parent = 2.0 * tree.segments()[parent].radius;
-          double diameter = std::max(max_diameter[child], diameter_parent);
-          if (diameter > max_diameter[parent])
-          {
-            max_diameter[parent] = diameter;
-          }
-          else
-          {
-            break;
-          }
-          child = parent;
-          parent = tree.segments()[parent].parent_id;
-        }
+        forest.trees[num_remaining] = std::move(forest.trees[t]);
       }
+      num_remaining++;
+    }
+  }
+  forest.trees.resize(num_remaining);
+}
+}  // namespace
+
+/// remove the branches of a single tree that fail any of the criteria
+bool prune(ray::TreeStructure &tree, const PruneCriteria &criteria)
+{
+  auto &segments = tree.segments();
+  const TreeTopology topology(tree);
+  int attribute_id = -1;
+  if (!criteria.attribute.empty())
+  {
+    const auto &names = tree.attributeNames();
+    const auto it = std::find(names.begin(), names.end(), criteria.attribute);
+    attribute_id = it == names.end() ? -1 : static_cast<int>(it - names.begin());
+  }
+
+  // firstly, find the length from each segment to the end of its longest branch, in a pass from the leaves down
+  struct SubtreeValues
+  {
+    double max_diameter;
+    double min_length_from_leaf;
+    double max_height;
+    double max_attribute;
+    int order;
+  };
+  std::vector<SubtreeValues> values(segments.size());
+  for (const int id : topology.postOrder())
+  {
+    auto &value = values[id];
+    value.min_length_from_leaf = 0.0;
+    for (const int child : topology.children(id))
+    {
+      const double distance = (segments[id].tip - segments[child].tip).norm();
+      value.min_length_from_leaf = std::max(value.min_length_from_leaf, values[child].min_length_from_leaf + distance);
     }
+  }
 
-    std::vector<int> new_index(tree.segments().size());
-    new_index[0] = 0;
+  // the tip length is removed before the other criteria are evaluated, as if pruned by length in a separate pass.
+  // So shorten the segments that the tip length ends within. Their parents are never shortened, as any segment
+  // within the tip length has its children removed
+  for (size_t i = 1; i < segments.size(); i++)
+  {
+    const int par = segments[i].parent_id;
+    if (par != -1 && values[par].min_length_from_leaf > criteria.tip_length &&
+        values[i].min_length_from_leaf <= criteria.tip_length)
+    {
+      double blend = (values[par].min_length_from_leaf - criteria.tip_length) /
+                     std::max(std::numeric_limits<double>::min(),
+                              values[par].min_length_from_leaf - values[i].min_length_from_leaf);
+      blend = std::max(std::numeric_limits<double>::min(), std::min(blend, 1.0));
+      segments[i].tip = segments[par].tip + (segments[i].tip - segments[par].tip) * blend;
+    }
+  }
 
-    auto &new_tree = new_forest.trees[t];
-    new_tree.segments().clear();
-    new_tree.segments().push_back(tree.segments()[0]);
-    // now going from root to tips, reindexing when below the
-    // specified diameter
-    for (size_t i = 1; i < tree.segments().size(); i++)
+  // then find the other values over each segment's shortened subtree, in a second pass from the leaves down.
+  // The maxima and the Strahler order are monotonically decreasing towards the tips, so easier to work with
+  for (const int id : topology.postOrder())
+  {
+    auto &value = values[id];
+    value.max_diameter = 2.0 * segments[id].radius;
+    value.max_height = segments[id].tip[2];
+    value.max_attribute = attribute_id == -1 ? 0.0 : segments[id].attributes[attribute_id];
+    if (value.min_length_from_leaf <= criteria.tip_length)
+    {
+      value.order = 1;  // the children are all removed by the tip length, so this segment ends a branch
+      continue;
+    }
+    int max_order = 0, num_max_order = 0;
+    for (const int child : topology.children(id))
     {
-      if (max_diameter[i] > 0.01 * diameter_value)
+      const auto &child_value = values[child];
+      value.max_diameter = std::max(value.max_diameter, child_value.max_diameter);
+      value.max_height = std::max(value.max_height, child_value.max_height);
+      value.max_attribute = std::max(value.max_attribute, child_value.max_attribute);
+      if (child_value.order > max_order)
       {
-        new_index[i] = static_cast<int>(new_tree.segments().size());
-        new_tree.segments().push_back(tree.segments()[i]);
-        new_tree.segments().back().parent_id = new_index[tree.segments()[i].parent_id];
+        max_order = child_value.order;
+        num_max_order = 1;
       }
-      else
+      else if (child_value.order == max_order)
       {
-        new_index[i] = new_index[tree.segments()[i].parent_id];
+        num_max_order++;
       }
     }
-    if (new_tree.segments().size() == 1)  // remove this tree
+    value.order = max_order == 0 ? 1 : max_order + (num_max_order > 1 ? 1 : 0);
+  }
+
+  // then iterate from root to leaf, compacting the segments that pass the criteria and whose parents remain.
+  // Removed segments have a new_index of -1, which removes their whole subtree. Kept parents have already been
+  // moved, so their tips are found through new_index
+  const double base_height = segments[0].tip[2];
+  std::vector<int> new_index(segments.size());
+  new_index[0] = 0;
+  int num_segments = 1;
+  for (size_t i = 1; i < segments.size(); i++)
+  {
+    const int par = segments[i].parent_id;
+    const auto &value = values[i];
+    new_index[i] = -1;
+    if (par == -1 || new_index[par] == -1 || values[par].min_length_from_leaf <= criteria.tip_length)
+    {
+      continue;
+    }
+    const double parent_height = segments[new_index[par]].tip[2];
+    const bool remove = value.max_diameter <= criteria.min_diameter || value.order < criteria.min_branch_order ||
+                        value.max_height - base_height < criteria.min_height ||
+                        parent_height - base_height > criteria.max_height ||
+                        (attribute_id != -1 && value.max_attribute < criteria.attribute_threshold);
+    if (!remove)
+    {
+      new_index[i] = num_segments++;
+      moveSegment(segments, i, new_index[i], new_index[par]);
+    }
+  }
+  segments.resize(num_segments);
+  return num_segments > 1;
+}
+
+/// remove the branches of each tree that fail any of the criteria
+void prune(ray::ForestStructure &forest, const PruneCriteria &criteria, bool parallel)
+{
+  pruneForest(forest, parallel, [&criteria](ray::TreeStructure &tree) { return prune(tree, criteria); });
+}
+
+/// remove all branches of a single tree which are less than the specified diameter
+bool pruneDiameter(ray::TreeStructure &tree, double diameter_value)
+{
+  PruneCriteria criteria;
+  criteria.min_diameter = 0.01 * diameter_value;  // the diameter is in cm
+  return prune(tree, criteria);
+}
+
+/// remove all branches of a single tree which are less than the specified diameter
+bool pruneDiameter(const ray::TreeStructure &tree, double diameter_value, ray::TreeStructure &new_tree)
+{
+  new_tree = tree;
+  return pruneDiameter(new_tree, diameter_value);
+}
+
+/// remove all branches which are less than the specified diameter
+void pruneDiameter(ray::ForestStructure &forest, double diameter_value, ray::ForestStructure &new_forest)
+{
+  new_forest = forest;
+
+  for (int t = 0; t < static_cast<int>(forest.trees.size()); t++)
+  {
+    if (!pruneDiameter(forest.trees[t], diameter_value, new_forest.trees[t]))  // remove this tree
     {
       new_forest.trees[t] = new_forest.trees.back();
       new_forest.trees.pop_back();
@@ -83,6 +206,27 @@ void pruneDiameter(ray::ForestStructure &forest, double diameter_value, ray::For
   }
 }
 
+/// remove all branches which are less than the specified diameter, in place
+void pruneDiameter(ray::ForestStructure &forest, double diameter_value, bool parallel)
+{
+  pruneForest(forest, parallel, [diameter_value](ray::TreeStructure &tree) { return pruneDiameter(tree, diameter_value); });
+}
+
+/// remove the specifiied length from the end of all branches of a single tree
+bool pruneLength(ray::TreeStructure &tree, double length_value)
+{
+  PruneCriteria criteria;
+  criteria.tip_length = length_value;
+  return prune(tree, criteria);
+}
+
+/// remove the specifiied length from the end of all branches of a single tree
+bool pruneLength(const ray::TreeStructure &tree, double length_value, ray::TreeStructure &new_tree)
+{
+  new_tree = tree;
+  return pruneLength(new_tree, length_value);
+}
+
 /// remove the specifiied length from the end of all branches
 void pruneLength(ray::ForestStructure &forest, double length_value, ray::ForestStructure &new_forest)
 {
@@ -90,79 +234,7 @@ void pruneLength(ray::ForestStructure &forest, double length_value, ray::ForestS
 
   for (int t = 0; t < static_cast<int>(forest.trees.size()); t++)
   {
-    auto &tree = forest.trees[t];
-    // temporarily get the children list, it helps
-    std::vector<std::vector<int>> children(tree.segments().size());
-    for (size_t i = 1; i < tree.segments().size(); i++)
-    {
-      children[tree.segments()[i].parent_id].push_back(static_cast<int>(i));
-    }
-    // find the minimum length from leaf for every branch segment
-    std::vector<double> min_length_from_leaf(tree.segments().size(), 0);
-    for (size_t i = 0; i < tree.segments().size(); i++)
-    {
-      if (children[i].size() == 0)  // a leaf, so ...
-      {
-        int parent = tree.segments()[i].parent_id;
-        int child = static_cast<int>(i);
-
-        min_length_from_leaf[i] = 0.0;
-        while (parent != -1)  // iterate through the parents
-        {
-          double distance = (tree.segments()[parent].tip - tree.segments()[child].tip).norm();
-          double new_dist = min_length_from_leaf[child] + distance;
-          if (new_dist > min_length_from_leaf[parent])
-          {
-            min_length_from_leaf[parent] = new_dist;
-          }
-          else
-          {
-            break;
-          }
-          child = parent;
-          parent = tree.segments()[parent].parent_id;
-        }
-      }
-    }
-
-    std::vector<int> new_index(tree.segments().size());
-    new_index[0] = 0;
-
-    auto &new_tree = new_forest.trees[t];
-    new_tree.segments().clear();
-    new_tree.segments().push_back(tree.segments()[0]);
-    // now iterate from root to leaf, filling new_tree only up to the
-    // minimum distance from end (length_value)
-    for (size_t i = 1; i < tree.segments().size(); i++)
-    {
-      if (min_length_from_leaf[i] > length_value)
-      {
-        new_index[i] = static_cast<int>(new_tree.segments().size());
-        new_tree.segments().push_back(tree.segments()[i]);
-        new_tree.segments().back().parent_id = new_index[tree.segments()[i].parent_id];
-      }
-      else
-      {
-        int par = tree.segments()[i].parent_id;
-        if (par != -1 && min_length_from_leaf[par] > length_value)
-        {
-          double blend = (min_length_from_leaf[par] - length_value) /
-                         std::max(std::numeric_limits<double>::min(), min_length_from_leaf[par] - min_length_from_leaf[i]);
-          blend = std::max(std::numeric_limits<double>::min(), std::min(blend, 1.0));
-          ray::TreeStructure::Segment seg = tree.segments()[i];
-          seg.tip = tree.segments()[par].tip + (seg.tip - tree.segments()[par].tip) * blend;
-
-          new_index[i] = static_cast<int>(new_tree.segments().size());
-          new_tree.segments().push_back(seg);
-          new_tree.segments().back().parent_id = new_index[seg.parent_id];
-        }
-        else
-        {
-          new_index[i] = new_index[tree.segments()[i].parent_id];
-        }
-      }
-    }
-    if (new_tree.segments().size() == 1)  // remove this tree
+    if (!pruneLength(forest.trees[t], length_value, new_forest.trees[t]))  // remove this tree
     {
       new_forest.trees[t] = new_forest.trees.back();
       new_forest.trees.pop_back();
@@ -173,4 +245,10 @@ void pruneLength(ray::ForestStructure &forest, double length_value, ray::ForestS
   }
 }
 
+/// remove the specified length from the end of all branches, in place
+void pruneLength(ray::ForestStructure &forest, double length_value, bool parallel)
+{
+  pruneForest(forest, parallel, [length_value](ray::TreeStructure &tree) { return pruneLength(tree, length_value); });
+}
+
 }  // namespace tree
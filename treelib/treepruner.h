@@ -9,15 +9,72 @@
 #include <raylib/rayforeststructure.h>
 #include <raylib/raytreegen.h>
 #include <Eigen/Dense>
+#include <limits>
+#include <string>
 #include "treelib/treelibconfig.h"
 
 namespace tree
 {
+/// The criteria for pruning branches from a tree, which are all applied in a single pass by prune().
+/// The tip length is removed first, so the other criteria apply to the shortened branches, as if the tree were pruned
+/// by length and then by the other criteria in separate passes.
+/// The default values leave the tree unchanged. Heights are measured from the tree's base, in metres
+struct TREELIB_EXPORT PruneCriteria
+{
+  /// remove branches that are no wider than this diameter all the way to their tips, in metres
+  double min_diameter = std::numeric_limits<double>::lowest();
+  /// remove this length from the end of all branches, in metres
+  double tip_length = std::numeric_limits<double>::lowest();
+  /// remove branches of lower Strahler order than this, where the branches that end at a tip are order 1
+  int min_branch_order = 0;
+  /// remove branches that are entirely below this height
+  double min_height = std::numeric_limits<double>::lowest();
+  /// remove branches that start above this height
+  double max_height = std::numeric_limits<double>::max();
+  /// the name of a per-segment attribute, and a threshold to remove branches that are below it all the way to
+  /// their tips. No branches are removed by attribute if @c attribute is empty or the tree does not have it
+  std::string attribute;
+  double attribute_threshold = std::numeric_limits<double>::lowest();
+};
+
+/// remove the branches of @c tree that fail any of the @c criteria, in place. The subtree values that the criteria
+/// use are found in two passes from the tips down, before and after the tip length is removed, then the remaining
+/// segments are compacted in one pass from the root up, keeping their order. Returns false if no branches remain
+bool TREELIB_EXPORT prune(ray::TreeStructure &tree, const PruneCriteria &criteria);
+
+/// remove the branches of each tree of @c forest that fail any of the @c criteria, in place. Trees with no remaining
+/// branches are removed, keeping the order of the others. The trees are pruned in parallel if @c parallel is set
+void TREELIB_EXPORT prune(ray::ForestStructure &forest, const PruneCriteria &criteria, bool parallel = false);
+
+/// remove all branches of @c tree which are less than the specified diameter, storing the result in @c new_tree.
+/// Returns false if no branches remain, in which case the tree should be removed from the forest
+bool TREELIB_EXPORT pruneDiameter(const ray::TreeStructure &tree, double diameter, ray::TreeStructure &new_tree);
+
+/// remove the specified length from the end of all branches of @c tree, storing the result in @c new_tree.
+/// Returns false if no branches remain, in which case the tree should be removed from the forest
+bool TREELIB_EXPORT pruneLength(const ray::TreeStructure &tree, double length, ray::TreeStructure &new_tree);
+
 /// remove all branches which are less than the specified diameter
 void TREELIB_EXPORT pruneDiameter(ray::ForestStructure &forest, double diameter, ray::ForestStructure &new_forest);
 
 /// remove the specifiied length from the end of all branches
 void TREELIB_EXPORT pruneLength(ray::ForestStructure &forest, double length, ray::ForestStructure &new_forest);
+
+/// remove all branches of @c tree which are less than the specified diameter, in place. The remaining segments are
+/// moved down within the tree's storage, keeping their order. Returns false if no branches remain
+bool TREELIB_EXPORT pruneDiameter(ray::TreeStructure &tree, double diameter);
+
+/// remove the specified length from the end of all branches of @c tree, in place. The remaining segments are
+/// moved down within the tree's storage, keeping their order. Returns false if no branches remain
+bool TREELIB_EXPORT pruneLength(ray::TreeStructure &tree, double length);
+
+/// remove all branches of the forest which are less than the specified diameter, in place. Trees with no remaining
+/// branches are removed, keeping the order of the others. The trees are pruned in parallel if @c parallel is set
+void TREELIB_EXPORT pruneDiameter(ray::ForestStructure &forest, double diameter, bool parallel = false);
+
+/// remove the specified length from the end of all branches of the forest, in place. Trees with no remaining
+/// branches are removed, keeping the order of the others. The trees are pruned in parallel if @c parallel is set
+void TREELIB_EXPORT pruneLength(ray::ForestStructure &forest, double length, bool parallel = false);
 }  // namespace tree
 
 #endif  // TREELIB_TREEPRUNER_H
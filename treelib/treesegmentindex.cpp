@@ -0,0 +1,306 @@
+// Copyright (c) 2022
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#include "treesegmentindex.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+namespace tree
+{
+namespace
+{
+const char kMagic[8] = { 'T', 'R', 'E', 'E', 'I', 'D', 'X', '\0' };
+const uint32_t kVersion = 1;
+
+/// the distance from @c point to the line segment from @c v1 to @c v2
+double segmentDistance(const Eigen::Vector3d &point, const Eigen::Vector3d &v1, const Eigen::Vector3d &v2)
+{
+  const Eigen::Vector3d axis = v2 - v1;
+  const double length_sqr = axis.squaredNorm();
+  const double t = length_sqr > 0.0 ? std::max(0.0, std::min((point - v1).dot(axis) / length_sqr, 1.0)) : 0.0;
+  return (v1 + axis * t - point).norm();
+}
+
+/// the distance along the ray from @c start in unit direction @c dir that it enters the sphere at @c centre,
+/// or infinity if it misses the sphere or it is behind the start
+double sphereEntry(const Eigen::Vector3d &start, const Eigen::Vector3d &dir, const Eigen::Vector3d &centre,
+                   double radius)
+{
+  const Eigen::Vector3d offset = start - centre;
+  const double b = offset.dot(dir);
+  const double h = b * b - (offset.squaredNorm() - radius * radius);
+  const double t = h >= 0.0 ? -b - std::sqrt(h) : -1.0;
+  return t >= 0.0 ? t : std::numeric_limits<double>::infinity();
+}
+
+/// the distance along the ray from @c start in unit direction @c dir that it enters @c capsule, 0 if it starts
+/// inside the capsule, or infinity if it misses. The capsule is the union of its cylindrical body and the spheres at
+/// its ends, so the ray enters it at the first entry to any of these
+double capsuleEntry(const Eigen::Vector3d &start, const Eigen::Vector3d &dir, const Cylinder &capsule)
+{
+  if (segmentDistance(start, capsule.v1, capsule.v2) <= capsule.radius)
+  {
+    return 0.0;
+  }
+  double entry = std::min(sphereEntry(start, dir, capsule.v1, capsule.radius),
+                          sphereEntry(start, dir, capsule.v2, capsule.radius));
+  // the body, as the ray's intersection with the infinite cylinder, limited to the length of the axis
+  const Eigen::Vector3d axis = capsule.v2 - capsule.v1;
+  const Eigen::Vector3d offset = start - capsule.v1;
+  const double axis_sqr = axis.squaredNorm();
+  const double axis_dir = axis.dot(dir);
+  const double axis_offset = axis.dot(offset);
+  const double a = axis_sqr - axis_dir * axis_dir;
+  if (a > 1e-12 * axis_sqr)  // otherwise the ray is parallel to the axis, so can only enter through the ends
+  {
+    const double b = axis_sqr * dir.dot(offset) - axis_offset * axis_dir;
+    const double c = axis_sqr * offset.squaredNorm() - axis_offset * axis_offset -
+                     capsule.radius * capsule.radius * axis_sqr;
+    const double h = b * b - a * c;
+    if (h >= 0.0)
+    {
+      const double t = (-b - std::sqrt(h)) / a;
+      const double y = axis_offset + t * axis_dir;
+      if (t >= 0.0 && y > 0.0 && y < axis_sqr)
+      {
+        entry = std::min(entry, t);
+      }
+    }
+  }
+  return entry;
+}
+
+template <class T>
+void writeArray(std::ostream &out, const std::vector<T> &values)
+{
+  const uint64_t size = values.size();
+  out.write(reinterpret_cast<const char *>(&size), sizeof(size));
+  out.write(reinterpret_cast<const char *>(values.data()), static_cast<std::streamsize>(size * sizeof(T)));
+}
+
+/// the number of bytes from the current position to the end of @c in
+uint64_t remainingBytes(std::istream &in)
+{
+  const std::streampos pos = in.tellg();
+  if (pos < 0 || !in.seekg(0, std::ios::end))
+  {
+    return 0;
+  }
+  const std::streampos end = in.tellg();
+  in.seekg(pos);
+  return end >= pos ? static_cast<uint64_t>(end - pos) : 0;
+}
+
+template <class T>
+bool readArray(std::istream &in, std::vector<T> &values, uint64_t max_size)
+{
+  uint64_t size = 0;
+  // the size is checked against what is left in the file before allocating, so a corrupt size can't exhaust memory
+  if (!in.read(reinterpret_cast<char *>(&size), sizeof(size)) || size > max_size ||
+      size > remainingBytes(in) / sizeof(T))
+  {
+    return false;
+  }
+  values.resize(size);
+  in.read(reinterpret_cast<char *>(values.data()), static_cast<std::streamsize>(size * sizeof(T)));
+  return static_cast<bool>(in);
+}
+}  // namespace
+
+void SegmentIndex::build(const ray::ForestStructure &forest)
+{
+  refs_.clear();
+  capsules_.clear();
+  for (size_t t = 0; t < forest.trees.size(); t++)
+  {
+    const auto &segments = forest.trees[t].segments();
+    for (size_t i = 0; i < segments.size(); i++)
+    {
+      if (segments[i].parent_id != -1)
+      {
+        refs_.push_back({ static_cast<int>(t), static_cast<int>(i) });
+        capsules_.push_back(Cylinder(segments[i].tip, segments[segments[i].parent_id].tip, segments[i].radius));
+      }
+    }
+  }
+  bvh_.build(capsules_);
+}
+
+void SegmentIndex::findInBox(const BoundingBox &box, std::vector<SegmentRef> &refs) const
+{
+  refs.clear();
+  bvh_.findOverlapping(box, [&](int id) { refs.push_back(refs_[id]); });
+  std::sort(refs.begin(), refs.end());
+}
+
+void SegmentIndex::findInRadius(const Eigen::Vector3d &centre, double radius, std::vector<SegmentRef> &refs) const
+{
+  refs.clear();
+  const Eigen::Vector3d extent = Eigen::Vector3d::Constant(radius);
+  bvh_.findOverlapping(BoundingBox(centre - extent, centre + extent), [&](int id) {
+    const Cylinder &capsule = capsules_[id];
+    if (segmentDistance(centre, capsule.v1, capsule.v2) <= radius + capsule.radius)
+    {
+      refs.push_back(refs_[id]);
+    }
+  });
+  std::sort(refs.begin(), refs.end());
+}
+
+bool SegmentIndex::raycast(const Eigen::Vector3d &start, const Eigen::Vector3d &end, SegmentRef &ref,
+                           double &distance) const
+{
+  const double length = (end - start).norm();
+  if (length == 0.0)  // only a point, so it hits the capsules that it is in
+  {
+    return nearest(start, ref, distance, 0.0);
+  }
+  const Eigen::Vector3d dir = (end - start) / length;
+  const Eigen::Vector3d inv_dir = dir.cwiseInverse();
+  bool found = false;
+  bvh_.findClosest([&](const BoundingBox &box) { return box.rayEntry(start, inv_dir); },
+                   [&](int id) {
+                     const double entry = capsuleEntry(start, dir, capsules_[id]);
+                     // the closest hit along the ray, with equal hits resolved to the first segment
+                     if (entry <= length && (!found || entry < distance || (entry == distance && refs_[id] < ref)))
+                     {
+                       found = true;
+                       distance = entry;
+                       ref = refs_[id];
+                     }
+                     return entry;
+                   },
+                   length);
+  return found;
+}
+
+bool SegmentIndex::nearest(const Eigen::Vector3d &point, SegmentRef &ref, double &distance,
+                           double max_distance) const
+{
+  bool found = false;
+  bvh_.findClosest([&](const BoundingBox &box) { return box.distance(point); },
+                   [&](int id) {
+                     const Cylinder &capsule = capsules_[id];
+                     const double dist = std::max(0.0, segmentDistance(point, capsule.v1, capsule.v2) - capsule.radius);
+                     // the nearest segment, with equal distances resolved to the first segment
+                     if (dist <= max_distance && (!found || dist < distance || (dist == distance && refs_[id] < ref)))
+                     {
+                       found = true;
+                       distance = dist;
+                       ref = refs_[id];
+                     }
+                     return dist;
+                   },
+                   max_distance);
+  return found;
+}
+
+bool SegmentIndex::matches(const ray::ForestStructure &forest) const
+{
+  size_t num = 0;
+  for (size_t t = 0; t < forest.trees.size(); t++)
+  {
+    const auto &segments = forest.trees[t].segments();
+    for (size_t i = 0; i < segments.size(); i++)
+    {
+      if (segments[i].parent_id == -1)
+      {
+        continue;
+      }
+      if (num >= refs_.size() || refs_[num].tree_id != static_cast<int>(t) ||
+          refs_[num].segment_id != static_cast<int>(i))
+      {
+        return false;
+      }
+      const Cylinder &capsule = capsules_[num++];
+      if (capsule.v1 != segments[i].tip || capsule.v2 != segments[segments[i].parent_id].tip ||
+          capsule.radius != segments[i].radius)
+      {
+        return false;
+      }
+    }
+  }
+  return num == refs_.size();
+}
+
+bool SegmentIndex::save(const std::string &filename) const
+{
+  std::ofstream ofs(filename, std::ios::binary | std::ios::out);
+  if (!ofs.is_open())
+  {
+    std::cerr << "Error: cannot open " << filename << " for writing" << std::endl;
+    return false;
+  }
+  // the capsules are stored as 7 doubles each: the tip, the parent's tip and the radius
+  std::vector<double> capsule_values;
+  capsule_values.reserve(7 * capsules_.size());
+  for (const auto &capsule : capsules_)
+  {
+    capsule_values.insert(capsule_values.end(), capsule.v1.data(), capsule.v1.data() + 3);
+    capsule_values.insert(capsule_values.end(), capsule.v2.data(), capsule.v2.data() + 3);
+    capsule_values.push_back(capsule.radius);
+  }
+  ofs.write(kMagic, sizeof(kMagic));
+  ofs.write(reinterpret_cast<const char *>(&kVersion), sizeof(kVersion));
+  writeArray(ofs, refs_);
+  writeArray(ofs, capsule_values);
+  bvh_.write(ofs);
+  if (!ofs.good())
+  {
+    std::cerr << "Error: failed writing " << filename << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool SegmentIndex::load(const std::string &filename)
+{
+  std::ifstream ifs(filename, std::ios::binary | std::ios::in);
+  char magic[sizeof(kMagic)];
+  uint32_t version = 0;
+  std::vector<double> capsule_values;
+  const uint64_t max_size = std::numeric_limits<int>::max();
+  bool valid = ifs.is_open() && ifs.read(magic, sizeof(magic)) && std::memcmp(magic, kMagic, sizeof(kMagic)) == 0 &&
+               ifs.read(reinterpret_cast<char *>(&version), sizeof(version)) && version == kVersion &&
+               readArray(ifs, refs_, max_size) && readArray(ifs, capsule_values, 7 * max_size) &&
+               capsule_values.size() == 7 * refs_.size() && bvh_.read(ifs) && bvh_.size() == refs_.size();
+  capsules_.clear();
+  if (!valid)
+  {
+    refs_.clear();
+    bvh_ = CylinderBVH();
+    return false;
+  }
+  capsules_.reserve(refs_.size());
+  for (size_t i = 0; i < refs_.size(); i++)
+  {
+    const double *values = &capsule_values[7 * i];
+    capsules_.push_back(Cylinder(Eigen::Vector3d(values[0], values[1], values[2]),
+                                 Eigen::Vector3d(values[3], values[4], values[5]), values[6]));
+  }
+  return true;
+}
+
+void SegmentIndex::loadOrBuild(const std::string &forest_file, const ray::ForestStructure &forest)
+{
+  const std::string filename = segmentIndexFileName(forest_file);
+  if (load(filename) && matches(forest))
+  {
+    return;
+  }
+  build(forest);
+  save(filename);
+}
+
+std::string segmentIndexFileName(const std::string &forest_file)
+{
+  const size_t dot = forest_file.find_last_of('.');
+  const size_t slash = forest_file.find_last_of("/\\");
+  const bool has_extension = dot != std::string::npos && (slash == std::string::npos || dot > slash);
+  return (has_extension ? forest_file.substr(0, dot) : forest_file) + "_index.bin";
+}
+}  // namespace tree
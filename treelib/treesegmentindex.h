@@ -0,0 +1,82 @@
+// Copyright (c) 2022
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#ifndef TREELIB_TREESEGMENTINDEX_H
+#define TREELIB_TREESEGMENTINDEX_H
+
+#include <raylib/rayforeststructure.h>
+#include <Eigen/Dense>
+#include <string>
+#include <vector>
+#include "treelib/treebvh.h"
+#include "treelib/treelibconfig.h"
+#include "treelib/treeutils.h"
+
+namespace tree
+{
+/// A reference to one segment of one tree in a forest
+struct TREELIB_EXPORT SegmentRef
+{
+  int tree_id;
+  int segment_id;
+  bool operator==(const SegmentRef &other) const
+  {
+    return tree_id == other.tree_id && segment_id == other.segment_id;
+  }
+  bool operator<(const SegmentRef &other) const
+  {
+    return tree_id < other.tree_id || (tree_id == other.tree_id && segment_id < other.segment_id);
+  }
+};
+
+/// A spatial index over the segments of every tree in a forest, so that tools can find the segments near a
+/// location without scanning the whole forest. Each segment with a parent is indexed as the capsule from its
+/// parent's tip to its own tip, using a bounding volume hierarchy over the capsule bounds.
+/// The index can be saved next to the forest file and loaded again while the forest is unchanged.
+/// Results are in increasing tree then segment order, so they don't depend on the structure of the hierarchy
+class TREELIB_EXPORT SegmentIndex
+{
+public:
+  SegmentIndex() = default;
+  explicit SegmentIndex(const ray::ForestStructure &forest) { build(forest); }
+  void build(const ray::ForestStructure &forest);
+
+  /// the number of indexed segments
+  size_t size() const { return refs_.size(); }
+  /// the indexed segment references, in tree then segment order
+  const std::vector<SegmentRef> &refs() const { return refs_; }
+
+  /// the segments whose capsule bounds overlap @c box
+  void findInBox(const BoundingBox &box, std::vector<SegmentRef> &refs) const;
+  /// the segments whose capsules are within @c radius of @c centre
+  void findInRadius(const Eigen::Vector3d &centre, double radius, std::vector<SegmentRef> &refs) const;
+  /// the first segment that the ray from @c start to @c end hits, and the distance along the ray that it is hit.
+  /// Returns false if no segment is hit. A ray starting inside a capsule hits it at distance 0
+  bool raycast(const Eigen::Vector3d &start, const Eigen::Vector3d &end, SegmentRef &ref, double &distance) const;
+  /// the segment whose capsule is nearest to @c point, and the distance to it, which is 0 inside the capsule.
+  /// Returns false if there are no segments within @c max_distance
+  bool nearest(const Eigen::Vector3d &point, SegmentRef &ref, double &distance,
+               double max_distance = std::numeric_limits<double>::infinity()) const;
+
+  /// whether the index was built from the same segment geometry as @c forest, so is valid to use with it
+  bool matches(const ray::ForestStructure &forest) const;
+  /// save the index in binary to @c filename, to be reused by load() while the forest is unchanged
+  bool save(const std::string &filename) const;
+  /// load an index saved by save(), returning false if it cannot be read
+  bool load(const std::string &filename);
+  /// load the index saved next to @c forest_file if it matches @c forest, otherwise build the index and save it there
+  void loadOrBuild(const std::string &forest_file, const ray::ForestStructure &forest);
+
+private:
+  std::vector<SegmentRef> refs_;
+  std::vector<Cylinder> capsules_;  // from each segment's tip (v1) to its parent's tip (v2)
+  CylinderBVH bvh_;
+};
+
+/// the file that the segment index of @c forest_file is saved to, next to the forest file
+std::string TREELIB_EXPORT segmentIndexFileName(const std::string &forest_file);
+}  // namespace tree
+
+#endif  // TREELIB_TREESEGMENTINDEX_H
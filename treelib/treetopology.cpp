@@ -0,0 +1,108 @@
+// Copyright (c) 2022
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#include "treetopology.h"
+#include <algorithm>
+
+namespace tree
+{
+void TreeTopology::build(const ray::TreeStructure &tree)
+{
+  const auto &segments = tree.segments();
+  const int num_segments = static_cast<int>(segments.size());
+
+  // count the children of each segment, then convert the counts into offsets
+  offsets_.assign(num_segments + 1, 0);
+  for (const auto &segment : segments)
+  {
+    if (segment.parent_id != -1)
+    {
+      offsets_[segment.parent_id + 1]++;
+    }
+  }
+  for (int i = 0; i < num_segments; i++)
+  {
+    offsets_[i + 1] += offsets_[i];
+  }
+  // fill in the child ids. Iterating in segment order keeps each child list in increasing id order
+  child_ids_.resize(offsets_[num_segments]);
+  std::vector<int> fill(offsets_.begin(), offsets_.end() - 1);
+  for (int i = 0; i < num_segments; i++)
+  {
+    const int parent = segments[i].parent_id;
+    if (parent != -1)
+    {
+      child_ids_[fill[parent]++] = i;
+    }
+  }
+
+  // depth-first traversals from each root. Segments with a parent id of -1 are roots.
+  depths_.assign(num_segments, 0);
+  pre_order_.clear();
+  pre_order_.reserve(num_segments);
+  post_order_.clear();
+  post_order_.reserve(num_segments);
+  std::vector<int> stack;
+  for (int root = 0; root < num_segments; root++)
+  {
+    if (segments[root].parent_id != -1)
+    {
+      continue;
+    }
+    // pre-order: visit the children in increasing id order, so push them in reverse
+    stack.push_back(root);
+    while (!stack.empty())
+    {
+      const int id = stack.back();
+      stack.pop_back();
+      pre_order_.push_back(id);
+      for (int c = offsets_[id + 1] - 1; c >= offsets_[id]; c--)
+      {
+        depths_[child_ids_[c]] = depths_[id] + 1;
+        stack.push_back(child_ids_[c]);
+      }
+    }
+    // post-order: the reverse of a node-first traversal that visits the children in decreasing id order
+    const size_t start = post_order_.size();
+    stack.push_back(root);
+    while (!stack.empty())
+    {
+      const int id = stack.back();
+      stack.pop_back();
+      post_order_.push_back(id);
+      for (int c = offsets_[id]; c < offsets_[id + 1]; c++)
+      {
+        stack.push_back(child_ids_[c]);
+      }
+    }
+    std::reverse(post_order_.begin() + start, post_order_.end());
+  }
+
+  leaves_.clear();
+  for (int i = 0; i < num_segments; i++)
+  {
+    if (offsets_[i + 1] == offsets_[i])
+    {
+      leaves_.push_back(i);
+    }
+  }
+}
+
+void TreeTopology::reduceSubtrees(std::vector<double> &values, SubtreeReduction reduction) const
+{
+  switch (reduction)
+  {
+  case SubtreeReduction::Max:
+    reduceSubtrees([&values](int id, int child) { values[id] = std::max(values[id], values[child]); });
+    break;
+  case SubtreeReduction::Min:
+    reduceSubtrees([&values](int id, int child) { values[id] = std::min(values[id], values[child]); });
+    break;
+  case SubtreeReduction::Sum:
+    reduceSubtrees([&values](int id, int child) { values[id] += values[child]; });
+    break;
+  }
+}
+}  // namespace tree
@@ -0,0 +1,105 @@
+// Copyright (c) 2022
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#ifndef TREELIB_TREETOPOLOGY_H
+#define TREELIB_TREETOPOLOGY_H
+
+#include <raylib/raytreestructure.h>
+#include <vector>
+#include "treelib/treelibconfig.h"
+
+namespace tree
+{
+/// The ways that per-segment values can be combined over each subtree, see TreeTopology::reduceSubtrees
+enum class SubtreeReduction
+{
+  Max,
+  Min,
+  Sum
+};
+
+/// A compact (compressed sparse row) representation of the connectivity of a single tree structure.
+/// This is built once per tree from the segment parent ids, and replaces the per-segment lists of children,
+/// so no allocations are made per segment. It also stores the depth of each segment, the list of leaf segments
+/// and the pre-order and post-order traversals of the tree, which are commonly needed when analysing trees.
+class TREELIB_EXPORT TreeTopology
+{
+public:
+  /// A light weight view onto the contiguous child ids of one segment, usable in range-based for loops
+  class ChildRange
+  {
+  public:
+    ChildRange(const int *begin, const int *end)
+      : begin_(begin)
+      , end_(end)
+    {}
+    const int *begin() const { return begin_; }
+    const int *end() const { return end_; }
+    size_t size() const { return static_cast<size_t>(end_ - begin_); }
+    bool empty() const { return begin_ == end_; }
+    int operator[](size_t i) const { return begin_[i]; }
+
+  private:
+    const int *begin_;
+    const int *end_;
+  };
+
+  TreeTopology() = default;
+  explicit TreeTopology(const ray::TreeStructure &tree) { build(tree); }
+
+  /// Generate the topology from the parent ids of the segments in @c tree. Any segment with a parent id of -1 is
+  /// treated as a root, and the children of each segment are kept in increasing id order
+  void build(const ray::TreeStructure &tree);
+
+  /// the number of segments in the tree
+  size_t size() const { return depths_.size(); }
+  /// the ids of the child segments of segment @c id
+  ChildRange children(int id) const
+  {
+    return ChildRange(child_ids_.data() + offsets_[id], child_ids_.data() + offsets_[id + 1]);
+  }
+  /// the number of child segments of segment @c id
+  int numChildren(int id) const { return offsets_[id + 1] - offsets_[id]; }
+  /// the number of segments between @c id and its root. Root segments have depth 0
+  int depth(int id) const { return depths_[id]; }
+
+  const std::vector<int> &depths() const { return depths_; }
+  /// segments without any children, in increasing id order
+  const std::vector<int> &leaves() const { return leaves_; }
+  /// segment ids ordered so that each parent precedes its children
+  const std::vector<int> &preOrder() const { return pre_order_; }
+  /// segment ids ordered so that each parent follows all of its descendants
+  const std::vector<int> &postOrder() const { return post_order_; }
+
+  /// Replace each of the per-segment @c values with the maximum, minimum or sum of the values over the subtree
+  /// rooted at that segment (including the segment itself). This is a single pass over the post-order, so is O(n)
+  void reduceSubtrees(std::vector<double> &values, SubtreeReduction reduction) const;
+
+  /// The general form of subtree reduction. @c combine(id, child) is called once for each child of each segment,
+  /// after all of the child's own children have been combined into it. So values accumulated into the child are
+  /// final by the time they are combined into the parent
+  template <class Combine>
+  void reduceSubtrees(Combine combine) const
+  {
+    for (const int id : post_order_)
+    {
+      for (const int child : children(id))
+      {
+        combine(id, child);
+      }
+    }
+  }
+
+private:
+  std::vector<int> offsets_;    // size() + 1 entries, the children of i are child_ids_[offsets_[i]] to [offsets_[i+1]]
+  std::vector<int> child_ids_;  // concatenated child lists
+  std::vector<int> depths_;
+  std::vector<int> leaves_;
+  std::vector<int> pre_order_;
+  std::vector<int> post_order_;
+};
+}  // namespace tree
+
+#endif  // TREELIB_TREETOPOLOGY_H
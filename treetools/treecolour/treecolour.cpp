@@ -3,6 +3,7 @@
 // ABN 41 687 119 230
 //
 // Author: Thomas Lowe
+#include "treelib/treeforeststream.h"
 #include "treelib/treeutils.h"
 #define STB_IMAGE_IMPLEMENTATION
 #include <raylib/raycloud.h>
@@ -62,38 +63,30 @@ int main(int argc, char *argv[])
     usage();
   }
 
-  ray::ForestStructure forest;
-  if (!forest.load(forest_file.name()))
+  // the trees are streamed one at a time, so that large forests need not fit in memory
+  tree::ForestReader reader;
+  if (!reader.open(forest_file.name()))
   {
     usage();
   }
+  ray::TreeStructure tree;
+  if (!reader.readTree(tree))
+  {
+    std::cerr << "Error: no trees found in " << forest_file.name() << std::endl;
+    usage();
+  }
 
-  auto &input_attributes =
-    tree_attribute_format ? forest.trees[0].treeAttributeNames() : forest.trees[0].attributeNames();
-  auto &att = forest.trees[0].attributeNames();
+  auto &input_attributes = tree_attribute_format ? reader.treeAttributeNames() : reader.attributeNames();
+  auto &att = reader.attributeNames();
   int red_id = static_cast<int>(att.size());
   const auto &it = std::find(att.begin(), att.end(), "red");
-  if (it != att.end())
+  const bool add_colour = it == att.end();
+  if (!add_colour)
   {
     red_id = static_cast<int>(
       (it - att.begin()));  // we always assume that red is followed immediately by attributes green and blue
     std::cout << "colour attributes found, so replacing these in the output file" << std::endl;
   }
-  else  // no colour found so lets add empty values across the whole structure
-  {
-    for (auto &tree : forest.trees)
-    {
-      tree.attributeNames().push_back("red");
-      tree.attributeNames().push_back("green");
-      tree.attributeNames().push_back("blue");
-      for (auto &segment : tree.segments())
-      {
-        segment.attributes.push_back(0);
-        segment.attributes.push_back(0);
-        segment.attributes.push_back(0);
-      }
-    }
-  }
   int attribute_ids[3] = { -1, -1, -1 };
   Eigen::Vector3d colour(0, 0, 0);
   int num_attributes = 0;
@@ -156,9 +149,64 @@ int main(int argc, char *argv[])
     scalevec = scale3D.value();
   }
 
-  if (attribute_format)
+  // the image is only needed for the image colouring
+  int width = 0, height = 0, num_channels = 0;
+  unsigned char *image_data = 0;
+  float *image_dataf = 0;
+  const bool is_hdr = image_format && image_file.nameExt() == "hdr";
+  int tree_radius_id = -1;
+  const double trunk_to_tree_radius_scale = 10.0;
+  const bool trunks_only = tree.segments().size() == 1;
+  if (!attribute_format && !trunk_attribute_format && !tree_attribute_format)
+  {
+    std::cout << "reading image: " << image_file.name() << std::endl;
+    const char *image_name = image_file.name().c_str();
+    stbi_set_flip_vertically_on_load(1);
+    if (is_hdr)
+    {
+      image_dataf = stbi_loadf(image_name, &width, &height, &num_channels, 0);
+    }
+    else
+    {
+      image_data = stbi_load(image_name, &width, &height, &num_channels, 0);
+    }
+
+    for (size_t i = 0; i < att.size(); i++)
+    {
+      if (att[i] == "subtree_radius")
+      {
+        tree_radius_id = static_cast<int>(i);
+      }
+    }
+    if (tree_radius_id == -1 && trunks_only)
+    {
+      std::cout << "Warning: tree file does not contain tree radii, so they are estimated as "
+                << trunk_to_tree_radius_scale << " times the trunk radius." << std::endl;
+    }
+  }
+
+  tree::ForestWriter writer;
+  if (!writer.open(forest_file.nameStub() + "_coloured" + tree::forestFileExtension(forest_file.name()),
+                   reader.comments()))
+  {
+    usage();
+  }
+  do
   {
-    for (auto &tree : forest.trees)
+    if (add_colour)  // no colour found so lets add empty values across the whole structure
+    {
+      tree.attributeNames().push_back("red");
+      tree.attributeNames().push_back("green");
+      tree.attributeNames().push_back("blue");
+      for (auto &segment : tree.segments())
+      {
+        segment.attributes.push_back(0);
+        segment.attributes.push_back(0);
+        segment.attributes.push_back(0);
+      }
+    }
+
+    if (attribute_format)
     {
       for (auto &segment : tree.segments())
       {
@@ -173,10 +221,7 @@ int main(int argc, char *argv[])
         }
       }
     }
-  }
-  else if (trunk_attribute_format)
-  {
-    for (auto &tree : forest.trees)
+    else if (trunk_attribute_format)
     {
       Eigen::Vector3d col;
       for (int i = 0; i < 3; i++)
@@ -194,10 +239,7 @@ int main(int argc, char *argv[])
         segment.attributes[red_id + 2] = col[2];
       }
     }
-  }
-  else if (tree_attribute_format)
-  {
-    for (auto &tree : forest.trees)
+    else if (tree_attribute_format)
     {
       Eigen::Vector3d col;
       for (int i = 0; i < 3; i++)
@@ -215,44 +257,7 @@ int main(int argc, char *argv[])
         segment.attributes[red_id + 2] = col[2];
       }
     }
-  }
-  else
-  {
-    std::cout << "reading image: " << image_file.name() << std::endl;
-    std::string ext = image_file.nameExt();
-
-    const char *image_name = image_file.name().c_str();
-    stbi_set_flip_vertically_on_load(1);
-    int width, height, num_channels;
-    unsigned char *image_data = 0;
-    float *image_dataf = 0;
-    const bool is_hdr = image_file.nameExt() == "hdr";
-    if (is_hdr)
-    {
-      image_dataf = stbi_loadf(image_name, &width, &height, &num_channels, 0);
-    }
     else
-    {
-      image_data = stbi_load(image_name, &width, &height, &num_channels, 0);
-    }
-
-    int tree_radius_id = -1;
-    for (size_t i = 0; i < forest.trees[0].attributeNames().size(); i++)
-    {
-      if (forest.trees[0].attributeNames()[i] == "subtree_radius")
-      {
-        tree_radius_id = static_cast<int>(i);
-      }
-    }
-    const double trunk_to_tree_radius_scale = 10.0;
-    const bool trunks_only = forest.trees[0].segments().size() == 1;
-    if (tree_radius_id == -1 && trunks_only)
-    {
-      std::cout << "Warning: tree file does not contain tree radii, so they are estimated as "
-                << trunk_to_tree_radius_scale << " times the trunk radius." << std::endl;
-    }
-
-    for (auto &tree : forest.trees)
     {
       const Eigen::Vector2d centre(tree.root()[0], tree.root()[1]);
       double rad = tree_radius_id == -1 ? tree.segments()[0].radius * trunk_to_tree_radius_scale :
@@ -322,7 +327,16 @@ int main(int argc, char *argv[])
         segment.attributes[red_id + 2] = colour[2] * scalevec[2];
       }
     }
+    writer.writeTree(tree);
+  } while (reader.readTree(tree));
+  if (reader.failed())
+  {
+    writer.discard();
+    return 1;
+  }
+  if (!writer.close())
+  {
+    return 1;
   }
-  forest.save(forest_file.nameStub() + "_coloured.txt");
   return 0;
 }
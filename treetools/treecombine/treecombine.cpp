@@ -3,6 +3,7 @@
 // ABN 41 687 119 230
 //
 // Author: Thomas Lowe
+#include "treelib/treeforestfile.h"
 #include "treelib/treeutils.h"
 #define STB_IMAGE_IMPLEMENTATION
 #include <raylib/raycloud.h>
@@ -46,7 +47,7 @@ int main(int argc, char *argv[])
   for (size_t i = 0; i < tree_files.files().size(); i++)
   {
     ray::ForestStructure forest;
-    if (!forest.load(tree_files.files()[i].name()))
+    if (!tree::loadForest(tree_files.files()[i].name(), forest))
     {
       std::cout << "file " << tree_files.files()[i].name() << " doesn't load, so skipping it" << std::endl;
       continue;
@@ -166,6 +167,6 @@ int main(int argc, char *argv[])
     std::cerr << "Error: no forest files could be loaded" << std::endl;
     usage();
   }
-  combined_forest.save(tree_files.files()[0].nameStub() + "_combined.txt");
+  tree::saveForest(tree_files.files()[0].nameStub() + "_combined" + tree::forestFileExtension(tree_files.files()[0].name()), combined_forest);
   return 0;
 }
@@ -0,0 +1,44 @@
+// Copyright (c) 2022
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#include <raylib/rayforeststructure.h>
+#include <raylib/rayparse.h>
+#include <cstdlib>
+#include <iostream>
+#include "treelib/treeforestfile.h"
+
+void usage(int exit_code = 1)
+{
+  // clang-format off
+  std::cout << "Convert a tree file between the text and binary (.treeb) formats" << std::endl;
+  std::cout << "usage:" << std::endl;
+  std::cout << "treeconvert forest.txt forest.treeb - convert text tree file to binary" << std::endl;
+  std::cout << "treeconvert forest.treeb forest.txt - convert binary tree file to text" << std::endl;
+  // clang-format on
+  exit(exit_code);
+}
+
+/// This method converts a tree file from one format to another, according to the file extensions.
+/// The binary format is much faster to load and save, so is preferable for large forests and pipelines of tools.
+int main(int argc, char *argv[])
+{
+  ray::FileArgument input_file, output_file;
+  if (!ray::parseCommandLine(argc, argv, { &input_file, &output_file }))
+  {
+    usage();
+  }
+
+  ray::ForestStructure forest;
+  if (!tree::loadForest(input_file.name(), forest))
+  {
+    usage();
+  }
+  if (!tree::saveForest(output_file.name(), forest))
+  {
+    std::cerr << "Error: failed to save " << output_file.name() << std::endl;
+    return 1;
+  }
+  return 0;
+}
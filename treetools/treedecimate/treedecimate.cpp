@@ -11,6 +11,8 @@
 #include <cstdlib>
 #include <iostream>
 #include "raylib/raytreegen.h"
+#include "treelib/treeforeststream.h"
+#include "treelib/treetopology.h"
 #include "treelib/treeutils.h"
 
 void usage(int exit_code = 1)
@@ -39,28 +41,30 @@ int main(int argc, char *argv[])
     usage();
   }
 
-  ray::ForestStructure forest;
-  if (!forest.load(forest_file.name()))
+  // the trees are decimated independently, so stream them one at a time to bound the memory use
+  tree::ForestReader reader;
+  if (!reader.open(forest_file.name()))
   {
     usage();
   }
-  if (forest.trees.size() != 0 && forest.trees[0].segments().size() == 0)
+  tree::ForestWriter writer;
+  if (!writer.open(forest_file.nameStub() + "_decimated" + tree::forestFileExtension(forest_file.name()),
+                   reader.comments()))
   {
-    std::cout << "decimate only works on tree structures, not trunks-only files" << std::endl;
     usage();
   }
-  ray::ForestStructure new_forest = forest;
 
-  for (size_t t = 0; t < forest.trees.size(); t++)
+  ray::TreeStructure tree;
+  while (reader.readTree(tree))
   {
-    auto &tree = forest.trees[t];
-    // temporarily get the children list, it helps
-    std::vector<std::vector<int>> children(tree.segments().size());
-    for (size_t i = 1; i < tree.segments().size(); i++)
+    if (tree.segments().size() == 0)
     {
-      children[tree.segments()[i].parent_id].push_back(static_cast<int>(i));
+      std::cout << "decimate only works on tree structures, not trunks-only files" << std::endl;
+      writer.discard();
+      usage();
     }
-    auto &new_tree = new_forest.trees[t];
+    const tree::TreeTopology topology(tree);
+    ray::TreeStructure new_tree = tree;
 
     if (decimate_segments)
     {
@@ -73,7 +77,7 @@ int main(int argc, char *argv[])
       for (size_t i = 1; i < tree.segments().size(); i++)
       {
         counts[i] = counts[tree.segments()[i].parent_id] + 1;
-        if (counts[i] == decimation.value() || children[i].size() > 1 || children[i].size() == 0)
+        if (counts[i] == decimation.value() || topology.children(i).size() > 1 || topology.children(i).size() == 0)
         {
           new_index[i] = static_cast<int>(new_tree.segments().size());
           new_tree.segments().push_back(tree.segments()[i]);
@@ -93,16 +97,25 @@ int main(int argc, char *argv[])
         auto &segment = new_tree.segments()[i];
         double length = (segment.tip - new_tree.segments()[segment.parent_id].tip).norm();
         double width = 2.0 * segment.radius;
-        if (children[i].size() == 1 && length < ratio.value() * width) 
+        if (topology.children(i).size() == 1 && length < ratio.value() * width) 
         {
           // we have to remove this segment...
-          new_tree.segments()[children[i][0]].parent_id = segment.parent_id;
+          new_tree.segments()[topology.children(i)[0]].parent_id = segment.parent_id;
           segment.parent_id = -1; // mark as unused, for later reindexing
         }
       }
       new_tree.reindex();
     }
+    writer.writeTree(new_tree);
+  }
+  if (reader.failed())
+  {
+    writer.discard();
+    return 1;
+  }
+  if (!writer.close())
+  {
+    return 1;
   }
-  new_forest.save(forest_file.nameStub() + "_decimated.txt");
   return 0;
 }
@@ -8,7 +8,11 @@
 #include <raylib/rayparse.h>
 #include <raylib/raytreegen.h>
 #include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <sstream>
+#include "treelib/treebvh.h"
+#include "treelib/treeforestfile.h"
 #include "treelib/treeutils.h"
 
 void usage(int exit_code = 1)
@@ -19,33 +23,345 @@ void usage(int exit_code = 1)
   std::cout << "treediff forest1.txt forest2.txt - difference information from forest1 to forest2" << std::endl;
   std::cout << "                            --include_growth - estimates radius growth of tree (slower)" << std::endl;
   std::cout << "                              --surface_area - estimates error between surfaces- Root Mean Square per surface patch" << std::endl;
+  std::cout << "                          --optimal_matching - match trunks to minimise the total trunk offset, rather than greedily in file order" << std::endl;
+  std::cout << "                          --pairs_csv pairs.csv - output the growth scale, overlap and volume change of each matched pair of trees" << std::endl;
   // clang-format on   
   exit(exit_code);
 }
 
-/// @brief returns an approximation of the overlapping volume between two tree structures @c tree1 and @c tree2
+/// the comparison of one matched pair of trees
+struct PairDifference
+{
+  double scale = 1.0;  // radius growth scale from the first tree to the second
+  double overlap = 0.0;
+  double overlap_weight = 0.0;
+  double overlap_percent = 0.0;
+  double added_volume = 0.0;
+  double removed_volume = 0.0;
+  double tree2_volume = 0.0;
+  bool scale_not_found = false;
+};
+
+/// @brief the cylinders of the branch segments of @c tree, so cylinder i is segment i+1
+std::vector<tree::Cylinder> segmentCylinders(const ray::TreeStructure &tree)
+{
+  std::vector<tree::Cylinder> cylinders;
+  cylinders.reserve(tree.segments().size());
+  for (size_t i = 1; i < tree.segments().size(); i++)
+  {
+    auto &branch = tree.segments()[i];
+    cylinders.push_back(tree::Cylinder(branch.tip, tree.segments()[branch.parent_id].tip, branch.radius));
+  }
+  return cylinders;
+}
+
+/// @brief finds the pairs of cylinders that can overlap, using a bounding volume hierarchy over each tree
+/// @param max_rad_scale the largest dilation of cylinders1 that the pairs will be used for
+/// @return pairs of indices into @c cylinders1 and @c cylinders2, in increasing order
+std::vector<std::pair<int, int>> overlapCandidates(const std::vector<tree::Cylinder> &cylinders1,
+                                                   const std::vector<tree::Cylinder> &cylinders2, double max_rad_scale)
+{
+  const tree::CylinderBVH bvh1(cylinders1, max_rad_scale);
+  const tree::CylinderBVH bvh2(cylinders2);
+  std::vector<std::pair<int, int>> pairs;
+  bvh1.findOverlappingPairs(bvh2, pairs);
+  // degenerate cylinders in the second tree do not contribute
+  const double eps = 1e-7;
+  pairs.erase(std::remove_if(pairs.begin(), pairs.end(),
+                             [&](const std::pair<int, int> &pair) {
+                               const tree::Cylinder &cyl2 = cylinders2[pair.second];
+                               return (cyl2.v2 - cyl2.v1).squaredNorm() < eps;
+                             }),
+              pairs.end());
+  return pairs;
+}
+
+/// @brief returns an approximation of the overlapping volume between two trees' cylinders
+/// @param candidates the pairs of cylinders that can overlap, from overlapCandidates
 /// @param tree1_rad_scale the dilation of tree1
 /// @return overlapping volume
-double treeOverlapVolume(const ray::TreeStructure &tree1, const ray::TreeStructure &tree2, double tree1_rad_scale)
+double treeOverlapVolume(const std::vector<tree::Cylinder> &cylinders1, const std::vector<tree::Cylinder> &cylinders2,
+                         const std::vector<std::pair<int, int>> &candidates, double tree1_rad_scale)
 {
   double volume = 0.0;
-  const double eps = 1e-7;
-  for (size_t i = 1; i < tree1.segments().size(); i++)
+  for (const auto &pair : candidates)
+  {
+    const tree::Cylinder &cyl = cylinders1[pair.first];
+    const tree::Cylinder cyl1(cyl.v1, cyl.v2, tree1_rad_scale * cyl.radius);
+    volume += tree::approximateIntersectionVolume(cyl1, cylinders2[pair.second]);
+  }
+  return volume;
+}
+
+/// @brief the horizontal distance between the trunks of @c tree1 and @c tree2, relative to their combined radius.
+/// The trunks overlap when this is less than 1
+double trunkOverlap(const ray::TreeStructure &tree1, const ray::TreeStructure &tree2)
+{
+  const double total_radius = tree1.segments()[0].radius + tree2.segments()[0].radius;
+  Eigen::Vector3d dif = tree1.segments()[0].tip - tree2.segments()[0].tip;
+  dif[2] = 0.0;
+  return dif.norm() / total_radius;
+}
+
+/// @brief finds the pairs of trunks (i in trees1, j in trees2) that overlap, using a uniform 2D grid over the trunks
+/// of @c trees2, so that each tree only tests the trunks within reach of its radius
+/// @return for each tree in trees1, its overlapping tree ids in trees2 in increasing order, as offsets into candidates
+void overlappingTrunks(const std::vector<ray::TreeStructure> &trees1, const std::vector<ray::TreeStructure> &trees2,
+                       std::vector<int> &offsets, std::vector<int> &candidates)
+{
+  double max_radius2 = 0.0;
+  for (auto &tree : trees2)
+  {
+    max_radius2 = std::max(max_radius2, tree.segments()[0].radius);
+  }
+  const double cell_width = std::max(2.0 * max_radius2, 1e-3);
+  // the grid is stored sparsely as sorted (cell key, tree id) pairs, so large empty regions cost nothing
+  auto cell_index = [cell_width](double x) { return static_cast<int64_t>(std::floor(x / cell_width)); };
+  auto cell_key = [](int64_t x, int64_t y) {
+    return (static_cast<uint64_t>(x) << 32) ^ static_cast<uint64_t>(static_cast<uint32_t>(y));
+  };
+  std::vector<std::pair<uint64_t, int>> cells(trees2.size());
+  for (size_t j = 0; j < trees2.size(); j++)
+  {
+    const Eigen::Vector3d &pos = trees2[j].segments()[0].tip;
+    cells[j] = std::make_pair(cell_key(cell_index(pos[0]), cell_index(pos[1])), static_cast<int>(j));
+  }
+  std::sort(cells.begin(), cells.end());
+
+  offsets.assign(1, 0);
+  candidates.clear();
+  for (size_t i = 0; i < trees1.size(); i++)
   {
-    auto &branch = tree1.segments()[i];
-    const Eigen::Vector3d base = tree1.segments()[branch.parent_id].tip;
-    const tree::Cylinder cyl1(branch.tip, base, tree1_rad_scale * branch.radius);
-    for (size_t j = 1; j < tree2.segments().size(); j++)
+    const Eigen::Vector3d &pos = trees1[i].segments()[0].tip;
+    // the furthest that an overlapping trunk centre can be
+    const double reach = trees1[i].segments()[0].radius + max_radius2;
+    const size_t start = candidates.size();
+    const int64_t minx = cell_index(pos[0] - reach), maxx = cell_index(pos[0] + reach);
+    const int64_t miny = cell_index(pos[1] - reach), maxy = cell_index(pos[1] + reach);
+    if (static_cast<double>(maxx - minx + 1) * static_cast<double>(maxy - miny + 1) > static_cast<double>(cells.size()))
+    {
+      // an unusually large trunk, so it is quicker to test every tree
+      for (int j = 0; j < static_cast<int>(trees2.size()); j++)
+      {
+        if (trunkOverlap(trees1[i], trees2[j]) < 1.0)
+        {
+          candidates.push_back(j);
+        }
+      }
+    }
+    else
     {
-      auto &other = tree2.segments()[j];
-      const Eigen::Vector3d base2 = tree2.segments()[other.parent_id].tip;
-      const tree::Cylinder cyl2(other.tip, base2, other.radius);
-      if ((cyl2.v2 - cyl2.v1).squaredNorm() < eps)
-        continue;
-      volume += tree::approximateIntersectionVolume(cyl1, cyl2);
+      for (int64_t x = minx; x <= maxx; x++)
+      {
+        for (int64_t y = miny; y <= maxy; y++)
+        {
+          const uint64_t key = cell_key(x, y);
+          auto it = std::lower_bound(cells.begin(), cells.end(), std::make_pair(key, -1));
+          for (; it != cells.end() && it->first == key; ++it)
+          {
+            if (trunkOverlap(trees1[i], trees2[it->second]) < 1.0)
+            {
+              candidates.push_back(it->second);
+            }
+          }
+        }
+      }
     }
+    std::sort(candidates.begin() + start, candidates.end());
+    offsets.push_back(static_cast<int>(candidates.size()));
   }
-  return volume;
+}
+
+/// @brief minimum cost assignment of each row to a different column, for a dense row-major @c costs matrix with
+/// @c num_rows <= @c num_cols, using the Hungarian algorithm in O(num_rows^2 num_cols)
+/// @return the column assigned to each row
+std::vector<int> minimumCostAssignment(const std::vector<double> &costs, int num_rows, int num_cols)
+{
+  // row potentials u, column potentials v and the row assigned to each column p, all 1-indexed with 0 as a sentinel
+  const double inf = std::numeric_limits<double>::max();
+  std::vector<double> u(num_rows + 1, 0.0), v(num_cols + 1, 0.0);
+  std::vector<int> p(num_cols + 1, 0), way(num_cols + 1, 0);
+  std::vector<double> minv(num_cols + 1);
+  std::vector<bool> used(num_cols + 1);
+  for (int i = 1; i <= num_rows; i++)
+  {
+    p[0] = i;
+    int j0 = 0;
+    std::fill(minv.begin(), minv.end(), inf);
+    std::fill(used.begin(), used.end(), false);
+    do
+    {
+      used[j0] = true;
+      const int i0 = p[j0];
+      double delta = inf;
+      int j1 = 0;
+      for (int j = 1; j <= num_cols; j++)
+      {
+        if (!used[j])
+        {
+          const double cur = costs[static_cast<size_t>(i0 - 1) * num_cols + (j - 1)] - u[i0] - v[j];
+          if (cur < minv[j])
+          {
+            minv[j] = cur;
+            way[j] = j0;
+          }
+          if (minv[j] < delta)
+          {
+            delta = minv[j];
+            j1 = j;
+          }
+        }
+      }
+      for (int j = 0; j <= num_cols; j++)
+      {
+        if (used[j])
+        {
+          u[p[j]] += delta;
+          v[j] -= delta;
+        }
+        else
+        {
+          minv[j] -= delta;
+        }
+      }
+      j0 = j1;
+    } while (p[j0] != 0);
+    // follow the augmenting path back, to update the assignment
+    do
+    {
+      const int j1 = way[j0];
+      p[j0] = p[j1];
+      j0 = j1;
+    } while (j0 != 0);
+  }
+  std::vector<int> assignment(num_rows, -1);
+  for (int j = 1; j <= num_cols; j++)
+  {
+    if (p[j] != 0)
+    {
+      assignment[p[j] - 1] = j - 1;
+    }
+  }
+  return assignment;
+}
+
+/// @brief match each tree in @c trees1 to an overlapping tree in @c trees2, with each tree matched at most once.
+/// By default each tree in turn takes its closest unmatched trunk. With @c optimal the matching minimises the total
+/// trunkOverlap, where an unmatched tree costs 1. This is solved exactly within each connected group of overlapping
+/// trunks, as these groups are small in practice.
+/// @return the matching tree id in trees2 for each tree in trees1, or -1 if unmatched
+std::vector<int> matchTrunks(const std::vector<ray::TreeStructure> &trees1,
+                             const std::vector<ray::TreeStructure> &trees2, bool optimal)
+{
+  std::vector<int> offsets, candidates;
+  overlappingTrunks(trees1, trees2, offsets, candidates);
+  std::vector<int> trunk_matches(trees1.size(), -1);
+  if (!optimal)
+  {
+    std::vector<bool> used(trees2.size(), false);
+    for (size_t i = 0; i < trees1.size(); i++)
+    {
+      double min_overlap = std::numeric_limits<double>::max();
+      for (int c = offsets[i]; c < offsets[i + 1]; c++)
+      {
+        const int j = candidates[c];
+        if (used[j])
+        {
+          continue;  // don't look at matches we have already made
+        }
+        const double overlap = trunkOverlap(trees1[i], trees2[j]);
+        if (overlap < min_overlap)
+        {
+          min_overlap = overlap;
+          trunk_matches[i] = j;
+        }
+      }
+      if (trunk_matches[i] != -1)
+      {
+        used[trunk_matches[i]] = true;
+      }
+    }
+    return trunk_matches;
+  }
+
+  // group the trees into connected components of overlapping trunks. Ids of trees2 are offset by the size of trees1
+  const int num1 = static_cast<int>(trees1.size());
+  const int num2 = static_cast<int>(trees2.size());
+  std::vector<int> parents(num1 + num2);
+  for (int i = 0; i < num1 + num2; i++)
+  {
+    parents[i] = i;
+  }
+  auto find_root = [&parents](int id) {
+    while (parents[id] != id)
+    {
+      parents[id] = parents[parents[id]];
+      id = parents[id];
+    }
+    return id;
+  };
+  for (int i = 0; i < num1; i++)
+  {
+    for (int c = offsets[i]; c < offsets[i + 1]; c++)
+    {
+      parents[find_root(i)] = find_root(num1 + candidates[c]);
+    }
+  }
+  std::vector<std::vector<int>> rows(num1 + num2), cols(num1 + num2);
+  for (int i = 0; i < num1; i++)
+  {
+    if (offsets[i + 1] > offsets[i])
+    {
+      rows[find_root(i)].push_back(i);
+    }
+  }
+  for (int j = 0; j < num2; j++)
+  {
+    cols[find_root(num1 + j)].push_back(j);
+  }
+
+  // solve each component separately. The extra columns allow each row to stay unmatched, at a cost of 1
+  const double unmatched_cost = 1.0;
+  const double disallowed_cost = 2.0;
+  std::vector<int> column_index(num2, -1);
+  for (size_t comp = 0; comp < rows.size(); comp++)
+  {
+    const int num_rows = static_cast<int>(rows[comp].size());
+    if (num_rows == 0)
+    {
+      continue;
+    }
+    const int num_real = static_cast<int>(cols[comp].size());
+    const int num_cols = num_real + num_rows;
+    for (int c = 0; c < num_real; c++)
+    {
+      column_index[cols[comp][c]] = c;
+    }
+    std::vector<double> costs(static_cast<size_t>(num_rows) * num_cols, disallowed_cost);
+    for (int r = 0; r < num_rows; r++)
+    {
+      const int i = rows[comp][r];
+      for (int c = offsets[i]; c < offsets[i + 1]; c++)
+      {
+        const int j = candidates[c];
+        costs[static_cast<size_t>(r) * num_cols + column_index[j]] = trunkOverlap(trees1[i], trees2[j]);
+      }
+      for (int c = num_real; c < num_cols; c++)
+      {
+        costs[static_cast<size_t>(r) * num_cols + c] = unmatched_cost;
+      }
+    }
+    const std::vector<int> assignment = minimumCostAssignment(costs, num_rows, num_cols);
+    for (int r = 0; r < num_rows; r++)
+    {
+      const int c = assignment[r];
+      if (c >= 0 && c < num_real && costs[static_cast<size_t>(r) * num_cols + c] < unmatched_cost)
+      {
+        trunk_matches[rows[comp][r]] = cols[comp][c];
+      }
+    }
+  }
+  return trunk_matches;
 }
 
 double getMinDistanceSqr(const Eigen::Vector3d &start1, const Eigen::Vector3d &end1, const Eigen::Vector3d &start2, const Eigen::Vector3d &end2)
@@ -155,55 +471,48 @@ int main(int argc, char *argv[])
   ray::FileArgument forest_file1, forest_file2;
   ray::OptionalFlagArgument include_growth("include_growth", 'i');
   ray::OptionalFlagArgument surface_area("surface_area", 's');
-  const bool parsed = ray::parseCommandLine(argc, argv, { &forest_file1, &forest_file2 }, { &include_growth, &surface_area });
+  ray::OptionalFlagArgument optimal_matching("optimal_matching", 'o');
+  ray::FileArgument pairs_file;
+  ray::OptionalKeyValueArgument pairs_option("pairs_csv", 'p', &pairs_file);
+  const bool parsed = ray::parseCommandLine(argc, argv, { &forest_file1, &forest_file2 }, { &include_growth, &surface_area, &optimal_matching, &pairs_option });
   if (!parsed)
   {
     usage();
   }
 
   ray::ForestStructure forest1, forest2;
-  if (!forest1.load(forest_file1.name()) || !forest2.load(forest_file2.name()))
+  if (!tree::loadForest(forest_file1.name(), forest1) || !tree::loadForest(forest_file2.name(), forest2))
   {
     usage();
   }
+  // open the pairs file before comparing the trees, so a bad path is reported without waiting for the comparison
+  std::ofstream pairs_ofs;
+  if (pairs_option.isSet())
+  {
+    pairs_ofs.open(pairs_file.name());
+    if (!pairs_ofs.is_open())
+    {
+      std::cerr << "Error: cannot open " << pairs_file.name() << " for writing" << std::endl;
+      usage();
+    }
+  }
   std::vector<ray::TreeStructure> &trees1 = forest1.trees;
   std::vector<ray::TreeStructure> &trees2 = forest2.trees;
 
   // first, find the amount of overlap in the tree trunks based on radius. This is the same code for trunks only and
   // full tree text files
-  std::vector<int> trunk_matches(trees1.size(), -1);
+  const std::vector<int> trunk_matches = matchTrunks(trees1, trees2, optimal_matching.isSet());
   int num_matches = 0;
   double mean_overlap = 0;
   double mean_radius1 = 0, mean_radius2 = 0.0;
   for (size_t i = 0; i < trees1.size(); i++)
   {
-    auto &tree1 = trees1[i];
-    double min_overlap = std::numeric_limits<double>::max();
-    double min_overlap_rad = 0;
-    for (size_t j = 0; j < trees2.size(); j++)
-    {
-      if (std::find(trunk_matches.begin(), trunk_matches.end(), j) != trunk_matches.end())
-      {
-        continue;  // don't look at matches we have already made
-      }
-      auto &tree2 = trees2[j];
-      double total_radius = tree1.segments()[0].radius + tree2.segments()[0].radius;
-      Eigen::Vector3d dif = tree1.segments()[0].tip - tree2.segments()[0].tip;
-      dif[2] = 0.0;
-      const double overlap = dif.norm() / total_radius;
-      if (overlap < min_overlap && overlap < 1.0)
-      {
-        min_overlap = overlap;
-        trunk_matches[i] = static_cast<int>(j);
-        min_overlap_rad = tree2.segments()[0].radius;
-      }
-    }
     if (trunk_matches[i] != -1)
     {
       num_matches++;
-      mean_overlap += min_overlap;
-      mean_radius1 += tree1.segments()[0].radius;
-      mean_radius2 += min_overlap_rad;
+      mean_overlap += trunkOverlap(trees1[i], trees2[trunk_matches[i]]);
+      mean_radius1 += trees1[i].segments()[0].radius;
+      mean_radius2 += trees2[trunk_matches[i]].segments()[0].radius;
     }
   }
   if (num_matches == 0)
@@ -231,20 +540,11 @@ int main(int argc, char *argv[])
   }
 
 
-  double mean_growth = 0;
-  double max_growth = 0.0;
-  double min_growth = std::numeric_limits<double>::max();
-  double total_overlap = 0;
-  double total_overlap_weight = 0;
-  double total_volume = 0;
-  double mean_added_volume = 0;
-  double mean_removed_volume = 0;
-  double max_removed_volume = 0;
-  int max_removal_i = -1;
-  double max_added_volume = 0;
-  int max_add_i = -1;
-  
-  for (size_t i = 0; i < trees1.size(); i++)
+  // each matched pair is evaluated independently in parallel, then the statistics are accumulated in tree order
+  // so that the results do not depend on the number of threads
+  std::vector<PairDifference> differences(trees1.size());
+  #pragma omp parallel for schedule(dynamic)
+  for (int i = 0; i < static_cast<int>(trees1.size()); i++)
   {
     if (trunk_matches[i] == -1)
     {
@@ -252,6 +552,7 @@ int main(int argc, char *argv[])
     }
     auto &tree1 = trees1[i];
     auto &tree2 = trees2[trunk_matches[i]];
+    PairDifference &difference = differences[i];
     const double tree1_volume = tree1.volume();
     const double tree2_volume = tree2.volume();
 
@@ -262,10 +563,15 @@ int main(int argc, char *argv[])
     double max_overlap = 0.0;
     double max_overlap_percent = 0.0;
     double max_overlap_weight = 0.0;
+    double scale_range = 0.5;  // actually the half-range
+    const double divisions = 5.0;
+    // the growth search below never exceeds this scale, so the candidate overlapping pairs are found once for it
+    const double max_rad_scale = include_growth.isSet() ? scale_mid + scale_range * divisions / (divisions - 1.0) : 1.0;
+    const std::vector<tree::Cylinder> cylinders1 = segmentCylinders(tree1);
+    const std::vector<tree::Cylinder> cylinders2 = segmentCylinders(tree2);
+    const std::vector<std::pair<int, int>> candidates = overlapCandidates(cylinders1, cylinders2, max_rad_scale);
     if (include_growth.isSet())
     {
-      double scale_range = 0.5;  // actually the half-range
-      const double divisions = 5.0;
       while (scale_range > 0.02)
       {
         max_overlap_percent = 0.0;
@@ -274,7 +580,7 @@ int main(int argc, char *argv[])
         for (double rad_scale = scale_mid - scale_range; rad_scale <= scale_mid + scale_range;
              rad_scale += scale_range / divisions)
         {
-          const double overlap = treeOverlapVolume(tree1, tree2, rad_scale);
+          const double overlap = treeOverlapVolume(cylinders1, cylinders2, candidates, rad_scale);
           const double overlap_weight = (rad_scale * rad_scale * tree1_volume + tree2_volume - overlap);
           const double overlap_percent = overlap / overlap_weight;
           if (overlap_percent > max_overlap_percent)
@@ -287,41 +593,91 @@ int main(int argc, char *argv[])
         }
         if (max_overlap_scale == 0.0)
         {
-          std::cout << "error: trunks overlap but no overlap scale found. This shouldn't happen" << std::endl;
+          difference.scale_not_found = true;
         }
         scale_mid = max_overlap_scale;
         scale_range /= divisions;
       }
-      mean_growth += scale_mid;
-      max_growth = std::max(max_growth, scale_mid);
-      min_growth = std::min(min_growth, scale_mid);
     }
     else
     {
-      max_overlap = treeOverlapVolume(tree1, tree2, scale_mid);
+      max_overlap = treeOverlapVolume(cylinders1, cylinders2, candidates, scale_mid);
       max_overlap_weight = (tree1_volume + tree2_volume - max_overlap);
       max_overlap_percent = max_overlap / max_overlap_weight;
     }
 
-    total_overlap += max_overlap;
-    total_overlap_weight += max_overlap_weight;
-
     // now we have a scale match, we need to look for change in volume:
-    double removed_volume = std::max(0.0, scale_mid * scale_mid * tree1_volume - max_overlap);
-    double added_volume = std::max(0.0, tree2_volume - max_overlap);
-    total_volume += tree2_volume;
-    mean_added_volume += added_volume;
-    mean_removed_volume += removed_volume;
-    if (removed_volume > max_removed_volume)
+    difference.scale = scale_mid;
+    difference.overlap = max_overlap;
+    difference.overlap_weight = max_overlap_weight;
+    difference.overlap_percent = max_overlap_percent;
+    difference.removed_volume = std::max(0.0, scale_mid * scale_mid * tree1_volume - max_overlap);
+    difference.added_volume = std::max(0.0, tree2_volume - max_overlap);
+    difference.tree2_volume = tree2_volume;
+  }
+
+  double mean_growth = 0;
+  double max_growth = 0.0;
+  double min_growth = std::numeric_limits<double>::max();
+  double total_overlap = 0;
+  double total_overlap_weight = 0;
+  double total_volume = 0;
+  double mean_added_volume = 0;
+  double mean_removed_volume = 0;
+  double max_removed_volume = 0;
+  int max_removal_i = -1;
+  double max_added_volume = 0;
+  int max_add_i = -1;
+  std::ostringstream pairs_csv;
+  pairs_csv << "tree_id1,tree_id2,growth_scale,overlap_percent,added_volume,removed_volume" << std::endl;
+  for (size_t i = 0; i < trees1.size(); i++)
+  {
+    if (trunk_matches[i] == -1)
     {
-      max_removed_volume = removed_volume;
+      continue;
+    }
+    const PairDifference &difference = differences[i];
+    if (include_growth.isSet())
+    {
+      if (difference.scale_not_found)
+      {
+        std::cout << "error: trunks overlap but no overlap scale found. This shouldn't happen" << std::endl;
+      }
+      mean_growth += difference.scale;
+      max_growth = std::max(max_growth, difference.scale);
+      min_growth = std::min(min_growth, difference.scale);
+    }
+
+    total_overlap += difference.overlap;
+    total_overlap_weight += difference.overlap_weight;
+    total_volume += difference.tree2_volume;
+    mean_added_volume += difference.added_volume;
+    mean_removed_volume += difference.removed_volume;
+    if (difference.removed_volume > max_removed_volume)
+    {
+      max_removed_volume = difference.removed_volume;
       max_removal_i = static_cast<int>(i);
     }
-    if (added_volume > max_added_volume)
+    if (difference.added_volume > max_added_volume)
     {
-      max_added_volume = added_volume;
+      max_added_volume = difference.added_volume;
       max_add_i = static_cast<int>(i);
     }
+    if (pairs_option.isSet())
+    {
+      pairs_csv << i << "," << trunk_matches[i] << "," << difference.scale << ","
+                << 100.0 * difference.overlap_percent << "," << difference.added_volume << ","
+                << difference.removed_volume << "\n";
+    }
+  }
+  if (pairs_option.isSet())
+  {
+    pairs_ofs << pairs_csv.str();
+    if (!pairs_ofs.good())
+    {
+      std::cerr << "Error: failed writing " << pairs_file.name() << std::endl;
+      return 1;
+    }
   }
 
   mean_growth /= static_cast<double>(num_matches);
@@ -12,6 +12,8 @@
 #include <cstdlib>
 #include <iostream>
 #include "raylib/raytreegen.h"
+#include "treelib/treeforestfile.h"
+#include "treelib/treetopology.h"
 #include "treelib/treeutils.h"
 
 void usage(int exit_code = 1)
@@ -38,7 +40,7 @@ int main(int argc, char *argv[])
   }
 
   ray::ForestStructure forest;
-  if (!forest.load(forest_file.name()))
+  if (!tree::loadForest(forest_file.name(), forest))
   {
     usage();
   }
@@ -114,30 +116,21 @@ int main(int argc, char *argv[])
     }
     tree.segments()[0].attributes.push_back(0);
     // next we average the per-segment foliage densities over each whole subtree:
-    std::vector<std::vector<int>> children(tree.segments().size());
+    const tree::TreeTopology topology(tree);
+    std::vector<double> densities(tree.segments().size());
+    std::vector<double> nums(tree.segments().size(), 1.0);
     for (size_t i = 0; i < tree.segments().size(); i++)
     {
-      if (tree.segments()[i].parent_id != -1)
-      {
-        children[tree.segments()[i].parent_id].push_back(static_cast<int>(i));
-      }
+      densities[i] = tree.segments()[i].attributes.back();
     }
-    std::vector<double> densities(tree.segments().size());
+    topology.reduceSubtrees(densities, tree::SubtreeReduction::Sum);
+    topology.reduceSubtrees(nums, tree::SubtreeReduction::Sum);
+    nums[0] -= 1.0;  // the root segment is not counted in its average
     for (size_t i = 0; i < tree.segments().size(); i++)
     {
-      densities[i] = tree.segments()[i].attributes.back();
-      double num = i == 0 ? 0.0 : 1.0;
-      std::vector<int> segments = children[i];
-      for (size_t b = 0; b < segments.size(); b++)
-      {
-        int seg_id = segments[b];
-        densities[i] += tree.segments()[seg_id].attributes.back();
-        num++;
-        segments.insert(segments.end(), children[seg_id].begin(), children[seg_id].end());
-      }
-      if (num > 0.0)
+      if (nums[i] > 0.0)
       {
-        densities[i] /= num;
+        densities[i] /= nums[i];
       }
     }
     for (size_t i = 0; i < tree.segments().size(); i++)
@@ -147,7 +140,7 @@ int main(int argc, char *argv[])
     }
   }
 
-  forest.save(forest_file.nameStub() + "_foliage.txt");
+  tree::saveForest(forest_file.nameStub() + "_foliage" + tree::forestFileExtension(forest_file.name()), forest);
 
   ray::CloudWriter writer;
   if (!writer.begin(cloud_file.nameStub() + "_densities.ply"))
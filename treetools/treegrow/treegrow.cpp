@@ -9,9 +9,11 @@
 #include <cstdlib>
 #include <iostream>
 #include "raylib/raytreegen.h"
+#include "treelib/treeforestfile.h"
 #include "treelib/treepruner.h"
 #include "treelib/treeutils.h"
 #include "treelib/treeinformation.h"
+#include "treelib/treetopology.h"
 
 void usage(int exit_code = 1)
 {
@@ -90,7 +92,7 @@ int main(int argc, char *argv[])
   }
 
   ray::ForestStructure forest;
-  if (!forest.load(forest_file.name()))
+  if (!tree::loadForest(forest_file.name(), forest))
   {
     usage();
   }
@@ -99,22 +101,13 @@ int main(int argc, char *argv[])
     std::cout << "grow only works on tree structures, not trunks-only files" << std::endl;
     usage();
   }
-  ray::ForestStructure grown_forest;
   const double len_rate = length_rate.value();
   const double length_growth = len_rate * period.value();
   const double prune_length = prune_length_argument.value();
 
   for (auto &tree : forest.trees)
   {
-    std::vector<std::vector<int> > children(tree.segments().size());
-    for (size_t j = 0; j<tree.segments().size(); j++)
-    {
-      int par = tree.segments()[j].parent_id;
-      if (par != -1)
-      {
-        children[par].push_back((int)j);
-      }
-    }
+    const tree::TreeTopology topology(tree);
     /// Information we need, per-tree:
     // 1. taper  (get length of tree, and radius at base)
     // 2. branch angle
@@ -122,22 +115,22 @@ int main(int argc, char *argv[])
     // 4. dimension
     std::vector<double> angles, num_children, dominances, all_lengths;
     // all_lengths are from segment start to end, including prune_length
-    tree::getBranchLengths(tree, children, all_lengths, prune_length); 
+    tree::getBranchLengths(tree, topology, all_lengths, prune_length); 
     double total_dominance, total_angle, total_weight;
-    tree::getBifurcationProperties(tree, children, angles, dominances, num_children, 
+    tree::getBifurcationProperties(tree, topology, angles, dominances, num_children, 
       total_dominance, total_angle, total_weight);
     std::vector<double> branch_lengths; // just the branches, not the segments
     std::vector<int> branch_ids;
-    for (size_t j = 0; j<children.size(); j++)
+    for (size_t j = 0; j<topology.size(); j++)
     {
       auto &segs = tree.segments();
-      if (segs[j].parent_id == -1 || children[segs[j].parent_id].size() > 1) 
+      if (segs[j].parent_id == -1 || topology.children(segs[j].parent_id).size() > 1) 
       {
         bool secondary = true;
         if (segs[j].parent_id > -1)
         {
           double max_rad = 0.0;
-          for (auto &child_id: children[segs[j].parent_id])
+          for (auto &child_id: topology.children(segs[j].parent_id))
           {
             max_rad = std::max(max_rad, segs[child_id].radius);
           }
@@ -206,7 +199,7 @@ int main(int argc, char *argv[])
       {
         auto &segments = tree.segments();
         auto &segment = segments[i];
-        if (children[i].empty()) // a leaf
+        if (topology.children(i).empty()) // a leaf
         {
           // extend the branch
           Eigen::Vector3d dir = segment.tip - segments[segment.parent_id].tip;
@@ -252,7 +245,7 @@ int main(int argc, char *argv[])
           std::vector<int> child_list = {(int)i};
           for (size_t j = 0; j<child_list.size(); j++)
           {
-            auto &kids = children[child_list[j]];
+            const auto kids = topology.children(child_list[j]);
             if (kids.size() > 1)
             {
               node.total_branches += (int)kids.size();
@@ -333,7 +326,7 @@ int main(int argc, char *argv[])
         for (size_t i = 0; i<num_segs; i++)
         {
           auto &segment = tree.segments()[i];
-          if (children[i].empty()) // a leaf
+          if (topology.children(i).empty()) // a leaf
           {
             double old_radius = segment.radius - radius_growth;
             if (old_radius < 0.0)
@@ -358,25 +351,20 @@ int main(int argc, char *argv[])
       }
     }
   }
-  grown_forest = forest;
   if (period.value() <= 0.0)
   {
-    ray::ForestStructure pruned_forest;
-    tree::pruneLength(forest, -length_growth, pruned_forest);
-    if (pruned_forest.trees.empty())
-    {
-      std::cout << "Warning: no trees left after shrinking. No file saved." << std::endl;
-      return 1;
-    }
-    const double minimum_branch_diameter = 0.001;
-    tree::pruneDiameter(pruned_forest, minimum_branch_diameter, grown_forest);
-    if (pruned_forest.trees.empty())
+    // prune the shrunk length and any vanishingly thin branches in one pass, in place
+    tree::PruneCriteria criteria;
+    criteria.tip_length = -length_growth;
+    criteria.min_diameter = 0.00001;  // 0.001 cm
+    tree::prune(forest, criteria, true);
+    if (forest.trees.empty())
     {
       std::cout << "Warning: no trees left after shrinking. No file saved." << std::endl;
       return 1;
     }
   }
 
-  grown_forest.save(forest_file.nameStub() + "_grown.txt");
+  tree::saveForest(forest_file.nameStub() + "_grown" + tree::forestFileExtension(forest_file.name()), forest);
   return 0;
 }
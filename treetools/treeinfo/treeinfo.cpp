@@ -9,8 +9,10 @@
 #include <cstdlib>
 #include <iostream>
 #include "raylib/raytreestructure.h"
+#include "treelib/treeforestfile.h"
 #include "treelib/treeinformation.h"
 #include "treelib/treepruner.h"
+#include "treelib/treetopology.h"
 
 double sqr(double x)
 {
@@ -92,6 +94,18 @@ struct Metrics
   }
 };
 
+/// @brief the per-tree values that contribute to the Metrics totals. These are calculated independently per tree,
+/// then accumulated into the Metrics in tree order, so the totals are the same whatever the number of threads
+struct TreeMetrics
+{
+  double volume = 0.0, DBH = 0.0, height = 0.0, strength = 0.0, bend = 0.0, crown_radius = 0.0;
+  double dominance = 0.0, angle = 0.0, dimension = 0.0;
+  double length = 0.0;     // length from the root to the farthest leaf
+  bool branched = false;   // whether dominance and angle are valid
+  bool has_dimension = false;
+  int num_branches = 0;
+};
+
 void printAttributes(const ray::ForestStructure &forest, std::vector<std::string> &tree_att, int num_tree_attributes, 
                      std::vector<std::string> &att, int num_attributes)
 {
@@ -174,7 +188,7 @@ int main(int argc, char *argv[])
   }
 
   ray::ForestStructure forest;
-  if (!forest.load(forest_file.name()))
+  if (!tree::loadForest(forest_file.name(), forest))
   {
     usage();
   }
@@ -326,18 +340,15 @@ int main(int argc, char *argv[])
   }
   const double prune_length = crop_length.value();
 
-  int num_stat_trees = 0;  // used for dimension values
-  int num_branched_trees = 0;
-  int num_branches = 0;
-  std::vector<double> tree_lengths;
-  for (auto &tree : forest.trees)
+  // each tree is analysed independently, so we process them in parallel
+  std::vector<TreeMetrics> tree_metrics(forest.trees.size());
+  #pragma omp parallel for schedule(dynamic)
+  for (int t = 0; t < static_cast<int>(forest.trees.size()); t++)
   {
-    // get the children
-    std::vector<std::vector<int>> children(tree.segments().size());
-    for (size_t i = 1; i < tree.segments().size(); i++)
-    {
-      children[tree.segments()[i].parent_id].push_back(static_cast<int>(i));
-    }
+    auto &tree = forest.trees[t];
+    auto &result = tree_metrics[t];
+    // get the connectivity of the tree, once per tree
+    const tree::TreeTopology topology(tree);
     if (branch_data.isSet())
     {
       // 1. get branch IDs:
@@ -348,7 +359,7 @@ int main(int argc, char *argv[])
         double max_score = -1;
         int largest_child = -1;
         Eigen::Vector4i id = ids[i];
-        for (const auto &child : children[i])
+        for (const auto &child : topology.children(i))
         {
           // we pick the route which has the longer and wider branch
           double score = tree.segments()[child].radius;
@@ -358,7 +369,7 @@ int main(int argc, char *argv[])
             largest_child = child;
           }
         }
-        for (const auto &child : children[i])
+        for (const auto &child : topology.children(i))
         {
           Eigen::Vector4i data(child, id[1], id[2], id[3]+1); // seg id, branch order, branch, pos on branch
           if (child == largest_child)
@@ -392,7 +403,7 @@ int main(int argc, char *argv[])
       max_bound = ray::maxVector(max_bound, tree.segments()[i].tip);
     }
     std::vector<double> branch_lengths;
-    tree::getBranchLengths(tree, children, branch_lengths, prune_length);
+    tree::getBranchLengths(tree, topology, branch_lengths, prune_length);
     for (size_t j = 0; j<branch_lengths.size(); j++)
     {
       tree.segments()[j].attributes[length_id] = branch_lengths[j];
@@ -401,43 +412,43 @@ int main(int argc, char *argv[])
     double tree_angle = 0.0;
     double total_weight = 0.0;
     std::vector<double> branch_angles, branch_dominances, branch_children;
-    tree::getBifurcationProperties(tree, children, branch_angles, branch_dominances, branch_children, tree_dominance, tree_angle, total_weight);    
+    tree::getBifurcationProperties(tree, topology, branch_angles, branch_dominances, branch_children, tree_dominance, tree_angle, total_weight);    
     for (size_t j = 0; j<branch_lengths.size(); j++)
     {
       tree.segments()[j].attributes[angle_id] = branch_angles[j];
       tree.segments()[j].attributes[dominance_id] = branch_dominances[j];
       tree.segments()[j].attributes[children_id] = branch_children[j];
     }
-    if (children[0].size() > 0)
+    if (topology.children(0).size() > 0)
     {
-      tree.segments()[0].attributes[children_id] = static_cast<double>(children[0].size());
+      tree.segments()[0].attributes[children_id] = static_cast<double>(topology.children(0).size());
     }
-    tree::setTrunkBend(tree, children, bend_id, length_id, branch_slope_id);
-    metrics.bend.update(tree.treeAttributes()[bend_id]);
-    tree::setMonocotal(tree, children, monocotal_id);
-    tree::setDBH(tree, children, DBH_id);
-    metrics.DBH.update(tree.treeAttributes()[DBH_id]);
+    tree::setTrunkBend(tree, topology, bend_id, length_id, branch_slope_id);
+    result.bend = tree.treeAttributes()[bend_id];
+    tree::setMonocotal(tree, topology, monocotal_id);
+    tree::setDBH(tree, topology, DBH_id);
+    result.DBH = tree.treeAttributes()[DBH_id];
 
     std::vector<double> lengths;
-    for (size_t j = 0; j<children.size(); j++)
+    for (size_t j = 0; j<topology.size(); j++)
     {
       auto &seg = tree.segments()[j];
       int par = seg.parent_id;
-      if (par == -1 || children[par].size() > 1) 
+      if (par == -1 || topology.children(par).size() > 1) 
       {
         lengths.push_back(seg.attributes[length_id]); // is the length even being set on this exact segment??
       }
     }
     const int min_branch_count = 6;  // can't do any reasonable stats with fewer than this number of branches
-    num_branches += static_cast<int>(lengths.size());
+    result.num_branches = static_cast<int>(lengths.size());
     if (lengths.size() >= min_branch_count)
     {
       double c, d, r2;
       tree::calculatePowerLaw(lengths, c, d, r2);
       const double tree_dimension = std::min(-d, 3.0);
       tree.treeAttributes()[dimension_id] = tree_dimension;
-      metrics.dimension.update(tree_dimension);
-      num_stat_trees++;
+      result.dimension = tree_dimension;
+      result.has_dimension = true;
     }
 
     // update per-tree values
@@ -445,9 +456,9 @@ int main(int argc, char *argv[])
     {
       tree_dominance /= total_weight;
       tree_angle /= total_weight;
-      num_branched_trees++;
-      metrics.dominance.update(tree_dominance);
-      metrics.angle.update(tree_angle);
+      result.branched = true;
+      result.dominance = tree_dominance;
+      result.angle = tree_angle;
     }
     tree.segments()[0].attributes[dominance_id] = tree_dominance;
     tree.segments()[0].attributes[angle_id] = tree_angle;
@@ -469,39 +480,66 @@ int main(int argc, char *argv[])
     }
     // update whole-tree and tree root attributes
     tree.segments()[0].attributes[volume_id] = tree_volume;
-    metrics.volume.update(tree_volume);
+    result.volume = tree_volume;
     tree.segments()[0].attributes[diameter_id] = tree_diameter;
     double tree_height = prune_length + max_bound[2] - tree.segments()[0].tip[2];
     tree.treeAttributes()[height_id] = tree_height;
     double crown_radius = prune_length + 
       ((max_bound[0] - min_bound[0]) + (max_bound[1] - min_bound[1])) / 2.0;  // mean of the bounding box extents
-    metrics.crown_radius.update(crown_radius);
+    result.crown_radius = crown_radius;
     tree.treeAttributes()[crown_radius_id] = crown_radius;
-    metrics.height.update(tree_height);
-    tree_lengths.push_back(tree.segments()[0].attributes[length_id]);
+    result.height = tree_height;
+    result.length = tree.segments()[0].attributes[length_id];
     tree.segments()[0].attributes[strength_id] = std::pow(tree_diameter, 3.0 / 4.0) 
       / std::max(std::numeric_limits<double>::min(), tree.segments()[0].attributes[length_id]);
-    metrics.strength.update(tree.segments()[0].attributes[strength_id]);
+    result.strength = tree.segments()[0].attributes[strength_id];
 
     // alright, now we get the minimum strength from root to tip
     for (auto &segment : tree.segments())
     {
       segment.attributes[min_strength_id] = std::numeric_limits<double>::max();
     }
-    std::vector<int> inds = children[0];
-    for (size_t i = 0; i < inds.size(); i++)
+    for (auto &j : topology.preOrder())
     {
-      int j = inds[i];
       auto &seg = tree.segments()[j];
-      seg.attributes[min_strength_id] =
-        std::min(seg.attributes[strength_id], tree.segments()[seg.parent_id].attributes[min_strength_id]);
-      for (auto &child : children[j])
+      if (seg.parent_id == -1)
       {
-        inds.push_back(child);
+        continue;
       }
+      seg.attributes[min_strength_id] =
+        std::min(seg.attributes[strength_id], tree.segments()[seg.parent_id].attributes[min_strength_id]);
     }
     tree.segments()[0].attributes[min_strength_id] = tree.segments()[0].attributes[strength_id];  // no different
   }
+
+  // accumulate the per-tree results in tree order, so the output matches a serial run exactly
+  int num_stat_trees = 0;  // used for dimension values
+  int num_branched_trees = 0;
+  int num_branches = 0;
+  std::vector<double> tree_lengths;
+  tree_lengths.reserve(tree_metrics.size());
+  for (auto &result : tree_metrics)
+  {
+    metrics.bend.update(result.bend);
+    metrics.DBH.update(result.DBH);
+    num_branches += result.num_branches;
+    if (result.has_dimension)
+    {
+      metrics.dimension.update(result.dimension);
+      num_stat_trees++;
+    }
+    if (result.branched)
+    {
+      num_branched_trees++;
+      metrics.dominance.update(result.dominance);
+      metrics.angle.update(result.angle);
+    }
+    metrics.volume.update(result.volume);
+    metrics.crown_radius.update(result.crown_radius);
+    metrics.height.update(result.height);
+    tree_lengths.push_back(result.length);
+    metrics.strength.update(result.strength);
+  }
   std::cout << "Number of:" << std::endl;
   std::cout << "                  trees: " << forest.trees.size() << std::endl;
   std::cout << "                  branches: " << num_branches << std::endl;
@@ -533,6 +571,6 @@ int main(int argc, char *argv[])
 
   metrics.print(forest.trees.size(), num_branched_trees, num_stat_trees, num_total);
   std::cout << "saving per-tree and per-segment data to file" << std::endl;
-  forest.save(forest_file.nameStub() + "_info.txt");
+  tree::saveForest(forest_file.nameStub() + "_info" + tree::forestFileExtension(forest_file.name()), forest);
   return 0;
 }
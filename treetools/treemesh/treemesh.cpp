@@ -7,8 +7,17 @@
 #include <raylib/raymesh.h>
 #include <raylib/rayparse.h>
 #include <raylib/rayply.h>
+#include <algorithm>
+#include <cmath>
 #include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <limits>
+#include <sstream>
+#include "treelib/treeforestfile.h"
+#include "treelib/treetopology.h"
 #include "treelib/treeutils.h"
 
 void usage(int exit_code = 1)
@@ -24,17 +33,126 @@ void usage(int exit_code = 1)
   std::cout << "                    --uvs - generate uvs and points to a wood_texture.png which needs to be created. Works in CloudCompare, not Meshlab." << std::endl;
   std::cout << "                    --capsules  - generate branch segments as the individual capsules" << std::endl;
   std::cout << "                    --cylinders - generate branch segments as the individual cylinders" << std::endl;
+  std::cout << "                    --stream - write the mesh a tree at a time, with single precision vertices, for very large forests" << std::endl;
+  std::cout << "                    --lod 0.01 - level of detail. Fewer vertices around thinner branches and fewer rings along straight branches, within this distance in metres" << std::endl;
+  std::cout << "                    --lod_levels 3 - output this many levels of detail to _mesh_lod0.ply onwards, doubling the lod distance at each level" << std::endl;
+  std::cout << "                    --glb - write a binary glTF file with one node per tree, quantized positions and shared buffers" << std::endl;
+  std::cout << "                    --twigs 0.01 - branches thinner than this radius are instances of a few canonical capsules, listed in _twigs.txt or instanced in the glb" << std::endl;
   // clang-format on
   exit(exit_code);
 }
 
+/// The sin and cos of the multiples of 30 degrees. These are the angles of the vertices in the 6-vertex rings,
+/// with alternate rings rotated by half a triangle width to keep the triangles isoceles
+const double kHalfRoot3 = 0.86602540378443865;
+const double kRingSin[12] = { 0.0, 0.5, kHalfRoot3, 1.0, kHalfRoot3, 0.5, 0.0, -0.5, -kHalfRoot3, -1.0, -kHalfRoot3, -0.5 };
+const double kRingCos[12] = { 1.0, kHalfRoot3, 0.5, 0.0, -0.5, -kHalfRoot3, -1.0, -kHalfRoot3, -0.5, 0.0, 0.5, kHalfRoot3 };
+
+/// the range of the number of vertices around the rings of branches at lower levels of detail
+const int kMinRingVertices = 3;
+const int kMaxRingVertices = 16;
+
+/// The sin and cos tables for rings of each number of vertices, in the same form as kRingSin and kRingCos
+struct RingTables
+{
+  RingTables()
+  {
+    for (int n = kMinRingVertices; n <= kMaxRingVertices; n++)
+    {
+      for (int i = 0; i < 2 * n; i++)
+      {
+        sins[n][i] = std::sin(static_cast<double>(i) * ray::kPi / static_cast<double>(n));
+        coss[n][i] = std::cos(static_cast<double>(i) * ray::kPi / static_cast<double>(n));
+      }
+    }
+  }
+  double sins[kMaxRingVertices + 1][2 * kMaxRingVertices];
+  double coss[kMaxRingVertices + 1][2 * kMaxRingVertices];
+};
+const RingTables &ringTables()
+{
+  static const RingTables tables;
+  return tables;
+}
+
+/// How the trees are meshed
+struct MeshStyle
+{
+  bool smooth = true;      // continuous branches, otherwise each segment is an individual capsule
+  double cap_scale = 1.0;  // scale on the length of the individual capsule ends, 0 for cylinders
+  int red_id = -1;         // the first colour channel id, used to colour the segments
+  double red_scale = 1.0, green_scale = 1.0, blue_scale = 1.0;  // scales on each colour channel
+  double tolerance = 0.0;  // the level of detail of smooth branches, as a distance in metres. 0 is full detail
+  double twig_radius = 0.0;  // segments thinner than this are output as twig instances rather than meshed
+};
+
+/// The number of canonical twig capsules. Capsule k has unit radius and runs along the z axis from 0 to 2^k, so that
+/// each twig is an instance of the capsule closest to its length to radius ratio, and its caps are only mildly stretched
+const int kNumTwigCapsules = 6;
+
+/// One twig segment, as a scaled and rotated instance of a canonical twig capsule
+struct TwigInstance
+{
+  int capsule;                  // the canonical capsule index
+  Eigen::Vector3d position;     // the base of the twig, at its parent segment's tip
+  Eigen::Quaterniond rotation;  // rotates the capsule's z axis onto the twig's direction
+  Eigen::Vector3d scale;        // scale of the capsule: the radius, the radius, then the length over the capsule length
+  ray::RGBA rgba;
+};
+
+/// One ring of vertices around a branch of the smooth mesh
+struct MeshRing
+{
+  Eigen::Vector3d pos;           // the centre of the ring
+  Eigen::Vector3d side1, side2;  // the orthogonal axes that the ring lies on
+  double radius;
+  ray::RGBA rgba;
+  int wind;          // the number of half triangle widths that the ring is rotated by
+  int num_vertices;  // the number of vertices around the ring, the same along the whole branch
+  bool cap_start, cap_end;
+};
+
+/// Writes vertices, colours and triangles directly into a range of a mesh's arrays that has already been allocated,
+/// so that no allocations are made per segment, and separate trees can be written in parallel
+struct MeshWriter
+{
+  MeshWriter(ray::Mesh &mesh, size_t first_vertex, size_t first_triangle)
+    : vertices(mesh.vertices().data() + first_vertex)
+    , colours(mesh.colours().data() + first_vertex)
+    , triangles(mesh.indexList().data() + first_triangle)
+    , vertex_index(static_cast<int>(first_vertex))
+  {}
+  /// add @c count vertices of colour @c rgba, returning their positions to be filled in
+  Eigen::Vector3d *addVertices(int count, const ray::RGBA &rgba)
+  {
+    Eigen::Vector3d *added = vertices;
+    std::fill(colours, colours + count, rgba);
+    vertices += count;
+    colours += count;
+    vertex_index += count;
+    return added;
+  }
+  void addTriangle(const Eigen::Vector3i &triangle) { *triangles++ = triangle; }
+
+  Eigen::Vector3d *vertices;
+  ray::RGBA *colours;
+  Eigen::Vector3i *triangles;
+  int vertex_index;  // the mesh index of the next vertex
+};
+
 // forward declarations
-void addCapsule(ray::Mesh &mesh, const Eigen::Vector3d &pos1, const Eigen::Vector3d &pos2, double radius,
+void addCapsule(MeshWriter &writer, const Eigen::Vector3d &pos1, const Eigen::Vector3d &pos2, double radius,
                 ray::RGBA rgba, double cap_scale);
-void addCapsulePiece(ray::Mesh &mesh, int wind, const Eigen::Vector3d &pos, const Eigen::Vector3d &side1,
-                     const Eigen::Vector3d &side2, double radius, const ray::RGBA &rgba, bool cap_start, bool cap_end);
-void generateSmoothMesh(ray::Mesh &mesh, const ray::ForestStructure &forest, int red_id, double red_scale,
-                        double green_scale, double blue_scale);
+void addCapsulePiece(MeshWriter &writer, const MeshRing &ring);
+bool generateForestMesh(ray::Mesh &mesh, const ray::ForestStructure &forest,
+                        const std::vector<tree::TreeTopology> &topologies, const MeshStyle &style);
+bool writeForestMeshPly(const std::string &file_name, const ray::ForestStructure &forest,
+                        const std::vector<tree::TreeTopology> &topologies, const MeshStyle &style);
+bool writeForestMeshGlb(const std::string &file_name, const ray::ForestStructure &forest,
+                        const std::vector<tree::TreeTopology> &topologies, const MeshStyle &style,
+                        const std::vector<TwigInstance> &twigs);
+void findTwigInstances(const ray::ForestStructure &forest, const MeshStyle &style, std::vector<TwigInstance> &twigs);
+bool writeTwigInstances(const std::string &file_name, const std::vector<TwigInstance> &twigs, const MeshStyle &style);
 
 /// This method converts the tree file into a .ply mesh structure, with one cylinder approximation
 /// per segment, coloured according to the tree file's colour attributes.
@@ -43,22 +161,27 @@ int main(int argc, char *argv[])
 {
   ray::FileArgument forest_file;
   ray::DoubleArgument max_brightness;
-  ray::OptionalFlagArgument view("view", 'v'), capsules_option("capsules", 'c'), cylinders_option("cylinders", 'y'), uvs_option("uvs", 'u');
+  ray::OptionalFlagArgument view("view", 'v'), capsules_option("capsules", 'c'), cylinders_option("cylinders", 'y'), uvs_option("uvs", 'u'), stream_option("stream", 's'), glb_option("glb", 'b');
   ray::Vector3dArgument max_colour;
   ray::OptionalKeyValueArgument max_brightness_option("max_colour", 'm', &max_brightness);
   ray::OptionalKeyValueArgument max_colour_option("max_colour", 'm', &max_colour);
+  ray::DoubleArgument lod(0.0001, 1000.0, 0.01);
+  ray::IntArgument lod_levels(1, 16, 1);
+  ray::OptionalKeyValueArgument lod_option("lod", 'l', &lod), lod_levels_option("lod_levels", 'e', &lod_levels);
+  ray::DoubleArgument twig_radius(0.0001, 100.0);
+  ray::OptionalKeyValueArgument twigs_option("twigs", 't', &twig_radius);
 
   const bool max_brightness_format =
-    ray::parseCommandLine(argc, argv, { &forest_file }, { &max_brightness_option, &view, &capsules_option, &cylinders_option, &uvs_option });
+    ray::parseCommandLine(argc, argv, { &forest_file }, { &max_brightness_option, &view, &capsules_option, &cylinders_option, &uvs_option, &stream_option, &lod_option, &lod_levels_option, &glb_option, &twigs_option });
   const bool max_colour_format =
-    ray::parseCommandLine(argc, argv, { &forest_file }, { &max_colour_option, &view, &capsules_option, &cylinders_option, &uvs_option });
+    ray::parseCommandLine(argc, argv, { &forest_file }, { &max_colour_option, &view, &capsules_option, &cylinders_option, &uvs_option, &stream_option, &lod_option, &lod_levels_option, &glb_option, &twigs_option });
   if (!max_brightness_format && !max_colour_format)
   {
     usage();
   }
 
   ray::ForestStructure forest;
-  if (!forest.load(forest_file.name()))
+  if (!tree::loadForest(forest_file.name(), forest))
   {
     usage();
   }
@@ -132,246 +255,971 @@ int main(int argc, char *argv[])
       std::cout << "auto re-scaling colour based on max colour value of " << max_col << std::endl;
     }
   }
-  ray::Mesh mesh;
-  // if rendering as individual capsules
-  if (capsules_option.isSet() || cylinders_option.isSet())
+  MeshStyle style;
+  style.smooth = !capsules_option.isSet() && !cylinders_option.isSet();
+  style.cap_scale = capsules_option.isSet() ? 1.0 : 0.0;
+  style.red_id = red_id;
+  style.red_scale = red_scale;
+  style.green_scale = green_scale;
+  style.blue_scale = blue_scale;
+  // texture coordinates are only generated by raylib's smooth mesh generation
+  const bool uvs = uvs_option.isSet() && style.smooth;
+  if ((lod_option.isSet() || lod_levels_option.isSet()) && (!style.smooth || uvs))
+  {
+    std::cerr << "Error: levels of detail are only generated for smooth meshes without uvs" << std::endl;
+    usage();
+  }
+  if (glb_option.isSet() && uvs)
+  {
+    std::cerr << "Error: uvs are not supported in glb output" << std::endl;
+    usage();
+  }
+  if (twigs_option.isSet() && uvs)
   {
-    double cap_scale = capsules_option.isSet() ? 1.0 : 0.0;
-    for (auto &tree : forest.trees)
+    std::cerr << "Error: twigs are not instanced in meshes with uvs" << std::endl;
+    usage();
+  }
+  std::vector<TwigInstance> twigs;
+  if (twigs_option.isSet())
+  {
+    style.twig_radius = twig_radius.value();
+    findTwigInstances(forest, style, twigs);
+    std::cout << "number of twig instances: " << twigs.size() << std::endl;
+    // the twigs are the same at every level of detail, so ply meshes share one instance table
+    if (!glb_option.isSet() && !writeTwigInstances(forest_file.nameStub() + "_twigs.txt", twigs, style))
     {
-      // for each segment
-      for (size_t i = 1; i < tree.segments().size(); i++)
-      {
-        // generate a capsule to its parent tip position
-        auto &segment = tree.segments()[i];
-        ray::RGBA rgba;
-        rgba.red = 127;
-        rgba.green = 127;
-        rgba.blue = 127;
-        rgba.alpha = 255;
-        if (red_id != -1)  // using per-segment colouring if supplied
-        {
-          rgba.red = uint8_t(std::min(red_scale * segment.attributes[red_id], 255.0));
-          rgba.green = uint8_t(std::min(green_scale * segment.attributes[red_id + 1], 255.0));
-          rgba.blue = uint8_t(std::min(blue_scale * segment.attributes[red_id + 2], 255.0));
-        }
-        addCapsule(mesh, segment.tip, tree.segments()[segment.parent_id].tip, segment.radius, rgba, cap_scale);
-      }
+      usage();
     }
   }
-  // otherwise use a smooth mesh generation function
-  else
+  std::vector<tree::TreeTopology> topologies(style.smooth ? forest.trees.size() : 0);
+  #pragma omp parallel for schedule(dynamic)
+  for (int t = 0; t < static_cast<int>(topologies.size()); t++)
+  {
+    topologies[t].build(forest.trees[t]);
+  }
+
+  // each level of detail doubles the tolerance of the previous level
+  const int num_levels = lod_levels_option.isSet() ? lod_levels.value() : 1;
+  const std::string mesh_ext = glb_option.isSet() ? ".glb" : ".ply";
+  const std::string mesh_file = forest_file.nameStub() + (num_levels > 1 ? "_mesh_lod0" : "_mesh") + mesh_ext;
+  for (int level = 0; level < num_levels; level++)
   {
-    forest.generateSmoothMesh(mesh, red_id, red_scale, green_scale, blue_scale, uvs_option.isSet());
+    const std::string level_file =
+      num_levels > 1 ? forest_file.nameStub() + "_mesh_lod" + std::to_string(level) + mesh_ext : mesh_file;
+    style.tolerance = lod_option.isSet() || lod_levels_option.isSet() ? lod.value() * std::pow(2.0, level) : 0.0;
+    if (glb_option.isSet())
+    {
+      if (!writeForestMeshGlb(level_file, forest, topologies, style, twigs))
+      {
+        usage();
+      }
+    }
+    else if (stream_option.isSet() && !uvs)
+    {
+      if (!writeForestMeshPly(level_file, forest, topologies, style))
+      {
+        usage();
+      }
+    }
+    else
+    {
+      if (stream_option.isSet())
+      {
+        std::cerr << "Warning: uvs are not streamed, so the whole mesh is generated before writing" << std::endl;
+      }
+      ray::Mesh mesh;
+      if (uvs)
+      {
+        forest.generateSmoothMesh(mesh, red_id, red_scale, green_scale, blue_scale, true);
+      }
+      else if (!generateForestMesh(mesh, forest, topologies, style))
+      {
+        usage();
+      }
+      ray::writePlyMesh(level_file, mesh, true);
+    }
   }
-  ray::writePlyMesh(forest_file.nameStub() + "_mesh.ply", mesh, true);
   // for convenience we can view the results immediately
   if (view.isSet())
   {
-    return system(("meshlab " + forest_file.nameStub() + "_mesh.ply").c_str());
+    return system(("meshlab " + mesh_file).c_str());
   }
   return 0;
 }
 
-/// @brief add the capsule (cylinder with hemispherical ends) to the mesh, approximated with 6 circumferential vertices
-/// @param mesh the mesh to add the capsule to
-/// @param pos1 base centre of capsule
-/// @param pos2 end centre of capsule
-/// @param radius radius of capsule
-/// @param rgba colour of capsule
-void addCapsule(ray::Mesh &mesh, const Eigen::Vector3d &pos1, const Eigen::Vector3d &pos2, double radius,
-                ray::RGBA rgba, double cap_scale)
+/// @brief the colour of @c segment from its colour attributes, or @c rgba if the trees are not coloured
+ray::RGBA segmentColour(const ray::TreeStructure::Segment &segment, const MeshStyle &style, ray::RGBA rgba)
 {
-  const int n = static_cast<int>(mesh.vertices().size());
-  const Eigen::Vector3i N(n, n, n);
-  std::vector<Eigen::Vector3i> &indices = mesh.indexList();
-  std::vector<Eigen::Vector3d> vertices(14);
+  if (style.red_id != -1)
+  {
+    rgba.red = uint8_t(std::min(style.red_scale * segment.attributes[style.red_id], 255.0));
+    rgba.green = uint8_t(std::min(style.green_scale * segment.attributes[style.red_id + 1], 255.0));
+    rgba.blue = uint8_t(std::min(style.blue_scale * segment.attributes[style.red_id + 2], 255.0));
+  }
+  return rgba;
+}
 
-  const Eigen::Vector3d dir = (pos2 - pos1).normalized();
-  const Eigen::Vector3d diag(1, 2, 3);
-  const Eigen::Vector3d side1 = dir.cross(diag).normalized();
-  const Eigen::Vector3d side2 = side1.cross(dir);
+/// @brief the number of vertices around a branch ring of @c radius, so that the polygon is within @c tolerance of
+/// the circle. A tolerance of 0 gives the full detail 6-vertex rings
+int ringVertices(double radius, double tolerance)
+{
+  if (tolerance <= 0.0)
+  {
+    return 6;
+  }
+  if (tolerance >= radius)
+  {
+    return kMinRingVertices;
+  }
+  // a chord of a circle divided into n parts is r(1 - cos(pi/n)) from the circle at its middle
+  const int num_vertices = static_cast<int>(std::ceil(ray::kPi / std::acos(1.0 - tolerance / radius)));
+  return std::max(kMinRingVertices, std::min(num_vertices, kMaxRingVertices));
+}
 
-  vertices[12] = pos1 - radius * dir * cap_scale;
-  vertices[13] = pos2 + radius * dir * cap_scale;
-  for (int i = 0; i < 6; i++)
+/// @brief whether the ring at @c joint can be left out of a branch at the level of detail given by @c tolerance, so
+/// that the branch surface runs straight from @c last_ring to the next joint @c next. This is when the radius is within
+/// the tolerance of the last ring's, and the joint and the previously @c skipped joints are within the tolerance of the
+/// straight line
+bool canSkipRing(const MeshRing &last_ring, const std::vector<Eigen::Vector3d> &skipped, const Eigen::Vector3d &joint,
+                 const Eigen::Vector3d &next, double radius, double tolerance)
+{
+  if (std::abs(radius - last_ring.radius) > tolerance)
+  {
+    return false;
+  }
+  const Eigen::Vector3d line = next - last_ring.pos;
+  const double length_sqr = line.squaredNorm();
+  auto distance = [&](const Eigen::Vector3d &pos)
+  {
+    const double d = length_sqr > 0.0 ? std::max(0.0, std::min((pos - last_ring.pos).dot(line) / length_sqr, 1.0)) : 0.0;
+    return (last_ring.pos + line * d - pos).norm();
+  };
+  if (distance(joint) > tolerance)
   {
-    const double pi = 3.14156;
-    const double angle = static_cast<double>(i) * 2.0 * pi / 6.0;
-    const double angle2 = angle + pi / 6.0;
-    vertices[i] = pos1 + radius * (side1 * std::sin(angle) + side2 * std::cos(angle));
-    vertices[i + 6] = pos2 + radius * (side1 * std::sin(angle2) + side2 * std::cos(angle2));
-    indices.push_back(N + Eigen::Vector3i(12, i, (i + 1) % 6));  // start end
-    indices.push_back(N + Eigen::Vector3i(13, (i + 1) % 6 + 6, i + 6));
-    indices.push_back(N + Eigen::Vector3i(i, i + 6, (i + 1) % 6));
-    indices.push_back(N + Eigen::Vector3i((i + 1) % 6 + 6, (i + 1) % 6, i + 6));
+    return false;
   }
-  mesh.vertices().insert(mesh.vertices().end(), vertices.begin(), vertices.end());
-  for (size_t i = 0; i < vertices.size(); i++)
+  for (const auto &pos : skipped)
   {
-    mesh.colours().push_back(rgba);
+    if (distance(pos) > tolerance)
+    {
+      return false;
+    }
   }
+  return true;
 }
 
-// add a single section of a capsule. Each one is like a node in the polyline with a radius.
-void addCapsulePiece(ray::Mesh &mesh, int wind, const Eigen::Vector3d &pos, const Eigen::Vector3d &side1,
-                     const Eigen::Vector3d &side2, double radius, const ray::RGBA &rgba, bool cap_start, bool cap_end)
+/// @brief This converts a piecewise cylindrical tree into a smoother mesh than individual capsule meshes
+///        Specifically, each branch (from its base up through the widest radius at each bifurcation) is a continuous
+///        mesh with 6 vertices around its circumference. This is equivalent to the capsules being connected
+///        wherever it is a continuation of the branch. The result is fewer triangles and a smoother result.
+///        With a level of detail tolerance, the number of vertices around each branch is chosen from its base radius,
+///        and rings are left out along straight, constant radius runs of the branch.
+///        This generates the rings of vertices that make up the mesh, which are added by addCapsulePiece
+/// @param tree the piecewise cylindrical tree
+/// @param topology the connectivity of @c tree
+/// @param style the colouring and level of detail of the mesh
+/// @param rings the rings of the branches, in order along each branch
+void planSmoothMesh(const ray::TreeStructure &tree, const tree::TreeTopology &topology, const MeshStyle &style,
+                    std::vector<MeshRing> &rings)
 {
-  const int start_index = static_cast<int>(mesh.vertices().size());
-  const Eigen::Vector3i start_indices(start_index, start_index, start_index);  // start indices
-  std::vector<Eigen::Vector3i> &indices = mesh.indexList();
-  std::vector<Eigen::Vector3d> vertices;
-  vertices.reserve(7);
-  Eigen::Vector3d dir = side2.cross(side1);
-  if (cap_start)
-    vertices.push_back(pos - radius * dir);
-
-  // add the six vertices in the circumferential ring for this point along the branch
-  for (int i = 0; i < 6; i++)
+  rings.clear();
+  const auto &segments = tree.segments();
+  // generate the set of root segments
+  std::vector<int> roots;
+  for (int i = 1; i < static_cast<int>(segments.size()); i++)
   {
-    const double pi = 3.14156;
-    double angle = (static_cast<double>(i) * 2.0 + static_cast<double>(wind)) * pi / 6.0;
+    if (segments[i].parent_id > 0)
+    {
+      break;
+    }
+    roots.push_back(i);
+  }
 
-    vertices.push_back(pos + radius * (side1 * std::sin(angle) + side2 * std::cos(angle)));
-    // the indexing is a bit more complicated, to connect the vertices with triangles
-    if (cap_start)
+  ray::RGBA rgba;
+  std::vector<Eigen::Vector3d> skipped;  // the joints left out since the last ring
+  // for each root, we follow up through the largest child to make a contiguous branch
+  for (size_t i = 0; i < roots.size(); i++)
+  {
+    int root_id = roots[i];
+    if (segments[root_id].radius < style.twig_radius)  // twigs are instanced, but may lead to thicker segments
     {
-      indices.push_back(start_indices + Eigen::Vector3i(0, 1 + i, 1 + ((i + 1) % 6)));
+      for (const int kid : topology.children(root_id))
+      {
+        roots.push_back(kid);
+      }
+      continue;
+    }
+    Eigen::Vector3d normal(1, 2, 3);  // unspecial 'up' direction for placing vertices along the circumference
+    const int num_vertices = ringVertices(segments[root_id].radius, style.tolerance);
+    skipped.clear();
+
+    // we iterate through this list and grow it at the same time
+    std::vector<int> childlist = { root_id };
+    int wind =
+      0;  // this is what rotates the vertices half a triangle width at each ring, to keep the triangles isoceles
+    for (size_t j = 0; j < childlist.size(); j++)
+    {
+      int child_id = childlist[j];
+      int par_id = segments[child_id].parent_id;
+      // generate an orthogonal frame for each ring of vertices to sit on
+      Eigen::Vector3d dir = (segments[child_id].tip - segments[par_id].tip).normalized();
+      Eigen::Vector3d axis1 = normal.cross(dir).normalized();
+      Eigen::Vector3d axis2 = axis1.cross(dir);
+      // the per-segment colour if it exists (e.g. from treecolour), otherwise the standardised colour in raycloudtools
+      rgba = segmentColour(segments[child_id], style, ray::RGBA::treetrunk());
+
+      if (child_id == root_id)  // add the base cap of the cylinder if we are at the root of the branch
+      {
+        rings.push_back({ segments[par_id].tip, axis1, axis2, segments[child_id].radius, rgba, wind, num_vertices,
+                          true, false });
+      }
+
+      const auto kids = topology.children(child_id);
+      // find the maximum radius subbranch
+      double max_rad = 0.0;
+      int max_k = 0;
+      for (int k = 0; k < static_cast<int>(kids.size()); k++)
+      {
+        double rad = segments[kids[k]].radius;
+        if (rad > max_rad)
+        {
+          max_rad = rad;
+          max_k = k;
+        }
+      }
+      // add the end cap of the cylinder if we are at the end of the whole branch, or it only continues as twigs
+      if (kids.empty() || segments[kids[max_k]].radius < style.twig_radius)
+      {
+        for (const int kid : kids)
+        {
+          roots.push_back(kid);
+        }
+        wind++;
+        rings.push_back({ segments[child_id].tip, axis1, axis2, segments[child_id].radius, rgba, wind, num_vertices,
+                          false, true });
+        break;
+      }
+      for (int k = 0; k < static_cast<int>(kids.size()); k++)
+      {
+        if (k != max_k)
+        {
+          roots.push_back(kids[k]);  // all other subbranches get added to the list, to be iterated over on their turn
+        }
+      }
+
+      int next_id = kids[max_k];
+      Eigen::Vector3d dir2 = (segments[next_id].tip - segments[child_id].tip).normalized();
+
+      Eigen::Vector3d top_dir = (dir2 + dir).normalized();  // here we average the directions of the two segments
+      // and generate an orthogonal basis for the ring of points on the branch
+      Eigen::Vector3d mid_axis1 = normal.cross(top_dir).normalized();
+      Eigen::Vector3d mid_axis2 = mid_axis1.cross(top_dir);
+      normal = -mid_axis2;
+      // add the ring of points, unless the level of detail allows the branch to continue straight past it
+      if (style.tolerance > 0.0 && canSkipRing(rings.back(), skipped, segments[child_id].tip, segments[next_id].tip,
+                                               segments[child_id].radius, style.tolerance))
+      {
+        skipped.push_back(segments[child_id].tip);
+      }
+      else
+      {
+        wind++;
+        rings.push_back({ segments[child_id].tip, mid_axis1, mid_axis2, segments[child_id].radius, rgba, wind,
+                          num_vertices, false, false });
+        skipped.clear();
+      }
+      // add the biggest subbranch to the list, so we continue to build the branch
+      childlist.push_back(kids[max_k]);
+    }
+  }
+}
+
+/// @brief the number of vertices and triangles added by addCapsulePiece for each of the @c rings
+void ringsMeshSize(const std::vector<MeshRing> &rings, size_t &num_vertices, size_t &num_triangles)
+{
+  num_vertices = num_triangles = 0;
+  for (const auto &ring : rings)
+  {
+    const size_t n = static_cast<size_t>(ring.num_vertices);
+    num_vertices += n + (ring.cap_start ? 1 : 0) + (ring.cap_end ? 1 : 0);
+    num_triangles += (ring.cap_start ? n : 2 * n) + (ring.cap_end ? n : 0);
+  }
+}
+
+/// @brief generate each segment of @c tree as an individual capsule, or cylinder when the style's cap_scale is 0
+/// @param writer the range of the mesh to generate into, of 14 vertices and 24 triangles per segment
+/// @param tree the piecewise cylindrical tree
+/// @param style the colouring of the mesh
+void generateCapsuleMesh(MeshWriter &writer, const ray::TreeStructure &tree, const MeshStyle &style)
+{
+  // for each segment
+  for (size_t i = 1; i < tree.segments().size(); i++)
+  {
+    // generate a capsule to its parent tip position
+    auto &segment = tree.segments()[i];
+    if (segment.radius < style.twig_radius)  // twigs are instanced instead
+    {
+      continue;
+    }
+    const ray::RGBA rgba = segmentColour(segment, style, ray::RGBA(127, 127, 127, 255));
+    addCapsule(writer, segment.tip, tree.segments()[segment.parent_id].tip, segment.radius, rgba, style.cap_scale);
+  }
+}
+
+/// @brief count the vertices and triangles of the mesh of each tree in @c forest, in parallel
+/// @param forest the piecewise cylindrical trees
+/// @param topologies the connectivity of each tree, needed for smooth meshes
+/// @param style how the trees are meshed
+/// @param vertex_starts the first vertex of each tree in the forest mesh, followed by the total number of vertices
+/// @param triangle_starts the first triangle of each tree, followed by the total number of triangles
+void countForestMesh(const ray::ForestStructure &forest, const std::vector<tree::TreeTopology> &topologies,
+                     const MeshStyle &style, std::vector<size_t> &vertex_starts, std::vector<size_t> &triangle_starts)
+{
+  const int num_trees = static_cast<int>(forest.trees.size());
+  vertex_starts.assign(num_trees + 1, 0);
+  triangle_starts.assign(num_trees + 1, 0);
+  #pragma omp parallel for schedule(dynamic)
+  for (int t = 0; t < num_trees; t++)
+  {
+    if (style.smooth)
+    {
+      std::vector<MeshRing> rings;
+      planSmoothMesh(forest.trees[t], topologies[t], style, rings);
+      ringsMeshSize(rings, vertex_starts[t + 1], triangle_starts[t + 1]);
     }
     else
     {
-      indices.push_back(start_indices + Eigen::Vector3i(i - 6, i, ((i + 1) % 6) - 6));
-      indices.push_back(start_indices + Eigen::Vector3i((i + 1) % 6, ((i + 1) % 6) - 6, i));
+      size_t num_capsules = 0;
+      for (size_t i = 1; i < forest.trees[t].segments().size(); i++)
+      {
+        num_capsules += forest.trees[t].segments()[i].radius < style.twig_radius ? 0 : 1;
+      }
+      vertex_starts[t + 1] = 14 * num_capsules;
+      triangle_starts[t + 1] = 24 * num_capsules;
     }
   }
-  if (cap_end)
+  // the prefix sum gives the range of each tree within the forest mesh
+  for (int t = 0; t < num_trees; t++)
   {
-    vertices.push_back(pos + radius * dir);
-    for (int i = 0; i < 6; i++)
+    vertex_starts[t + 1] += vertex_starts[t];
+    triangle_starts[t + 1] += triangle_starts[t];
+  }
+}
+
+/// @brief generate the mesh of tree @c t of @c forest into @c writer, which has the space counted by countForestMesh
+void generateTreeMesh(MeshWriter &writer, const ray::ForestStructure &forest,
+                      const std::vector<tree::TreeTopology> &topologies, const MeshStyle &style, int t)
+{
+  if (style.smooth)
+  {
+    std::vector<MeshRing> rings;
+    planSmoothMesh(forest.trees[t], topologies[t], style, rings);
+    for (const auto &ring : rings)
     {
-      indices.push_back(start_indices + Eigen::Vector3i(6, (i + 1) % 6, i));
+      addCapsulePiece(writer, ring);
     }
   }
-  // add these vertices into the mesh
-  mesh.vertices().insert(mesh.vertices().end(), vertices.begin(), vertices.end());
-  for (size_t i = 0; i < vertices.size(); i++)
+  else
   {
-    mesh.colours().push_back(rgba);
+    generateCapsuleMesh(writer, forest.trees[t], style);
   }
 }
 
-/// @brief This converts the piecewise cylindrical model into a smoother mesh than individual capsule meshes
-///        Specifically, each branch (from its base up through the widest radius at each bifurcation) is a continuous
-///        mesh with 6 vertices around its circumference. This is equivalent to the capsules being connected
-///        wherever it is a continuation of the branch. The result is fewer triangles and a smoother result.
+/// @brief generate the mesh of every tree in @c forest into @c mesh, as smooth branches or individual capsules. The
+/// size of each tree's mesh is counted first, so the mesh arrays are allocated once and each tree is then generated
+/// directly into its own range of them, in parallel
 /// @param mesh the mesh object to generate into
-/// @param forest the forest structure representing the piecewise cylindrical trees
-/// @param red_id the first colour channel id, used to colour the trees
-/// @param red_scale scale on the red colour component
-/// @param green_scale scale on the green channel
-/// @param blue_scale scale on the blue channel
-void generateSmoothMesh(ray::Mesh &mesh, const ray::ForestStructure &forest, int red_id, double red_scale,
-                        double green_scale, double blue_scale)
+/// @param forest the piecewise cylindrical trees
+/// @param topologies the connectivity of each tree, needed for smooth meshes
+/// @param style how the trees are meshed
+/// @return false, leaving @c mesh unchanged, if the mesh would have more vertices than its indices can address
+bool generateForestMesh(ray::Mesh &mesh, const ray::ForestStructure &forest,
+                        const std::vector<tree::TreeTopology> &topologies, const MeshStyle &style)
+{
+  const int num_trees = static_cast<int>(forest.trees.size());
+  std::vector<size_t> vertex_starts, triangle_starts;
+  countForestMesh(forest, topologies, style, vertex_starts, triangle_starts);
+  const size_t first_vertex = mesh.vertices().size();
+  const size_t first_triangle = mesh.indexList().size();
+  if (first_vertex + vertex_starts[num_trees] > static_cast<size_t>(std::numeric_limits<int>::max()))
+  {
+    std::cerr << "Error: mesh has " << first_vertex + vertex_starts[num_trees]
+              << " vertices, more than can be indexed. Use --stream to write up to 2^32 vertices" << std::endl;
+    return false;
+  }
+  mesh.vertices().resize(first_vertex + vertex_starts[num_trees]);
+  mesh.colours().resize(first_vertex + vertex_starts[num_trees]);
+  mesh.indexList().resize(first_triangle + triangle_starts[num_trees]);
+
+  #pragma omp parallel for schedule(dynamic)
+  for (int t = 0; t < num_trees; t++)
+  {
+    MeshWriter writer(mesh, first_vertex + vertex_starts[t], first_triangle + triangle_starts[t]);
+    generateTreeMesh(writer, forest, topologies, style, t);
+  }
+  return true;
+}
+
+/// @brief the default colour of the branches when the trees are not coloured
+ray::RGBA defaultColour(const MeshStyle &style)
+{
+  return style.smooth ? ray::RGBA::treetrunk() : ray::RGBA(127, 127, 127, 255);
+}
+
+/// @brief the length of canonical twig capsule @c capsule
+double twigCapsuleLength(int capsule)
+{
+  return static_cast<double>(1 << capsule);
+}
+
+/// @brief the cap scale of the twig capsules. Smooth branches end in caps, so their twigs have them too
+double twigCapScale(const MeshStyle &style)
+{
+  return style.smooth ? 1.0 : style.cap_scale;
+}
+
+/// @brief find the segments of @c forest thinner than the style's twig radius, as instances of canonical capsules
+/// @param forest the piecewise cylindrical trees
+/// @param style how the trees are meshed, including the twig radius
+/// @param twigs the twig instances, in order of tree then segment
+void findTwigInstances(const ray::ForestStructure &forest, const MeshStyle &style, std::vector<TwigInstance> &twigs)
 {
+  twigs.clear();
   for (const auto &tree : forest.trees)
   {
     const auto &segments = tree.segments();
-    // first generate the list of children for each segment
-    std::vector<std::vector<int>> children(segments.size());
-    for (size_t i = 0; i < segments.size(); i++)
+    for (size_t i = 1; i < segments.size(); i++)
     {
       const auto &segment = segments[i];
-      int parent = segment.parent_id;
-      if (parent != -1)
+      if (segment.radius >= style.twig_radius)
       {
-        children[parent].push_back((int)i);
+        continue;
       }
+      TwigInstance twig;
+      twig.position = segments[segment.parent_id].tip;
+      const Eigen::Vector3d dir = segment.tip - twig.position;
+      const double length = dir.norm();
+      // the capsule whose length to radius ratio is nearest in log scale, to minimise the stretching of its caps
+      const double ratio = std::round(std::log2(length / std::max(segment.radius, 1e-10)));
+      twig.capsule = static_cast<int>(std::max(0.0, std::min(ratio, static_cast<double>(kNumTwigCapsules - 1))));
+      twig.rotation = length > 0.0 ? Eigen::Quaterniond::FromTwoVectors(Eigen::Vector3d::UnitZ(), dir) :
+                                     Eigen::Quaterniond::Identity();
+      twig.scale = Eigen::Vector3d(segment.radius, segment.radius, length / twigCapsuleLength(twig.capsule));
+      twig.rgba = segmentColour(segment, style, defaultColour(style));
+      twigs.push_back(twig);
+    }
+  }
+}
+
+/// @brief write the twig instances to the text file @c file_name, one line per instance. The header describes the
+/// canonical capsules, so the twigs can be reconstructed or instanced by other software
+/// @param file_name the text file to write
+/// @param twigs the twig instances
+/// @param style how the trees are meshed
+bool writeTwigInstances(const std::string &file_name, const std::vector<TwigInstance> &twigs, const MeshStyle &style)
+{
+  std::ofstream ofs(file_name, std::ios::out);
+  if (!ofs.is_open())
+  {
+    std::cerr << "Error: cannot open " << file_name << " for writing" << std::endl;
+    return false;
+  }
+  ofs << "# Twig instances from treemesh. Each twig is a canonical capsule, scaled then rotated then translated" << std::endl;
+  ofs << "# capsule k has radius 1 and runs along the z axis from 0 to 2^k, with end caps of length "
+      << twigCapScale(style) << std::endl;
+  ofs << "# capsule, x, y, z, qx, qy, qz, qw, sx, sy, sz, red, green, blue" << std::endl;
+  ofs << std::setprecision(8);
+  for (const auto &twig : twigs)
+  {
+    ofs << twig.capsule << ", " << twig.position[0] << ", " << twig.position[1] << ", " << twig.position[2] << ", "
+        << twig.rotation.x() << ", " << twig.rotation.y() << ", " << twig.rotation.z() << ", " << twig.rotation.w()
+        << ", " << twig.scale[0] << ", " << twig.scale[1] << ", " << twig.scale[2] << ", " << int(twig.rgba.red)
+        << ", " << int(twig.rgba.green) << ", " << int(twig.rgba.blue) << std::endl;
+  }
+  if (!ofs.good())
+  {
+    std::cerr << "Error: failed writing " << file_name << std::endl;
+    return false;
+  }
+  return true;
+}
+
+/// @brief write the mesh of every tree in @c forest to the binary ply file @c file_name, without holding the whole
+/// forest mesh in memory. The vertex and face counts are found first, so the header can be written and each tree's
+/// vertices and faces placed directly at their positions in the file. The trees are meshed a batch at a time in
+/// parallel, and written with single precision vertices and 32-bit unsigned indices
+/// @param file_name the ply file to write
+/// @param forest the piecewise cylindrical trees
+/// @param topologies the connectivity of each tree, needed for smooth meshes
+/// @param style how the trees are meshed
+bool writeForestMeshPly(const std::string &file_name, const ray::ForestStructure &forest,
+                        const std::vector<tree::TreeTopology> &topologies, const MeshStyle &style)
+{
+  const int num_trees = static_cast<int>(forest.trees.size());
+  std::vector<size_t> vertex_starts, triangle_starts;
+  countForestMesh(forest, topologies, style, vertex_starts, triangle_starts);
+  if (vertex_starts[num_trees] > static_cast<size_t>(std::numeric_limits<uint32_t>::max()))
+  {
+    std::cerr << "Error: mesh has more vertices than can be indexed" << std::endl;
+    return false;
+  }
+
+  std::ofstream ofs(file_name, std::ios::binary | std::ios::out);
+  if (!ofs.is_open())
+  {
+    std::cerr << "Error: cannot open " << file_name << " for writing" << std::endl;
+    return false;
+  }
+  // clang-format off
+  ofs << "ply" << std::endl;
+  ofs << "format binary_little_endian 1.0" << std::endl;
+  ofs << "comment generated by treemesh" << std::endl;
+  ofs << "element vertex " << vertex_starts[num_trees] << std::endl;
+  ofs << "property float x" << std::endl;
+  ofs << "property float y" << std::endl;
+  ofs << "property float z" << std::endl;
+  ofs << "property uchar red" << std::endl;
+  ofs << "property uchar green" << std::endl;
+  ofs << "property uchar blue" << std::endl;
+  ofs << "property uchar alpha" << std::endl;
+  ofs << "element face " << triangle_starts[num_trees] << std::endl;
+  ofs << "property list uchar uint vertex_indices" << std::endl;
+  ofs << "end_header" << std::endl;
+  // clang-format on
+  const size_t vertex_size = 3 * sizeof(float) + sizeof(ray::RGBA);
+  const size_t face_size = 1 + 3 * sizeof(uint32_t);
+  const size_t vertices_start = static_cast<size_t>(ofs.tellp());
+  const size_t faces_start = vertices_start + vertex_size * vertex_starts[num_trees];
+
+  // a batch of trees is meshed in parallel, then written in order
+  const int batch_size = 256;
+  std::vector<ray::Mesh> meshes(batch_size);
+  std::vector<char> buffer;
+  for (int batch_start = 0; batch_start < num_trees; batch_start += batch_size)
+  {
+    const int batch_end = std::min(batch_start + batch_size, num_trees);
+    #pragma omp parallel for schedule(dynamic)
+    for (int t = batch_start; t < batch_end; t++)
+    {
+      ray::Mesh &mesh = meshes[t - batch_start];
+      mesh.vertices().resize(vertex_starts[t + 1] - vertex_starts[t]);
+      mesh.colours().resize(mesh.vertices().size());
+      mesh.indexList().resize(triangle_starts[t + 1] - triangle_starts[t]);
+      MeshWriter writer(mesh, 0, 0);
+      generateTreeMesh(writer, forest, topologies, style, t);
     }
-    // now generate the set of root segments
-    std::vector<int> roots;
-    for (int i = 1; i < static_cast<int>(segments.size()); i++)
+    for (int t = batch_start; t < batch_end; t++)
     {
-      if (segments[i].parent_id > 0)
+      const ray::Mesh &mesh = meshes[t - batch_start];
+      buffer.resize(vertex_size * mesh.vertices().size());
+      char *data = buffer.data();
+      for (size_t i = 0; i < mesh.vertices().size(); i++)
       {
-        break;
+        const Eigen::Vector3f vertex = mesh.vertices()[i].cast<float>();
+        memcpy(data, vertex.data(), 3 * sizeof(float));
+        memcpy(data + 3 * sizeof(float), &mesh.colours()[i], sizeof(ray::RGBA));
+        data += vertex_size;
       }
-      roots.push_back(i);
-    }
+      ofs.seekp(vertices_start + vertex_size * vertex_starts[t]);
+      ofs.write(buffer.data(), buffer.size());
 
-    ray::RGBA rgba;
-    // for each root, we follow up through the largest child to make a contiguous branch
-    for (size_t i = 0; i < roots.size(); i++)
-    {
-      int root_id = roots[i];
-      Eigen::Vector3d normal(1, 2, 3);  // unspecial 'up' direction for placing vertices along the circumference
-
-      // we iterate through this list and grow it at the same time
-      std::vector<int> childlist = { root_id };
-      int wind =
-        0;  // this is what rotates the vertices half a triangle width at each segment, to keep the triangles isoceles
-      for (size_t j = 0; j < childlist.size(); j++)
+      // the face indices are offset to the tree's first vertex
+      buffer.resize(face_size * mesh.indexList().size());
+      data = buffer.data();
+      for (const auto &triangle : mesh.indexList())
       {
-        int child_id = childlist[j];
-        int par_id = segments[child_id].parent_id;
-        // generate an orthogonal frame for each ring of vertices to sit on
-        Eigen::Vector3d dir = (segments[child_id].tip - segments[par_id].tip).normalized();
-        Eigen::Vector3d axis1 = normal.cross(dir).normalized();
-        Eigen::Vector3d axis2 = axis1.cross(dir);
-        rgba = ray::RGBA::treetrunk();  // standardised colour in raycloudtools
-        if (red_id != -1)               // use the per-segment colour if it exists (e.g. from treecolour)
-        {
-          rgba.red = uint8_t(std::min(red_scale * segments[child_id].attributes[red_id], 255.0));
-          rgba.green = uint8_t(std::min(green_scale * segments[child_id].attributes[red_id + 1], 255.0));
-          rgba.blue = uint8_t(std::min(blue_scale * segments[child_id].attributes[red_id + 2], 255.0));
-        }
+        const uint32_t indices[3] = { static_cast<uint32_t>(vertex_starts[t] + triangle[0]),
+                                      static_cast<uint32_t>(vertex_starts[t] + triangle[1]),
+                                      static_cast<uint32_t>(vertex_starts[t] + triangle[2]) };
+        *data = 3;
+        memcpy(data + 1, indices, sizeof(indices));
+        data += face_size;
+      }
+      ofs.seekp(faces_start + face_size * triangle_starts[t]);
+      ofs.write(buffer.data(), buffer.size());
+    }
+  }
+  if (!ofs.good())
+  {
+    std::cerr << "Error: failed writing " << file_name << std::endl;
+    return false;
+  }
+  return true;
+}
 
-        if (child_id == root_id)  // add the base cap of the cylinder if we are at the root of the branch
-        {
-          addCapsulePiece(mesh, wind, segments[par_id].tip, axis1, axis2, segments[child_id].radius, rgba, true, false);
-        }
+/// @brief write the mesh of every tree in @c forest to the binary glTF 2.0 file @c file_name, with one node and mesh
+/// per tree so that viewers can cull and stream the trees individually. The trees share one buffer of positions,
+/// colours and indices. Each tree's positions are quantized to 16 bits over its bounding box, with the node's
+/// translation and scale restoring them (KHR_mesh_quantization). Indices are 16 bit for trees with few enough
+/// vertices, otherwise 32 bit. The trees are in a root node that converts from the z-up forest to glTF's y-up axes.
+/// Any twigs follow as one node per canonical capsule, instancing it at every twig (EXT_mesh_gpu_instancing).
+/// Returns false if there is no geometry to write, as glTF doesn't allow empty buffers
+/// @param file_name the glb file to write
+/// @param forest the piecewise cylindrical trees
+/// @param topologies the connectivity of each tree, needed for smooth meshes
+/// @param style how the trees are meshed
+/// @param twigs the twig instances, which are not in the tree meshes
+bool writeForestMeshGlb(const std::string &file_name, const ray::ForestStructure &forest,
+                        const std::vector<tree::TreeTopology> &topologies, const MeshStyle &style,
+                        const std::vector<TwigInstance> &twigs)
+{
+  const int num_trees = static_cast<int>(forest.trees.size());
+  std::vector<size_t> vertex_starts, triangle_starts;
+  countForestMesh(forest, topologies, style, vertex_starts, triangle_starts);
 
-        wind++;
-        std::vector<int> kids = children[child_id];
-        if (kids.empty())  // add the end cap of the cylinder if we are at the end of the whole branch
+  // the layout of the binary buffer is found from the counts: the positions (padded to 8 bytes for alignment), then
+  // the colours, then the indices of each tree, each tree's indices starting on a 4 byte boundary
+  const size_t position_size = 4 * sizeof(uint16_t), colour_size = sizeof(ray::RGBA);
+  const size_t colours_start = position_size * vertex_starts[num_trees];
+  const size_t indices_start = colours_start + colour_size * vertex_starts[num_trees];
+  std::vector<size_t> index_starts(num_trees + 1);
+  std::vector<uint8_t> short_indices(num_trees);
+  index_starts[0] = 0;
+  for (int t = 0; t < num_trees; t++)
+  {
+    short_indices[t] = vertex_starts[t + 1] - vertex_starts[t] < std::numeric_limits<uint16_t>::max();
+    const size_t size = 3 * (triangle_starts[t + 1] - triangle_starts[t]) * (short_indices[t] ? 2 : 4);
+    index_starts[t + 1] = index_starts[t] + ((size + 3) / 4) * 4;
+  }
+  // each twig instance has a float translation, rotation and scale, and a colour
+  const size_t twigs_size = (10 * sizeof(float) + sizeof(ray::RGBA)) * twigs.size();
+  if (vertex_starts[num_trees] == 0 && twigs.empty())
+  {
+    std::cerr << "Error: no tree has any branches to mesh, so there is no glb geometry to write" << std::endl;
+    return false;
+  }
+  if (indices_start + index_starts[num_trees] + twigs_size >
+      static_cast<size_t>(std::numeric_limits<uint32_t>::max()) - (1 << 24))
+  {
+    std::cerr << "Error: mesh is too large for a single glb file" << std::endl;
+    return false;
+  }
+  std::vector<uint8_t> buffer(indices_start + index_starts[num_trees], 0);
+  std::vector<Eigen::Vector3d> origins(num_trees), scales(num_trees);
+  std::vector<Eigen::Vector3i> maxima(num_trees);
+
+  // each tree is meshed in parallel and quantized directly into its parts of the buffer
+  #pragma omp parallel
+  {
+    ray::Mesh mesh;
+    #pragma omp for schedule(dynamic)
+    for (int t = 0; t < num_trees; t++)
+    {
+      mesh.vertices().resize(vertex_starts[t + 1] - vertex_starts[t]);
+      mesh.colours().resize(mesh.vertices().size());
+      mesh.indexList().resize(triangle_starts[t + 1] - triangle_starts[t]);
+      MeshWriter writer(mesh, 0, 0);
+      generateTreeMesh(writer, forest, topologies, style, t);
+      if (mesh.vertices().empty())
+      {
+        continue;
+      }
+      Eigen::Vector3d min_bound = mesh.vertices()[0], max_bound = mesh.vertices()[0];
+      for (const auto &vertex : mesh.vertices())
+      {
+        min_bound = min_bound.cwiseMin(vertex);
+        max_bound = max_bound.cwiseMax(vertex);
+      }
+      const double max_value = static_cast<double>(std::numeric_limits<uint16_t>::max());
+      Eigen::Vector3d scale = (max_bound - min_bound) / max_value;
+      for (int i = 0; i < 3; i++)
+      {
+        scale[i] = scale[i] > 0.0 ? scale[i] : 1.0;
+      }
+      origins[t] = min_bound;
+      scales[t] = scale;
+      maxima[t] = Eigen::Vector3i::Zero();
+      uint8_t *positions = &buffer[position_size * vertex_starts[t]];
+      for (size_t i = 0; i < mesh.vertices().size(); i++)
+      {
+        const Eigen::Vector3d pos = (mesh.vertices()[i] - min_bound).cwiseQuotient(scale);
+        uint16_t quantized[4] = { 0, 0, 0, 0 };
+        for (int j = 0; j < 3; j++)
         {
-          addCapsulePiece(mesh, wind, segments[child_id].tip, axis1, axis2, segments[child_id].radius, rgba, false,
-                          true);
-          break;
+          quantized[j] = static_cast<uint16_t>(std::max(0.0, std::min(std::round(pos[j]), max_value)));
+          maxima[t][j] = std::max(maxima[t][j], static_cast<int>(quantized[j]));
         }
-        // now find the maximum radius subbranch
-        double max_rad = 0.0;
-        int max_k = 0;
-        for (int k = 0; k < static_cast<int>(kids.size()); k++)
+        memcpy(positions + position_size * i, quantized, position_size);
+      }
+      memcpy(&buffer[colours_start + colour_size * vertex_starts[t]], mesh.colours().data(),
+             colour_size * mesh.colours().size());
+      uint8_t *indices = &buffer[indices_start + index_starts[t]];
+      for (const auto &triangle : mesh.indexList())
+      {
+        for (int j = 0; j < 3; j++)
         {
-          double rad = segments[kids[k]].radius;
-          if (rad > max_rad)
+          if (short_indices[t])
           {
-            max_rad = rad;
-            max_k = k;
+            const uint16_t index = static_cast<uint16_t>(triangle[j]);
+            memcpy(indices, &index, sizeof(index));
+            indices += sizeof(index);
           }
-        }
-        for (int k = 0; k < static_cast<int>(kids.size()); k++)
-        {
-          if (k != max_k)
+          else
           {
-            roots.push_back(kids[k]);  // all other subbranches get added to the list, to be iterated over on their turn
+            const uint32_t index = static_cast<uint32_t>(triangle[j]);
+            memcpy(indices, &index, sizeof(index));
+            indices += sizeof(index);
           }
         }
-
-        int next_id = kids[max_k];
-        Eigen::Vector3d dir2 = (segments[next_id].tip - segments[child_id].tip).normalized();
-
-        Eigen::Vector3d top_dir = (dir2 + dir).normalized();  // here we average the directions of the two segments
-        // and generate an orthogonal basis for the ring of points on the branch
-        Eigen::Vector3d mid_axis1 = normal.cross(top_dir).normalized();
-        Eigen::Vector3d mid_axis2 = mid_axis1.cross(top_dir);
-        normal = -mid_axis2;
-        // add the ring of points
-        addCapsulePiece(mesh, wind, segments[child_id].tip, mid_axis1, mid_axis2, segments[child_id].radius, rgba,
-                        false, false);
-        // add the biggest subbranch to the list, so we continue to build the branch
-        childlist.push_back(kids[max_k]);
       }
     }
   }
+
+  // the json describes each tree as a node with its own mesh, whose accessors index into the shared buffer views
+  std::ostringstream json, buffer_views;
+  json << std::setprecision(17);
+  int num_buffer_views = 0;
+  // the tree meshes' views are first, but glTF doesn't allow empty views so they are left out if only twigs have
+  // geometry
+  if (vertex_starts[num_trees] > 0)
+  {
+    buffer_views << "{\"buffer\":0,\"byteOffset\":0,\"byteLength\":" << colours_start
+                 << ",\"byteStride\":" << position_size << ",\"target\":34962},";
+    buffer_views << "{\"buffer\":0,\"byteOffset\":" << colours_start << ",\"byteLength\":"
+                 << indices_start - colours_start << ",\"byteStride\":" << colour_size << ",\"target\":34962},";
+    buffer_views << "{\"buffer\":0,\"byteOffset\":" << indices_start << ",\"byteLength\":"
+                 << index_starts[num_trees] << ",\"target\":34963}";
+    num_buffer_views = 3;
+  }
+  // appends data to the end of the buffer in its own buffer view, returning the view's index
+  auto addBufferView = [&](const void *data, size_t size, int target) {
+    buffer_views << (num_buffer_views > 0 ? "," : "") << "{\"buffer\":0,\"byteOffset\":" << buffer.size()
+                 << ",\"byteLength\":" << size;
+    buffer_views << (target ? ",\"target\":" + std::to_string(target) : std::string()) << "}";
+    buffer.insert(buffer.end(), (const uint8_t *)data, (const uint8_t *)data + size);
+    buffer.resize(((buffer.size() + 3) / 4) * 4, 0);
+    return num_buffer_views++;
+  };
+
+  // the twigs are grouped by their canonical capsule, each group to become one instanced node
+  std::vector<std::vector<const TwigInstance *>> twig_groups(kNumTwigCapsules);
+  for (const auto &twig : twigs)
+  {
+    twig_groups[twig.capsule].push_back(&twig);
+  }
+  int num_twig_nodes = 0;
+  for (const auto &group : twig_groups)
+  {
+    num_twig_nodes += group.empty() ? 0 : 1;
+  }
+
+  std::ostringstream nodes, meshes, accessors;
+  // the root node rotates the z-up trees to y-up
+  nodes << "{\"name\":\"forest\",\"rotation\":[-0.70710678118654757,0,0,0.70710678118654757]";
+  int num_meshes = 0;
+  for (int n = 0; n < num_trees + num_twig_nodes; n++)
+  {
+    nodes << (n == 0 ? ",\"children\":[" : ",") << n + 1;
+  }
+  nodes << (num_trees + num_twig_nodes > 0 ? "]}" : "}");
+  for (int t = 0; t < num_trees; t++)
+  {
+    const size_t num_vertices = vertex_starts[t + 1] - vertex_starts[t];
+    nodes << ",{\"name\":\"tree_" << t << "\"";
+    if (num_vertices == 0)  // trees without any branches have no mesh
+    {
+      nodes << "}";
+      continue;
+    }
+    nodes << ",\"mesh\":" << num_meshes << ",\"translation\":[" << origins[t][0] << "," << origins[t][1] << ","
+          << origins[t][2] << "],\"scale\":[" << scales[t][0] << "," << scales[t][1] << "," << scales[t][2] << "]}";
+    const int accessor = 3 * num_meshes;
+    meshes << (num_meshes > 0 ? "," : "") << "{\"primitives\":[{\"attributes\":{\"POSITION\":" << accessor
+           << ",\"COLOR_0\":" << accessor + 1 << "},\"indices\":" << accessor + 2 << ",\"mode\":4}]}";
+    accessors << (num_meshes > 0 ? "," : "") << "{\"bufferView\":0,\"byteOffset\":" << position_size * vertex_starts[t]
+              << ",\"componentType\":5123,\"count\":" << num_vertices << ",\"type\":\"VEC3\",\"min\":[0,0,0],\"max\":["
+              << maxima[t][0] << "," << maxima[t][1] << "," << maxima[t][2] << "]},";
+    accessors << "{\"bufferView\":1,\"byteOffset\":" << colour_size * vertex_starts[t]
+              << ",\"componentType\":5121,\"normalized\":true,\"count\":" << num_vertices << ",\"type\":\"VEC4\"},";
+    accessors << "{\"bufferView\":2,\"byteOffset\":" << index_starts[t]
+              << ",\"componentType\":" << (short_indices[t] ? 5123 : 5125)
+              << ",\"count\":" << 3 * (triangle_starts[t + 1] - triangle_starts[t]) << ",\"type\":\"SCALAR\"}";
+    num_meshes++;
+  }
+  int num_accessors = 3 * num_meshes;
+  for (int c = 0; c < kNumTwigCapsules; c++)
+  {
+    const auto &group = twig_groups[c];
+    if (group.empty())
+    {
+      continue;
+    }
+    // the canonical capsule, in single precision
+    ray::Mesh capsule;
+    capsule.vertices().resize(14);
+    capsule.colours().resize(14);
+    capsule.indexList().resize(24);
+    MeshWriter writer(capsule, 0, 0);
+    addCapsule(writer, Eigen::Vector3d::Zero(), Eigen::Vector3d(0, 0, twigCapsuleLength(c)), 1.0,
+               defaultColour(style), twigCapScale(style));
+    std::vector<float> positions;
+    std::vector<uint16_t> indices;
+    Eigen::Vector3d min_bound = capsule.vertices()[0], max_bound = capsule.vertices()[0];
+    for (const auto &vertex : capsule.vertices())
+    {
+      positions.insert(positions.end(), { float(vertex[0]), float(vertex[1]), float(vertex[2]) });
+      min_bound = min_bound.cwiseMin(vertex.cast<float>().cast<double>());
+      max_bound = max_bound.cwiseMax(vertex.cast<float>().cast<double>());
+    }
+    for (const auto &triangle : capsule.indexList())
+    {
+      indices.insert(indices.end(), { uint16_t(triangle[0]), uint16_t(triangle[1]), uint16_t(triangle[2]) });
+    }
+    const int position_view = addBufferView(positions.data(), sizeof(float) * positions.size(), 34962);
+    const int colour_view = addBufferView(capsule.colours().data(), colour_size * capsule.colours().size(), 34962);
+    const int index_view = addBufferView(indices.data(), sizeof(uint16_t) * indices.size(), 34963);
+
+    // the instance transforms, relative to the group's minimum position to keep the precision of single floats
+    Eigen::Vector3d origin = group[0]->position;
+    for (const auto &twig : group)
+    {
+      origin = origin.cwiseMin(twig->position);
+    }
+    std::vector<float> translations, rotations, scales;
+    std::vector<ray::RGBA> colours;
+    for (const auto &twig : group)
+    {
+      const Eigen::Vector3d pos = twig->position - origin;
+      translations.insert(translations.end(), { float(pos[0]), float(pos[1]), float(pos[2]) });
+      const Eigen::Vector4d &rot = twig->rotation.coeffs();  // x, y, z, w as in glTF
+      rotations.insert(rotations.end(), { float(rot[0]), float(rot[1]), float(rot[2]), float(rot[3]) });
+      scales.insert(scales.end(), { float(twig->scale[0]), float(twig->scale[1]), float(twig->scale[2]) });
+      colours.push_back(twig->rgba);
+    }
+    const int translation_view = addBufferView(translations.data(), sizeof(float) * translations.size(), 0);
+    const int rotation_view = addBufferView(rotations.data(), sizeof(float) * rotations.size(), 0);
+    const int scale_view = addBufferView(scales.data(), sizeof(float) * scales.size(), 0);
+    const int instance_colour_view = addBufferView(colours.data(), colour_size * colours.size(), 0);
+
+    const int accessor = num_accessors;
+    nodes << ",{\"name\":\"twigs_" << c << "\",\"mesh\":" << num_meshes << ",\"translation\":[" << origin[0] << ","
+          << origin[1] << "," << origin[2] << "],\"extensions\":{\"EXT_mesh_gpu_instancing\":{\"attributes\":{"
+          << "\"TRANSLATION\":" << accessor + 3 << ",\"ROTATION\":" << accessor + 4 << ",\"SCALE\":" << accessor + 5
+          << ",\"_COLOR_0\":" << accessor + 6 << "}}}}";
+    meshes << (num_meshes > 0 ? "," : "") << "{\"primitives\":[{\"attributes\":{\"POSITION\":" << accessor
+           << ",\"COLOR_0\":" << accessor + 1 << "},\"indices\":" << accessor + 2 << ",\"mode\":4}]}";
+    accessors << (num_accessors > 0 ? "," : "") << "{\"bufferView\":" << position_view
+              << ",\"componentType\":5126,\"count\":14,\"type\":\"VEC3\",\"min\":[" << min_bound[0] << ","
+              << min_bound[1] << "," << min_bound[2] << "],\"max\":[" << max_bound[0] << "," << max_bound[1] << ","
+              << max_bound[2] << "]},";
+    accessors << "{\"bufferView\":" << colour_view
+              << ",\"componentType\":5121,\"normalized\":true,\"count\":14,\"type\":\"VEC4\"},";
+    accessors << "{\"bufferView\":" << index_view << ",\"componentType\":5123,\"count\":72,\"type\":\"SCALAR\"},";
+    accessors << "{\"bufferView\":" << translation_view << ",\"componentType\":5126,\"count\":" << group.size()
+              << ",\"type\":\"VEC3\"},";
+    accessors << "{\"bufferView\":" << rotation_view << ",\"componentType\":5126,\"count\":" << group.size()
+              << ",\"type\":\"VEC4\"},";
+    accessors << "{\"bufferView\":" << scale_view << ",\"componentType\":5126,\"count\":" << group.size()
+              << ",\"type\":\"VEC3\"},";
+    accessors << "{\"bufferView\":" << instance_colour_view
+              << ",\"componentType\":5121,\"normalized\":true,\"count\":" << group.size() << ",\"type\":\"VEC4\"}";
+    num_accessors += 7;
+    num_meshes++;
+  }
+
+  json << "{\"asset\":{\"version\":\"2.0\",\"generator\":\"treemesh\"},";
+  json << "\"extensionsUsed\":[\"KHR_mesh_quantization\"" << (num_twig_nodes > 0 ? ",\"EXT_mesh_gpu_instancing\"" : "")
+       << "],\"extensionsRequired\":[\"KHR_mesh_quantization\"],";
+  json << "\"scene\":0,\"scenes\":[{\"nodes\":[0]}],";
+  json << "\"buffers\":[{\"byteLength\":" << buffer.size() << "}],";
+  json << "\"bufferViews\":[" << buffer_views.str() << "],";
+  json << "\"nodes\":[" << nodes.str() << "],";
+  json << "\"meshes\":[" << meshes.str() << "],";
+  json << "\"accessors\":[" << accessors.str() << "]}";
+  std::string json_chunk = json.str();
+  json_chunk.resize(((json_chunk.size() + 3) / 4) * 4, ' ');  // chunks are padded to 4 bytes
+
+  std::ofstream ofs(file_name, std::ios::binary | std::ios::out);
+  if (!ofs.is_open())
+  {
+    std::cerr << "Error: cannot open " << file_name << " for writing" << std::endl;
+    return false;
+  }
+  // the glb header, then the json and binary chunks, each with their length and type
+  const uint32_t header[3] = { 0x46546C67, 2, static_cast<uint32_t>(12 + 8 + json_chunk.size() + 8 + buffer.size()) };
+  const uint32_t json_header[2] = { static_cast<uint32_t>(json_chunk.size()), 0x4E4F534A };
+  const uint32_t binary_header[2] = { static_cast<uint32_t>(buffer.size()), 0x004E4942 };
+  ofs.write((const char *)header, sizeof(header));
+  ofs.write((const char *)json_header, sizeof(json_header));
+  ofs.write(json_chunk.data(), json_chunk.size());
+  ofs.write((const char *)binary_header, sizeof(binary_header));
+  ofs.write((const char *)buffer.data(), buffer.size());
+  if (!ofs.good())
+  {
+    std::cerr << "Error: failed writing " << file_name << std::endl;
+    return false;
+  }
+  return true;
+}
+
+/// @brief add the capsule (cylinder with hemispherical ends) to the mesh, approximated with 6 circumferential vertices
+/// @param writer the mesh range to add the capsule's 14 vertices and 24 triangles to
+/// @param pos1 base centre of capsule
+/// @param pos2 end centre of capsule
+/// @param radius radius of capsule
+/// @param rgba colour of capsule
+void addCapsule(MeshWriter &writer, const Eigen::Vector3d &pos1, const Eigen::Vector3d &pos2, double radius,
+                ray::RGBA rgba, double cap_scale)
+{
+  const int n = writer.vertex_index;
+  const Eigen::Vector3i N(n, n, n);
+  Eigen::Vector3d *vertices = writer.addVertices(14, rgba);
+
+  const Eigen::Vector3d dir = (pos2 - pos1).normalized();
+  const Eigen::Vector3d diag(1, 2, 3);
+  const Eigen::Vector3d side1 = dir.cross(diag).normalized();
+  const Eigen::Vector3d side2 = side1.cross(dir);
+
+  for (int i = 0; i < 6; i++)
+  {
+    // the end ring is rotated by half a triangle width from the start ring
+    vertices[i] = pos1 + radius * (side1 * kRingSin[2 * i] + side2 * kRingCos[2 * i]);
+    vertices[i + 6] = pos2 + radius * (side1 * kRingSin[2 * i + 1] + side2 * kRingCos[2 * i + 1]);
+    writer.addTriangle(N + Eigen::Vector3i(12, i, (i + 1) % 6));  // start end
+    writer.addTriangle(N + Eigen::Vector3i(13, (i + 1) % 6 + 6, i + 6));
+    writer.addTriangle(N + Eigen::Vector3i(i, i + 6, (i + 1) % 6));
+    writer.addTriangle(N + Eigen::Vector3i((i + 1) % 6 + 6, (i + 1) % 6, i + 6));
+  }
+  vertices[12] = pos1 - radius * dir * cap_scale;
+  vertices[13] = pos2 + radius * dir * cap_scale;
+}
+
+// add a single section of a capsule. Each one is like a node in the polyline with a radius.
+// The previous ring of the branch must have the same number of vertices
+void addCapsulePiece(MeshWriter &writer, const MeshRing &ring)
+{
+  const int n = ring.num_vertices;
+  const int start_index = writer.vertex_index;
+  const Eigen::Vector3i start_indices(start_index, start_index, start_index);  // start indices
+  const double *sins = n == 6 ? kRingSin : ringTables().sins[n];
+  const double *coss = n == 6 ? kRingCos : ringTables().coss[n];
+  Eigen::Vector3d dir = ring.side2.cross(ring.side1);
+  if (ring.cap_start)
+    *writer.addVertices(1, ring.rgba) = ring.pos - ring.radius * dir;
+
+  // add the vertices in the circumferential ring for this point along the branch
+  Eigen::Vector3d *vertices = writer.addVertices(n, ring.rgba);
+  for (int i = 0; i < n; i++)
+  {
+    const int angle_id = (2 * i + ring.wind) % (2 * n);
+    vertices[i] = ring.pos + ring.radius * (ring.side1 * sins[angle_id] + ring.side2 * coss[angle_id]);
+    // the indexing is a bit more complicated, to connect the vertices with triangles
+    if (ring.cap_start)
+    {
+      writer.addTriangle(start_indices + Eigen::Vector3i(0, 1 + i, 1 + ((i + 1) % n)));
+    }
+    else
+    {
+      writer.addTriangle(start_indices + Eigen::Vector3i(i - n, i, ((i + 1) % n) - n));
+      writer.addTriangle(start_indices + Eigen::Vector3i((i + 1) % n, ((i + 1) % n) - n, i));
+    }
+  }
+  if (ring.cap_end)
+  {
+    *writer.addVertices(1, ring.rgba) = ring.pos + ring.radius * dir;
+    for (int i = 0; i < n; i++)
+    {
+      writer.addTriangle(start_indices + Eigen::Vector3i(n, (i + 1) % n, i));
+    }
+  }
 }
@@ -3,6 +3,7 @@
 // ABN 41 687 119 230
 //
 // Author: Thomas Lowe
+#include "treelib/treeforestfile.h"
 #include "treelib/treeutils.h"
 #define STB_IMAGE_IMPLEMENTATION
 #include <raylib/extraction/raytrees.h>
@@ -45,7 +46,7 @@ int main(int argc, char *argv[])
   }
 
   ray::ForestStructure forest;
-  if (!forest.load(forest_file.name()))
+  if (!tree::loadForest(forest_file.name(), forest))
   {
     usage();
   }
@@ -6,24 +6,58 @@
 #include <raylib/raycloud.h>
 #include <raylib/rayparse.h>
 #include <raylib/rayrenderer.h>
+#include "treelib/treeforeststream.h"
 #include "treelib/treepruner.h"
 #include "treelib/treeutils.h"
 
+#include <algorithm>
 #include <cstdlib>
 #include <iostream>
+#include <string>
 
 void usage(int exit_code = 1)
 {
   // clang-format off
-  std::cout << "Prune branches less than a diameter, or by a chosen length" << std::endl;
+  std::cout << "Prune branches less than a diameter, or by a chosen length, or by several criteria at once" << std::endl;
   std::cout << "usage:" << std::endl;
   std::cout << "treeprune forest.txt 2 cm       - cut off branches less than 2 cm wide" << std::endl;
   std::cout << "                     0.5 m long - cut off branches less than 0.5 m long" << std::endl;
+  std::cout << "treeprune forest.txt --diameter 2 --length 0.5 - apply any of these criteria in a single pass:" << std::endl;
+  std::cout << "                     --diameter 2    - cut off branches less than 2 cm wide" << std::endl;
+  std::cout << "                     --length 0.5    - cut off branches less than 0.5 m long" << std::endl;
+  std::cout << "                     --order 2       - cut off branches of Strahler order less than 2, where the branches ending at tips are order 1" << std::endl;
+  std::cout << "                     --min_height 1  - cut off branches that are entirely below 1 m above the tree base" << std::endl;
+  std::cout << "                     --max_height 20 - cut off branches that start more than 20 m above the tree base" << std::endl;
+  std::cout << "                     --attribute name --threshold 0.5 - cut off branches whose attribute is below 0.5 all the way to their tips" << std::endl;
   // clang-format on
   exit(exit_code);
 }
 
-/// This method prunes the ends off branches according to a specified diameter or length.
+/// A plain text argument, such as an attribute name. ray::TextArgument only matches a fixed word, and
+/// ray::FileArgument is for file names, so this takes any single word as its value
+class NameArgument : public ray::FixedArgument
+{
+public:
+  bool parse(int argc, char *argv[], int &index, bool set_value = true) override
+  {
+    if (index >= argc)
+    {
+      return false;
+    }
+    if (set_value)
+    {
+      name_ = argv[index];
+    }
+    index++;
+    return true;
+  }
+  const std::string &name() const { return name_; }
+
+private:
+  std::string name_;
+};
+
+/// This method prunes the ends off branches according to a specified diameter or length, or several criteria at once.
 /// The pruned tree file is output with an _pruned.txt suffix.
 int main(int argc, char *argv[])
 {
@@ -34,38 +68,117 @@ int main(int argc, char *argv[])
 
   const bool prune_diameter = ray::parseCommandLine(argc, argv, { &forest_file, &diameter, &cm });
   const bool prune_length = ray::parseCommandLine(argc, argv, { &forest_file, &length, &m, &long_text });
-  if (!prune_diameter && !prune_length)
+
+  ray::DoubleArgument min_diameter(0.0001, 100.0), tip_length(0.001, 1000.0);
+  ray::DoubleArgument min_height(-1000.0, 1000.0), max_height(-1000.0, 1000.0), threshold(-1e10, 1e10);
+  ray::IntArgument min_order(1, 100);
+  NameArgument attribute;
+  ray::OptionalKeyValueArgument diameter_option("diameter", 'd', &min_diameter), length_option("length", 'l', &tip_length);
+  ray::OptionalKeyValueArgument order_option("order", 'o', &min_order);
+  ray::OptionalKeyValueArgument min_height_option("min_height", 'n', &min_height), max_height_option("max_height", 'x', &max_height);
+  ray::OptionalKeyValueArgument attribute_option("attribute", 'a', &attribute), threshold_option("threshold", 't', &threshold);
+  const bool prune_criteria = ray::parseCommandLine(argc, argv, { &forest_file }, { &diameter_option, &length_option, &order_option, &min_height_option, &max_height_option, &attribute_option, &threshold_option });
+  if (!prune_diameter && !prune_length && !prune_criteria)
   {
     usage();
   }
 
-  ray::ForestStructure forest;
-  if (!forest.load(forest_file.name()))
+  // all of the criteria are applied together, in one pass per tree
+  tree::PruneCriteria criteria;
+  if (prune_diameter)
+  {
+    criteria.min_diameter = 0.01 * diameter.value();  // from cm
+  }
+  else if (prune_length)
+  {
+    criteria.tip_length = length.value();
+  }
+  else
+  {
+    if (!diameter_option.isSet() && !length_option.isSet() && !order_option.isSet() && !min_height_option.isSet() &&
+        !max_height_option.isSet() && !attribute_option.isSet())
+    {
+      usage();
+    }
+    if (attribute_option.isSet() != threshold_option.isSet())
+    {
+      std::cerr << "Error: --attribute and --threshold must be used together" << std::endl;
+      usage();
+    }
+    if (diameter_option.isSet())
+    {
+      criteria.min_diameter = 0.01 * min_diameter.value();  // from cm
+    }
+    if (length_option.isSet())
+    {
+      criteria.tip_length = tip_length.value();
+    }
+    if (order_option.isSet())
+    {
+      criteria.min_branch_order = min_order.value();
+    }
+    if (min_height_option.isSet())
+    {
+      criteria.min_height = min_height.value();
+    }
+    if (max_height_option.isSet())
+    {
+      criteria.max_height = max_height.value();
+    }
+    if (attribute_option.isSet())
+    {
+      criteria.attribute = attribute.name();
+      criteria.attribute_threshold = threshold.value();
+    }
+  }
+
+  // the trees are pruned independently, so stream them one at a time to bound the memory use
+  tree::ForestReader reader;
+  if (!reader.open(forest_file.name()))
   {
     usage();
   }
-  if (forest.trees.size() != 0 && forest.trees[0].segments().size() == 0)
+  tree::ForestWriter writer;
+  if (!writer.open(forest_file.nameStub() + "_pruned" + tree::forestFileExtension(forest_file.name()),
+                   reader.comments()))
   {
-    std::cout << "prune only works on tree structures, not trunks-only files" << std::endl;
     usage();
   }
-  ray::ForestStructure new_forest;
-  if (prune_diameter)
+  ray::TreeStructure tree;
+  while (reader.readTree(tree))
   {
-    tree::pruneDiameter(forest, diameter.value(), new_forest);
+    if (tree.segments().size() == 0)
+    {
+      std::cout << "prune only works on tree structures, not trunks-only files" << std::endl;
+      writer.discard();
+      usage();
+    }
+    const auto &names = tree.attributeNames();
+    if (!criteria.attribute.empty() && std::find(names.begin(), names.end(), criteria.attribute) == names.end())
+    {
+      std::cerr << "Error: attribute " << criteria.attribute << " was not found in " << forest_file.name() << std::endl;
+      writer.discard();
+      usage();
+    }
+    if (tree::prune(tree, criteria))
+    {
+      writer.writeTree(tree);
+    }
   }
-  else if (prune_length)
+  if (reader.failed())
   {
-    tree::pruneLength(forest, length.value(), new_forest);
+    writer.discard();
+    return 1;
   }
 
-  if (new_forest.trees.empty())
+  if (writer.numTrees() == 0)
   {
     std::cout << "Warning: no trees left after pruning. No file saved." << std::endl;
+    writer.discard();
   }
-  else
+  else if (!writer.close())
   {
-    new_forest.save(forest_file.nameStub() + "_pruned.txt");
+    return 1;
   }
   return 0;
 }
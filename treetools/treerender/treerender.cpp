@@ -3,18 +3,26 @@
 // ABN 41 687 119 230
 //
 // Author: Thomas Lowe
+#include "treelib/treeforestfile.h"
 #include "treelib/treeutils.h"
+#define STB_IMAGE_IMPLEMENTATION
 #include <raylib/raycloud.h>
 #include <raylib/rayforeststructure.h>
 #include <raylib/rayparse.h>
 #include <raylib/rayrenderer.h>
 #include <raylib/raytreegen.h>
+#include <atomic>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <limits>
 #include "raylib/raytreegen.h"
 #include "raylib/rayprogress.h"
 #include "raylib/rayprogressthread.h"
-//#define STB_IMAGE_IMPLEMENTATION
+#include "treelib/imageread.h"
 #include "treelib/imagewrite.h"
 #include "raylib/raylibconfig.h"
 
@@ -27,15 +35,19 @@ void usage(int exit_code = 1)
   std::cout << "                  --max_colour 1     - colour using this as the maximum component value" << std::endl;
   std::cout << "treerender trees.txt height          - render by height (greyscale over range)" << std::endl;
   std::cout << "                     volume          - render by volume (greyscale over range)" << std::endl;
-//  std::cout << "                     surface_area    - render by surface area" << std::endl;
+  std::cout << "                     surface_area    - render by bark surface area (greyscale over range)" << std::endl;
+  std::cout << "                     plant_density   - render stems per hectare as red and wood volume per hectare as green" << std::endl;
   std::cout << "                     --rgb           - render greyscale as a red->green->blue colour gradient around its range" << std::endl;
   std::cout << "                  --resolution 512   - default resolution of longest axis" << std::endl;
   std::cout << "                  --pixel_width 0.1  - pixel width in metres as alternative to resolution setting" << std::endl;
   std::cout << "                  --grid_width 100   - fit to a square grid of this width, with one grid cell centre at 0,0" << std::endl;
   std::cout << "                  --crop x,y,rx,ry   - crop to window centred at x,y with radius (half-width) rx,ry" << std::endl;
   std::cout << "                  --output image.hdr - set output file (supported image types: .jpg, .png, .bmp, .tga, .hdr)" << std::endl;
-  std::cout << "                  --num_subvoxels 8  - used for volume estimation" << std::endl;
+  std::cout << "                  --num_subvoxels 8  - sub-columns per pixel width, used for volume estimation" << std::endl;
   std::cout << "                  --georeference name.proj- projection file name, to output (geo)tif file. " << std::endl;
+  std::cout << "                  --tiles 1024       - output as separate image tiles of this width, named image_column_row, rendered one at a time for very large images" << std::endl;
+  std::cout << "                  --pyramid 5        - output an XYZ pyramid of this many levels of 256x256 tiles, named image_z_x_y. Only changed tiles are rendered again" << std::endl;
+  std::cout << "                  --max_reduction    - build the coarser pyramid levels from the maximum rather than the mean of each 2x2 pixels" << std::endl;
   // clang-format on
   exit(exit_code);
 }
@@ -54,68 +66,1408 @@ struct Capsule
   double min_height {-1e10};
   double radius;
 
-  bool overlaps(const Eigen::Vector3d &pos)
+  bool overlaps(const Eigen::Vector3d &pos) const
   {
     Eigen::Vector3d vec = v2 - v1;
     Eigen::Vector3d closest = v1 + vec*(pos - v1).dot(vec)/vec.squaredNorm();
     return (closest - pos).squaredNorm() <= radius*radius;
   }
-  double rayIntersectionDepth(const Eigen::Vector3d &start, const Eigen::Vector3d &end)
+};
+
+/// The intersection of a capsule with vertical lines, for top-down rendering. The depths are those of a ray from height
+/// @c top down to @c bottom, using the expressions of a general ray-capsule intersection so that they match a ray
+/// traced that way bit for bit, but the terms that only depend on the capsule and the ray direction are computed once
+struct VerticalCapsule
+{
+  VerticalCapsule(const Capsule &capsule, double top, double bottom)
+    : v1(capsule.v1)
+    , v2(capsule.v2)
+    , radius(capsule.radius)
+    , radius_sqr(capsule.radius * capsule.radius)
+    , top(top)
+    , min_height(capsule.min_height)
+  {
+    ray = Eigen::Vector3d(0.0, 0.0, bottom - top);
+    dir = v2 - v1;
+    length = dir.norm();
+    if (length > 0.0)
+    {
+      dir /= length;
+    }
+    lateral_sqr = dir[0] * dir[0] + dir[1] * dir[1];
+    up = dir.cross(ray);
+    mag = up.norm();
+    if (mag > 0.0) // the axis is not vertical
+    {
+      up /= mag;
+    }
+    lateral_dir = ray - dir * ray.dot(dir);
+    lateral_length = lateral_dir.norm();
+    ray_dot_lateral = ray.dot(lateral_dir);
+    ray_length = ray.norm();
+    ray_length_sqr = ray_length * ray_length;
+  }
+
+  /// the depth below @c top of the capsule surface at position (@c x, @c y), or 0 if the ray misses the capsule
+  double depth(double x, double y) const
+  {
+    const Eigen::Vector3d start(x, y, top);
+    // cylinder part:
+    double cylinder_intersection1 = 1e10;
+    if (mag > 0.0)
+    {
+      double gap = std::abs((start - v1).dot(up));
+      if (gap > radius)
+        return 0.0;
+
+      double d_mid = (v1 - start).dot(lateral_dir) / ray_dot_lateral;
+      double shift = std::sqrt(radius_sqr - gap*gap) / lateral_length;
+      double d_min = d_mid - shift;
+      double d1 = (start + ray*d_min - v1).dot(dir) / length;
+      if (d1 > 0.0 && d1 < 1.0)
+      {
+        cylinder_intersection1 = d_min;
+      }
+    }
+
+    // the spheres part:
+    double sphere_intersection1[2] = {1e10, 1e10};
+    const Eigen::Vector3d ends[2] = {v1, v2};
+    for (int e = 0; e<2; e++)
+    {
+      double mid_d = (ends[e] - start).dot(ray) / ray_length_sqr;
+      Eigen::Vector3d shortest_dir = (ends[e] - start) - ray * mid_d;
+      double shortest_sqr = shortest_dir.squaredNorm();
+      if (shortest_sqr < radius_sqr)
+      {
+        double shift = std::sqrt(radius_sqr - shortest_sqr) / ray_length;
+        sphere_intersection1[e] = mid_d - shift;
+      }
+    }
+
+    // combining together
+    double closest_d = std::min( {cylinder_intersection1, sphere_intersection1[0], sphere_intersection1[1]} );
+    if (closest_d == 1e10)
+      return 0.0;
+    return closest_d * ray_length;
+  }
+
+  /// the range of heights [@c lower, @c upper] over which the vertical line through (@c x, @c y) is inside the
+  /// capsule and above its minimum height. Returns false if the line misses it
+  bool interval(double x, double y, double &lower, double &upper) const
+  {
+    lower = std::numeric_limits<double>::max();
+    upper = std::numeric_limits<double>::lowest();
+    // the capsule is convex, so the union of the sphere and cylinder intervals is their combined range
+    const Eigen::Vector3d ends[2] = {v1, v2};
+    for (int e = 0; e<2; e++)
+    {
+      const double dist_sqr = (x - ends[e][0]) * (x - ends[e][0]) + (y - ends[e][1]) * (y - ends[e][1]);
+      if (dist_sqr < radius_sqr)
+      {
+        const double half_chord = std::sqrt(radius_sqr - dist_sqr);
+        lower = std::min(lower, ends[e][2] - half_chord);
+        upper = std::max(upper, ends[e][2] + half_chord);
+      }
+    }
+    const double x1 = x - v1[0];
+    const double y1 = y - v1[1];
+    const double dist1_sqr = x1 * x1 + y1 * y1;
+    if (lateral_sqr > 0.0)
+    {
+      const double along = x1 * dir[0] + y1 * dir[1];
+      const double b = along * dir[2];
+      const double c = dist1_sqr - along * along - radius_sqr;
+      const double discriminant = b * b - lateral_sqr * c;
+      if (discriminant >= 0.0)
+      {
+        // the two roots, in a form that avoids cancellation
+        const double q = b >= 0.0 ? b + std::sqrt(discriminant) : b - std::sqrt(discriminant);
+        double w_min = q / lateral_sqr;
+        double w_max = q != 0.0 ? c / q : w_min;
+        if (w_min > w_max)
+        {
+          std::swap(w_min, w_max);
+        }
+        // clip to the part of the line within the cylinder's length
+        if (dir[2] != 0.0)
+        {
+          const double w_start = -along / dir[2];
+          const double w_end = (length - along) / dir[2];
+          w_min = std::max(w_min, std::min(w_start, w_end));
+          w_max = std::min(w_max, std::max(w_start, w_end));
+        }
+        else if (along < 0.0 || along > length)
+        {
+          w_max = w_min - 1.0;
+        }
+        if (w_min <= w_max)
+        {
+          lower = std::min(lower, v1[2] + w_min);
+          upper = std::max(upper, v1[2] + w_max);
+        }
+      }
+    }
+    else if (length > 0.0 && dist1_sqr < radius_sqr)  // a vertical cylinder
+    {
+      lower = std::min(lower, std::min(v1[2], v2[2]));
+      upper = std::max(upper, std::max(v1[2], v2[2]));
+    }
+    lower = std::max(lower, min_height);
+    return lower < upper;
+  }
+
+  Eigen::Vector3d v1, v2, dir;
+  double length, lateral_sqr, radius, radius_sqr, top;
+  double min_height;
+  // the downward ray and its terms against the capsule axis
+  Eigen::Vector3d ray, up, lateral_dir;
+  double mag, lateral_length, ray_dot_lateral, ray_length, ray_length_sqr;
+};
+
+/// the total length covered by a list of [lower, upper] @c intervals, which are sorted in place
+double unionLength(std::vector<std::pair<double, double>> &intervals)
+{
+  std::sort(intervals.begin(), intervals.end());
+  double length = 0.0;
+  double covered = std::numeric_limits<double>::lowest();  // the top of the intervals so far
+  for (const auto &interval: intervals)
+  {
+    if (interval.second > covered)
+    {
+      length += interval.second - std::max(interval.first, covered);
+      covered = interval.second;
+    }
+  }
+  return length;
+}
+
+/// the range of pixels [mins, maxs) covered by the horizontal bounds of @c capsule, clipped to a width x height image
+void capsulePixels(const Capsule &capsule, const Eigen::Vector3d &min_bound, double pixel_width, int width, int height,
+                   Eigen::Vector2i &mins, Eigen::Vector2i &maxs)
+{
+  Eigen::Vector3d min_caps = ray::minVector(capsule.v1, capsule.v2) - Eigen::Vector3d(capsule.radius, capsule.radius, 0);
+  Eigen::Vector3d max_caps = ray::maxVector(capsule.v1, capsule.v2) + Eigen::Vector3d(capsule.radius, capsule.radius, 0);
+  mins = ((min_caps - min_bound) / pixel_width).head<2>().cast<int>();
+  maxs = ((max_caps - min_bound) / pixel_width).head<2>().cast<int>() + Eigen::Vector2i(1,1);
+  mins = mins.cwiseMax(Eigen::Vector2i(0,0));
+  maxs = maxs.cwiseMin(Eigen::Vector2i(width, height));
+}
+
+/// The capsules that overlap each tile of a grid of square tiles over a window of the image, in compressed sparse row
+/// form. The capsule ids of each tile are in increasing order, so processing them gives the same result as
+/// processing every capsule in turn.
+struct CapsuleBins
+{
+  /// bin the capsules @c capsule_ids, which cover pixel ranges [mins[id], maxs[id]), into tiles of @c tile_width
+  /// pixels over the window [window_min, window_max) of the image. Built by a two-pass counting sort, so there is
+  /// one allocation for the whole table
+  void build(const std::vector<int> &capsule_ids, const std::vector<Eigen::Vector2i> &mins,
+             const std::vector<Eigen::Vector2i> &maxs, const Eigen::Vector2i &window_min,
+             const Eigen::Vector2i &window_max, int tile_width)
+  {
+    this->tile_width = tile_width;
+    this->window_min = window_min;
+    this->window_max = window_max;
+    num_x = (window_max[0] - window_min[0] + tile_width - 1) / tile_width;
+    num_y = (window_max[1] - window_min[1] + tile_width - 1) / tile_width;
+    starts.assign(static_cast<size_t>(num_x) * num_y + 1, 0);
+    // the first pass counts the capsules per tile, the second fills them in
+    for (int pass = 0; pass < 2; pass++)
+    {
+      for (auto &id: capsule_ids)
+      {
+        const Eigen::Vector2i lo = mins[id].cwiseMax(window_min) - window_min;
+        const Eigen::Vector2i hi = maxs[id].cwiseMin(window_max) - window_min;
+        if (lo[0] >= hi[0] || lo[1] >= hi[1])
+        {
+          continue;
+        }
+        const Eigen::Vector2i min_tile = lo / tile_width;
+        const Eigen::Vector2i max_tile = (hi - Eigen::Vector2i(1,1)) / tile_width;
+        for (int y = min_tile[1]; y <= max_tile[1]; y++)
+        {
+          for (int x = min_tile[0]; x <= max_tile[0]; x++)
+          {
+            const size_t tile = static_cast<size_t>(x) + static_cast<size_t>(num_x) * y;
+            if (pass == 0)
+            {
+              starts[tile + 1]++;
+            }
+            else
+            {
+              ids[starts[tile]++] = id;
+            }
+          }
+        }
+      }
+      if (pass == 0)
+      {
+        for (size_t t = 1; t < starts.size(); t++)
+        {
+          starts[t] += starts[t - 1];
+        }
+        ids.resize(starts.back());
+      }
+    }
+    // filling advanced each start to the next tile's start, so shift them back
+    for (size_t t = starts.size() - 1; t > 0; t--)
+    {
+      starts[t] = starts[t - 1];
+    }
+    starts[0] = 0;
+  }
+  size_t numTiles() const { return starts.size() - 1; }
+  /// the range of pixels [tileMin(t), tileMax(t)) of tile @c t
+  Eigen::Vector2i tileMin(size_t t) const
+  {
+    return window_min + Eigen::Vector2i(static_cast<int>(t % num_x), static_cast<int>(t / num_x)) * tile_width;
+  }
+  Eigen::Vector2i tileMax(size_t t) const
+  {
+    return (tileMin(t) + Eigen::Vector2i(tile_width, tile_width)).cwiseMin(window_max);
+  }
+  /// the capsule ids of tile @c t
+  std::vector<int> tileIds(size_t t) const
+  {
+    return std::vector<int>(ids.begin() + starts[t], ids.begin() + starts[t + 1]);
+  }
+
+  int tile_width = 1;
+  int num_x = 0, num_y = 0;
+  Eigen::Vector2i window_min, window_max;
+  std::vector<size_t> starts;  // the capsules of tile t are ids[starts[t]] up to ids[starts[t+1]]
+  std::vector<int> ids;
+};
+
+/// set pixel @c ind of the image to @c colour, which is multiplied by @c scale for 8-bit images
+void setPixel(int ind, const Eigen::Vector3d &colour, double scale, std::vector<ray::RGBA> &pixel_colours,
+              std::vector<float> &float_pixel_colours)
+{
+  if (!float_pixel_colours.empty())
+  {
+    float_pixel_colours[3*ind + 0] = (float)colour[0];
+    float_pixel_colours[3*ind + 1] = (float)colour[1];
+    float_pixel_colours[3*ind + 2] = (float)colour[2];
+  }
+  else
+  {
+    pixel_colours[ind] = ray::RGBA((uint8_t)(colour[0]*scale), (uint8_t)(colour[1]*scale), (uint8_t)(colour[2]*scale), 255);
+  }
+}
+
+/// set pixel @c ind of the image by a @c value, shaded over the range 0 to @c max_value in greyscale or along the
+/// colour gradient. Float images store the value itself when in greyscale
+void setValuePixel(int ind, double value, double max_value, bool use_gradient, std::vector<ray::RGBA> &pixel_colours,
+                   std::vector<float> &float_pixel_colours)
+{
+  double shade = max_value > 0.0 ? std::max(0.0, std::min(value/max_value, 1.0)) : 0.0;
+  if (use_gradient)
+    setPixel(ind, gradient(shade), 255.0, pixel_colours, float_pixel_colours);
+  else if (!float_pixel_colours.empty())
+    setPixel(ind, Eigen::Vector3d(value, value, value), 1.0, pixel_colours, float_pixel_colours);
+  else
+    setPixel(ind, Eigen::Vector3d(shade, shade, shade), 255.0, pixel_colours, float_pixel_colours);
+}
+
+/// The rendered values of a rectangular window of pixels [min_pixel, max_pixel) of the image, in row order
+struct Window
+{
+  Window(const Eigen::Vector2i &min_pixel, const Eigen::Vector2i &max_pixel)
+    : min_pixel(min_pixel)
+    , max_pixel(max_pixel)
+  {
+    values.resize(static_cast<size_t>(width()) * height(), Eigen::Vector3d(0,0,0));
+    covered.resize(values.size(), 0);
+  }
+  int width() const { return max_pixel[0] - min_pixel[0]; }
+  int height() const { return max_pixel[1] - min_pixel[1]; }
+  /// the index of image pixel (x, y) within the window
+  int index(int x, int y) const { return (x - min_pixel[0]) + width() * (y - min_pixel[1]); }
+
+  Eigen::Vector2i min_pixel, max_pixel;
+  /// for the colour and height styles the pixel colour. Otherwise the style's values: the wood volume from each
+  /// of the two sampling phases for volume, the bark area for surface_area, and the number of stems and the wood
+  /// volume for plant_density
+  std::vector<Eigen::Vector3d> values;
+  std::vector<uint8_t> covered;  // whether each pixel has been set, otherwise it is transparent
+};
+
+/// Distribute the bark surface area and the wood volume of the cylinder part of @c capsule onto the pixels
+/// in [tile_min, tile_max) of @c window that they lie above. The surface is split into patches and the axis into
+/// pieces at most half a pixel apart, and each adds its share to the pixel below its centre. The end caps are
+/// not included, since they are shared with the adjoining segments
+void addCapsuleCoverage(const Capsule &capsule, const Eigen::Vector3d &min_bound, double pixel_width,
+                        const Eigen::Vector2i &tile_min, const Eigen::Vector2i &tile_max, const Window &window,
+                        std::vector<double> &areas, std::vector<double> &volumes)
+{
+  Eigen::Vector3d axis = capsule.v2 - capsule.v1;
+  const double length = axis.norm();
+  if (length == 0.0)
+  {
+    return;
+  }
+  axis /= length;
+  const Eigen::Vector3d side1 = axis.cross(std::abs(axis[2]) < 0.9 ? Eigen::Vector3d(0,0,1) : Eigen::Vector3d(1,0,0)).normalized();
+  const Eigen::Vector3d side2 = axis.cross(side1);
+  const double spacing = 0.5 * pixel_width;
+  const double circumference = 2.0 * ray::kPi * capsule.radius;
+  const int num_along = std::max(1, (int)std::ceil(length * axis.head<2>().norm() / spacing));
+  const int num_around = std::max(4, (int)std::ceil(circumference / spacing));
+  const double patch_area = circumference * length / (double)(num_along * num_around);
+  const double piece_volume = ray::kPi * capsule.radius * capsule.radius * length / (double)num_along;
+
+  auto add = [&](const Eigen::Vector3d &pos, double amount, std::vector<double> &values)
+  {
+    const int x = (int)std::floor((pos[0] - min_bound[0]) / pixel_width);
+    const int y = (int)std::floor((pos[1] - min_bound[1]) / pixel_width);
+    if (x >= tile_min[0] && x < tile_max[0] && y >= tile_min[1] && y < tile_max[1])
+    {
+      values[window.index(x, y)] += amount;
+    }
+  };
+  for (int i = 0; i < num_along; i++)
+  {
+    const Eigen::Vector3d centre = capsule.v1 + axis * (length * ((double)i + 0.5) / (double)num_along);
+    add(centre, piece_volume, volumes);
+    for (int j = 0; j < num_around; j++)
+    {
+      const double angle = 2.0 * ray::kPi * ((double)j + 0.5) / (double)num_around;
+      add(centre + capsule.radius * (std::cos(angle) * side1 + std::sin(angle) * side2), patch_area, areas);
+    }
+  }
+}
+
+/// The capsules of a forest and the settings for rendering them. The image is rendered in windows, each of which
+/// only visits the capsules that overlap it, so an image can be rendered a part at a time
+struct ForestRender
+{
+  enum class Style
+  {
+    Colour,
+    Height,
+    Volume,
+    SurfaceArea,
+    PlantDensity
+  };
+
+  /// convert the forest's segments to capsules, and find the pixel of each tree base. For the colour style,
+  /// @c red_id is the index of the red attribute
+  void addForest(const ray::ForestStructure &forest, int red_id)
+  {
+    const bool depth_styles = style == Style::Colour || style == Style::Height;
+    for (auto &tree: forest.trees)
+    {
+      const Eigen::Vector3d &base = tree.segments()[0].tip;
+      stems.push_back(Eigen::Vector2i((int)std::floor((base[0] - min_bound[0]) / pixel_width),
+                                      (int)std::floor((base[1] - min_bound[1]) / pixel_width)));
+      for (size_t i = 1; i<tree.segments().size(); i++)
+      {
+        auto &segment = tree.segments()[i];
+        Capsule capsule;
+        capsule.v2 = segment.tip;
+        capsule.v1 = tree.segments()[segment.parent_id].tip;
+        capsule.radius = segment.radius;
+        if (depth_styles)
+        {
+          capsule.radius += pixel_width/2.0;
+          if (segment.parent_id == 0) // need to clip capsule's lower cap at ground level
+          {
+            capsule.min_height = capsule.v1[2];
+          }
+        }
+        capsules.push_back(capsule);
+        if (style == Style::Colour)
+        {
+          colours.push_back(Eigen::Vector3d(segment.attributes[red_id], segment.attributes[red_id + 1], segment.attributes[red_id + 2]));
+        }
+      }
+    }
+    mins.resize(capsules.size());
+    maxs.resize(capsules.size());
+    vertical_capsules.reserve(capsules.size());
+    for (size_t i = 0; i < capsules.size(); i++)
+    {
+      capsulePixels(capsules[i], min_bound, pixel_width, width, height, mins[i], maxs[i]);
+      const double margin = depth_styles ? pixel_width : 0.0;
+      vertical_capsules.push_back(VerticalCapsule(capsules[i], max_bound[2] + margin, min_bound[2] - margin));
+    }
+  }
+
+  /// render the pixels of @c window from the capsules @c ids that overlap it, counting its rows in @c progress
+  void renderWindow(const std::vector<int> &ids, Window &window, ray::Progress &progress) const
+  {
+    if (style == Style::Colour || style == Style::Height)
+      renderDepths(ids, window);
+    else if (style == Style::Volume)
+      renderVolumes(ids, window, progress);
+    else
+      renderCoverage(ids, window);
+    if (style != Style::Volume)
+      progress.increment(window.height());
+  }
+
+  /// the colour and height styles: the colour of the nearest capsule seen from above
+  void renderDepths(const std::vector<int> &ids, Window &window) const
+  {
+    CapsuleBins bins;
+    bins.build(ids, mins, maxs, window.min_pixel, window.max_pixel, kTileWidth);
+
+    // each tile is rendered independently with its own depth buffer. Its capsules are in forest order, so
+    // the nearest capsule at each pixel is the same as for a serial render
+    #pragma omp parallel for schedule(dynamic)
+    for (int t = 0; t < static_cast<int>(bins.numTiles()); t++)
+    {
+      const Eigen::Vector2i tile_min = bins.tileMin(t);
+      const Eigen::Vector2i tile_max = bins.tileMax(t);
+      std::vector<double> depths(kTileWidth*kTileWidth, 1e10);
+      std::vector<int> nearest(kTileWidth*kTileWidth, -1);  // the capsule at each depth
+      for (size_t j = bins.starts[t]; j < bins.starts[t+1]; j++)
+      {
+        const int id = bins.ids[j];
+        const VerticalCapsule &capsule = vertical_capsules[id];
+        const Eigen::Vector2i lo = mins[id].cwiseMax(tile_min);
+        const Eigen::Vector2i hi = maxs[id].cwiseMin(tile_max);
+        for (int y = lo[1]; y < hi[1]; y++)
+        {
+          const double pos_y = ((double)y + 0.5)*pixel_width + min_bound[1];
+          for (int x = lo[0]; x < hi[0]; x++)
+          {
+            const double depth = capsule.depth(((double)x + 0.5)*pixel_width + min_bound[0], pos_y);
+            const int ind = (x - tile_min[0]) + kTileWidth*(y - tile_min[1]);
+            if (depth > 0.0 && depth <= depths[ind]) // as in a serial render, the later capsule is used at equal depths
+            {
+              depths[ind] = depth;
+              nearest[ind] = id;
+            }
+          }
+        }
+      }
+      for (int y = tile_min[1]; y < tile_max[1]; y++)
+      {
+        for (int x = tile_min[0]; x < tile_max[0]; x++)
+        {
+          const int tile_ind = (x - tile_min[0]) + kTileWidth*(y - tile_min[1]);
+          if (nearest[tile_ind] == -1)
+          {
+            continue;
+          }
+          const int ind = window.index(x, y);
+          window.covered[ind] = 1;
+          if (style == Style::Height)
+          {
+            double shade = std::max(0.0, std::min(1.0 - depths[tile_ind] / (max_bound[2] - min_bound[2]), 1.0));
+            window.values[ind] = use_gradient ? gradient(shade) : Eigen::Vector3d(shade, shade, shade);
+          }
+          else // segment colour
+          {
+            window.values[ind] = colours[nearest[tile_ind]];
+          }
+        }
+      }
+    }
+  }
+
+  /// the volume style: the wood volume over each pixel, for the two sampling phases
+  void renderVolumes(const std::vector<int> &ids, Window &window, ray::Progress &progress) const
+  {
+    // first, calculate capsules that intersect each pixel, as lists of indices into the capsule array
+    CapsuleBins pixel_capsules;
+    pixel_capsules.build(ids, mins, maxs, window.min_pixel, window.max_pixel, 1);
+
+    // each pixel's volume is integrated over n x n sub-columns. The capsules cut each sub-column in vertical
+    // intervals, whose union is the length of wood in the sub-column, so overlapping capsules are not counted twice
+    const int n = num_subvoxels;
+    const double subpixel_width = pixel_width / (double)n;
+    const double subpixel_area = subpixel_width*subpixel_width;
+    const double ds[2] = {0.25, 0.75};
+
+    // rows are independent, so are processed in parallel, with each thread reusing its own interval buffer.
+    // Both phases are calculated together so each pixel's capsule list is only visited once
+    #pragma omp parallel
+    {
+      std::vector<std::pair<double, double>> intervals;
+      #pragma omp for schedule(dynamic)
+      for (int y = window.min_pixel[1]; y<window.max_pixel[1]; y++)
+      {
+        for (int x = window.min_pixel[0]; x<window.max_pixel[0]; x++)
+        {
+          Eigen::Vector3d pixel_min_bound = min_bound + pixel_width*Eigen::Vector3d(x,y,0);
+          const int ind = window.index(x, y);
+          for (int phase = 0; phase<2; phase++)
+          {
+            double delta = ds[phase];
+            double length = 0.0;
+            for (int xx = 0; xx < n; xx++)
+            {
+              for (int yy = 0; yy < n; yy++)
+              {
+                const double pos_x = ((double)xx + delta)*subpixel_width + pixel_min_bound[0];
+                const double pos_y = ((double)yy + delta)*subpixel_width + pixel_min_bound[1];
+                intervals.clear();
+                for (size_t j = pixel_capsules.starts[ind]; j < pixel_capsules.starts[ind + 1]; j++)
+                {
+                  double lower, upper;
+                  if (vertical_capsules[pixel_capsules.ids[j]].interval(pos_x, pos_y, lower, upper))
+                  {
+                    lower = std::max(lower, min_bound[2]); // nothing below the ground is counted
+                    if (lower < upper)
+                    {
+                      intervals.push_back(std::make_pair(lower, upper));
+                    }
+                  }
+                }
+                length += unionLength(intervals);
+              }
+            }
+            window.values[ind][phase] = subpixel_area * length;
+          }
+          window.covered[ind] = 1;
+        }
+        progress.increment();  // the progress count is atomic
+      }
+    }
+  }
+
+  /// the surface_area and plant_density styles: the bark area, wood volume and stems over each pixel
+  void renderCoverage(const std::vector<int> &ids, Window &window) const
+  {
+    CapsuleBins bins;
+    bins.build(ids, mins, maxs, window.min_pixel, window.max_pixel, kTileWidth);
+
+    // the surface area and volume are accumulated together, with each tile of pixels summed by one thread in
+    // forest order, so the result does not depend on the number of threads
+    std::vector<double> areas(window.values.size(), 0.0), volumes(window.values.size(), 0.0);
+    #pragma omp parallel for schedule(dynamic)
+    for (int t = 0; t < static_cast<int>(bins.numTiles()); t++)
+    {
+      for (size_t j = bins.starts[t]; j < bins.starts[t+1]; j++)
+      {
+        addCapsuleCoverage(capsules[bins.ids[j]], min_bound, pixel_width, bins.tileMin(t), bins.tileMax(t), window, areas, volumes);
+      }
+    }
+    for (size_t i = 0; i < window.values.size(); i++)
+    {
+      window.values[i] = style == Style::SurfaceArea ? Eigen::Vector3d(areas[i], 0, 0) : Eigen::Vector3d(0, volumes[i], 0);
+      window.covered[i] = 1;
+    }
+    if (style == Style::PlantDensity)
+    {
+      for (auto &stem: stems)
+      {
+        if ((stem.array() >= window.min_pixel.array()).all() && (stem.array() < window.max_pixel.array()).all())
+        {
+          window.values[window.index(stem[0], stem[1])][0]++;
+        }
+      }
+    }
+  }
+
+  /// whether the colours depend on the maximum values over the whole image, which must then be found first
+  bool needsMaxima() const
+  {
+    if (style == Style::Volume || style == Style::SurfaceArea)
+      return use_gradient || !is_hdr;
+    return style == Style::PlantDensity && !is_hdr;
+  }
+
+  /// update the per-value @c maxima and @c totals with the values of @c window. The totals are the wood volume
+  /// and its estimated error for volume, the bark area for surface_area, and the stems and wood volume for
+  /// plant_density
+  void accumulate(const Window &window, Eigen::Vector3d &maxima, Eigen::Vector3d &totals) const
+  {
+    for (auto &value: window.values)
+    {
+      maxima = maxima.cwiseMax(value);
+      if (style == Style::Volume)
+        totals += Eigen::Vector3d((value[0] + value[1])/2.0, std::abs(value[0] - value[1])/2.0, 0);
+      else
+        totals += value;
+    }
+  }
+
+  /// write the colours of @c window to the image buffers, which cover the pixels from @c image_min and are
+  /// @c image_width pixels wide. @c maxima are the maximum values over the whole image
+  void colourWindow(const Window &window, const Eigen::Vector3d &maxima, const Eigen::Vector2i &image_min,
+                    int image_width, std::vector<ray::RGBA> &pixel_colours, std::vector<float> &float_pixel_colours) const
+  {
+    const double per_hectare = 10000.0 / (pixel_width*pixel_width);
+    for (int y = window.min_pixel[1]; y < window.max_pixel[1]; y++)
+    {
+      for (int x = window.min_pixel[0]; x < window.max_pixel[0]; x++)
+      {
+        const int i = window.index(x, y);
+        if (!window.covered[i])
+        {
+          continue;
+        }
+        const Eigen::Vector3d &value = window.values[i];
+        const int ind = (x - image_min[0]) + image_width*(y - image_min[1]);
+        if (style == Style::Colour)
+          setPixel(ind, value, colour_scale, pixel_colours, float_pixel_colours);
+        else if (style == Style::Height)
+          setPixel(ind, value, 255.0, pixel_colours, float_pixel_colours);
+        else if (style == Style::Volume)
+          setValuePixel(ind, (value[0] + value[1])/2.0, maxima[0] + maxima[1], use_gradient, pixel_colours, float_pixel_colours);
+        else if (style == Style::SurfaceArea)
+          setValuePixel(ind, value[0], maxima[0], use_gradient, pixel_colours, float_pixel_colours);
+        else if (is_hdr) // densities per hectare: stems in red and wood volume in green
+          setPixel(ind, value * per_hectare, 1.0, pixel_colours, float_pixel_colours);
+        else
+        {
+          const double stem_shade = maxima[0] > 0.0 ? value[0] / maxima[0] : 0.0;
+          const double volume_shade = maxima[1] > 0.0 ? value[1] / maxima[1] : 0.0;
+          setPixel(ind, Eigen::Vector3d(stem_shade, volume_shade, 0.0), 255.0, pixel_colours, float_pixel_colours);
+        }
+      }
+    }
+  }
+
+  // the width in pixels of the square tiles that are rendered in parallel
+  static const int kTileWidth = 64;
+
+  Style style = Style::Colour;
+  bool use_gradient = false;
+  bool is_hdr = false;
+  int num_subvoxels = 8;
+  double colour_scale = 1.0;
+  Eigen::Vector3d min_bound, max_bound;
+  double pixel_width = 1.0;
+  int width = 0, height = 0;
+
+  std::vector<Capsule> capsules;
+  std::vector<VerticalCapsule> vertical_capsules;
+  std::vector<Eigen::Vector3d> colours;     // the segment colour of each capsule, for the colour style
+  std::vector<Eigen::Vector2i> mins, maxs;  // the range of pixels covered by each capsule
+  std::vector<Eigen::Vector2i> stems;       // the pixel of each tree base
+};
+
+/// whether images of the type given by extension @c image_ext can be written
+bool supportedImageType(const std::string &image_ext)
+{
+  if (image_ext == "png" || image_ext == "bmp" || image_ext == "tga" || image_ext == "jpg" || image_ext == "hdr")
+    return true;
+#if RAYLIB_WITH_TIFF
+  if (image_ext == "tif")
+    return true;
+#endif
+  return false;
+}
+
+/// write an image in the format given by its file extension. @c min_bound is the position of the image's lower left
+/// corner, used to georeference tif files. Returns false if the image could not be written
+bool writeImage(const std::string &image_file, int width, int height, std::vector<ray::RGBA> &pixel_colours,
+                std::vector<float> &float_pixel_colours, const Eigen::Vector3d &min_bound, double pixel_width,
+                const std::string &projection_file)
+{
+  const std::string image_ext = ray::getFileNameExtension(image_file);
+  const char *image_name = image_file.c_str();
+  stbi_flip_vertically_on_write(1);
+  int written = 1;  // stb returns 0 on failure
+  if (image_ext == "png")
+    written = stbi_write_png(image_name, width, height, 4, (void *)&pixel_colours[0], 4 * width);
+  else if (image_ext == "bmp")
+    written = stbi_write_bmp(image_name, width, height, 4, (void *)&pixel_colours[0]);
+  else if (image_ext == "tga")
+    written = stbi_write_tga(image_name, width, height, 4, (void *)&pixel_colours[0]);
+  else if (image_ext == "jpg")
+    written = stbi_write_jpg(image_name, width, height, 4, (void *)&pixel_colours[0], 100);  // 100 is maximal quality
+  else if (image_ext == "hdr")
+    written = stbi_write_hdr(image_name, width, height, 3, &float_pixel_colours[0]);
+#if RAYLIB_WITH_TIFF
+  else if (image_ext == "tif")
+  {
+    // obtain the origin offsets
+    const Eigen::Vector3d origin(0, 0, 0);
+    const Eigen::Vector3d pos = -(origin - min_bound);
+    const double x = pos[0], y = pos[1] + static_cast<double>(height) * pixel_width;
+    // generate the geotiff file
+    ray::writeGeoTiffFloat(image_file, width, height, &float_pixel_colours[0], pixel_width, false, projection_file, x, y);
+  }
+#else
+  (void)min_bound;
+  (void)pixel_width;
+  (void)projection_file;
+#endif
+  if (!written)
+  {
+    std::cerr << "Error: cannot write " << image_file << std::endl;
+  }
+  return written != 0;
+}
+
+/// colour @c window into its own image buffers and write it as the image file @c image_file. Returns false if the
+/// image could not be written
+bool writeWindow(const ForestRender &render, const Window &window, const Eigen::Vector3d &maxima,
+                 const std::string &image_file, const std::string &projection_file)
+{
+  std::vector<ray::RGBA> pixel_colours;
+  std::vector<float> float_pixel_colours;
+  if (render.is_hdr)
+    float_pixel_colours.resize(3 * window.values.size(), 0.0);
+  else
+    pixel_colours.resize(window.values.size(), ray::RGBA(0,0,0,0));
+  render.colourWindow(window, maxima, window.min_pixel, window.width(), pixel_colours, float_pixel_colours);
+  const Eigen::Vector3d corner = render.min_bound + render.pixel_width * Eigen::Vector3d(window.min_pixel[0], window.min_pixel[1], 0);
+  return writeImage(image_file, window.width(), window.height(), pixel_colours, float_pixel_colours, corner, render.pixel_width, projection_file);
+}
+
+/// Render the image as separate tile images of @c tile_size pixels wide, one tile at a time, so the memory used does
+/// not depend on the image size. The tiles are named image_column_row, counting from the top left tile.
+/// Styles that are shaded relative to the maximum over the image are first rendered to a temporary file of values,
+/// which is coloured and written in a second pass. Returns false if any tile could not be written
+bool renderTiles(const ForestRender &render, int tile_size, const std::string &image_file,
+                 const std::string &projection_file, Eigen::Vector3d &maxima, Eigen::Vector3d &totals)
+{
+  std::vector<int> capsule_ids(render.capsules.size());
+  for (size_t i = 0; i < capsule_ids.size(); i++)
+  {
+    capsule_ids[i] = static_cast<int>(i);
+  }
+  // the capsules overlapping each tile, so that each tile only visits its own capsules
+  CapsuleBins tiles;
+  tiles.build(capsule_ids, render.mins, render.maxs, Eigen::Vector2i(0,0), Eigen::Vector2i(render.width, render.height), tile_size);
+
+  const std::string image_stub = image_file.substr(0, image_file.find_last_of('.'));
+  const std::string image_ext = ray::getFileNameExtension(image_file);
+  auto tile_name = [&](size_t t)
+  {
+    const int column = static_cast<int>(t % tiles.num_x);
+    const int row = tiles.num_y - 1 - static_cast<int>(t / tiles.num_x);
+    return image_stub + "_" + std::to_string(column) + "_" + std::to_string(row) + "." + image_ext;
+  };
+
+  const bool two_pass = render.needsMaxima();
+  const std::string values_file = image_stub + "_values.tmp";
+  std::ofstream values_out;
+  if (two_pass)
+  {
+    values_out.open(values_file, std::ios::binary);
+    if (!values_out.is_open())
+    {
+      std::cerr << "Error: cannot open " << values_file << " for writing" << std::endl;
+      return false;
+    }
+  }
+
+  ray::Progress progress;
+  ray::ProgressThread progress_thread(progress);
+  progress.begin("render tiles: ", static_cast<size_t>(render.height) * tiles.num_x);
+  bool tiles_written = true;
+  for (size_t t = 0; t < tiles.numTiles(); t++)
+  {
+    Window window(tiles.tileMin(t), tiles.tileMax(t));
+    render.renderWindow(tiles.tileIds(t), window, progress);
+    render.accumulate(window, maxima, totals);
+    if (two_pass)
+    {
+      values_out.write((const char *)window.values[0].data(), sizeof(Eigen::Vector3d) * window.values.size());
+      values_out.write((const char *)window.covered.data(), window.covered.size());
+      if (!values_out.good())
+      {
+        break;
+      }
+    }
+    else if (!writeWindow(render, window, maxima, tile_name(t), projection_file))
+    {
+      tiles_written = false;
+      break;
+    }
+  }
+  progress.end();
+  progress_thread.requestQuit();
+  progress_thread.join();
+  if (!tiles_written)
+  {
+    return false;
+  }
+
+  if (two_pass)
+  {
+    const bool values_written = values_out.good();
+    values_out.close();
+    if (!values_written || values_out.fail())
+    {
+      std::cerr << "Error: failed writing " << values_file << std::endl;
+      std::remove(values_file.c_str());
+      return false;
+    }
+    std::ifstream values_in(values_file, std::ios::binary);
+    for (size_t t = 0; t < tiles.numTiles(); t++)
+    {
+      Window window(tiles.tileMin(t), tiles.tileMax(t));
+      values_in.read((char *)window.values[0].data(), sizeof(Eigen::Vector3d) * window.values.size());
+      values_in.read((char *)window.covered.data(), window.covered.size());
+      if (!values_in)
+      {
+        std::cerr << "Error: cannot read back " << values_file << std::endl;
+        values_in.close();
+        std::remove(values_file.c_str());
+        return false;
+      }
+      if (!writeWindow(render, window, maxima, tile_name(t), projection_file))
+      {
+        tiles_written = false;
+        break;
+      }
+    }
+    values_in.close();
+    std::remove(values_file.c_str());
+    if (!tiles_written)
+    {
+      return false;
+    }
+  }
+  if (tiles.numTiles() > 0)
+  {
+    std::cout << "output " << tiles.numTiles() << " tiles of " << tile_size << "x" << tile_size << " pixels: "
+              << tile_name(0) << " to " << tile_name(tiles.numTiles() - 1) << std::endl;
+  }
+  return true;
+}
+
+/// A 64-bit FNV-1a hash, used to detect changes to the content of each tile
+struct Hash
+{
+  void add(const void *data, size_t size)
+  {
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    for (size_t i = 0; i < size; i++)
+    {
+      value = (value ^ bytes[i]) * 1099511628211ull;
+    }
+  }
+  template <class T>
+  void add(const T &data)
+  {
+    add(&data, sizeof(T));
+  }
+  uint64_t value = 14695981039346656037ull;
+};
+
+bool fileExists(const std::string &file_name)
+{
+  std::ifstream ifs(file_name);
+  return ifs.is_open();
+}
+
+/// An XYZ (quadtree) pyramid of 256 pixel square image tiles, named image_z_x_y, with y counting down from the top row
+/// of tiles and z from the coarsest level. The finest level is rendered from the forest and each coarser tile is
+/// reduced from the four tiles below it, by the mean or the maximum of each 2x2 block of pixels. The tile contents and
+/// settings are recorded in a manifest file, so that when the pyramid is rebuilt only the tiles whose trees have
+/// changed are rendered and written again.
+struct TilePyramid
+{
+  static const int kTileSize = 256;
+
+  TilePyramid(const ForestRender &render, int num_levels, bool max_reduction, const std::string &image_file)
+    : render(render)
+    , num_levels(num_levels)
+    , max_reduction(max_reduction)
+  {
+    image_stub = image_file.substr(0, image_file.find_last_of('.'));
+    image_ext = ray::getFileNameExtension(image_file);
+    manifest_file = image_stub + "_pyramid.txt";
+  }
+
+  /// render the pyramid, returning the image's @c maxima and @c totals as for a single image
+  bool build(Eigen::Vector3d &maxima, Eigen::Vector3d &totals);
+
+  /// the number of tiles in each direction at level @c z
+  Eigen::Vector2i levelSize(int z) const
+  {
+    const int scale = 1 << (num_levels - 1 - z);
+    return Eigen::Vector2i((num_x + scale - 1) / scale, (num_y + scale - 1) / scale);
+  }
+  std::string tileName(int z, int x, int y) const
+  {
+    return image_stub + "_" + std::to_string(z) + "_" + std::to_string(x) + "_" + std::to_string(y) + "." + image_ext;
+  }
+  /// the index into the finest level bins of tile (x, y)
+  size_t finestIndex(int x, int y) const { return static_cast<size_t>(x) + static_cast<size_t>(num_x) * (num_y - 1 - y); }
+  /// the part of the image covered by finest level tile @c t
+  Window finestWindow(size_t t) const
+  {
+    const Eigen::Vector2i image_max(render.width, render.height);
+    return Window(bins.tileMin(t).cwiseMax(Eigen::Vector2i(0,0)), bins.tileMax(t).cwiseMin(image_max));
+  }
+  /// the hash of the settings and of the capsules and stems within finest level tile @c t
+  uint64_t tileHash(size_t t, uint64_t settings_hash) const;
+  /// the values of finest level tile @c t, rendered or read back from the values file. Returns false if they could
+  /// not be read back
+  bool finestValues(size_t t, Window &window, ray::Progress &progress) const;
+  /// write tile (x, y) of level @c z and its sub-tiles where they have changed. Returns whether the tile was written,
+  /// in which case its @c pixels are set
+  bool buildTile(int z, int x, int y, std::vector<ray::RGBA> &pixels, ray::Progress &progress);
+  /// read the settings hash, the maxima that the tiles were coloured with and the finest tiles of the last build
+  bool readManifest(uint64_t &settings_hash, Eigen::Vector3d &old_maxima);
+  /// write the settings hash, maxima and finest tiles. Tiles that failed to be written are left out, so that they
+  /// are rendered again by the next build. Returns false if the manifest could not be written
+  bool writeManifest(uint64_t settings_hash) const;
+
+  const ForestRender &render;
+  int num_levels;
+  bool max_reduction;
+  std::string image_stub, image_ext, manifest_file, values_file;
+  int num_x = 0, num_y = 0;  // the number of tiles at the finest level
+  CapsuleBins bins;          // the capsules overlapping each finest level tile
+  // per finest level tile:
+  std::vector<uint64_t> hashes;
+  std::vector<uint8_t> dirty;  // whether it needs rendering again
+  std::vector<Eigen::Vector3d> tile_maxima, tile_totals;
+  std::vector<uint8_t> known;  // whether its hash and values were read from the manifest
+  std::vector<uint8_t> failed;  // whether it could not be written
+  std::atomic<size_t> num_failed{0};  // the number of tiles at any level that could not be written
+  Eigen::Vector3d maxima = Eigen::Vector3d(0,0,0);  // the maximum values over the image, used to colour it
+};
+
+uint64_t TilePyramid::tileHash(size_t t, uint64_t settings_hash) const
+{
+  Hash hash;
+  hash.add(settings_hash);
+  for (size_t j = bins.starts[t]; j < bins.starts[t + 1]; j++)
+  {
+    const int id = bins.ids[j];
+    const Capsule &capsule = render.capsules[id];
+    hash.add(capsule.v1);
+    hash.add(capsule.v2);
+    hash.add(capsule.radius);
+    hash.add(capsule.min_height);
+    if (!render.colours.empty())
+    {
+      hash.add(render.colours[id]);
+    }
+  }
+  const Eigen::Vector2i tile_min = bins.tileMin(t), tile_max = bins.tileMax(t);
+  for (auto &stem: render.stems)
+  {
+    if ((stem.array() >= tile_min.array()).all() && (stem.array() < tile_max.array()).all())
+    {
+      hash.add(stem);
+    }
+  }
+  return hash.value;
+}
+
+bool TilePyramid::readManifest(uint64_t &settings_hash, Eigen::Vector3d &old_maxima)
+{
+  std::ifstream ifs(manifest_file);
+  if (!ifs.is_open() || !(ifs >> settings_hash >> old_maxima[0] >> old_maxima[1] >> old_maxima[2]))
+  {
+    return false;
+  }
+  int x, y;
+  uint64_t hash;
+  Eigen::Vector3d maxima, totals;
+  while (ifs >> x >> y >> hash >> maxima[0] >> maxima[1] >> maxima[2] >> totals[0] >> totals[1] >> totals[2])
+  {
+    if (x < 0 || x >= num_x || y < 0 || y >= num_y)
+    {
+      continue;
+    }
+    const size_t t = finestIndex(x, y);
+    hashes[t] = hash;
+    tile_maxima[t] = maxima;
+    tile_totals[t] = totals;
+    known[t] = 1;
+  }
+  return true;
+}
+
+bool TilePyramid::writeManifest(uint64_t settings_hash) const
+{
+  std::ofstream ofs(manifest_file);
+  if (!ofs.is_open())
+  {
+    std::cerr << "Error: cannot open " << manifest_file << " for writing" << std::endl;
+    return false;
+  }
+  ofs << std::setprecision(17);
+  ofs << settings_hash << " " << maxima[0] << " " << maxima[1] << " " << maxima[2] << std::endl;
+  for (int y = 0; y < num_y; y++)
+  {
+    for (int x = 0; x < num_x; x++)
+    {
+      const size_t t = finestIndex(x, y);
+      if (failed[t])
+      {
+        continue;
+      }
+      ofs << x << " " << y << " " << hashes[t] << " " << tile_maxima[t][0] << " " << tile_maxima[t][1] << " "
+          << tile_maxima[t][2] << " " << tile_totals[t][0] << " " << tile_totals[t][1] << " " << tile_totals[t][2]
+          << std::endl;
+    }
+  }
+  ofs.close();
+  if (ofs.fail())
   {
-    Eigen::Vector3d ray = end - start;
-    Eigen::Vector3d dir = v2 - v1;
-    double length = dir.norm();
-    if (length > 0.0)
+    std::cerr << "Error: failed writing " << manifest_file << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool TilePyramid::finestValues(size_t t, Window &window, ray::Progress &progress) const
+{
+  if (values_file.empty())
+  {
+    render.renderWindow(bins.tileIds(t), window, progress);
+    return true;
+  }
+  // each tile has a fixed size slot in the values file, which must have been written in full
+  const size_t slot = static_cast<size_t>(kTileSize * kTileSize) * (sizeof(Eigen::Vector3d) + 1);
+  const size_t size = sizeof(Eigen::Vector3d) * window.values.size() + window.covered.size();
+  std::ifstream ifs(values_file, std::ios::binary | std::ios::ate);
+  const std::streamoff file_size = ifs.is_open() ? static_cast<std::streamoff>(ifs.tellg()) : -1;
+  if (file_size < 0 || t * slot + size > static_cast<size_t>(file_size) ||
+      !ifs.seekg(static_cast<std::streamoff>(t * slot)) ||
+      !ifs.read((char *)window.values[0].data(), sizeof(Eigen::Vector3d) * window.values.size()) ||
+      !ifs.read((char *)window.covered.data(), window.covered.size()))
+  {
+    std::cerr << "Error: cannot read back tile " << t << " from " << values_file << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool TilePyramid::buildTile(int z, int x, int y, std::vector<ray::RGBA> &pixels, ray::Progress &progress)
+{
+  const std::string tile_name = tileName(z, x, y);
+  if (z == num_levels - 1)
+  {
+    const size_t t = finestIndex(x, y);
+    if (!dirty[t])
+    {
+      return false;
+    }
+    Window window = finestWindow(t);
+    if (!finestValues(t, window, progress))
+    {
+      failed[t] = 1;
+      num_failed++;
+      return false;
+    }
+    if (values_file.empty())
+    {
+      tile_maxima[t] = tile_totals[t] = Eigen::Vector3d(0,0,0);
+      render.accumulate(window, tile_maxima[t], tile_totals[t]);
+    }
+    // the tile buffer is placed over the padded tile, which extends beyond the image at the lower and right edges
+    pixels.assign(kTileSize * kTileSize, ray::RGBA(0,0,0,0));
+    std::vector<float> float_pixel_colours;
+    render.colourWindow(window, maxima, bins.tileMin(t), kTileSize, pixels, float_pixel_colours);
+    if (!writeImage(tile_name, kTileSize, kTileSize, pixels, float_pixel_colours, Eigen::Vector3d(0,0,0), render.pixel_width, ""))
     {
-      dir /= length;      
+      failed[t] = 1;
+      num_failed++;
     }
+    return true;
+  }
 
-    // cylinder part:
-    double cylinder_intersection1 = 1e10;
-    Eigen::Vector3d up = dir.cross(ray);
-    double mag = up.norm();
-    if (mag > 0.0) // two rays are not inline
+  // the four sub-tiles are built in parallel
+  std::vector<ray::RGBA> child_pixels[4];
+  bool changed[4] = {false, false, false, false};
+  const Eigen::Vector2i child_size = levelSize(z + 1);
+  for (int i = 0; i < 4; i++)
+  {
+    const int child_x = 2*x + i%2, child_y = 2*y + i/2;
+    if (child_x < child_size[0] && child_y < child_size[1])
     {
-      up /= mag;
-      double gap = std::abs((start - v1).dot(up));
-      if (gap > radius)
-        return 0.0;
+      #pragma omp task shared(child_pixels, changed, progress)
+      changed[i] = buildTile(z + 1, child_x, child_y, child_pixels[i], progress);
+    }
+  }
+  #pragma omp taskwait
+  if (!changed[0] && !changed[1] && !changed[2] && !changed[3] && fileExists(tile_name))
+  {
+    return false;
+  }
+  // unchanged sub-tiles are read back from their files
+  for (int i = 0; i < 4; i++)
+  {
+    const int child_x = 2*x + i%2, child_y = 2*y + i/2;
+    if (!changed[i] && child_x < child_size[0] && child_y < child_size[1])
+    {
+      int width = 0, height = 0, num_channels = 0;
+      uint8_t *data = stbi_load(tileName(z + 1, child_x, child_y).c_str(), &width, &height, &num_channels, 4);
+      if (data && width == kTileSize && height == kTileSize)
+      {
+        child_pixels[i].resize(kTileSize * kTileSize);
+        memcpy(&child_pixels[i][0], data, child_pixels[i].size() * sizeof(ray::RGBA));
+      }
+      stbi_image_free(data);
+    }
+  }
 
-      Eigen::Vector3d lateral_dir = ray - dir * ray.dot(dir);
-      double lateral_length = lateral_dir.norm();
-      double d_mid = (v1 - start).dot(lateral_dir) / ray.dot(lateral_dir);
-      double shift = std::sqrt(radius*radius - gap*gap) / lateral_length;
-      double d_min = d_mid - shift;
-      double d1 = (start + ray*d_min - v1).dot(dir) / length;
-      if (d1 > 0.0 && d1 < 1.0)
+  // reduce each 2x2 block of sub-tile pixels to one pixel. Buffer rows start at the bottom of the tile, so the
+  // upper sub-tiles (even child_y) are in the upper half
+  const int half = kTileSize / 2;
+  pixels.assign(kTileSize * kTileSize, ray::RGBA(0,0,0,0));
+  for (int i = 0; i < 4; i++)
+  {
+    if (child_pixels[i].empty())
+    {
+      continue;
+    }
+    const int offset_x = (i%2) * half, offset_y = (1 - i/2) * half;
+    for (int py = 0; py < half; py++)
+    {
+      for (int px = 0; px < half; px++)
       {
-        cylinder_intersection1 = d_min;
+        const ray::RGBA *block[4] = {
+          &child_pixels[i][2*px + kTileSize*2*py], &child_pixels[i][2*px + 1 + kTileSize*2*py],
+          &child_pixels[i][2*px + kTileSize*(2*py + 1)], &child_pixels[i][2*px + 1 + kTileSize*(2*py + 1)] };
+        ray::RGBA &pixel = pixels[offset_x + px + kTileSize*(offset_y + py)];
+        if (max_reduction)
+        {
+          for (auto &p: block)
+          {
+            pixel.red = std::max(pixel.red, p->red);
+            pixel.green = std::max(pixel.green, p->green);
+            pixel.blue = std::max(pixel.blue, p->blue);
+            pixel.alpha = std::max(pixel.alpha, p->alpha);
+          }
+        }
+        else // mean, weighting the colours by their opacity
+        {
+          double red = 0.0, green = 0.0, blue = 0.0, alpha = 0.0;
+          for (auto &p: block)
+          {
+            red += (double)p->red * (double)p->alpha;
+            green += (double)p->green * (double)p->alpha;
+            blue += (double)p->blue * (double)p->alpha;
+            alpha += (double)p->alpha;
+          }
+          if (alpha > 0.0)
+          {
+            pixel = ray::RGBA((uint8_t)std::round(red/alpha), (uint8_t)std::round(green/alpha), (uint8_t)std::round(blue/alpha), (uint8_t)std::round(alpha/4.0));
+          }
+        }
       }
     }
+  }
+  std::vector<float> float_pixel_colours;
+  if (!writeImage(tile_name, kTileSize, kTileSize, pixels, float_pixel_colours, Eigen::Vector3d(0,0,0), render.pixel_width, ""))
+  {
+    num_failed++;
+    std::remove(tile_name.c_str());  // so that it is written again by the next build, even if its sub-tiles are unchanged
+  }
+  return true;
+}
 
-    // the spheres part:
-    double ray_length = ray.norm();
-    double sphere_intersection1[2] = {1e10, 1e10};
-    Eigen::Vector3d ends[2] = {v1, v2};
-    for (int e = 0; e<2; e++)
+bool TilePyramid::build(Eigen::Vector3d &image_maxima, Eigen::Vector3d &image_totals)
+{
+  // the finest level tiles are aligned to the top left of the image, as the tile numbering starts there
+  num_x = (render.width + kTileSize - 1) / kTileSize;
+  num_y = (render.height + kTileSize - 1) / kTileSize;
+  std::vector<int> capsule_ids(render.capsules.size());
+  for (size_t i = 0; i < capsule_ids.size(); i++)
+  {
+    capsule_ids[i] = static_cast<int>(i);
+  }
+  bins.build(capsule_ids, render.mins, render.maxs, Eigen::Vector2i(0, render.height - num_y*kTileSize),
+             Eigen::Vector2i(num_x*kTileSize, render.height), kTileSize);
+  const size_t num_tiles = bins.numTiles();
+  hashes.assign(num_tiles, 0);
+  dirty.assign(num_tiles, 1);
+  known.assign(num_tiles, 0);
+  failed.assign(num_tiles, 0);
+  tile_maxima.assign(num_tiles, Eigen::Vector3d(0,0,0));
+  tile_totals.assign(num_tiles, Eigen::Vector3d(0,0,0));
+
+  Hash settings;
+  settings.add(render.style);
+  settings.add(render.use_gradient);
+  settings.add(render.num_subvoxels);
+  settings.add(render.colour_scale);
+  // the tiles are only shaded relative to the vertical bounds in the height and volume styles, so the other styles
+  // don't need rendering again when the height of the forest changes
+  settings.add(render.min_bound[0]);
+  settings.add(render.min_bound[1]);
+  if (render.style == ForestRender::Style::Height || render.style == ForestRender::Style::Volume)
+  {
+    settings.add(render.min_bound[2]);
+    settings.add(render.max_bound[2]);
+  }
+  settings.add(render.pixel_width);
+  settings.add(render.width);
+  settings.add(render.height);
+  settings.add(num_levels);
+  settings.add(max_reduction);
+  uint64_t old_settings = 0;
+  Eigen::Vector3d old_maxima(0,0,0);
+  const bool has_manifest = readManifest(old_settings, old_maxima);
+  for (size_t t = 0; t < num_tiles; t++)
+  {
+    const uint64_t hash = tileHash(t, settings.value);
+    const int x = static_cast<int>(t % num_x), y = num_y - 1 - static_cast<int>(t / num_x);
+    dirty[t] = !has_manifest || old_settings != settings.value || !known[t] || hashes[t] != hash ||
+               !fileExists(tileName(num_levels - 1, x, y));
+    hashes[t] = hash;
+  }
+
+  ray::Progress progress;
+  ray::ProgressThread progress_thread(progress);
+  // styles shaded relative to the image maximum need the values of every tile first. Changed tiles are rendered to
+  // a values file, and if that changes the maximum then every tile must be coloured again
+  if (render.needsMaxima())
+  {
+    values_file = image_stub + "_values.tmp";
+    std::fstream values(values_file, std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc);
+    if (!values.is_open())
     {
-      double mid_d = (ends[e] - start).dot(ray) / (ray_length * ray_length);
-      Eigen::Vector3d shortest_dir = (ends[e] - start) - ray * mid_d;
-      double shortest_sqr = shortest_dir.squaredNorm();
-      if (shortest_sqr < radius*radius)
+      std::cerr << "Error: cannot open " << values_file << " for writing" << std::endl;
+      progress_thread.requestQuit();
+      progress_thread.join();
+      return false;
+    }
+    const size_t slot = static_cast<size_t>(kTileSize * kTileSize) * (sizeof(Eigen::Vector3d) + 1);
+    std::vector<uint8_t> rendered(num_tiles, 0);
+    for (int pass = 0; pass < 2; pass++)
+    {
+      size_t num_rows = 0;
+      for (size_t t = 0; t < num_tiles; t++)
       {
-        double shift = std::sqrt(radius * radius - shortest_sqr) / ray_length;
-        sphere_intersection1[e] = mid_d - shift;
+        num_rows += (dirty[t] && !rendered[t]) ? finestWindow(t).height() : 0;
+      }
+      progress.begin("render pyramid values: ", num_rows);
+      for (size_t t = 0; t < num_tiles; t++)
+      {
+        if (!dirty[t] || rendered[t])
+        {
+          continue;
+        }
+        Window window = finestWindow(t);
+        render.renderWindow(bins.tileIds(t), window, progress);
+        tile_maxima[t] = tile_totals[t] = Eigen::Vector3d(0,0,0);
+        render.accumulate(window, tile_maxima[t], tile_totals[t]);
+        values.seekp(t * slot);
+        values.write((const char *)window.values[0].data(), sizeof(Eigen::Vector3d) * window.values.size());
+        values.write((const char *)window.covered.data(), window.covered.size());
+        if (!values.good())
+        {
+          break;
+        }
+        rendered[t] = 1;
+      }
+      progress.end();
+      if (!values.good())
+      {
+        break;
+      }
+      for (size_t t = 0; t < num_tiles; t++)
+      {
+        maxima = maxima.cwiseMax(tile_maxima[t]);
+      }
+      if (maxima == old_maxima)
+      {
+        break;
+      }
+      dirty.assign(num_tiles, 1);
+    }
+    const bool values_written = values.good();
+    values.close();
+    if (!values_written || values.fail())
+    {
+      std::cerr << "Error: failed writing " << values_file << std::endl;
+      progress_thread.requestQuit();
+      progress_thread.join();
+      std::remove(values_file.c_str());
+      return false;
+    }
+  }
+
+  size_t num_rows = 0;
+  for (size_t t = 0; t < num_tiles; t++)
+  {
+    num_rows += dirty[t] && values_file.empty() ? finestWindow(t).height() : 0;
+  }
+  progress.begin("render pyramid: ", num_rows);
+  stbi_set_flip_vertically_on_load(1);  // unchanged tiles are read back into buffers that start at the bottom row
+  // each top level tile builds its sub-tiles as parallel tasks
+  const Eigen::Vector2i top_size = levelSize(0);
+  #pragma omp parallel
+  #pragma omp single
+  {
+    for (int y = 0; y < top_size[1]; y++)
+    {
+      for (int x = 0; x < top_size[0]; x++)
+      {
+        #pragma omp task shared(progress)
+        {
+          std::vector<ray::RGBA> pixels;
+          buildTile(0, x, y, pixels, progress);
+        }
       }
     }
+  }
+  progress.end();
+  progress_thread.requestQuit();
+  progress_thread.join();
+  if (!values_file.empty())
+  {
+    std::remove(values_file.c_str());
+  }
+  const bool manifest_written = writeManifest(settings.value);
 
-    // combining together
-    double closest_d = std::min( {cylinder_intersection1, sphere_intersection1[0], sphere_intersection1[1]} );
-    if (closest_d == 1e10)
-      return 0.0;
-    return closest_d * ray_length;
+  size_t num_written = 0;
+  for (size_t t = 0; t < num_tiles; t++)
+  {
+    image_maxima = image_maxima.cwiseMax(tile_maxima[t]);
+    image_totals += tile_totals[t];
+    num_written += dirty[t];
   }
-};
+  std::cout << "output pyramid of " << num_levels << " levels, " << num_written << " of " << num_tiles
+            << " finest tiles rendered: " << tileName(0, 0, 0) << " to "
+            << tileName(num_levels - 1, num_x - 1, num_y - 1) << std::endl;
+  if (num_failed > 0)
+  {
+    std::cerr << "Error: " << num_failed << " tiles could not be written, so will be rendered by the next build"
+              << std::endl;
+    return false;
+  }
+  return manifest_written;
+}
+
+/// Render the whole image into memory and write it to @c image_file. Styles that are shaded relative to the maximum
+/// over the image are rendered as a single window, otherwise the image is rendered a window at a time. Returns false
+/// if the image could not be written
+bool renderImage(const ForestRender &render, const std::string &image_file, const std::string &projection_file,
+                 Eigen::Vector3d &maxima, Eigen::Vector3d &totals)
+{
+  const int window_width = render.needsMaxima() ? std::max(render.width, render.height) : 1024;
+  std::vector<int> capsule_ids(render.capsules.size());
+  for (size_t i = 0; i < capsule_ids.size(); i++)
+  {
+    capsule_ids[i] = static_cast<int>(i);
+  }
+  CapsuleBins windows;
+  windows.build(capsule_ids, render.mins, render.maxs, Eigen::Vector2i(0,0), Eigen::Vector2i(render.width, render.height), std::max(window_width, 1));
+
+  std::vector<ray::RGBA> pixel_colours;
+  std::vector<float> float_pixel_colours;
+  if (render.is_hdr)
+    float_pixel_colours.resize(3 * render.width * render.height, 0.0);
+  else
+    pixel_colours.resize(render.width * render.height, ray::RGBA(0,0,0,0));
+
+  ray::Progress progress;
+  ray::ProgressThread progress_thread(progress);
+  progress.begin("render: ", static_cast<size_t>(render.height) * windows.num_x);
+  for (size_t t = 0; t < windows.numTiles(); t++)
+  {
+    Window window(windows.tileMin(t), windows.tileMax(t));
+    render.renderWindow(windows.tileIds(t), window, progress);
+    render.accumulate(window, maxima, totals);  // complete before colouring, when the maxima are needed
+    render.colourWindow(window, maxima, Eigen::Vector2i(0,0), render.width, pixel_colours, float_pixel_colours);
+  }
+  progress.end();
+  progress_thread.requestQuit();
+  progress_thread.join();
+
+  std::cout << "outputting image: " << image_file << std::endl;
+  return writeImage(image_file, render.width, render.height, pixel_colours, float_pixel_colours, render.min_bound, render.pixel_width, projection_file);
+}
 
 /// This method combines multiple tree files into a single file. There are currently two ways it can combine:
 /// 1. the files have the same attributes - so concatenate the files
@@ -123,10 +1475,10 @@ struct Capsule
 int main(int argc, char *argv[])
 {
   ray::FileArgument tree_file, output_file, projection_file;
-  ray::KeyChoice style({ "height", "volume", "surface_area", "plant_density" }); 
+  ray::KeyChoice style({ "height", "volume", "surface_area", "plant_density" });
   ray::OptionalFlagArgument rgb_flag("rgb", 'r');
   ray::DoubleArgument pixel_width_arg(0.001, 100000.0), grid_width(0.001, 100000.0), max_brightness(0.000001, 100000000.0);
-  ray::IntArgument num_subvoxels(1,1000, 8), resolution(1, 20000, 512);
+  ray::IntArgument num_subvoxels(1,1000, 8), resolution(1, 20000, 512), tile_size(16, 100000, 1024), pyramid_levels(1, 24, 5);
   ray::Vector4dArgument crop_posrad;
   ray::OptionalKeyValueArgument output_image_option("output", 'o', &output_file);
   ray::OptionalKeyValueArgument pixel_width_option("pixel_width", 'p', &pixel_width_arg);
@@ -136,25 +1488,26 @@ int main(int argc, char *argv[])
   ray::OptionalKeyValueArgument max_brightness_option("max_colour", 'm', &max_brightness);
   ray::OptionalKeyValueArgument num_subvoxels_option("num_subvoxels", 'n', &num_subvoxels);
   ray::OptionalKeyValueArgument projection_file_option("georeference", 'g', &projection_file);
+  ray::OptionalKeyValueArgument tile_size_option("tiles", 't', &tile_size);
+  ray::OptionalKeyValueArgument pyramid_option("pyramid", 'y', &pyramid_levels);
+  ray::OptionalFlagArgument max_reduction_flag("max_reduction", 'x');
 
-  const bool standard_format = ray::parseCommandLine(argc, argv, { &tree_file }, {&output_image_option, &grid_width_option, &resolution_option, &pixel_width_option, &crop_option, &max_brightness_option, &projection_file_option});
-  const bool variant_format = ray::parseCommandLine(argc, argv, { &tree_file, &style }, {&output_image_option, &grid_width_option, &resolution_option, &pixel_width_option, &crop_option, &num_subvoxels_option, &rgb_flag, &projection_file_option});
+  const bool standard_format = ray::parseCommandLine(argc, argv, { &tree_file }, {&output_image_option, &grid_width_option, &resolution_option, &pixel_width_option, &crop_option, &max_brightness_option, &projection_file_option, &tile_size_option, &pyramid_option, &max_reduction_flag});
+  const bool variant_format = ray::parseCommandLine(argc, argv, { &tree_file, &style }, {&output_image_option, &grid_width_option, &resolution_option, &pixel_width_option, &crop_option, &num_subvoxels_option, &rgb_flag, &projection_file_option, &tile_size_option, &pyramid_option, &max_reduction_flag});
   if (!standard_format && !variant_format)
   {
     usage();
   }
 
   ray::ForestStructure forest;
-  if (!forest.load(tree_file.name()))
+  if (!tree::loadForest(tree_file.name(), forest))
   {
     usage();
   }
 
   // if colouring the mesh:
   int red_id = -1;
-  double red_scale = 1.0;
-  double green_scale = 1.0;
-  double blue_scale = 1.0;
+  double colour_scale = 1.0;
 
   // first, get a pixel width:
   const double big = 1e10;
@@ -198,300 +1551,110 @@ int main(int argc, char *argv[])
 
   std::string image_file = output_image_option.isSet() ? output_file.name() : tree_file.nameStub() + ".png";
   const std::string image_ext = ray::getFileNameExtension(image_file);
-  const bool is_hdr = image_ext == "hdr" || image_ext == "tif";
-
-  std::vector<ray::RGBA> pixel_colours;
-  std::vector<float> float_pixel_colours;
-  if (is_hdr)
-    float_pixel_colours.resize(3 * width * height, 0.0);
-  else
-    pixel_colours.resize(width * height, ray::RGBA(0,0,0,0));
+  if (!supportedImageType(image_ext))
+  {
+    std::cerr << "Error: output file extension " << image_ext << " not supported" << std::endl;
+    usage();
+  }
+  if (pyramid_option.isSet() && (tile_size_option.isSet() || image_ext == "hdr" || image_ext == "tif"))
+  {
+    std::cerr << "Error: the pyramid is output as 8-bit image tiles, so cannot be combined with --tiles or hdr and tif output" << std::endl;
+    usage();
+  }
 
-  if (standard_format || (variant_format && style.selectedKey() == "height"))
+  if (standard_format)
   {
-    if (standard_format)
+    auto &att = forest.trees[0].attributeNames();
+    const auto &it = std::find(att.begin(), att.end(), "red");
+    if (it == att.end())
     {
-      auto &att = forest.trees[0].attributeNames();
-      const auto &it = std::find(att.begin(), att.end(), "red");
-      if (it == att.end())
+      std::cerr << "Error: cannot find colour in trees file" << std::endl;
+      usage();
+    }
+    red_id = static_cast<int>(it - att.begin());
+    if (red_id != -1)
+    {
+      // option to rescale overall brightness
+      if (max_brightness_option.isSet())
       {
-        std::cerr << "Error: cannot find colour in trees file" << std::endl;
-        usage();
+        colour_scale = 255.0 / max_brightness.value();
       }
-      red_id = static_cast<int>(it - att.begin());
-      if (red_id != -1)
+      // otherwise auto-scale
+      else
       {
-        // option to rescale overall brightness
-        if (max_brightness_option.isSet())
-        {
-          red_scale = green_scale = blue_scale = 255.0 / max_brightness.value();
-        }
-        // otherwise auto-scale
-        else
+        double max_col = 0.0;
+        for (auto &tree : forest.trees)
         {
-          double max_col = 0.0;
-          for (auto &tree : forest.trees)
+          for (size_t s = 1; s < tree.segments().size(); s++)
           {
-            for (size_t s = 1; s < tree.segments().size(); s++)
+            auto &segment = tree.segments()[s];
+            for (int i = 0; i < 3; i++)
             {
-              auto &segment = tree.segments()[s];
-              for (int i = 0; i < 3; i++)
-              {
-                max_col = std::max(max_col, segment.attributes[red_id + i]);
-              }
+              max_col = std::max(max_col, segment.attributes[red_id + i]);
             }
           }
-          red_scale = green_scale = blue_scale = 255.0 / max_col;
-          std::cout << "auto re-scaling colour based on max colour value of " << max_col << std::endl;
         }
+        colour_scale = 255.0 / max_col;
+        std::cout << "auto re-scaling colour based on max colour value of " << max_col << std::endl;
       }
     }
-    // we need a depth buffer
-    std::vector<double> depths(width*height, big);
-    for (auto &tree: forest.trees)
-    {
-      for (size_t i = 1; i<tree.segments().size(); i++)
-      {
-        auto &segment = tree.segments()[i];
-        Capsule capsule;
-        capsule.v2 = segment.tip;
-        capsule.v1 = tree.segments()[segment.parent_id].tip;
-        capsule.radius = segment.radius + pixel_width/2.0;
-        if (segment.parent_id == 0) // need to clip capsule's lower cap at ground level
-        {
-          capsule.min_height = capsule.v1[2];
-        }
-        Eigen::Vector3d min_caps = ray::minVector(capsule.v1, capsule.v2) - Eigen::Vector3d(capsule.radius, capsule.radius, 0);
-        Eigen::Vector3d max_caps = ray::maxVector(capsule.v1, capsule.v2) + Eigen::Vector3d(capsule.radius, capsule.radius, 0);
-        Eigen::Vector3i mins = ((min_caps - min_bound) / pixel_width).cast<int>();
-        Eigen::Vector3i maxs = ((max_caps - min_bound) / pixel_width).cast<int>() + Eigen::Vector3i(1,1,1);
-        mins = ray::maxVector(Eigen::Vector3i(0,0,0), mins);
-        maxs = ray::minVector(maxs, Eigen::Vector3i(width, height, 0));
-        for (int x = mins[0]; x < maxs[0]; x++)
-        {
-          for (int y = mins[1]; y < maxs[1]; y++)
-          {
-            Eigen::Vector3d top = Eigen::Vector3d((double)x + 0.5, (double)y + 0.5, 0.0)*pixel_width + min_bound;
-            top[2] = max_bound[2] + pixel_width;
-            Eigen::Vector3d bottom = top;
-            bottom[2] = min_bound[2] - pixel_width;
-
-            double depth = capsule.rayIntersectionDepth(top, bottom);
-            if (depth > 0.0)
-            {
-              int ind = x + width*y;
-              depths[ind] = std::min(depths[ind], depth);
-              if (depths[ind] == depth) // deepest
-              {
-                if (variant_format)
-                {
-                  double shade = std::max(0.0, std::min(1.0 - depth / (max_bound[2] - min_bound[2]), 1.0));
-                  if (rgb_flag.isSet())
-                  {
-                    Eigen::Vector3d col = gradient(shade);
-                    if (is_hdr)
-                    {
-                      float_pixel_colours[3*ind + 0] = (float)col[0];
-                      float_pixel_colours[3*ind + 1] = (float)col[1];
-                      float_pixel_colours[3*ind + 2] = (float)col[2];
-                    }
-                    else
-                      pixel_colours[ind] = ray::RGBA((uint8_t)(col[0] * 255.0),(uint8_t)(col[1] * 255.0),(uint8_t)(col[2] * 255.0),255); 
-                  }
-                  else
-                  {
-                    uint8_t shade255 = (uint8_t)(shade * 255.0);
-                    if (is_hdr)
-                      float_pixel_colours[3*ind + 0] = float_pixel_colours[3*ind + 1] = float_pixel_colours[3*ind + 2] = (float)shade;
-                    else
-                      pixel_colours[ind] = ray::RGBA(shade255,shade255,shade255,255); 
-                  }
-                }
-                else // segment colour
-                {
-                  Eigen::Vector3d col(segment.attributes[red_id], segment.attributes[red_id + 1], segment.attributes[red_id + 2]);
-                  if (is_hdr)
-                  {
-                    float_pixel_colours[3*ind + 0] = (float)col[0];
-                    float_pixel_colours[3*ind + 1] = (float)col[1];
-                    float_pixel_colours[3*ind + 2] = (float)col[2];
-                  }
-                  else
-                  {
-                    pixel_colours[ind] = ray::RGBA((uint8_t)(col[0]*red_scale), (uint8_t)(col[1]*green_scale), (uint8_t)(col[2]*blue_scale), 255);                 
-                  }
-                }
-              }
-            }
-          }
-        }
-      }
-    }    
   }
+
+  ForestRender render;
+  if (standard_format)
+    render.style = ForestRender::Style::Colour;
+  else if (style.selectedKey() == "height")
+    render.style = ForestRender::Style::Height;
   else if (style.selectedKey() == "volume")
+    render.style = ForestRender::Style::Volume;
+  else if (style.selectedKey() == "surface_area")
+    render.style = ForestRender::Style::SurfaceArea;
+  else
+    render.style = ForestRender::Style::PlantDensity;
+  render.use_gradient = rgb_flag.isSet();
+  render.is_hdr = image_ext == "hdr" || image_ext == "tif";
+  render.num_subvoxels = num_subvoxels.value();
+  render.colour_scale = colour_scale;
+  render.min_bound = min_bound;
+  render.max_bound = max_bound;
+  render.pixel_width = pixel_width;
+  render.width = width;
+  render.height = height;
+  render.addForest(forest, red_id);
+
+  Eigen::Vector3d maxima(0,0,0), totals(0,0,0);
+  if (pyramid_option.isSet())
   {
-    // first, calculate capsules that intersect each pixel
-    std::vector<std::vector<Capsule>> capsule_grid(width*height);
-    for (auto &tree: forest.trees)
+    TilePyramid pyramid(render, pyramid_levels.value(), max_reduction_flag.isSet(), image_file);
+    if (!pyramid.build(maxima, totals))
     {
-      for (size_t i = 1; i<tree.segments().size(); i++)
-      {
-        auto &segment = tree.segments()[i];
-        Capsule capsule;
-        capsule.v2 = segment.tip;
-        capsule.v1 = tree.segments()[segment.parent_id].tip;
-        capsule.radius = segment.radius;
-        Eigen::Vector3d min_caps = ray::minVector(capsule.v1, capsule.v2) - Eigen::Vector3d(capsule.radius, capsule.radius, 0);
-        Eigen::Vector3d max_caps = ray::maxVector(capsule.v1, capsule.v2) + Eigen::Vector3d(capsule.radius, capsule.radius, 0);
-        Eigen::Vector3i mins = ((min_caps - min_bound) / pixel_width).cast<int>();
-        Eigen::Vector3i maxs = ((max_caps - min_bound) / pixel_width).cast<int>() + Eigen::Vector3i(1,1,1);
-        mins = ray::maxVector(Eigen::Vector3i(0,0,0), mins);
-        maxs = ray::minVector(maxs, Eigen::Vector3i(width, height, 0));
-        for (int x = mins[0]; x < maxs[0]; x++)
-        {
-          for (int y = mins[1]; y < maxs[1]; y++)
-          {
-            capsule_grid[x + width*y].push_back(capsule);
-          }
-        }
-      }
-    }
-
-    int n = num_subvoxels.value();
-    // now use a grid memory structure to avoid overlap issues
-    double subpixel_width = pixel_width / (double)n;
-    double subpixel_volume = subpixel_width*subpixel_width*subpixel_width;
-    int num_vertical = (int)std::ceil((max_bound[2] - min_bound[2])/subpixel_width); // this will be large!!
-    std::vector<int> counts[2];
-    int max_count[2] = {0,0};
-    
-    double ds[2] = {0.25, 0.75};
-    for (int phase = 0; phase<2; phase++)
-    {
-      double delta = ds[phase];
-      counts[phase].resize(width*height, 0);
-      ray::Progress progress;
-      ray::ProgressThread progress_thread(progress);    
-      progress.begin("calculate volumes " + std::to_string(phase+1) + "/2: ", width/10);
-      for (int x = 0; x<width; x++)
-      {
-        for (int y = 0; y<height; y++)
-        {
-          Eigen::Vector3d pixel_min_bound = min_bound + pixel_width*Eigen::Vector3d(x,y,0);
-          std::vector<bool> subpixels(n*n*num_vertical, false);
-          int count = 0;
-          int ind = x + width*y;
-          for (auto &capsule: capsule_grid[ind])
-          {
-            Eigen::Vector3d min_caps = ray::minVector(capsule.v1, capsule.v2) - Eigen::Vector3d(capsule.radius, capsule.radius, capsule.radius);
-            Eigen::Vector3d max_caps = ray::maxVector(capsule.v1, capsule.v2) + Eigen::Vector3d(capsule.radius, capsule.radius, capsule.radius);
-            Eigen::Vector3i mins = ((min_caps - pixel_min_bound) / subpixel_width).cast<int>();
-            Eigen::Vector3i maxs = ((max_caps - pixel_min_bound) / subpixel_width).cast<int>() + Eigen::Vector3i(1,1,1);
-            mins = ray::maxVector(Eigen::Vector3i(0,0,0), mins);
-            maxs = ray::minVector(maxs, Eigen::Vector3i(n, n, num_vertical));
-            for (int xx = mins[0]; xx < maxs[0]; xx++)
-            {
-              for (int yy = mins[1]; yy < maxs[1]; yy++)
-              {
-                for (int zz = mins[2]; zz < maxs[2]; zz++)
-                {
-                  if (subpixels[xx + n*yy + n*n*zz]) // already set
-                    continue;
-                  Eigen::Vector3d pos = Eigen::Vector3d((double)xx+delta,(double)yy+delta,(double)zz+delta)*subpixel_width + pixel_min_bound;
-                  if (pos[2] < capsule.min_height) // below ground
-                    continue;
-                  if (capsule.overlaps(pos))
-                  {
-                    subpixels[xx + n*yy + n*n*zz] = true;       
-                    count++;
-                  }           
-                }
-              }
-            }
-          }
-          counts[phase][ind] = count;
-          max_count[phase] = std::max(max_count[phase], count);
-        }
-        if (!(x%10))
-          progress.increment();
-      }
-      progress.end();
-      progress_thread.requestQuit();
-      progress_thread.join();
+      usage();
     }
-    double total_error = 0.0;
-    double total_volume = 0.0;
-    for (int x = 0; x<width; x++)
+  }
+  else if (tile_size_option.isSet())
+  {
+    if (!renderTiles(render, tile_size.value(), image_file, projection_file.name(), maxima, totals))
     {
-      for (int y = 0; y<height; y++)
-      {
-        int ind = x + width*y;
-        double error = subpixel_volume * (double)(counts[0][ind] - counts[1][ind])/2.0;
-        total_error += std::abs(error);
-        double volume = subpixel_volume * (double)(counts[0][ind] + counts[1][ind])/2.0;
-        total_volume += volume;
-        double max_volume = subpixel_volume * (double)(max_count[0] + max_count[1]);
-        double shade = std::max(0.0, std::min(volume/max_volume, 1.0));
-        if (rgb_flag.isSet())
-        {
-          Eigen::Vector3d col = gradient(shade);
-          if (is_hdr)
-          {
-            float_pixel_colours[3*ind + 0] = (float)col[0];
-            float_pixel_colours[3*ind + 1] = (float)col[1];
-            float_pixel_colours[3*ind + 2] = (float)col[2];
-          }
-          else
-            pixel_colours[ind] = ray::RGBA((uint8_t)(col[0] * 255.0),(uint8_t)(col[1] * 255.0),(uint8_t)(col[2] * 255.0),255); 
-        }
-        else
-        {
-          uint8_t shade255 = (uint8_t)(shade * 255.0);
-          if (is_hdr)
-            float_pixel_colours[3*ind + 0] = float_pixel_colours[3*ind + 1] = float_pixel_colours[3*ind + 2] = (float)volume;
-          else
-            pixel_colours[ind] = ray::RGBA(shade255,shade255,shade255,255);         
-        }
-      }
+      usage();
     }
-    std::cout << "subpixel width: " << subpixel_width << " m, total volume: " << total_volume << " m^3, pixel volume % error: " << 100.0*total_error/total_volume << "%" << std::endl;
   }
-  else
+  else if (!renderImage(render, image_file, projection_file.name(), maxima, totals))
   {
-    std::cerr << "Error: style " << style.selectedKey() << " not yet supported" << std::endl;
     usage();
   }
 
-  std::cout << "outputting image: " << image_file << std::endl;
-
-  // write the image depending on the file format
-  const char *image_name = image_file.c_str();
-  stbi_flip_vertically_on_write(1);
-  if (image_ext == "png")
-    stbi_write_png(image_name, width, height, 4, (void *)&pixel_colours[0], 4 * width);
-  else if (image_ext == "bmp")
-    stbi_write_bmp(image_name, width, height, 4, (void *)&pixel_colours[0]);
-  else if (image_ext == "tga")
-    stbi_write_tga(image_name, width, height, 4, (void *)&pixel_colours[0]);
-  else if (image_ext == "jpg")
-    stbi_write_jpg(image_name, width, height, 4, (void *)&pixel_colours[0], 100);  // 100 is maximal quality
-  else if (image_ext == "hdr")
-    stbi_write_hdr(image_name, width, height, 3, &float_pixel_colours[0]);
-#if RAYLIB_WITH_TIFF 
-  else if (image_ext == "tif")
+  if (render.style == ForestRender::Style::Volume)
   {
-    // obtain the origin offsets
-    const Eigen::Vector3d origin(0, 0, 0);
-    const Eigen::Vector3d pos = -(origin - min_bound);
-    const double x = pos[0], y = pos[1] + static_cast<double>(height) * pixel_width;
-    // generate the geotiff file
-    ray::writeGeoTiffFloat(image_file, width, height, &float_pixel_colours[0], pixel_width, false, projection_file.name(), x, y);
+    std::cout << "sub-column width: " << pixel_width / (double)num_subvoxels.value() << " m, total volume: " << totals[0] << " m^3, pixel volume % error: " << 100.0*totals[1]/totals[0] << "%" << std::endl;
   }
-#endif
-  else 
+  else if (render.style == ForestRender::Style::SurfaceArea)
   {
-    std::cerr << "Error: output file extension " << image_ext << " not supported" << std::endl;
-    usage();
+    std::cout << "total surface area: " << totals[0] << " m^2" << std::endl;
+  }
+  else if (render.style == ForestRender::Style::PlantDensity)
+  {
+    const double area = (double)width * (double)height * pixel_width*pixel_width;
+    std::cout << "mean density: " << totals[0] * 10000.0 / area << " stems/ha, " << totals[1] * 10000.0 / area << " m^3/ha" << std::endl;
   }
 
   return 0;
@@ -3,8 +3,8 @@
 // ABN 41 687 119 230
 //
 // Author: Thomas Lowe
-#include "raylib/rayforeststructure.h"
 #include "raylib/rayparse.h"
+#include "treelib/treeforeststream.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -39,17 +39,37 @@ int main(int argc, char *argv[])
   rot /= angle;
   const Eigen::Quaterniond rotation(Eigen::AngleAxisd(angle * ray::kPi / 180.0, rot));
 
-  ray::ForestStructure forest;
-  forest.load(tree_file.name());
-  // rotate the tips, that is all that needs rotating
-  for (auto &tree : forest.trees)
+  // stream the trees one at a time, so that large forests need not fit in memory
+  tree::ForestReader reader;
+  if (!reader.open(tree_file.name()))
   {
+    usage();
+  }
+  tree::ForestWriter writer;
+  if (!writer.open(tree_file.name(), reader.comments()))
+  {
+    usage();
+  }
+  ray::TreeStructure tree;
+  while (reader.readTree(tree))
+  {
+    // rotate the tips, that is all that needs rotating
     for (auto &segment : tree.segments())
     {
       segment.tip = rotation * segment.tip;
     }
+    writer.writeTree(tree);
+  }
+  if (reader.failed())
+  {
+    writer.discard();
+    return 1;
+  }
+  reader.close();
+  if (!writer.close())
+  {
+    return 1;
   }
-  forest.save(tree_file.name());
 
   return 0;
 }
@@ -11,6 +11,8 @@
 #include <cstdlib>
 #include <iostream>
 #include "raylib/raytreegen.h"
+#include "treelib/treeforeststream.h"
+#include "treelib/treetopology.h"
 #include "treelib/treeutils.h"
 
 void usage(int exit_code = 1)
@@ -37,27 +39,30 @@ int main(int argc, char *argv[])
 
   double power = 0.0; // 1 will weight in proportion to radius, 2 in proportion to square radius.
 
-  ray::ForestStructure forest;
-  if (!forest.load(forest_file.name()))
+  // the trees are smoothed independently, so stream them one at a time to bound the memory use
+  tree::ForestReader reader;
+  if (!reader.open(forest_file.name()))
   {
     usage();
   }
-  if (forest.trees.size() != 0 && forest.trees[0].segments().size() == 0)
+  tree::ForestWriter writer;
+  if (!writer.open(forest_file.nameStub() + "_smoothed" + tree::forestFileExtension(forest_file.name()),
+                   reader.comments()))
   {
-    std::cout << "smooth only works on tree structures, not trunks-only files" << std::endl;
     usage();
   }
 
   // for each tree
-  for (size_t t = 0; t < forest.trees.size(); t++)
+  ray::TreeStructure tree;
+  while (reader.readTree(tree))
   {
-    auto &tree = forest.trees[t];
-    // temporarily get the children list, it helps
-    std::vector<std::vector<int>> children(tree.segments().size());
-    for (size_t i = 1; i < tree.segments().size(); i++)
+    if (tree.segments().size() == 0)
     {
-      children[tree.segments()[i].parent_id].push_back(static_cast<int>(i));
+      std::cout << "smooth only works on tree structures, not trunks-only files" << std::endl;
+      writer.discard();
+      usage();
     }
+    const tree::TreeTopology topology(tree);
     const double full_w = std::pow(tree.segments()[0].radius, power);
 
     // smooth multiple times, in order to pass the information up/down the trees
@@ -78,7 +83,7 @@ int main(int argc, char *argv[])
         auto &segment = tree.segments()[i];
         const Eigen::Vector3d segment_tip = old_tips[i];
         const Eigen::Vector3d parent_tip = old_tips[segment.parent_id];
-        const size_t num_kids = children[i].size();
+        const size_t num_kids = topology.children(i).size();
         Eigen::Vector3d child_tip(0, 0, 0);
         // now smooth differently depending on the number of child branches
         if (num_kids == 0)  // end of branch. Usually thin so do nothing
@@ -87,12 +92,12 @@ int main(int argc, char *argv[])
         }
         else if (num_kids == 1)  // usual case
         {
-          child_tip = old_tips[children[i][0]];
+          child_tip = old_tips[topology.children(i)[0]];
         }
         else  // a bifurcation point, so get a centroidal child tip
         {
           double weight = 0.0;
-          for (auto &child : children[i])
+          for (auto &child : topology.children(i))
           {
             const double rad_sqr = tree.segments()[child].radius * tree.segments()[child].radius;
             child_tip += old_tips[child] * rad_sqr;
@@ -122,7 +127,16 @@ int main(int argc, char *argv[])
         tree.segments()[0].tip += root_shift / root_weight;
       }
     }
+    writer.writeTree(tree);
+  }
+  if (reader.failed())
+  {
+    writer.discard();
+    return 1;
+  }
+  if (!writer.close())
+  {
+    return 1;
   }
-  forest.save(forest_file.nameStub() + "_smoothed.txt");
   return 0;
 }
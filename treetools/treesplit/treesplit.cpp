@@ -12,6 +12,7 @@
 #include <iostream>
 #include "raylib/raytreegen.h"
 #include "raylib/extraction/rayclusters.h"
+#include "treelib/treeforestfile.h"
 #include "treelib/treeutils.h"
 
 
@@ -63,11 +64,12 @@ int main(int argc, char *argv[])
   }
 
   ray::ForestStructure forest;
-  if (!forest.load(forest_file.name()))
+  if (!tree::loadForest(forest_file.name(), forest))
   {
     usage();
   }
 
+  const std::string ext = tree::forestFileExtension(forest_file.name());
   ray::ForestStructure forest_in, forest_out;
   forest_in.comments = forest.comments;
   forest_out.comments = forest.comments;
@@ -111,7 +113,7 @@ int main(int argc, char *argv[])
       i++;
       ray::ForestStructure new_tree;
       new_tree.trees.push_back(tree);
-      new_tree.save(forest_file.nameStub() + "_" + std::to_string(i) + ".txt");
+      tree::saveForest(forest_file.nameStub() + "_" + std::to_string(i) + ext, new_tree);
     }
     return 0;
   }
@@ -212,13 +214,13 @@ int main(int argc, char *argv[])
       {
         tree_clusters[i].trees.push_back(forest.trees[id]);
       }
-      tree_clusters[i].save(forest_file.nameStub() + "_cluster_" + std::to_string(i) + ".txt");
+      tree::saveForest(forest_file.nameStub() + "_cluster_" + std::to_string(i) + ext, tree_clusters[i]);
       i++;
     }
     return 0;
   }
 
-  forest_in.save(forest_file.nameStub() + "_inside.txt");
-  forest_out.save(forest_file.nameStub() + "_outside.txt");
+  tree::saveForest(forest_file.nameStub() + "_inside" + ext, forest_in);
+  tree::saveForest(forest_file.nameStub() + "_outside" + ext, forest_out);
   return 0;
 }
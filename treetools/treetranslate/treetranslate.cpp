@@ -7,8 +7,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <iostream>
-#include "raylib/rayforeststructure.h"
 #include "raylib/rayparse.h"
+#include "treelib/treeforeststream.h"
 
 void usage(int exit_code = 1)
 {
@@ -33,17 +33,37 @@ int main(int argc, char *argv[])
 
   const Eigen::Vector3d translation = translation3.value();
 
-  ray::ForestStructure forest;
-  forest.load(tree_file.name());
-  // translation requires just the tip parameter to be updated
-  for (auto &tree : forest.trees)
+  // stream the trees one at a time, so that large forests need not fit in memory
+  tree::ForestReader reader;
+  if (!reader.open(tree_file.name()))
   {
+    usage();
+  }
+  tree::ForestWriter writer;
+  if (!writer.open(tree_file.name(), reader.comments()))
+  {
+    usage();
+  }
+  ray::TreeStructure tree;
+  while (reader.readTree(tree))
+  {
+    // translation requires just the tip parameter to be updated
     for (auto &segment : tree.segments())
     {
       segment.tip += translation;
     }
+    writer.writeTree(tree);
+  }
+  if (reader.failed())
+  {
+    writer.discard();
+    return 1;
+  }
+  reader.close();
+  if (!writer.close())
+  {
+    return 1;
   }
-  forest.save(tree_file.name());
 
   return 0;
 }